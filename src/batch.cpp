@@ -0,0 +1,206 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+
+#include "image.h"
+#include "metrics.h"
+#include "platform.h"
+#include "threadpool.h"
+
+bool CollectInputFiles(const std::vector<std::string>& inputs,
+                       std::vector<std::string>& files, std::string& error)
+{
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const std::string& input = inputs[i];
+
+        if (!input.empty() && input[0] == '@') {
+            std::ifstream list(input.c_str() + 1);
+            if (!list.is_open()) {
+                error = "cannot open list file " + input.substr(1);
+                return false;
+            }
+            std::string line;
+            while (std::getline(list, line)) {
+                // Tolerate lists written on Windows
+                if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+                if (!line.empty()) files.push_back(line);
+            }
+        }
+        else if (IsDirectory(input)) {
+            std::vector<std::string> entries;
+            if (!ListDirectory(input, entries)) {
+                error = "cannot read directory " + input;
+                return false;
+            }
+            for (size_t j = 0; j < entries.size(); ++j) {
+                if (IsImageFileName(entries[j])) files.push_back(entries[j]);
+            }
+        }
+        else {
+            files.push_back(input);
+        }
+    }
+    return true;
+}
+
+// One page of one of the input files
+struct BatchPage {
+    const std::string* file;
+    int page;
+    int pageCount;      // Of the file
+};
+
+// Shared state for the batch worker tasks
+struct BatchJob {
+    std::vector<BatchPage> pages;
+    const BatchOptions* options;
+    Mutex outputMutex;  // Keeps report lines from interleaving
+    int failures;
+    int pageThreads;    // Threads to split each page across
+    ResultCache* cache; // NULL without a cache
+    ResultWriter* results;  // NULL for XML per page
+};
+
+// Name of a page in reports, the file name alone for single-page files
+static std::string PageName(const BatchPage& page)
+{
+    if (page.pageCount == 1) return *page.file;
+
+    char number[32];
+    sprintf(number, " page %d", page.page + 1);
+    return *page.file + number;
+}
+
+// Path of the XML file that holds the result for a page. Pages of
+// multi-page files get their number, from 1, before the extension.
+static std::string ResultPath(const BatchPage& page, const BatchOptions& options)
+{
+    std::string path = options.outputDir.empty() ? *page.file :
+                       options.outputDir + PATH_SEPARATOR + BaseName(*page.file);
+    if (page.pageCount > 1) {
+        char number[32];
+        sprintf(number, ".%d", page.page + 1);
+        path += number;
+    }
+    return path + ".xml";
+}
+
+static void ProcessBatchPage(void* context, int index)
+{
+    BatchJob* job = (BatchJob*)context;
+    const BatchPage& page = job->pages[index];
+    const char* filename = page.file->c_str();
+
+    const PipelineParams& params = job->options->params;
+
+    // Pages seen before only cost hashing their file
+    PageResult result;
+    std::string key;
+    bool cached = false;
+    if (job->cache != NULL) {
+        MappedFile file;
+        if (file.Open(filename)) {
+            key = ResultCache::Key(file.Data(), file.Size(), page.page, params);
+            cached = job->cache->Lookup(key, result);
+            result.filename = *page.file;
+            result.page = page.page;
+        }
+    }
+
+    std::string error;
+    bool ok = cached;
+    bool lost = false;          // Counted by the result writer instead
+    if (!cached) {
+        // Spare workers help with individual pages when there are fewer
+        // pages than workers
+        ThreadPool* pagePool = job->pageThreads > 1 ? new ThreadPool(job->pageThreads) : NULL;
+        ok = ProcessFile(filename, page.page, params, result, error, pagePool);
+        delete pagePool;
+        if (ok && MetricsEnabled()) RecordPageMetrics(result.metrics);
+        if (ok && !key.empty()) job->cache->Store(key, result);
+    }
+    if (ok && job->results != NULL) {
+        ok = job->results->Write(result, error);
+        lost = !ok;
+    }
+    else if (ok) {
+        std::string resultPath = ResultPath(page, *job->options);
+        if (!SaveColumnDataToXML(result.columns, resultPath.c_str())) {
+            error = "cannot write " + resultPath;
+            ok = false;
+        }
+    }
+
+    ScopedLock lock(job->outputMutex);
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", PageName(page).c_str(), error.c_str());
+        if (!lost) ++job->failures;
+    }
+    else if (!job->options->quiet) {
+        printf("%s: %dx%d, %d columns%s\n", PageName(page).c_str(), result.width, result.height,
+               (int)result.columns.size(), cached ? " (cached)" : "");
+    }
+
+    // Requested dumps are written between pages, under the lock so only one
+    // worker writes the file at a time
+    const std::string& metricsFile = job->options->metricsFile;
+    if (!metricsFile.empty() && TakeMetricsDumpRequest() && !SaveMetrics(metricsFile.c_str(), error))
+        fprintf(stderr, "colfindc: %s\n", error.c_str());
+}
+
+int RunBatch(const std::vector<std::string>& files, const BatchOptions& options,
+             int* pageCount)
+{
+    BatchJob job;
+    job.options = &options;
+    job.failures = 0;
+    job.cache = NULL;
+    job.results = NULL;
+
+    // A cache that cannot be used only makes the batch slower
+    ResultCache cache;
+    if (!options.cacheDir.empty()) {
+        std::string error;
+        if (cache.Open(options.cacheDir, options.cacheBytes, error)) job.cache = &cache;
+        else fprintf(stderr, "colfindc: %s, continuing without it\n", error.c_str());
+    }
+
+    // Without its results file the batch would be wasted
+    ResultWriter results;
+    if (!options.resultsFile.empty()) {
+        std::string error;
+        if (!results.Open(options.resultsFile, options.resultsRotateBytes, error)) {
+            fprintf(stderr, "colfindc: %s\n", error.c_str());
+            return (int)files.size();
+        }
+        job.results = &results;
+    }
+
+    // Multi-page files are split so their pages spread across the workers
+    for (size_t i = 0; i < files.size(); ++i) {
+        BatchPage page;
+        page.file = &files[i];
+        page.pageCount = CountImagePages(files[i].c_str());
+        for (page.page = 0; page.page < page.pageCount; ++page.page) job.pages.push_back(page);
+    }
+
+    int pages = (int)job.pages.size();
+    if (pageCount != NULL) *pageCount = pages;
+    ThreadPool pool(options.workers);
+    job.pageThreads = pages == 0 ? 1 : std::max(1, pool.ThreadCount() / pages);
+    pool.Run(ProcessBatchPage, &job, pages);
+
+    // Pages reported done whose records were still waiting to be written
+    // when writing failed count as failed too
+    std::string error;
+    if (job.results != NULL) {
+        bool closed = results.Close(error);
+        if (!closed) fprintf(stderr, "colfindc: %s\n", error.c_str());
+        int lost = results.LostRecords();
+        if (lost > 0) fprintf(stderr, "colfindc: %d results were not written\n", lost);
+        job.failures += lost > 0 ? lost : closed ? 0 : 1;
+    }
+    return job.failures;
+}
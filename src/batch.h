@@ -0,0 +1,45 @@
+// Batch processing of many pages on a pool of worker threads
+#ifndef COLFIND_BATCH_H
+#define COLFIND_BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "pipeline.h"
+#include "results.h"
+
+struct BatchOptions {
+    int workers;            // Worker threads, 0 = one per CPU
+    PipelineParams params;
+    std::string outputDir;  // Where per-page XML goes, empty = next to the input
+    std::string resultsFile;    // One file for all results instead of XML per page
+    size_t resultsRotateBytes;  // Size after which a new results file is started
+    bool quiet;             // Only report failures
+    std::string metricsFile;    // Where to save metrics on request, empty = not collected
+    std::string cacheDir;   // Result cache shared between runs, empty = no cache
+    size_t cacheBytes;      // Size limit of the cache directory
+
+    BatchOptions() :
+        workers(0),
+        resultsRotateBytes((size_t)DEFAULT_RESULTS_MEGABYTES << 20),
+        quiet(false),
+        cacheBytes((size_t)DEFAULT_CACHE_MEGABYTES << 20) {}
+};
+
+// Expands command line inputs into a list of image files. An input can be a
+// file, a directory (all supported images directly inside it) or @listfile
+// (one path per line).
+bool CollectInputFiles(const std::vector<std::string>& inputs,
+                       std::vector<std::string>& files, std::string& error);
+
+// Processes every page of every file and writes its result, to resultsFile if one is
+// given and to a separate XML file per page otherwise, skipping the
+// processing of pages found in the result cache. Returns the number of pages
+// that failed. With metrics enabled every page is recorded, and the
+// metrics are saved to metricsFile whenever a dump has been requested.
+// The number of pages found in the files goes to pageCount, if given.
+int RunBatch(const std::vector<std::string>& files, const BatchOptions& options,
+             int* pageCount = NULL);
+
+#endif
@@ -0,0 +1,305 @@
+// Benchmarks of the pipeline stages on deterministic synthetic pages
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bmp.h"
+#include "coarse.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "platform.h"
+#include "skew.h"
+#include "smear.h"
+#include "synth.h"
+#include "thumbnail.h"
+#include "threadpool.h"
+
+#define DEFAULT_REPEATS 5
+#define DEFAULT_PAGE_FILE "colfind_bench_page.bmp"
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "usage: colfind_bench [options]\n"
+        "\n"
+        "Renders a synthetic page, saves it as a .bmp and times every pipeline stage on it.\n"
+        "\n"
+        "page options:\n"
+        "  --dpi N      resolution of the US letter page (default: %d)\n"
+        "  --size WxH   page size in pixels instead of a letter page\n"
+        "  -c N         text columns (default: 3)\n"
+        "  -g N         gutter width in pixels (default: a sixth of an inch)\n"
+        "  --grain N    paper grain amplitude (default: 8)\n"
+        "  --specks N   specks of dirt per megapixel (default: 20)\n"
+        "  --skew DEG   turn the page by this many degrees (default: 0)\n"
+        "  --rules      draw rule lines between columns and under a header\n"
+        "  --seed N     page layout seed (default: 1)\n"
+        "  -b N         bits per pixel of the saved page, 8 or 24 (default: 24)\n"
+        "  -o FILE      where to save the page, kept afterwards (default: a temporary file)\n"
+        "\n"
+        "run options:\n"
+        "  -r N         repetitions, the median time is reported (default: %d)\n"
+        "  -j N         threads for the end-to-end pipeline stages (default: 1)\n"
+        "  -k LEVEL     pixel kernels to use: scalar, sse2 or avx2 (default: %s)\n"
+        "  --json       print results as JSON, for comparing across commits\n",
+        SYNTH_DEFAULT_DPI, DEFAULT_REPEATS, KernelLevelName(GetSupportedKernelLevel()));
+}
+
+// Parses the integer argument of an option, or returns false
+static bool ParseIntArg(int argc, char** argv, int& i, int& value)
+{
+    if (i + 1 >= argc) return false;
+    char* end;
+    long parsed = strtol(argv[++i], &end, 10);
+    if (*end != '\0' || parsed < 0) return false;
+    value = (int)parsed;
+    return true;
+}
+
+static bool ParseSizeArg(int argc, char** argv, int& i, int& width, int& height)
+{
+    if (i + 1 >= argc) return false;
+    return sscanf(argv[++i], "%dx%d", &width, &height) == 2 && width > 0 && height > 0;
+}
+
+static bool ParseKernelArg(int argc, char** argv, int& i, KernelLevel& level)
+{
+    if (i + 1 >= argc) return false;
+    const char* name = argv[++i];
+    for (int l = KERNELS_SCALAR; l <= GetSupportedKernelLevel(); ++l) {
+        if (strcmp(name, KernelLevelName((KernelLevel)l)) == 0) {
+            level = (KernelLevel)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Timings of one stage over all repetitions
+struct StageTiming {
+    const char* name;
+    std::vector<double> seconds;
+
+    explicit StageTiming(const char* name) : name(name) {}
+
+    double Median() const {
+        std::vector<double> sorted(seconds);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted.empty() ? 0 : sorted[sorted.size() / 2];
+    }
+
+    double Best() const {
+        return seconds.empty() ? 0 : *std::min_element(seconds.begin(), seconds.end());
+    }
+};
+
+int main(int argc, char** argv)
+{
+    SynthParams page;
+    int bitCount = 24;
+    int repeats = DEFAULT_REPEATS;
+    int threads = 1;
+    KernelLevel kernelLevel = GetSupportedKernelLevel();
+    bool json = false;
+    std::string pageFile;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool ok = true;
+
+        if (strcmp(arg, "--dpi") == 0) {
+            ok = ParseIntArg(argc, argv, i, page.dpi) && page.dpi > 0;
+            page.width = page.dpi * 17 / 2;
+            page.height = page.dpi * 11;
+        }
+        else if (strcmp(arg, "--size") == 0) ok = ParseSizeArg(argc, argv, i, page.width, page.height);
+        else if (strcmp(arg, "-c") == 0) ok = ParseIntArg(argc, argv, i, page.columns) && page.columns > 0;
+        else if (strcmp(arg, "-g") == 0) ok = ParseIntArg(argc, argv, i, page.gutter);
+        else if (strcmp(arg, "--grain") == 0) ok = ParseIntArg(argc, argv, i, page.grain);
+        else if (strcmp(arg, "--specks") == 0) ok = ParseIntArg(argc, argv, i, page.specks);
+        else if (strcmp(arg, "--skew") == 0) {
+            char* end = NULL;
+            if (i + 1 < argc) page.skew = strtod(argv[++i], &end);
+            ok = end != NULL && *end == '\0';
+        }
+        else if (strcmp(arg, "--rules") == 0) page.rules = true;
+        else if (strcmp(arg, "--seed") == 0) {
+            int seed;
+            ok = ParseIntArg(argc, argv, i, seed);
+            page.seed = (unsigned int)seed;
+        }
+        else if (strcmp(arg, "-b") == 0) ok = ParseIntArg(argc, argv, i, bitCount) && (bitCount == 8 || bitCount == 24);
+        else if (strcmp(arg, "-o") == 0) {
+            if (i + 1 < argc) pageFile = argv[++i];
+            else ok = false;
+        }
+        else if (strcmp(arg, "-r") == 0) ok = ParseIntArg(argc, argv, i, repeats) && repeats > 0;
+        else if (strcmp(arg, "-j") == 0) ok = ParseIntArg(argc, argv, i, threads);
+        else if (strcmp(arg, "-k") == 0) ok = ParseKernelArg(argc, argv, i, kernelLevel);
+        else if (strcmp(arg, "--json") == 0) json = true;
+        else ok = false;
+
+        if (!ok) {
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    SetKernelLevel(kernelLevel);
+    bool keepPage = !pageFile.empty();
+    if (!keepPage) pageFile = DEFAULT_PAGE_FILE;
+
+    // The page itself is not timed
+    std::vector<unsigned char> source;
+    std::vector<ColumnRect> truth;
+    RenderSyntheticPage(page, source, &truth);
+    std::string error;
+    if (!SaveBmpGray(pageFile.c_str(), &source[0], page.width, page.height, bitCount, error)) {
+        fprintf(stderr, "colfind_bench: %s\n", error.c_str());
+        return 1;
+    }
+    std::vector<unsigned char>().swap(source);
+
+    int width = page.width;
+    int height = page.height;
+    size_t pixels = (size_t)width * height;
+    std::vector<unsigned char> bgra(pixels * 4);
+    std::vector<unsigned char> gray(pixels);
+    std::vector<unsigned char> smear(pixels);
+    std::vector<ColumnRect> columns;
+    std::vector<ColumnRect> deskewedColumns;
+    double slope = 0;
+
+    StageTiming decode("decode"), toGray("gray"), smearing("smear"), detect("detect"),
+                thumb("thumbnail"), coarse("coarse"), deskew("deskew"), endToEnd("pipeline"),
+                bilevel("bilevel");
+    ThreadPool* pool = threads > 1 ? new ThreadPool(threads) : NULL;
+    PipelineParams params;
+    PipelineParams bilevelParams;
+    bilevelParams.binarize = BINARIZE_OTSU;
+
+    for (int run = 0; run < repeats; ++run) {
+        double start = GetTimeSeconds();
+        BmpReader reader;
+        if (!reader.Open(pageFile.c_str())) {
+            fprintf(stderr, "colfind_bench: %s\n", reader.Error().c_str());
+            return 1;
+        }
+        for (int y = 0; y < height; ++y) reader.ReadRow(&bgra[(size_t)y * width * 4]);
+        reader.Close();
+        decode.seconds.push_back(GetTimeSeconds() - start);
+
+        start = GetTimeSeconds();
+        for (int y = 0; y < height; ++y)
+            BgrRowToGray(&bgra[(size_t)y * width * 4], 4, &gray[(size_t)y * width], width);
+        toGray.seconds.push_back(GetTimeSeconds() - start);
+
+        start = GetTimeSeconds();
+        VerticalSmear smearer;
+        smearer.Reset(width, params.maxVert);
+        memcpy(&smear[0], &gray[0], pixels);
+        for (int y = 0; y < height; ++y) smearer.SmearRow(&smear[(size_t)y * width]);
+        smearing.seconds.push_back(GetTimeSeconds() - start);
+
+        start = GetTimeSeconds();
+        ColumnProfile profile;
+        profile.Reset(width, params.threshold);
+        for (int y = 0; y < height; ++y)
+            profile.AddRow(&gray[(size_t)y * width], &smear[(size_t)y * width], y);
+        profile.FindColumns(columns);
+        detect.seconds.push_back(GetTimeSeconds() - start);
+
+        start = GetTimeSeconds();
+        ThumbnailPyramid pyramid;
+        pyramid.Begin(width, height);
+        pyramid.AddRows(&smear[0], height);
+        thumb.seconds.push_back(GetTimeSeconds() - start);
+
+        // Detection that starts on the pyramid of the page, which is not
+        // timed since the thumbnails need one anyway
+        ThumbnailPyramid grayPyramid;
+        grayPyramid.Begin(width, height);
+        grayPyramid.AddRows(&gray[0], height);
+        std::vector<ColumnRect> coarseColumns;
+        start = GetTimeSeconds();
+        FindColumnsCoarseToFine(&gray[0], width, height, grayPyramid, params, coarseColumns);
+        coarse.seconds.push_back(GetTimeSeconds() - start);
+
+        // Skew estimation on the same pyramid and detection along the skew
+        start = GetTimeSeconds();
+        slope = EstimateSkew(&gray[0], width, height, grayPyramid);
+        FindColumnsAlongSkew(&gray[0], width, height, slope, params, deskewedColumns, pool);
+        deskew.seconds.push_back(GetTimeSeconds() - start);
+
+        // What colfindc does per page: streamed decode, smear and detection
+        start = GetTimeSeconds();
+        PageResult result;
+        if (!ProcessFile(pageFile.c_str(), 0, params, result, error, pool)) {
+            fprintf(stderr, "colfind_bench: %s\n", error.c_str());
+            return 1;
+        }
+        endToEnd.seconds.push_back(GetTimeSeconds() - start);
+
+        // The same on bits, binarized at the page's Otsu threshold
+        start = GetTimeSeconds();
+        if (!ProcessFile(pageFile.c_str(), 0, bilevelParams, result, error, pool)) {
+            fprintf(stderr, "colfind_bench: %s\n", error.c_str());
+            return 1;
+        }
+        bilevel.seconds.push_back(GetTimeSeconds() - start);
+    }
+
+    delete pool;
+    if (!keepPage) remove(pageFile.c_str());
+
+    const StageTiming* stages[] = { &decode, &toGray, &smearing, &detect, &thumb, &coarse, &deskew, &endToEnd,
+                                    &bilevel };
+    int stageCount = (int)(sizeof(stages) / sizeof(stages[0]));
+    double megapixels = pixels / 1e6;
+    size_t peakMemory = GetPeakMemoryBytes();
+
+    if (json) {
+        printf("{\n");
+        printf("  \"page\": {\"width\": %d, \"height\": %d, \"dpi\": %d, \"columns\": %d, \"gutter\": %d, "
+               "\"grain\": %d, \"specks\": %d, \"skew\": %g, \"rules\": %s, \"seed\": %u, \"bits\": %d},\n",
+               width, height, page.dpi, page.columns, page.gutter, page.grain, page.specks,
+               page.skew, page.rules ? "true" : "false", page.seed, bitCount);
+        printf("  \"kernels\": \"%s\",\n", KernelLevelName(GetKernelLevel()));
+        printf("  \"threads\": %d,\n", threads);
+        printf("  \"repeats\": %d,\n", repeats);
+        printf("  \"stages\": [\n");
+        for (int i = 0; i < stageCount; ++i) {
+            double median = stages[i]->Median();
+            printf("    {\"name\": \"%s\", \"median_seconds\": %.6f, \"best_seconds\": %.6f, "
+                   "\"megapixels_per_second\": %.2f}%s\n",
+                   stages[i]->name, median, stages[i]->Best(),
+                   median > 0 ? megapixels / median : 0.0, i + 1 < stageCount ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"columns_expected\": %d,\n", (int)truth.size());
+        printf("  \"columns_found\": %d,\n", (int)columns.size());
+        printf("  \"skew_estimated\": %.3f,\n", SkewDegrees(slope));
+        printf("  \"columns_found_deskewed\": %d,\n", (int)deskewedColumns.size());
+        printf("  \"peak_memory_bytes\": %lu\n", (unsigned long)peakMemory);
+        printf("}\n");
+    }
+    else {
+        printf("page %dx%d (%.1f MP), %d columns, %s kernels, %d repetitions\n\n",
+               width, height, megapixels, page.columns, KernelLevelName(GetKernelLevel()), repeats);
+        printf("%-10s %12s %12s %10s\n", "stage", "median ms", "best ms", "MP/s");
+        for (int i = 0; i < stageCount; ++i) {
+            double median = stages[i]->Median();
+            printf("%-10s %12.2f %12.2f %10.1f\n", stages[i]->name, median * 1000,
+                   stages[i]->Best() * 1000, median > 0 ? megapixels / median : 0.0);
+        }
+        printf("\ncolumns found %d of %d, peak memory %.1f MB\n",
+               (int)columns.size(), (int)truth.size(), peakMemory / 1048576.0);
+        printf("skew estimated at %.2f degrees, %d columns found along it\n", SkewDegrees(slope),
+               (int)deskewedColumns.size());
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "binarize.h"
+
+#include <string.h>
+
+#include "bitplane.h"
+
+const char* BinarizeModeName(BinarizeMode mode)
+{
+    switch (mode) {
+    case BINARIZE_OTSU: return "otsu";
+    case BINARIZE_ADAPTIVE: return "adaptive";
+    default: return "none";
+    }
+}
+
+void AddToHistogram(const unsigned char* row, int width, uint32_t* histogram)
+{
+    for (int x = 0; x < width; ++x) ++histogram[row[x]];
+}
+
+int OtsuThreshold(const uint32_t* histogram)
+{
+    double total = 0;
+    double sum = 0;
+    for (int v = 0; v < 256; ++v) {
+        total += histogram[v];
+        sum += (double)v * histogram[v];
+    }
+    if (total == 0) return 0;
+
+    // Maximize the between-class variance w0 * w1 * (m0 - m1)^2, growing the
+    // dark class one value at a time
+    double darkCount = 0;
+    double darkSum = 0;
+    double best = -1;
+    int threshold = 0;
+    for (int t = 0; t < 255; ++t) {
+        darkCount += histogram[t];
+        darkSum += (double)t * histogram[t];
+        double lightCount = total - darkCount;
+        if (darkCount == 0 || lightCount == 0) continue;
+
+        double difference = darkSum / darkCount - (sum - darkSum) / lightCount;
+        double spread = darkCount * lightCount * difference * difference;
+        if (spread > best) {
+            best = spread;
+            threshold = t;
+        }
+    }
+    return threshold;
+}
+
+void AdaptiveInkRow(const unsigned char* row, int width, int radius, int threshold,
+                    uint64_t* words)
+{
+    memset(words, 0, WordsForWidth(width) * sizeof(uint64_t));
+
+    // Running sum of the window, which is cut short at the row's ends
+    uint32_t sum = 0;
+    int end = radius < width ? radius : width - 1;
+    for (int x = 0; x <= end; ++x) sum += row[x];
+    int begin = 0;
+
+    for (int x = 0; x < width; ++x) {
+        // (row + threshold) * span < sum, without dividing
+        uint32_t span = (uint32_t)(end - begin + 1);
+        if ((uint32_t)(row[x] + threshold) * span < sum)
+            words[x / BITS_PER_WORD] |= (uint64_t)1 << (x % BITS_PER_WORD);
+
+        if (end + 1 < width) sum += row[++end];
+        if (x - radius >= 0) sum -= row[begin++];
+    }
+}
@@ -0,0 +1,34 @@
+// Turning luminance into ink bits for the binarized pipeline
+#ifndef COLFIND_BINARIZE_H
+#define COLFIND_BINARIZE_H
+
+#include <stdint.h>
+
+// How the pipeline decides what is ink
+enum BinarizeMode {
+    BINARIZE_NONE,      // Keep the grayscale pipeline
+    BINARIZE_OTSU,      // One threshold for the whole page, from its histogram
+    BINARIZE_ADAPTIVE   // Darker than the pixels around it in the row
+};
+
+// Pixels on either side that the adaptive threshold averages, as a part of
+// the page width, so that it spans a few letters
+#define ADAPTIVE_RADIUS_DIVISOR 64
+
+// Short name of a mode, as the batch tool accepts it
+const char* BinarizeModeName(BinarizeMode mode);
+
+// Adds the values of a row to a 256-bin histogram
+void AddToHistogram(const unsigned char* row, int width, uint32_t* histogram);
+
+// Otsu's threshold of a 256-bin histogram: the value t for which splitting
+// it into [0, t] and [t + 1, 255] leaves the two classes most apart
+int OtsuThreshold(const uint32_t* histogram);
+
+// Packs a row into ink bits, ink where a pixel is more than threshold darker
+// than the mean of the pixels up to radius away in the row (Wellner's
+// moving average, centered). Runs in time linear in the width.
+void AdaptiveInkRow(const unsigned char* row, int width, int radius, int threshold,
+                    uint64_t* words);
+
+#endif
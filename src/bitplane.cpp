@@ -0,0 +1,123 @@
+#include "bitplane.h"
+
+#include <string.h>
+
+int LowestBit64(uint64_t word)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    if ((word & 0xffffffffULL) == 0) { word >>= 32; bit += 32; }
+    if ((word & 0xffff) == 0) { word >>= 16; bit += 16; }
+    if ((word & 0xff) == 0) { word >>= 8; bit += 8; }
+    if ((word & 0xf) == 0) { word >>= 4; bit += 4; }
+    if ((word & 0x3) == 0) { word >>= 2; bit += 2; }
+    if ((word & 0x1) == 0) bit += 1;
+    return bit;
+#endif
+}
+
+int HighestBit64(uint64_t word)
+{
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(word);
+#else
+    int bit = 0;
+    if (word >> 32) { word >>= 32; bit += 32; }
+    if (word >> 16) { word >>= 16; bit += 16; }
+    if (word >> 8) { word >>= 8; bit += 8; }
+    if (word >> 4) { word >>= 4; bit += 4; }
+    if (word >> 2) { word >>= 2; bit += 2; }
+    if (word >> 1) bit += 1;
+    return bit;
+#endif
+}
+
+void TransposeBits64(uint64_t block[BITS_PER_WORD])
+{
+    // Swap the off-diagonal halves, then the off-diagonal quarters of each
+    // half and so on, six rounds of 32 word pairs each
+    uint64_t mask = 0x00000000ffffffffULL;
+    for (int j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+        for (int k = 0; k < BITS_PER_WORD; k = (k + j + 1) & ~j) {
+            uint64_t t = ((block[k] >> j) ^ block[k + j]) & mask;
+            block[k] ^= t << j;
+            block[k + j] ^= t;
+        }
+    }
+}
+
+void SetBitRange(uint64_t* words, int x0, int x1)
+{
+    if (x1 <= x0) return;
+
+    int first = x0 / BITS_PER_WORD;
+    int last = (x1 - 1) / BITS_PER_WORD;
+    uint64_t head = ~0ULL << (x0 % BITS_PER_WORD);
+    uint64_t tail = ~0ULL >> (BITS_PER_WORD - 1 - (x1 - 1) % BITS_PER_WORD);
+    if (first == last) {
+        words[first] |= head & tail;
+        return;
+    }
+    words[first] |= head;
+    for (int i = first + 1; i < last; ++i) words[i] = ~0ULL;
+    words[last] |= tail;
+}
+
+void UnpackInkRow(const uint64_t* words, int width, unsigned char* row)
+{
+    for (int x0 = 0; x0 < width; x0 += BITS_PER_WORD) {
+        uint64_t word = words[x0 / BITS_PER_WORD];
+        int count = width - x0 < BITS_PER_WORD ? width - x0 : BITS_PER_WORD;
+        if (word == 0) {
+            memset(row + x0, 255, count);
+            continue;
+        }
+        for (int i = 0; i < count; ++i) row[x0 + i] = (word >> i) & 1 ? 0 : 255;
+    }
+}
+
+BitSmear::BitSmear() :
+    words(0),
+    window(1),
+    offset(0) {}
+
+void BitSmear::Reset(int words, int maxVert)
+{
+    if (maxVert < 0) maxVert = 0;
+
+    this->words = words;
+    window = maxVert + 1;
+    offset = 0;
+    prefix.Assign(words, 0);
+    block.Assign((size_t)words * window, 0);
+
+    // The rows above the page are blank
+    suffix.Assign((size_t)words * window, 0);
+}
+
+void BitSmear::SmearRow(uint64_t* row)
+{
+    // Rows offset + 1 and below of the block above are still in the window;
+    // for the last row of a block the window is that block alone
+    uint64_t* raw = &block[(size_t)offset * words];
+    const uint64_t* above = offset + 1 < window ? &suffix[(size_t)(offset + 1) * words] : NULL;
+    for (int i = 0; i < words; ++i) {
+        uint64_t ink = row[i];
+        raw[i] = ink;
+        prefix[i] = offset == 0 ? ink : prefix[i] | ink;
+        row[i] = above != NULL ? prefix[i] | above[i] : prefix[i];
+    }
+
+    if (++offset < window) return;
+
+    // The block is complete, its suffixes serve the next one
+    for (int r = window - 2; r >= 0; --r) {
+        uint64_t* upper = &block[(size_t)r * words];
+        const uint64_t* lower = upper + words;
+        for (int i = 0; i < words; ++i) upper[i] |= lower[i];
+    }
+    block.Swap(suffix);
+    offset = 0;
+}
@@ -0,0 +1,78 @@
+// Bilevel rows packed 64 pixels to a 64-bit word, for the binarized
+// pipeline. Pixel x of a row is bit x % 64 of word x / 64, set where the
+// pixel is ink, and the bits past the end of a row are always clear. At one
+// bit per pixel whole words of pixels are smeared and counted at once.
+#ifndef COLFIND_BITPLANE_H
+#define COLFIND_BITPLANE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bufferpool.h"
+
+#define BITS_PER_WORD 64
+
+// Words holding a row of width pixels
+inline int WordsForWidth(int width) {
+    return (width + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+// Number of set bits
+inline int PopCount64(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Index of the lowest and of the highest set bit of a word that is not 0
+int LowestBit64(uint64_t word);
+int HighestBit64(uint64_t word);
+
+// Transposes a 64x64 block of bits in place, so that bit c of word r ends
+// up as bit r of word c. Turns 64 rows of a word column into one word per
+// pixel column, whose ink can then be counted with PopCount64().
+void TransposeBits64(uint64_t block[BITS_PER_WORD]);
+
+// Sets the bits of pixels [x0, x1) of a row
+void SetBitRange(uint64_t* words, int x0, int x1);
+
+// Writes a row of bits as one byte per pixel, ink as 0 and the rest as 255
+void UnpackInkRow(const uint64_t* words, int width, unsigned char* row);
+
+// The vertical smear of the binarized pipeline: a pixel is ink once any of
+// the maxVert pixels above it is, which is the OR of a sliding window of
+// maxVert + 1 rows. It is computed with the van Herk/Gil-Werman split of
+// the rows into blocks as tall as the window, each of which keeps the OR of
+// its rows from the top down to the current one and, once complete, from
+// every row down to its bottom. Any window then joins one such suffix of
+// the block above with the prefix of the current block, for three word
+// operations per row whatever maxVert is.
+class BitSmear {
+public:
+    BitSmear();
+
+    // Prepares for a new image whose rows are words wide
+    void Reset(int words, int maxVert);
+
+    // Smears the next row in place, rows must arrive top to bottom
+    void SmearRow(uint64_t* row);
+
+    // Bytes of working memory held for the current image
+    size_t MemoryBytes() const {
+        return (prefix.Size() + block.Size() + suffix.Size()) * sizeof(uint64_t);
+    }
+
+private:
+    int words;
+    int window;                     // Rows ORed together, maxVert + 1
+    int offset;                     // Of the next row within its block
+    PooledArray<uint64_t> prefix;   // OR of the current block's rows so far
+    PooledArray<uint64_t> block;    // The current block's rows as they came
+    PooledArray<uint64_t> suffix;   // For each row of the block above, OR of it and all below it
+};
+
+#endif
@@ -0,0 +1,577 @@
+#include "bmp.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "kernels.h"
+#include "threadpool.h"
+
+// Size of BITMAPFILEHEADER and of the OS/2 and Windows info headers
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_CORE_HEADER_SIZE 12
+#define BMP_INFO_HEADER_SIZE 40
+
+// biCompression values
+#define BMP_RGB 0
+#define BMP_RLE8 1
+#define BMP_RLE4 2
+#define BMP_BITFIELDS 3
+
+// Largest width or height accepted, to keep buffer sizes sane on bad input
+#define BMP_MAX_DIMENSION 1000000
+
+// Most pixels an RLE page may have per byte of its encoded data. An encoded
+// run covers up to 255 pixels with two bytes; only pages that leave nearly
+// all of themselves blank through deltas or an early end come near this.
+#define BMP_RLE_MAX_PIXELS_PER_BYTE 1024
+
+// Decoded rows of an uncompressed image are released from the mapping in
+// bands of this many, so a huge page never sits in memory all at once
+#define BMP_RELEASE_ROWS 64
+
+// Little-endian field readers, so the code does not depend on struct layout
+static unsigned int ReadU16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int ReadU32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+BmpReader::BmpReader() :
+    width(0),
+    height(0),
+    bottomUp(true),
+    bitCount(0),
+    compression(BMP_RGB),
+    dataOffset(0),
+    stride(0),
+    nextRow(0),
+    releasedRows(0),
+    currentFileRow(0)
+{
+    memset(palette, 0, sizeof(palette));
+    memset(grayPalette, 0, sizeof(grayPalette));
+    memset(masks, 0, sizeof(masks));
+    memset(maskShift, 0, sizeof(maskShift));
+    memset(maskBits, 0, sizeof(maskBits));
+}
+
+bool BmpReader::Fail(const char* message)
+{
+    error = message;
+    Close();
+    return false;
+}
+
+bool BmpReader::Open(const char* filename)
+{
+    Close();
+    error.clear();
+
+    if (!file.Open(filename)) return Fail("cannot open file");
+    if (!ParseHeaders()) return false;
+    scratch.Resize((size_t)width * 4);
+    if (compression == BMP_RLE8 || compression == BMP_RLE4) return IndexRleRows();
+    return true;
+}
+
+void BmpReader::Close()
+{
+    file.Close();
+    width = 0;
+    height = 0;
+    nextRow = 0;
+    releasedRows = 0;
+    rleOffset.clear();
+    rleStartX.clear();
+}
+
+bool BmpReader::ParseHeaders()
+{
+    const unsigned char* data = file.Data();
+    size_t size = file.Size();
+
+    if (size < BMP_FILE_HEADER_SIZE + BMP_CORE_HEADER_SIZE || data[0] != 'B' || data[1] != 'M')
+        return Fail("not a BMP file");
+
+    dataOffset = ReadU32(data + 10);
+    const unsigned char* info = data + BMP_FILE_HEADER_SIZE;
+    size_t infoSize = ReadU32(info);
+    size_t paletteOffset = BMP_FILE_HEADER_SIZE + infoSize;
+    size_t paletteEntrySize = 4;
+    size_t colorsUsed = 0;
+    int fileHeight;
+
+    if (infoSize == BMP_CORE_HEADER_SIZE) {
+        // OS/2 BITMAPCOREHEADER with 16-bit sizes and 3-byte palette entries
+        width = (int)ReadU16(info + 4);
+        fileHeight = (int)ReadU16(info + 6);
+        bitCount = (int)ReadU16(info + 10);
+        compression = BMP_RGB;
+        paletteEntrySize = 3;
+    }
+    else if (infoSize >= BMP_INFO_HEADER_SIZE && size >= BMP_FILE_HEADER_SIZE + infoSize) {
+        width = (int)ReadU32(info + 4);
+        fileHeight = (int)ReadU32(info + 8);
+        bitCount = (int)ReadU16(info + 14);
+        compression = (int)ReadU32(info + 16);
+        colorsUsed = ReadU32(info + 32);
+    }
+    else {
+        return Fail("unsupported BMP header");
+    }
+
+    // Positive height means the rows are stored bottom-up
+    bottomUp = fileHeight > 0;
+    height = fileHeight < 0 ? -fileHeight : fileHeight;
+
+    if (width <= 0 || height <= 0 || width > BMP_MAX_DIMENSION || height > BMP_MAX_DIMENSION ||
+        (uint64_t)width * height > MAX_PAGE_PIXELS)
+        return Fail("invalid BMP dimensions");
+
+    bool validFormat;
+    switch (compression) {
+    case BMP_RGB: validFormat = bitCount == 1 || bitCount == 4 || bitCount == 8 ||
+                                bitCount == 16 || bitCount == 24 || bitCount == 32; break;
+    case BMP_RLE8: validFormat = bitCount == 8; break;
+    case BMP_RLE4: validFormat = bitCount == 4; break;
+    case BMP_BITFIELDS: validFormat = bitCount == 16 || bitCount == 32; break;
+    default: validFormat = false;
+    }
+    if (!validFormat) return Fail("unsupported BMP pixel format");
+
+    // Channel masks for 16 and 32-bit images. With a plain BITMAPINFOHEADER
+    // they follow the header, in later versions they are part of it; both
+    // put them at the same offset.
+    if (bitCount == 16 || bitCount == 32) {
+        if (compression == BMP_BITFIELDS) {
+            if (size < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + 12)
+                return Fail("truncated BMP header");
+            for (int c = 0; c < 3; ++c)
+                masks[c] = ReadU32(info + BMP_INFO_HEADER_SIZE + c * 4);
+            if (infoSize == BMP_INFO_HEADER_SIZE) paletteOffset += 12;
+        }
+        else if (bitCount == 16) {
+            masks[0] = 0x7c00; masks[1] = 0x03e0; masks[2] = 0x001f;
+        }
+        else {
+            masks[0] = 0xff0000; masks[1] = 0x00ff00; masks[2] = 0x0000ff;
+        }
+
+        for (int c = 0; c < 3; ++c) {
+            unsigned int m = masks[c];
+            maskShift[c] = 0;
+            maskBits[c] = 0;
+            if (m == 0) continue;
+            while (!(m & 1)) { m >>= 1; ++maskShift[c]; }
+            while (m & 1) { m >>= 1; ++maskBits[c]; }
+        }
+    }
+
+    // Palette for indexed images, converted to BGRA once up front
+    if (bitCount <= 8) {
+        size_t maxColors = (size_t)1 << bitCount;
+        if (colorsUsed == 0 || colorsUsed > maxColors) colorsUsed = maxColors;
+        if (paletteOffset + colorsUsed * paletteEntrySize > size)
+            return Fail("truncated BMP palette");
+
+        memset(palette, 0, sizeof(palette));
+        for (size_t i = 0; i < colorsUsed; ++i) {
+            const unsigned char* entry = data + paletteOffset + i * paletteEntrySize;
+            palette[i * 4] = entry[0];      // Blue
+            palette[i * 4 + 1] = entry[1];  // Green
+            palette[i * 4 + 2] = entry[2];  // Red
+        }
+        for (int i = 0; i < 256; ++i) {
+            palette[i * 4 + 3] = 255;  // Alpha
+            grayPalette[i] = (unsigned char)bgrToGrayscale(palette[i * 4], palette[i * 4 + 1], palette[i * 4 + 2]);
+        }
+    }
+
+    if (dataOffset >= size) return Fail("truncated BMP file");
+
+    if (compression == BMP_RLE8 || compression == BMP_RLE4) {
+        // A few bytes of RLE data could otherwise claim a huge blank page
+        if ((uint64_t)width * height > (uint64_t)(size - dataOffset) * BMP_RLE_MAX_PIXELS_PER_BYTE)
+            return Fail("BMP dimensions too large for its RLE data");
+    }
+    else {
+        stride = (((size_t)width * bitCount + 31) / 32) * 4;
+        size_t rowBytes = ((size_t)width * bitCount + 7) / 8;
+        if (size - dataOffset < rowBytes || (size - dataOffset - rowBytes) / stride < (size_t)height - 1)
+            return Fail("truncated BMP file");
+    }
+    return true;
+}
+
+bool BmpReader::IndexRleRows()
+{
+    // Walks the RLE stream once without producing pixels, remembering where
+    // each stored row begins, so rows can be decoded later in any order
+    const unsigned char* data = file.Data();
+    size_t size = file.Size();
+    bool rle8 = compression == BMP_RLE8;
+
+    rleOffset.assign(height, 0);
+    rleStartX.assign(height, 0);
+
+    size_t pos = dataOffset;
+    int x = 0;
+    int row = 0;
+    rleOffset[0] = pos;
+
+    while (row < height && pos + 2 <= size) {
+        int count = data[pos];
+        int value = data[pos + 1];
+        pos += 2;
+
+        if (count > 0) {
+            x += count;
+            continue;
+        }
+
+        switch (value) {
+        case 0:     // End of line
+            x = 0;
+            if (++row < height) rleOffset[row] = pos;
+            break;
+        case 1:     // End of bitmap, remaining rows stay blank
+            row = height;
+            break;
+        case 2:     // Delta, rows jumped over stay blank
+            if (pos + 2 > size) return true;
+            x = std::min(x + data[pos], width);
+            row += data[pos + 1];
+            pos += 2;
+            if (data[pos - 1] > 0 && row < height) {
+                rleOffset[row] = pos;
+                rleStartX[row] = x;
+            }
+            break;
+        default:    // Absolute run, padded to a 16-bit boundary
+            {
+                size_t bytes = rle8 ? value : (value + 1) / 2;
+                pos += (bytes + 1) & ~(size_t)1;
+                x += value;
+            }
+        }
+    }
+
+    // A stream that stops early just leaves the remaining rows blank
+    return true;
+}
+
+void BmpReader::DecodeRleRow(int fileRow, unsigned char* indices) const
+{
+    const unsigned char* data = file.Data();
+    size_t size = file.Size();
+    bool rle8 = compression == BMP_RLE8;
+
+    // Pixels not covered by the stream take the first palette color
+    memset(indices, 0, width);
+
+    size_t pos = rleOffset[fileRow];
+    if (pos == 0) return;
+    int x = rleStartX[fileRow];
+
+    while (pos + 2 <= size) {
+        int count = data[pos];
+        int value = data[pos + 1];
+        pos += 2;
+        if (x > width) x = width;
+
+        if (count > 0) {
+            // Encoded run, RLE4 alternates between the two nibbles
+            for (int i = 0; i < count && x < width; ++i, ++x)
+                indices[x] = (unsigned char)(rle8 ? value : ((i & 1) ? (value & 0x0f) : (value >> 4)));
+            continue;
+        }
+
+        if (value == 0 || value == 1) return;      // End of line or bitmap
+
+        if (value == 2) {
+            if (pos + 2 > size || data[pos + 1] > 0) return;    // Continues on a later row
+            x += data[pos];
+            pos += 2;
+            continue;
+        }
+
+        // Absolute run
+        size_t bytes = rle8 ? value : (value + 1) / 2;
+        if (pos + bytes > size) return;
+        for (int i = 0; i < value && x < width; ++i, ++x)
+            indices[x] = rle8 ? data[pos + i] : ((i & 1) ? (data[pos + i / 2] & 0x0f) : (data[pos + i / 2] >> 4));
+        pos += (bytes + 1) & ~(size_t)1;
+    }
+}
+
+void BmpReader::DecodeIndexRow(int fileRow, unsigned char* indices) const
+{
+    if (compression == BMP_RLE8 || compression == BMP_RLE4) {
+        DecodeRleRow(fileRow, indices);
+        return;
+    }
+
+    const unsigned char* src = file.Data() + dataOffset + (size_t)fileRow * stride;
+    switch (bitCount) {
+    case 1:
+        for (int x = 0; x < width; ++x)
+            indices[x] = (src[x >> 3] >> (7 - (x & 7))) & 1;
+        break;
+    case 4:
+        for (int x = 0; x < width; ++x)
+            indices[x] = (x & 1) ? (src[x >> 1] & 0x0f) : (src[x >> 1] >> 4);
+        break;
+    case 8:
+        memcpy(indices, src, width);
+        break;
+    }
+}
+
+// Scales a bitfield channel value to 8 bits
+static unsigned char ExpandChannel(unsigned int pixel, unsigned int mask, int shift, int bits)
+{
+    if (bits == 0) return 0;
+    unsigned int value = (pixel & mask) >> shift;
+    if (bits >= 8) return (unsigned char)(value >> (bits - 8));
+    return (unsigned char)(value * 255 / ((1u << bits) - 1));
+}
+
+void BmpReader::DecodeColorRow(const unsigned char* src, unsigned char* bgra) const
+{
+    if (bitCount == 24 || (bitCount == 32 && compression == BMP_RGB)) {
+        int pixelSize = bitCount / 8;
+        for (int x = 0; x < width; ++x, src += pixelSize) {
+            bgra[x * 4] = src[0];           // Blue
+            bgra[x * 4 + 1] = src[1];       // Green
+            bgra[x * 4 + 2] = src[2];       // Red
+            bgra[x * 4 + 3] = 255;          // Alpha
+        }
+    }
+    else {
+        DecodeBitfieldRow(src, bgra);
+    }
+}
+
+void BmpReader::DecodeBitfieldRow(const unsigned char* src, unsigned char* bgra) const
+{
+    for (int x = 0; x < width; ++x) {
+        unsigned int pixel = bitCount == 16 ? ReadU16(src + x * 2) : ReadU32(src + x * 4);
+        bgra[x * 4] = ExpandChannel(pixel, masks[2], maskShift[2], maskBits[2]);
+        bgra[x * 4 + 1] = ExpandChannel(pixel, masks[1], maskShift[1], maskBits[1]);
+        bgra[x * 4 + 2] = ExpandChannel(pixel, masks[0], maskShift[0], maskBits[0]);
+        bgra[x * 4 + 3] = 255;
+    }
+}
+
+const unsigned char* BmpReader::NextFileRow()
+{
+    if (nextRow >= height) return NULL;
+
+    currentFileRow = bottomUp ? height - 1 - nextRow : nextRow;
+    ++nextRow;
+
+    if (compression == BMP_RLE8 || compression == BMP_RLE4) return file.Data();
+
+    // Everything before the row being handed out has been decoded
+    if (nextRow - 1 - releasedRows >= BMP_RELEASE_ROWS) {
+        int first = bottomUp ? height - (nextRow - 1) : releasedRows;
+        file.Release(dataOffset + (size_t)first * stride,
+                     (size_t)(nextRow - 1 - releasedRows) * stride);
+        releasedRows = nextRow - 1;
+    }
+    return file.Data() + dataOffset + (size_t)currentFileRow * stride;
+}
+
+bool BmpReader::ReadRow(unsigned char* bgra)
+{
+    const unsigned char* src = NextFileRow();
+    if (src == NULL) return false;
+
+    if (IsIndexed()) {
+        DecodeIndexRow(currentFileRow, scratch.Data());
+        for (int x = 0; x < width; ++x)
+            memcpy(bgra + x * 4, palette + scratch[x] * 4, 4);
+    }
+    else {
+        DecodeColorRow(src, bgra);
+    }
+    return true;
+}
+
+void BmpReader::DecodeGrayRow(int fileRow, unsigned char* gray, unsigned char* work) const
+{
+    if (IsIndexed()) {
+        DecodeIndexRow(fileRow, work);
+        for (int x = 0; x < width; ++x) gray[x] = grayPalette[work[x]];
+        return;
+    }
+
+    const unsigned char* src = file.Data() + dataOffset + (size_t)fileRow * stride;
+    if (bitCount == 24 || (bitCount == 32 && compression == BMP_RGB)) {
+        BgrRowToGray(src, bitCount / 8, gray, width);
+    }
+    else {
+        DecodeBitfieldRow(src, work);
+        BgrRowToGray(work, 4, gray, width);
+    }
+}
+
+bool BmpReader::ReadGrayRow(unsigned char* gray)
+{
+    if (NextFileRow() == NULL) return false;
+    DecodeGrayRow(currentFileRow, gray, scratch.Data());
+    return true;
+}
+
+// A strip of rows being decoded in parallel, split into one chunk per task
+struct GrayStripJob {
+    const BmpReader* reader;
+    unsigned char* gray;
+    int firstRow;       // Top-down index of the strip's first row
+    int count;
+    int chunks;
+    unsigned char* work;    // width*4 bytes per chunk, allocated up front so
+                            // the tasks stay off the heap
+};
+
+void BmpReader::DecodeGrayTask(void* context, int index)
+{
+    GrayStripJob* job = (GrayStripJob*)context;
+    const BmpReader* reader = job->reader;
+    int begin = (int)((long long)job->count * index / job->chunks);
+    int end = (int)((long long)job->count * (index + 1) / job->chunks);
+
+    unsigned char* work = job->work + (size_t)reader->width * 4 * index;
+    for (int i = begin; i < end; ++i) {
+        int row = job->firstRow + i;
+        int fileRow = reader->bottomUp ? reader->height - 1 - row : row;
+        reader->DecodeGrayRow(fileRow, job->gray + (size_t)i * reader->width, work);
+    }
+}
+
+void BmpReader::ReserveStripScratch(ThreadPool* pool)
+{
+    size_t needed = pool != NULL ? scratch.Size() * pool->ThreadCount() : 0;
+    if (stripScratch.Size() < needed) stripScratch.Resize(needed);
+}
+
+bool BmpReader::ReadGrayRows(unsigned char* gray, int count, ThreadPool* pool)
+{
+    if (pool == NULL || pool->ThreadCount() == 1 || count > height - nextRow)
+        return RowSource::ReadGrayRows(gray, count, pool);
+
+    // Rows decode independently, the RLE ones through the index built by Open()
+    GrayStripJob job;
+    job.reader = this;
+    job.gray = gray;
+    job.firstRow = nextRow;
+    job.count = count;
+    job.chunks = std::min(count, pool->ThreadCount());
+    if (stripScratch.Size() < scratch.Size() * job.chunks) stripScratch.Resize(scratch.Size() * job.chunks);
+    job.work = stripScratch.Data();
+    pool->Run(DecodeGrayTask, &job, job.chunks);
+
+    for (int i = 0; i < count; ++i) NextFileRow();
+    return true;
+}
+
+bool LoadBmpGray(const char* filename, int& width, int& height,
+                 std::vector<unsigned char>& gray, std::string& error)
+{
+    BmpReader reader;
+    if (!reader.Open(filename)) {
+        error = reader.Error();
+        return false;
+    }
+
+    width = reader.Width();
+    height = reader.Height();
+    gray.resize((size_t)width * height);
+    for (int y = 0; y < height; ++y)
+        reader.ReadGrayRow(&gray[(size_t)y * width]);
+    return true;
+}
+
+// Little-endian field writers, the counterparts of ReadU16() and ReadU32()
+static void WriteU16(unsigned char* p, unsigned int value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void WriteU32(unsigned char* p, unsigned int value)
+{
+    WriteU16(p, value & 0xffff);
+    WriteU16(p + 2, value >> 16);
+}
+
+bool SaveBmpGray(const char* filename, const unsigned char* gray, int width, int height,
+                 int bitCount, std::string& error)
+{
+    if (bitCount != 8 && bitCount != 24) {
+        error = "only 8 and 24-bit output is supported";
+        return false;
+    }
+
+    size_t rowBytes = ((size_t)width * (bitCount / 8) + 3) & ~(size_t)3;
+    size_t paletteSize = bitCount == 8 ? 256 * 4 : 0;
+    size_t dataOffset = BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + paletteSize;
+    size_t fileSize = dataOffset + rowBytes * height;
+    if (fileSize > 0xffffffffu) {
+        error = "image too large for a .bmp file";
+        return false;
+    }
+
+    std::vector<unsigned char> header(dataOffset, 0);
+    unsigned char* p = &header[0];
+    p[0] = 'B';
+    p[1] = 'M';
+    WriteU32(p + 2, (unsigned int)fileSize);
+    WriteU32(p + 10, (unsigned int)dataOffset);
+
+    p += BMP_FILE_HEADER_SIZE;
+    WriteU32(p, BMP_INFO_HEADER_SIZE);
+    WriteU32(p + 4, width);
+    WriteU32(p + 8, height);                    // Positive, so bottom-up
+    WriteU16(p + 12, 1);                        // Planes
+    WriteU16(p + 14, bitCount);
+    WriteU32(p + 16, BMP_RGB);
+    WriteU32(p + 20, (unsigned int)(rowBytes * height));
+    WriteU32(p + 24, 2835);                     // 72 dpi
+    WriteU32(p + 28, 2835);
+    WriteU32(p + 32, bitCount == 8 ? 256 : 0);  // Palette entries
+
+    p += BMP_INFO_HEADER_SIZE;
+    for (size_t i = 0; i < paletteSize / 4; ++i) {
+        p[i * 4] = p[i * 4 + 1] = p[i * 4 + 2] = (unsigned char)i;
+    }
+
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        error = std::string("cannot create ") + filename;
+        return false;
+    }
+
+    bool ok = fwrite(&header[0], 1, header.size(), file) == header.size();
+    std::vector<unsigned char> row(rowBytes, 0);
+    for (int y = height - 1; y >= 0 && ok; --y) {
+        const unsigned char* src = gray + (size_t)y * width;
+        if (bitCount == 8) {
+            memcpy(&row[0], src, width);
+        }
+        else {
+            for (int x = 0; x < width; ++x)
+                row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = src[x];
+        }
+        ok = fwrite(&row[0], 1, rowBytes, file) == rowBytes;
+    }
+
+    if (fclose(file) != 0) ok = false;
+    if (!ok) error = std::string("cannot write ") + filename;
+    return ok;
+}
@@ -0,0 +1,107 @@
+// Native .bmp decoding, replacing LoadImage() and per-pixel GetPixel() calls
+#ifndef COLFIND_BMP_H
+#define COLFIND_BMP_H
+
+#include <string>
+#include <vector>
+
+#include "bufferpool.h"
+#include "platform.h"
+#include "rowsource.h"
+
+// Streaming .bmp decoder. The file is memory-mapped and parsed directly, and
+// rows are handed out one at a time in top-down order, so callers can decode
+// straight into their own buffers or process a page without holding all of
+// it. Handles 1, 4, 8, 16, 24 and 32-bit images, bottom-up and top-down row
+// order, BI_BITFIELDS and RLE8/RLE4 compression.
+class BmpReader : public RowSource {
+public:
+    BmpReader();
+
+    // Maps the file and parses its headers. On failure returns false and
+    // Error() describes why.
+    bool Open(const char* filename);
+    void Close();
+
+    virtual int Width() const { return width; }
+    virtual int Height() const { return height; }
+    virtual const std::string& Error() const { return error; }
+
+    // Decodes the next row as width*4 bytes of BGRA. Returns false once all
+    // rows have been read.
+    bool ReadRow(unsigned char* bgra);
+
+    // Decodes the next row straight to width bytes of luminance, without
+    // expanding to BGRA first where the format allows it
+    virtual bool ReadGrayRow(unsigned char* gray);
+
+    // Decodes the next count rows, splitting them across the pool
+    virtual bool ReadGrayRows(unsigned char* gray, int count, ThreadPool* pool);
+
+    // Sizes the per-thread scratch for a pool up front, so that reading
+    // with it from a thread that must not allocate is safe
+    virtual void ReserveStripScratch(ThreadPool* pool);
+
+    // Starts over at the top row
+    void Rewind() { nextRow = releasedRows = 0; }
+
+private:
+    BmpReader(const BmpReader&);
+    BmpReader& operator=(const BmpReader&);
+
+    bool Fail(const char* message);
+    bool ParseHeaders();
+    bool IndexRleRows();
+    bool IsIndexed() const { return bitCount <= 8; }
+    const unsigned char* NextFileRow();
+    void DecodeIndexRow(int fileRow, unsigned char* indices) const;
+    void DecodeRleRow(int fileRow, unsigned char* indices) const;
+    void DecodeColorRow(const unsigned char* src, unsigned char* bgra) const;
+    void DecodeBitfieldRow(const unsigned char* src, unsigned char* bgra) const;
+
+    // Decodes any stored row to luminance, work holds width*4 bytes. Safe to
+    // call from several threads at once.
+    void DecodeGrayRow(int fileRow, unsigned char* gray, unsigned char* work) const;
+    static void DecodeGrayTask(void* context, int index);
+
+    MappedFile file;
+    std::string error;
+
+    int width;
+    int height;
+    bool bottomUp;
+    int bitCount;
+    int compression;
+    size_t dataOffset;
+    size_t stride;              // Bytes per stored row, uncompressed only
+    int nextRow;
+    int releasedRows;           // Rows before this one were released from the mapping
+
+    int currentFileRow;                     // Stored row picked by NextFileRow()
+    PooledArray<unsigned char> scratch;     // Palette indices or BGRA for one row
+    PooledArray<unsigned char> stripScratch;    // Same, for each ReadGrayRows() task
+
+    unsigned char palette[256 * 4];         // BGRA for indexed images
+    unsigned char grayPalette[256];         // Luminance of each palette entry
+    unsigned int masks[3];                  // Red, green and blue for bitfields
+    int maskShift[3];
+    int maskBits[3];
+
+    // Where each stored row starts in the RLE stream; offset 0 marks a row
+    // skipped entirely by a delta escape
+    std::vector<size_t> rleOffset;
+    std::vector<int> rleStartX;
+};
+
+// Loads a .bmp file into a top-down luminance plane of width*height bytes.
+// On failure returns false and describes why in error.
+bool LoadBmpGray(const char* filename, int& width, int& height,
+                 std::vector<unsigned char>& gray, std::string& error);
+
+// Writes a top-down luminance plane as an uncompressed bottom-up .bmp, either
+// 8-bit with a gray palette or 24-bit. On failure returns false and
+// describes why in error.
+bool SaveBmpGray(const char* filename, const unsigned char* gray, int width, int height,
+                 int bitCount, std::string& error);
+
+#endif
@@ -0,0 +1,148 @@
+#include "bufferpool.h"
+
+// Bytes in front of every block, holding its size class and capacity, and
+// keeping what follows aligned for any type
+#define BLOCK_HEADER_BYTES 16
+
+// Size in bytes of a size class: POOL_CLASS_STEPS classes from every power
+// of two up to the next
+static size_t ClassBytes(size_t sizeClass)
+{
+    size_t base = (size_t)POOL_MIN_BYTES << (sizeClass / POOL_CLASS_STEPS);
+    return base + base / POOL_CLASS_STEPS * (sizeClass % POOL_CLASS_STEPS);
+}
+
+// Smallest size class holding bytes, at most POOL_MAX_BYTES. The octave
+// stops short of shifting POOL_MIN_BYTES out of a size_t.
+static size_t ClassFor(size_t bytes)
+{
+    size_t octave = 0;
+    while (octave < sizeof(size_t) * 8 - 8 && ((size_t)POOL_MIN_BYTES << (octave + 1)) <= bytes)
+        ++octave;
+    size_t sizeClass = octave * POOL_CLASS_STEPS;
+    while (ClassBytes(sizeClass) < bytes) ++sizeClass;
+    return sizeClass;
+}
+
+static size_t* Header(const void* block)
+{
+    return (size_t*)((unsigned char*)block - BLOCK_HEADER_BYTES);
+}
+
+BufferPool::BufferPool(size_t maxBytes) :
+    maxBytes(maxBytes)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    Trim();
+}
+
+void BufferPool::SetMaxBytes(size_t maxBytes)
+{
+    ScopedLock lock(mutex);
+    this->maxBytes = maxBytes;
+    FreeIdle(0);
+}
+
+void* BufferPool::Borrow(size_t bytes)
+{
+    if (bytes > POOL_MAX_BYTES) throw std::bad_alloc();
+    size_t sizeClass = ClassFor(bytes);
+    size_t capacity = ClassBytes(sizeClass);
+    void* block = NULL;
+    {
+        ScopedLock lock(mutex);
+        ++stats.borrows;
+        if (sizeClass < idle.size() && !idle[sizeClass].empty()) {
+            block = idle[sizeClass].back();
+            idle[sizeClass].pop_back();
+            stats.idleBytes -= capacity;
+        }
+        else {
+            FreeIdle(capacity);
+            ++stats.allocations;
+            stats.allocatedBytes += capacity;
+        }
+        stats.inUseBytes += capacity;
+        if (stats.inUseBytes > stats.highWaterBytes) stats.highWaterBytes = stats.inUseBytes;
+    }
+    if (block != NULL) return block;
+
+    // Allocated outside the lock, other threads need not wait for the heap
+    unsigned char* raw = new unsigned char[BLOCK_HEADER_BYTES + capacity];
+    block = raw + BLOCK_HEADER_BYTES;
+    Header(block)[0] = sizeClass;
+    Header(block)[1] = capacity;
+    return block;
+}
+
+void BufferPool::Return(void* block)
+{
+    if (block == NULL) return;
+    size_t sizeClass = Header(block)[0];
+    size_t capacity = Header(block)[1];
+    {
+        ScopedLock lock(mutex);
+        stats.inUseBytes -= capacity;
+        if (maxBytes == 0 || stats.inUseBytes + stats.idleBytes + capacity <= maxBytes) {
+            if (idle.size() <= sizeClass) idle.resize(sizeClass + 1);
+            idle[sizeClass].push_back(block);
+            stats.idleBytes += capacity;
+            return;
+        }
+    }
+    delete[] (unsigned char*)Header(block);
+}
+
+size_t BufferPool::Capacity(const void* block)
+{
+    return Header(block)[1];
+}
+
+void BufferPool::Trim()
+{
+    ScopedLock lock(mutex);
+    for (size_t sizeClass = 0; sizeClass < idle.size(); ++sizeClass) {
+        for (size_t i = 0; i < idle[sizeClass].size(); ++i)
+            delete[] (unsigned char*)Header(idle[sizeClass][i]);
+        idle[sizeClass].clear();
+    }
+    stats.idleBytes = 0;
+}
+
+BufferPoolStats BufferPool::Stats() const
+{
+    ScopedLock lock(mutex);
+    return stats;
+}
+
+// Frees idle blocks, the largest first, until needed more bytes fit under
+// the limit or nothing idle is left. The mutex must be held.
+void BufferPool::FreeIdle(size_t needed)
+{
+    if (maxBytes == 0) return;
+    size_t sizeClass = idle.size();
+    while (stats.inUseBytes + stats.idleBytes + needed > maxBytes && sizeClass > 0) {
+        std::vector<void*>& blocks = idle[sizeClass - 1];
+        if (blocks.empty()) {
+            --sizeClass;
+            continue;
+        }
+        delete[] (unsigned char*)Header(blocks.back());
+        blocks.pop_back();
+        stats.idleBytes -= ClassBytes(sizeClass - 1);
+    }
+}
+
+static BufferPool* sharedPool = NULL;
+
+BufferPool& SharedBufferPool()
+{
+    if (sharedPool == NULL) sharedPool = new BufferPool((size_t)DEFAULT_POOL_MEGABYTES << 20);
+    return *sharedPool;
+}
+
+// Made before main() can start any threads that would race to make it
+static BufferPool& initialPool = SharedBufferPool();
@@ -0,0 +1,173 @@
+// Working memory of the pipeline, kept between pages. Planes, strips, smear
+// history and profile arrays are borrowed from one process-wide pool and
+// given back when a page is done, so a batch of pages of the same size only
+// allocates for the first page each worker sees; after that every buffer
+// comes back from the pool instead of from the heap, where it would be
+// page-faulted in anew and fragment the address space.
+#ifndef COLFIND_BUFFERPOOL_H
+#define COLFIND_BUFFERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+#include "platform.h"
+
+// Default limit on the memory the shared pool holds on to
+#define DEFAULT_POOL_MEGABYTES 512
+
+// Smallest size class, every block is at least this large
+#define POOL_MIN_BYTES 64
+
+// Size classes per doubling of the block size. With four, a block is at
+// most a quarter larger than what was asked for.
+#define POOL_CLASS_STEPS 4
+
+// Largest block that can be borrowed, half of what a size_t can count, so
+// size classes never run past it
+#define POOL_MAX_BYTES ((size_t)-1 / 2)
+
+// What a pool has done so far
+struct BufferPoolStats {
+    uint64_t inUseBytes;        // Lent out right now
+    uint64_t idleBytes;         // Kept for reuse
+    uint64_t highWaterBytes;    // Most ever lent out at once
+    uint64_t borrows;
+    uint64_t allocations;       // Borrows that had to go to the heap
+    uint64_t allocatedBytes;
+
+    BufferPoolStats() :
+        inUseBytes(0),
+        idleBytes(0),
+        highWaterBytes(0),
+        borrows(0),
+        allocations(0),
+        allocatedBytes(0) {}
+};
+
+// Blocks of memory in size classes, a few per doubling, each with a list of
+// blocks given back and not yet lent out again. A block is only reused for
+// requests of its own class, so pages of the same size get exactly the
+// blocks the previous page returned. Safe to use from any thread.
+//
+// The pool never makes a borrow fail: past maxBytes it drops idle blocks to
+// make room, and once nothing idle is left it allocates anyway, which the
+// high water mark then shows. Blocks given back while the pool holds more
+// than maxBytes are freed at once.
+class BufferPool {
+public:
+    // A maxBytes of 0 means no limit
+    explicit BufferPool(size_t maxBytes = 0);
+    ~BufferPool();
+
+    void SetMaxBytes(size_t maxBytes);
+
+    // A block of at least bytes bytes, aligned for any type, with undefined
+    // contents. Capacity() tells its actual size. Throws std::bad_alloc, as
+    // new does, if there is no such block or bytes is over POOL_MAX_BYTES.
+    void* Borrow(size_t bytes);
+
+    // Takes back a block from Borrow(), NULL is ignored
+    void Return(void* block);
+
+    // Usable bytes of a borrowed block
+    static size_t Capacity(const void* block);
+
+    // Frees every idle block
+    void Trim();
+
+    BufferPoolStats Stats() const;
+
+private:
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+
+    void FreeIdle(size_t needed);
+
+    size_t maxBytes;
+    mutable Mutex mutex;
+    std::vector<std::vector<void*> > idle;  // Per size class
+    BufferPoolStats stats;
+};
+
+// The pool the pipeline borrows from. It is never destroyed, so globals
+// holding pages can still give their planes back while the process exits.
+BufferPool& SharedBufferPool();
+
+// A fixed-size array of plain data in a block of the shared pool, for the
+// working memory of a page. Unlike std::vector it does not keep its
+// contents when resized, and it keeps its block when made smaller, so
+// resizing it for the next page of the same size costs nothing. Copies get
+// a block of their own.
+template <class T>
+class PooledArray {
+public:
+    PooledArray() :
+        data(NULL),
+        count(0) {}
+
+    PooledArray(const PooledArray& other) :
+        data(NULL),
+        count(0)
+    {
+        *this = other;
+    }
+
+    ~PooledArray() { Release(); }
+
+    PooledArray& operator=(const PooledArray& other) {
+        if (this != &other) {
+            Resize(other.count);
+            if (count > 0) memcpy(data, other.data, count * sizeof(T));
+        }
+        return *this;
+    }
+
+    // Holds count elements with undefined values
+    void Resize(size_t count) {
+        if (count > POOL_MAX_BYTES / sizeof(T)) throw std::bad_alloc();
+        if (data == NULL || BufferPool::Capacity(data) < count * sizeof(T)) {
+            Release();
+            if (count > 0) data = (T*)SharedBufferPool().Borrow(count * sizeof(T));
+        }
+        this->count = count;
+    }
+
+    // Holds count copies of value
+    void Assign(size_t count, T value) {
+        Resize(count);
+        for (size_t i = 0; i < count; ++i) data[i] = value;
+    }
+
+    // Gives the block back to the pool
+    void Release() {
+        SharedBufferPool().Return(data);
+        data = NULL;
+        count = 0;
+    }
+
+    void Swap(PooledArray& other) {
+        T* otherData = other.data;
+        size_t otherCount = other.count;
+        other.data = data;
+        other.count = count;
+        data = otherData;
+        count = otherCount;
+    }
+
+    T* Data() { return data; }
+    const T* Data() const { return data; }
+    size_t Size() const { return count; }
+    bool Empty() const { return count == 0; }
+
+    T& operator[](size_t index) { return data[index]; }
+    const T& operator[](size_t index) const { return data[index]; }
+
+private:
+    T* data;
+    size_t count;
+};
+
+#endif
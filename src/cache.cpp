@@ -0,0 +1,292 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Format of the entry files, bumped when it changes
+#define CACHE_FORMAT 1
+
+// Entries are written under their own name with this appended first
+#define TEMPORARY_EXTENSION ".tmp"
+
+// Temporary files older than this were left behind by a process that died
+// before renaming them; a store takes far less
+#define STALE_TEMPORARY_SECONDS 3600
+
+//===========================================================================//
+// XXH64
+
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+static inline uint64_t RotateLeft(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Native byte order, so keys differ between little and big endian machines;
+// sharing a cache between them only costs misses
+static inline uint64_t Read64(const unsigned char* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Read32(const unsigned char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t HashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    return RotateLeft(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t MergeRound(uint64_t acc, uint64_t lane)
+{
+    acc ^= HashRound(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        // Four independent lanes keep the multipliers busy
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = HashRound(v1, Read64(p));
+            v2 = HashRound(v2, Read64(p + 8));
+            v3 = HashRound(v3, Read64(p + 16));
+            v4 = HashRound(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+        h = MergeRound(h, v1);
+        h = MergeRound(h, v2);
+        h = MergeRound(h, v3);
+        h = MergeRound(h, v4);
+    }
+    else {
+        h = seed + PRIME64_5;
+    }
+    h += (uint64_t)size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= HashRound(0, Read64(p));
+        h = RotateLeft(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)Read32(p) * PRIME64_1;
+        h = RotateLeft(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * PRIME64_5;
+        h = RotateLeft(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+//===========================================================================//
+// Cache directory
+
+ResultCache::ResultCache() :
+    maxBytes(0),
+    totalBytes(0),
+    stores(0)
+{
+}
+
+bool ResultCache::Open(const std::string& directory, size_t maxBytes, std::string& error)
+{
+    if (!MakeDirectory(directory)) {
+        error = "cannot create cache directory " + directory;
+        return false;
+    }
+
+    ScopedLock lock(mutex);
+    this->directory = directory;
+    this->maxBytes = maxBytes;
+    Evict();
+    return true;
+}
+
+std::string ResultCache::Key(const unsigned char* data, size_t size, int page,
+                             const PipelineParams& params)
+{
+    uint64_t parts[7];
+    parts[0] = HashBytes(data, size, 0);
+    parts[1] = size;
+    parts[2] = (uint64_t)params.threshold;
+    parts[3] = (uint64_t)params.maxVert;
+    parts[4] = PIPELINE_VERSION;
+    parts[5] = (uint64_t)params.binarize;
+    // Both flags in one part, so pages processed without deskewing keep their keys
+    parts[6] = (params.coarse ? 1 : 0) | (params.deskew ? 2 : 0);
+    // Seeded with the page, which only matters for multi-page files
+    uint64_t key = HashBytes(parts, sizeof(parts), (uint64_t)page);
+
+    char text[17];
+    sprintf(text, "%08lx%08lx", (unsigned long)(key >> 32), (unsigned long)(key & 0xffffffffu));
+    return text;
+}
+
+std::string ResultCache::EntryPath(const std::string& key) const
+{
+    return directory + PATH_SEPARATOR + key + CACHE_EXTENSION;
+}
+
+bool ResultCache::Lookup(const std::string& key, PageResult& result)
+{
+    if (!IsOpen()) return false;
+
+    std::string path = EntryPath(key);
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == NULL) return false;
+
+    // Anything unexpected, down to a missing end line, is a miss
+    char storedKey[64];
+    int format = 0, width = 0, height = 0, count = -1;
+    bool ok = fscanf(file, "colfind-cache %d\n", &format) == 1 && format == CACHE_FORMAT &&
+              fscanf(file, "key %63s\n", storedKey) == 1 && key == storedKey &&
+              fscanf(file, "page %d %d\n", &width, &height) == 2 &&
+              fscanf(file, "columns %d\n", &count) == 1 && count >= 0;
+
+    std::vector<ColumnRect> columns;
+    for (int i = 0; ok && i < count; ++i) {
+        ColumnRect column;
+        ok = fscanf(file, "%d %d %d %d %f\n", &column.x0, &column.x1, &column.y0, &column.y1,
+                    &column.confidence) == 5;
+        columns.push_back(column);
+    }
+    char endLine[8] = "";
+    ok = ok && fscanf(file, "%7s", endLine) == 1 && strcmp(endLine, "end") == 0;
+    fclose(file);
+    if (!ok) return false;
+
+    // Mark it as recently used for eviction
+    TouchFile(path);
+
+    result.width = width;
+    result.height = height;
+    result.columns.swap(columns);
+    return true;
+}
+
+bool ResultCache::Store(const std::string& key, const PageResult& result)
+{
+    if (!IsOpen()) return false;
+
+    // A name no other writer uses, in this process or any other
+    char suffix[64];
+    {
+        ScopedLock lock(mutex);
+        sprintf(suffix, ".%d.%u" TEMPORARY_EXTENSION, GetProcessNumber(), stores++);
+    }
+    std::string path = EntryPath(key);
+    std::string temporary = path + suffix;
+
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (file == NULL) return false;
+    fprintf(file, "colfind-cache %d\nkey %s\npage %d %d\ncolumns %d\n", CACHE_FORMAT,
+            key.c_str(), result.width, result.height, (int)result.columns.size());
+    for (size_t i = 0; i < result.columns.size(); ++i) {
+        const ColumnRect& column = result.columns[i];
+        fprintf(file, "%d %d %d %d %.9g\n", column.x0, column.x1, column.y0, column.y1,
+                column.confidence);
+    }
+    fprintf(file, "end\n");
+    long size = ftell(file);
+    bool written = !ferror(file);
+    if (fclose(file) != 0) written = false;
+
+    // On Windows rename() fails if another process stored the same page
+    // first, which is just as good
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+
+    ScopedLock lock(mutex);
+    totalBytes += size > 0 ? (size_t)size : 0;
+    if (totalBytes > maxBytes) Evict();
+    return true;
+}
+
+// Entry file with its last use
+struct CacheEntry {
+    std::string path;
+    size_t size;
+    double used;
+
+    bool operator<(const CacheEntry& other) const { return used < other.used; }
+};
+
+static bool EndsWith(const std::string& text, const char* suffix)
+{
+    size_t length = strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+void ResultCache::Evict()
+{
+    // The directory is the only shared state, so it is scanned again rather
+    // than trusting what this process alone has added
+    std::vector<std::string> files;
+    if (!ListDirectory(directory, files)) return;
+
+    std::vector<CacheEntry> entries;
+    double staleBefore = GetFileTimeNow() - STALE_TEMPORARY_SECONDS;
+    totalBytes = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const std::string& path = files[i];
+        bool temporary = EndsWith(path, TEMPORARY_EXTENSION) &&
+                         path.find(CACHE_EXTENSION ".") != std::string::npos;
+        if (!temporary && !EndsWith(path, CACHE_EXTENSION)) continue;
+
+        CacheEntry entry;
+        entry.path = path;
+        if (!GetFileInfo(path, entry.size, entry.used)) continue;
+        if (temporary) {
+            // Ones still being written are counted once they are renamed
+            if (entry.used < staleBefore) remove(path.c_str());
+            continue;
+        }
+        entries.push_back(entry);
+        totalBytes += entry.size;
+    }
+    if (totalBytes <= maxBytes) return;
+
+    // Oldest first, down to 90% so eviction does not run on every store
+    std::sort(entries.begin(), entries.end());
+    size_t target = maxBytes / 10 * 9;
+    for (size_t i = 0; i < entries.size() && totalBytes > target; ++i) {
+        // Another process may have deleted it already
+        remove(entries[i].path.c_str());
+        totalBytes -= entries[i].size;
+    }
+}
@@ -0,0 +1,73 @@
+// Persistent cache of page results, so pages that were processed before are
+// not decoded again. Entries are addressed by a hash of the file contents
+// and of everything that affects the result (the pipeline parameters and
+// PIPELINE_VERSION), so renamed or copied pages still hit and changed ones
+// never do.
+//
+// Every entry is a small text file in the cache directory, written under a
+// temporary name and renamed into place, so any number of processes can
+// share one directory: readers see a whole entry or none. Reading an entry
+// touches it, and once the directory grows past its size limit the least
+// recently used entries are deleted. Temporary files that a crash kept from
+// being renamed are deleted once they are an hour old.
+#ifndef COLFIND_CACHE_H
+#define COLFIND_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "pipeline.h"
+#include "platform.h"
+
+// Default limit on the size of the cache directory
+#define DEFAULT_CACHE_MEGABYTES 256
+
+// Entries take this extension, other files in the directory are left alone
+#define CACHE_EXTENSION ".cfc"
+
+// 64-bit XXH64 hash of a byte range, fast enough to be limited by memory
+// bandwidth
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed);
+
+class ResultCache {
+public:
+    ResultCache();
+
+    // Uses the given directory, creating it if needed, and keeps it below
+    // maxBytes. On failure returns false and describes why in error.
+    bool Open(const std::string& directory, size_t maxBytes, std::string& error);
+
+    bool IsOpen() const { return !directory.empty(); }
+
+    // Cache key of a page of a file, given its contents, processed with params
+    static std::string Key(const unsigned char* data, size_t size, int page,
+                           const PipelineParams& params);
+
+    // Fills in the width, height and columns stored under key, if any. Safe
+    // to call from several threads at once.
+    bool Lookup(const std::string& key, PageResult& result);
+
+    // Stores the width, height and columns of a page under key. Safe to call
+    // from several threads at once.
+    bool Store(const std::string& key, const PageResult& result);
+
+private:
+    ResultCache(const ResultCache&);
+    ResultCache& operator=(const ResultCache&);
+
+    std::string EntryPath(const std::string& key) const;
+
+    // Deletes temporary files left behind by processes that died while
+    // storing, then the least recently used entries until the directory is
+    // back below 90% of its limit. Called with mutex held.
+    void Evict();
+
+    std::string directory;
+    size_t maxBytes;
+    Mutex mutex;
+    size_t totalBytes;      // Estimated size of all entries, guarded by mutex
+    unsigned int stores;    // Temporary file names so far, guarded by mutex
+};
+
+#endif
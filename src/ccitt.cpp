@@ -0,0 +1,362 @@
+#include "ccitt.h"
+
+#include <string.h>
+
+#include "bitplane.h"
+
+// Longest run length code, in bits, and the lookup tables indexed by that
+// many upcoming bits
+#define RUN_CODE_BITS 13
+#define MODE_CODE_BITS 7
+
+// Two-dimensional coding modes
+enum CcittMode {
+    MODE_INVALID,
+    MODE_PASS,
+    MODE_HORIZONTAL,
+    MODE_VERTICAL
+};
+
+struct CodeDefinition {
+    int value;          // Run length, or offset for vertical modes
+    const char* bits;
+};
+
+// Run length codes of ITU-T T.4, terminating codes for runs of 0 to 63 and
+// make-up codes for multiples of 64
+static const CodeDefinition whiteCodes[] = {
+    { 0, "00110101" }, { 1, "000111" }, { 2, "0111" }, { 3, "1000" },
+    { 4, "1011" }, { 5, "1100" }, { 6, "1110" }, { 7, "1111" },
+    { 8, "10011" }, { 9, "10100" }, { 10, "00111" }, { 11, "01000" },
+    { 12, "001000" }, { 13, "000011" }, { 14, "110100" }, { 15, "110101" },
+    { 16, "101010" }, { 17, "101011" }, { 18, "0100111" }, { 19, "0001100" },
+    { 20, "0001000" }, { 21, "0010111" }, { 22, "0000011" }, { 23, "0000100" },
+    { 24, "0101000" }, { 25, "0101011" }, { 26, "0010011" }, { 27, "0100100" },
+    { 28, "0011000" }, { 29, "00000010" }, { 30, "00000011" }, { 31, "00011010" },
+    { 32, "00011011" }, { 33, "00010010" }, { 34, "00010011" }, { 35, "00010100" },
+    { 36, "00010101" }, { 37, "00010110" }, { 38, "00010111" }, { 39, "00101000" },
+    { 40, "00101001" }, { 41, "00101010" }, { 42, "00101011" }, { 43, "00101100" },
+    { 44, "00101101" }, { 45, "00000100" }, { 46, "00000101" }, { 47, "00001010" },
+    { 48, "00001011" }, { 49, "01010010" }, { 50, "01010011" }, { 51, "01010100" },
+    { 52, "01010101" }, { 53, "00100100" }, { 54, "00100101" }, { 55, "01011000" },
+    { 56, "01011001" }, { 57, "01011010" }, { 58, "01011011" }, { 59, "01001010" },
+    { 60, "01001011" }, { 61, "00110010" }, { 62, "00110011" }, { 63, "00110100" },
+    { 64, "11011" }, { 128, "10010" }, { 192, "010111" }, { 256, "0110111" },
+    { 320, "00110110" }, { 384, "00110111" }, { 448, "01100100" }, { 512, "01100101" },
+    { 576, "01101000" }, { 640, "01100111" }, { 704, "011001100" }, { 768, "011001101" },
+    { 832, "011010010" }, { 896, "011010011" }, { 960, "011010100" }, { 1024, "011010101" },
+    { 1088, "011010110" }, { 1152, "011010111" }, { 1216, "011011000" }, { 1280, "011011001" },
+    { 1344, "011011010" }, { 1408, "011011011" }, { 1472, "010011000" }, { 1536, "010011001" },
+    { 1600, "010011010" }, { 1664, "011000" }, { 1728, "010011011" }
+};
+
+static const CodeDefinition blackCodes[] = {
+    { 0, "0000110111" }, { 1, "010" }, { 2, "11" }, { 3, "10" },
+    { 4, "011" }, { 5, "0011" }, { 6, "0010" }, { 7, "00011" },
+    { 8, "000101" }, { 9, "000100" }, { 10, "0000100" }, { 11, "0000101" },
+    { 12, "0000111" }, { 13, "00000100" }, { 14, "00000111" }, { 15, "000011000" },
+    { 16, "0000010111" }, { 17, "0000011000" }, { 18, "0000001000" }, { 19, "00001100111" },
+    { 20, "00001101000" }, { 21, "00001101100" }, { 22, "00000110111" }, { 23, "00000101000" },
+    { 24, "00000010111" }, { 25, "00000011000" }, { 26, "000011001010" }, { 27, "000011001011" },
+    { 28, "000011001100" }, { 29, "000011001101" }, { 30, "000001101000" }, { 31, "000001101001" },
+    { 32, "000001101010" }, { 33, "000001101011" }, { 34, "000011010010" }, { 35, "000011010011" },
+    { 36, "000011010100" }, { 37, "000011010101" }, { 38, "000011010110" }, { 39, "000011010111" },
+    { 40, "000001101100" }, { 41, "000001101101" }, { 42, "000011011010" }, { 43, "000011011011" },
+    { 44, "000001010100" }, { 45, "000001010101" }, { 46, "000001010110" }, { 47, "000001010111" },
+    { 48, "000001100100" }, { 49, "000001100101" }, { 50, "000001010010" }, { 51, "000001010011" },
+    { 52, "000000100100" }, { 53, "000000110111" }, { 54, "000000111000" }, { 55, "000000100111" },
+    { 56, "000000101000" }, { 57, "000001011000" }, { 58, "000001011001" }, { 59, "000000101011" },
+    { 60, "000000101100" }, { 61, "000001011010" }, { 62, "000001100110" }, { 63, "000001100111" },
+    { 64, "0000001111" }, { 128, "000011001000" }, { 192, "000011001001" }, { 256, "000001011011" },
+    { 320, "000000110011" }, { 384, "000000110100" }, { 448, "000000110101" }, { 512, "0000001101100" },
+    { 576, "0000001101101" }, { 640, "0000001001010" }, { 704, "0000001001011" }, { 768, "0000001001100" },
+    { 832, "0000001001101" }, { 896, "0000001110010" }, { 960, "0000001110011" }, { 1024, "0000001110100" },
+    { 1088, "0000001110101" }, { 1152, "0000001110110" }, { 1216, "0000001110111" }, { 1280, "0000001010010" },
+    { 1344, "0000001010011" }, { 1408, "0000001010100" }, { 1472, "0000001010101" }, { 1536, "0000001011010" },
+    { 1600, "0000001011011" }, { 1664, "0000001100100" }, { 1728, "0000001100101" }
+};
+
+// Make-up codes for long runs, the same for both colors
+static const CodeDefinition extendedCodes[] = {
+    { 1792, "00000001000" }, { 1856, "00000001100" }, { 1920, "00000001101" },
+    { 1984, "000000010010" }, { 2048, "000000010011" }, { 2112, "000000010100" },
+    { 2176, "000000010101" }, { 2240, "000000010110" }, { 2304, "000000010111" },
+    { 2368, "000000011100" }, { 2432, "000000011101" }, { 2496, "000000011110" },
+    { 2560, "000000011111" }
+};
+
+// Two-dimensional mode codes, vertical ones by offset from b1
+static const CodeDefinition verticalCodes[] = {
+    { 0, "1" }, { 1, "011" }, { -1, "010" }, { 2, "000011" }, { -2, "000010" },
+    { 3, "0000011" }, { -3, "0000010" }
+};
+
+#define COUNT_OF(array) (sizeof(array) / sizeof(array[0]))
+
+struct CodeEntry {
+    short value;
+    unsigned char length;   // 0 where no code matches
+    unsigned char mode;     // CcittMode, for the mode table
+};
+
+// Lookup tables for every combination of upcoming bits, built once at start-up
+struct CcittTables {
+    CodeEntry white[1 << RUN_CODE_BITS];
+    CodeEntry black[1 << RUN_CODE_BITS];
+    CodeEntry modes[1 << MODE_CODE_BITS];
+    unsigned char reversed[256];    // Bit order of every byte turned around
+
+    CcittTables() {
+        memset(white, 0, sizeof(white));
+        memset(black, 0, sizeof(black));
+        memset(modes, 0, sizeof(modes));
+
+        Add(white, RUN_CODE_BITS, whiteCodes, COUNT_OF(whiteCodes), MODE_INVALID);
+        Add(white, RUN_CODE_BITS, extendedCodes, COUNT_OF(extendedCodes), MODE_INVALID);
+        Add(black, RUN_CODE_BITS, blackCodes, COUNT_OF(blackCodes), MODE_INVALID);
+        Add(black, RUN_CODE_BITS, extendedCodes, COUNT_OF(extendedCodes), MODE_INVALID);
+
+        static const CodeDefinition pass = { 0, "0001" };
+        static const CodeDefinition horizontal = { 0, "001" };
+        Add(modes, MODE_CODE_BITS, &pass, 1, MODE_PASS);
+        Add(modes, MODE_CODE_BITS, &horizontal, 1, MODE_HORIZONTAL);
+        Add(modes, MODE_CODE_BITS, verticalCodes, COUNT_OF(verticalCodes), MODE_VERTICAL);
+
+        for (int i = 0; i < 256; ++i) {
+            int r = 0;
+            for (int bit = 0; bit < 8; ++bit) {
+                if (i & (1 << bit)) r |= 0x80 >> bit;
+            }
+            reversed[i] = (unsigned char)r;
+        }
+    }
+
+    // Fills in every table slot whose leading bits are one of the codes
+    static void Add(CodeEntry* table, int tableBits, const CodeDefinition* codes, size_t count,
+                    CcittMode mode) {
+        for (size_t i = 0; i < count; ++i) {
+            int length = (int)strlen(codes[i].bits);
+            int code = 0;
+            for (int b = 0; b < length; ++b) code = code * 2 + (codes[i].bits[b] - '0');
+
+            int spare = tableBits - length;
+            for (int suffix = 0; suffix < (1 << spare); ++suffix) {
+                CodeEntry& entry = table[(code << spare) | suffix];
+                entry.value = (short)codes[i].value;
+                entry.length = (unsigned char)length;
+                entry.mode = (unsigned char)mode;
+            }
+        }
+    }
+};
+
+static const CcittTables tables;
+
+CcittDecoder::CcittDecoder() :
+    width(0),
+    coding(CCITT_T6),
+    twoDimensional(false),
+    reverseBits(false),
+    data(NULL),
+    size(0),
+    bitPosition(0),
+    referenceCount(0),
+    currentCount(0)
+{
+}
+
+void CcittDecoder::Begin(int width, CcittCoding coding, bool twoDimensional, bool reverseBits)
+{
+    this->width = width;
+    this->coding = coding;
+    this->twoDimensional = twoDimensional;
+    this->reverseBits = reverseBits;
+
+    // A row has at most one change per pixel, plus the one at its end and
+    // the two closing entries
+    reference.assign((size_t)width + 4, width);
+    current.assign((size_t)width + 4, width);
+    Reset(NULL, 0);
+}
+
+void CcittDecoder::Reset(const unsigned char* data, size_t size)
+{
+    this->data = data;
+    this->size = size;
+    bitPosition = 0;
+    current[0] = current[1] = width;
+    currentCount = 0;
+}
+
+// The next bits of the data, the first one highest, reading zeros past its
+// end. At most 16 bits.
+unsigned int CcittDecoder::Peek(int bits) const
+{
+    size_t byte = bitPosition >> 3;
+    unsigned int window = 0;
+    for (size_t i = byte; i < byte + 3; ++i) {
+        unsigned int value = i < size ? data[i] : 0;
+        window = (window << 8) | (reverseBits ? tables.reversed[value] : value);
+    }
+    return (window >> (24 - (int)(bitPosition & 7) - bits)) & ((1u << bits) - 1);
+}
+
+// Reads make-up codes up to a terminating code and returns the whole run,
+// or -1 for an invalid code
+int CcittDecoder::ReadRun(bool black)
+{
+    const CodeEntry* table = black ? tables.black : tables.white;
+    int run = 0;
+    for (;;) {
+        const CodeEntry& entry = table[Peek(RUN_CODE_BITS)];
+        if (entry.length == 0) return -1;
+        bitPosition += entry.length;
+        run += entry.value;
+        if (entry.value < 64) return run;
+        if (run > width) return -1;
+    }
+}
+
+// Steps over an EOL code and the fill bits that may pad it to a byte
+// boundary. Some encoders leave out the first EOL, so none is also fine.
+void CcittDecoder::SkipEol()
+{
+    unsigned int next = Peek(12);
+    if (next == 1) {
+        bitPosition += 12;
+    }
+    else if (next == 0) {
+        while (bitPosition < size * 8 && Peek(1) == 0) ++bitPosition;
+        ++bitPosition;
+    }
+}
+
+bool CcittDecoder::DecodeRow()
+{
+    // The row just decoded is the reference for this one
+    reference.swap(current);
+    referenceCount = currentCount;
+
+    bool decoded;
+    if (coding == CCITT_MODIFIED_HUFFMAN) {
+        bitPosition = (bitPosition + 7) & ~(size_t)7;
+        decoded = Decode1D();
+    }
+    else if (coding == CCITT_T4) {
+        SkipEol();
+        // A tag bit after the EOL tells one-dimensional rows from the others
+        bool oneDimensional = true;
+        if (twoDimensional) {
+            oneDimensional = Peek(1) == 1;
+            ++bitPosition;
+        }
+        decoded = oneDimensional ? Decode1D() : Decode2D();
+    }
+    else {
+        decoded = Decode2D();
+    }
+
+    current[currentCount] = current[currentCount + 1] = width;
+    return decoded && bitPosition <= size * 8;
+}
+
+bool CcittDecoder::Decode1D()
+{
+    int* changes = &current[0];
+    int count = 0;
+    int position = 0;
+    bool black = false;
+    while (position < width) {
+        int run = ReadRun(black);
+        if (run < 0 || count > width) {
+            currentCount = count;
+            return false;
+        }
+        // Rows that run long are cut off at the width
+        position += run;
+        if (position > width) position = width;
+        changes[count++] = position;
+        black = !black;
+    }
+    currentCount = count;
+    return true;
+}
+
+bool CcittDecoder::Decode2D()
+{
+    const int* above = &reference[0];
+    int* changes = &current[0];
+    int count = 0;
+    int a0 = -1;                // Just left of the row at its start
+    int color = 0;              // 0 while white, 1 while black
+    int b = 0;                  // Index of b1 in the reference row
+
+    while (a0 < width) {
+        // b1 is the first change in the row above right of a0 to the
+        // opposite of the current color, that is one at an index of the
+        // current color's parity; b2 is the change after it
+        while (b < referenceCount && (above[b] <= a0 || (b & 1) != color)) ++b;
+        int b1 = above[b];
+        int b2 = above[b + 1];
+
+        const CodeEntry& mode = tables.modes[Peek(MODE_CODE_BITS)];
+        bitPosition += mode.length;
+        if (mode.mode == MODE_PASS) {
+            a0 = b2;
+        }
+        else if (mode.mode == MODE_HORIZONTAL) {
+            int start = a0 < 0 ? 0 : a0;
+            int run1 = ReadRun(color == 1);
+            int run2 = run1 < 0 ? -1 : ReadRun(color == 0);
+            if (run2 < 0 || count + 2 > width + 1) break;
+
+            int a1 = start + run1 < width ? start + run1 : width;
+            int a2 = a1 + run2 < width ? a1 + run2 : width;
+            changes[count++] = a1;
+            changes[count++] = a2;
+            a0 = a2;
+        }
+        else if (mode.mode == MODE_VERTICAL) {
+            int a1 = b1 + mode.value;
+            if (a1 < 0 || a1 < a0 || a1 > width || count + 1 > width + 1) break;
+            changes[count++] = a1;
+            a0 = a1;
+            color ^= 1;
+
+            // The new b1 can be the change just before the old one
+            if (b > 0) --b;
+        }
+        else {
+            // Invalid, or an extension such as uncompressed mode
+            break;
+        }
+    }
+
+    currentCount = count;
+    return a0 >= width;
+}
+
+void CcittDecoder::FillRow(unsigned char* row, int count, unsigned char white,
+                           unsigned char black) const
+{
+    memset(row, white, count);
+    for (int i = 0; i < currentCount && current[i] < count; i += 2) {
+        int start = current[i];
+        int end = i + 1 < currentCount ? current[i + 1] : width;
+        if (end > count) end = count;
+        if (end > start) memset(row + start, black, end - start);
+    }
+}
+
+void CcittDecoder::MarkRuns(uint64_t* words, int offset, int count, bool black) const
+{
+    // Black runs go from an even change to the next one, white ones from an
+    // odd change or the start of the row, and the entry after the last
+    // change holds the width
+    for (int i = black ? 0 : -1; i < currentCount; i += 2) {
+        int x0 = i >= 0 ? current[i] : 0;
+        int x1 = current[i + 1];
+        if (x0 >= count) break;
+        SetBitRange(words, offset + x0, offset + (x1 < count ? x1 : count));
+    }
+}
@@ -0,0 +1,75 @@
+// Decoder for the CCITT fax codings that bilevel TIFF scans use: Modified
+// Huffman runs (TIFF compression 2), T.4 with EOL codes and optional
+// two-dimensional rows (Group 3) and T.6 (Group 4). Rows are decoded one at
+// a time, each against the row above it, and come out as the positions
+// where the color changes, which is what the codes describe, so filling in
+// a decoded row costs one memset per run rather than one step per pixel.
+#ifndef COLFIND_CCITT_H
+#define COLFIND_CCITT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum CcittCoding {
+    CCITT_MODIFIED_HUFFMAN,     // One-dimensional rows, each starting on a byte
+    CCITT_T4,                   // Rows after EOL codes, optionally two-dimensional
+    CCITT_T6                    // Two-dimensional rows, no EOL codes
+};
+
+class CcittDecoder {
+public:
+    CcittDecoder();
+
+    // Prepares for blocks of rows width pixels wide. Only this allocates.
+    // twoDimensional applies to T.4, reverseBits is for TIFF FillOrder 2,
+    // where the first bit is the lowest of each byte.
+    void Begin(int width, CcittCoding coding, bool twoDimensional, bool reverseBits);
+
+    // Starts on a new block of coded rows, such as a TIFF strip or tile. The
+    // row above the first one counts as white.
+    void Reset(const unsigned char* data, size_t size);
+
+    // Decodes the next row. Returns false if the data is damaged or ends
+    // before the row does.
+    bool DecodeRow();
+
+    // The last decoded row, which starts white: pixels from Changes()[2k] up
+    // to Changes()[2k + 1] are black, the last run reaching to the end of
+    // the row if the count is odd
+    const int* Changes() const { return &current[0]; }
+    int ChangeCount() const { return currentCount; }
+
+    // Writes the first count pixels of the last decoded row, one byte each
+    void FillRow(unsigned char* row, int count, unsigned char white, unsigned char black) const;
+
+    // Sets bit offset + x of a row of ink bits (see bitplane.h) for every
+    // pixel x among the first count of the last decoded row that is black,
+    // or white if black is false. The other bits are left alone.
+    void MarkRuns(uint64_t* words, int offset, int count, bool black) const;
+
+private:
+    unsigned int Peek(int bits) const;
+    int ReadRun(bool black);
+    void SkipEol();
+    bool Decode1D();
+    bool Decode2D();
+
+    int width;
+    CcittCoding coding;
+    bool twoDimensional;
+    bool reverseBits;
+
+    const unsigned char* data;
+    size_t size;
+    size_t bitPosition;
+
+    // Changes of the row above and of the row being decoded, each followed
+    // by two entries of width so lookups past the last change stop there
+    std::vector<int> reference;
+    std::vector<int> current;
+    int referenceCount;
+    int currentCount;
+};
+
+#endif
@@ -0,0 +1,282 @@
+// Headless batch front end for the column finding pipeline
+
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "bufferpool.h"
+#include "kernels.h"
+#include "metrics.h"
+#include "server.h"
+#include "skew.h"
+#include "smear.h"
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "usage: colfindc [options] <file|directory|@listfile>...\n"
+        "       colfindc [options] --serve SOCKET|-\n"
+        "\n"
+        "options:\n"
+        "  -j N      worker threads (default: one per CPU)\n"
+        "  -t N      ink threshold: how much darker than its row's paper level a\n"
+        "            pixel must be to count as ink (default: %d)\n"
+        "  -v N      rows blended by the vertical smear (default: %d, at most %d)\n"
+        "  -b MODE   binarize pages first and work on bits, much faster for text on\n"
+        "            paper: otsu (one threshold per page) or adaptive (default: none)\n"
+        "  --coarse  find columns on the page scaled down to an eighth first and only\n"
+        "            refine their bounds in full resolution, holds whole pages in memory\n"
+        "  --deskew  estimate how far each page is turned and detect columns along\n"
+        "            that, up to %d degrees either way, holds whole pages in memory\n"
+        "  -o DIR    write per-page XML results into DIR instead of next to each image\n"
+        "  -r FILE   append all results to FILE instead, as JSON Lines, or in binary\n"
+        "            if it ends in " RESULTS_BINARY_EXTENSION ", with an index of the pages in FILE.idx\n"
+        "  --rotate MB\n"
+        "            go on in a new results file once one reaches MB megabytes, 0 for\n"
+        "            never (default: %d)\n"
+        "  -q        only report failures\n"
+        "  -c DIR    keep results in a cache in DIR and reuse them for pages seen before\n"
+        "  --cache-size MB\n"
+        "            limit the cache to MB megabytes (default: %d)\n"
+        "  --pool-size MB\n"
+        "            keep at most MB megabytes of working memory for reuse by later\n"
+        "            pages, 0 for no limit (default: %d)\n"
+        "  -k LEVEL  pixel kernels to use: scalar, sse2 or avx2 (default: %s)\n"
+        "  -m FILE   record per-stage metrics and save them to FILE at exit, as JSON\n"
+        "            if it ends in .json and in Prometheus text format otherwise\n"
+#ifndef _WIN32
+        "            (and whenever the process receives SIGUSR1)\n"
+#endif
+        "  --serve SOCKET|-\n"
+        "            stay running and answer JSON requests, one per line, on a Unix\n"
+        "            domain socket at SOCKET or on standard input and output\n"
+        "  --queue N requests in flight at most while serving (default: twice -j)\n"
+        "  --max-clients N\n"
+        "            clients served at once, more are turned away (default: %d)\n"
+        "  --verify-kernels\n"
+        "            check the vectorized kernels against the scalar ones and exit\n",
+        DEFAULT_THRESHOLD, DEFAULT_MAX_VERT, MAX_VERT_LIMIT, MAX_SKEW_DEGREES, DEFAULT_RESULTS_MEGABYTES,
+        DEFAULT_CACHE_MEGABYTES, DEFAULT_POOL_MEGABYTES,
+        KernelLevelName(GetSupportedKernelLevel()), DEFAULT_MAX_CLIENTS);
+}
+
+// Parses the integer argument of an option, or returns false
+static bool ParseIntArg(int argc, char** argv, int& i, int& value)
+{
+    if (i + 1 >= argc) return false;
+    char* end;
+    long parsed = strtol(argv[++i], &end, 10);
+    if (*end != '\0' || parsed < 0 || parsed > INT_MAX) return false;
+    value = (int)parsed;
+    return true;
+}
+
+// Parses a size in megabytes into bytes, or returns false if it is not a
+// number or does not fit in a size_t
+static bool ParseMegabytesArg(int argc, char** argv, int& i, size_t& bytes)
+{
+    int megabytes;
+    if (!ParseIntArg(argc, argv, i, megabytes) || (size_t)megabytes > ((size_t)-1 >> 20)) return false;
+    bytes = (size_t)megabytes << 20;
+    return true;
+}
+
+// Parses a kernel level name, or returns false if it is unknown or not
+// supported on this CPU
+static bool ParseKernelArg(int argc, char** argv, int& i, KernelLevel& level)
+{
+    if (i + 1 >= argc) return false;
+    const char* name = argv[++i];
+    for (int l = KERNELS_SCALAR; l <= GetSupportedKernelLevel(); ++l) {
+        if (strcmp(name, KernelLevelName((KernelLevel)l)) == 0) {
+            level = (KernelLevel)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses a binarization mode name, or returns false if it is unknown
+static bool ParseBinarizeArg(int argc, char** argv, int& i, BinarizeMode& mode)
+{
+    if (i + 1 >= argc) return false;
+    const char* name = argv[++i];
+    for (int m = BINARIZE_NONE; m <= BINARIZE_ADAPTIVE; ++m) {
+        if (strcmp(name, BinarizeModeName((BinarizeMode)m)) == 0) {
+            mode = (BinarizeMode)m;
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifndef _WIN32
+static void OnDumpSignal(int)
+{
+    RequestMetricsDump();
+}
+
+static void OnStopSignal(int)
+{
+    StopServer();
+}
+#endif
+
+// Serves requests until the input ends or a signal stops the server,
+// returning the number of requests that failed, or -1 if the socket could
+// not be set up
+static int Serve(const std::string& socketPath, const BatchOptions& batch,
+                 int queueDepth, int maxClients)
+{
+    ServerOptions options;
+    options.workers = batch.workers;
+    options.queueDepth = queueDepth;
+    options.maxClients = maxClients;
+    options.params = batch.params;
+    options.cacheDir = batch.cacheDir;
+    options.cacheBytes = batch.cacheBytes;
+    options.metricsFile = batch.metricsFile;
+    options.quiet = batch.quiet;
+
+#ifndef _WIN32
+    // A client that hangs up only loses its own responses
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    if (socketPath == "-") return ServeStandardStreams(options);
+
+#ifndef _WIN32
+    signal(SIGINT, OnStopSignal);
+    signal(SIGTERM, OnStopSignal);
+#endif
+    std::string error;
+    int failures = ServeLocalSocket(socketPath, options, error);
+    if (failures < 0) fprintf(stderr, "colfindc: %s\n", error.c_str());
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    BatchOptions options;
+    std::vector<std::string> inputs;
+    KernelLevel kernelLevel = GetSupportedKernelLevel();
+    bool verifyKernels = false;
+    std::string socketPath;     // Empty unless serving
+    int queueDepth = 0;
+    int maxClients = DEFAULT_MAX_CLIENTS;
+    size_t poolBytes = (size_t)DEFAULT_POOL_MEGABYTES << 20;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool ok = true;
+
+        if (strcmp(arg, "-j") == 0) ok = ParseIntArg(argc, argv, i, options.workers);
+        else if (strcmp(arg, "-t") == 0) ok = ParseIntArg(argc, argv, i, options.params.threshold);
+        else if (strcmp(arg, "-v") == 0) ok = ParseIntArg(argc, argv, i, options.params.maxVert) && options.params.maxVert <= MAX_VERT_LIMIT;
+        else if (strcmp(arg, "-b") == 0) ok = ParseBinarizeArg(argc, argv, i, options.params.binarize);
+        else if (strcmp(arg, "--coarse") == 0) options.params.coarse = true;
+        else if (strcmp(arg, "--deskew") == 0) options.params.deskew = true;
+        else if (strcmp(arg, "-o") == 0) {
+            if (i + 1 < argc) options.outputDir = argv[++i];
+            else ok = false;
+        }
+        else if (strcmp(arg, "-r") == 0) {
+            if (i + 1 < argc) options.resultsFile = argv[++i];
+            else ok = false;
+        }
+        else if (strcmp(arg, "--rotate") == 0) ok = ParseMegabytesArg(argc, argv, i, options.resultsRotateBytes);
+        else if (strcmp(arg, "-q") == 0) options.quiet = true;
+        else if (strcmp(arg, "-c") == 0) {
+            if (i + 1 < argc) options.cacheDir = argv[++i];
+            else ok = false;
+        }
+        else if (strcmp(arg, "--cache-size") == 0) ok = ParseMegabytesArg(argc, argv, i, options.cacheBytes);
+        else if (strcmp(arg, "--pool-size") == 0) ok = ParseMegabytesArg(argc, argv, i, poolBytes);
+        else if (strcmp(arg, "-k") == 0) ok = ParseKernelArg(argc, argv, i, kernelLevel);
+        else if (strcmp(arg, "-m") == 0) {
+            if (i + 1 < argc) options.metricsFile = argv[++i];
+            else ok = false;
+        }
+        else if (strcmp(arg, "--serve") == 0) {
+            if (i + 1 < argc) socketPath = argv[++i];
+            else ok = false;
+        }
+        else if (strcmp(arg, "--queue") == 0) ok = ParseIntArg(argc, argv, i, queueDepth);
+        else if (strcmp(arg, "--max-clients") == 0) ok = ParseIntArg(argc, argv, i, maxClients) && maxClients > 0;
+        else if (strcmp(arg, "--verify-kernels") == 0) verifyKernels = true;
+        else if (arg[0] == '-' && arg[1] != '\0') ok = false;
+        else inputs.push_back(arg);
+
+        if (!ok) {
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    if (verifyKernels) {
+        std::string report;
+        bool passed = VerifyKernels(report);
+        fprintf(passed ? stdout : stderr, "colfindc: %s\n", report.c_str());
+        return passed ? 0 : 1;
+    }
+
+    SetKernelLevel(kernelLevel);
+    SharedBufferPool().SetMaxBytes(poolBytes);
+
+    if (options.params.coarse && options.params.binarize != BINARIZE_NONE) {
+        fprintf(stderr, "colfindc: -b and --coarse cannot be combined\n");
+        return 2;
+    }
+
+    if (inputs.empty() == socketPath.empty()) {
+        PrintUsage();
+        return 2;
+    }
+
+    std::string error;
+    if (!socketPath.empty()) {
+        if (!options.metricsFile.empty()) {
+            EnableMetrics(true);
+#ifndef _WIN32
+            signal(SIGUSR1, OnDumpSignal);
+#endif
+        }
+        int failures = Serve(socketPath, options, queueDepth, maxClients);
+        if (failures < 0) return 2;
+        if (!options.metricsFile.empty() && !SaveMetrics(options.metricsFile.c_str(), error)) {
+            fprintf(stderr, "colfindc: %s\n", error.c_str());
+            ++failures;
+        }
+        if (!options.quiet || failures > 0)
+            fprintf(stderr, "colfindc: server stopped, %d requests failed\n", failures);
+        return failures > 0 ? 1 : 0;
+    }
+
+    std::vector<std::string> files;
+    if (!CollectInputFiles(inputs, files, error)) {
+        fprintf(stderr, "colfindc: %s\n", error.c_str());
+        return 2;
+    }
+
+    if (!options.metricsFile.empty()) {
+        EnableMetrics(true);
+#ifndef _WIN32
+        signal(SIGUSR1, OnDumpSignal);
+#endif
+    }
+
+    int pageCount = (int)files.size();
+    int failures = RunBatch(files, options, &pageCount);
+    if (!options.metricsFile.empty() && !SaveMetrics(options.metricsFile.c_str(), error)) {
+        fprintf(stderr, "colfindc: %s\n", error.c_str());
+        ++failures;
+    }
+    if (!options.quiet || failures > 0)
+        fprintf(stderr, "colfindc: %d pages, %d failed\n", pageCount, failures);
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,340 @@
+#include "coarse.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "kernels.h"
+#include "smear.h"
+
+// A range of full resolution pixel columns whose profile is computed, and
+// where its pixels start among the gathered pixels of a row
+struct RefineBand {
+    int x0;
+    int x1;         // Inclusive
+    int offset;
+};
+
+static bool BandStartsBefore(const RefineBand& a, const RefineBand& b)
+{
+    return a.x0 < b.x0;
+}
+
+// Finest level at most COARSE_LEVEL that is still COARSE_MIN_WIDTH wide
+static int PickCoarseLevel(const ThumbnailPyramid& pyramid)
+{
+    int level = std::min(COARSE_LEVEL, pyramid.Levels() - 1);
+    while (level > 0 && pyramid.LevelWidth(level) < COARSE_MIN_WIDTH) --level;
+    return level;
+}
+
+// The plain full resolution pipeline, for pages too small to scale down
+static void FindColumnsFull(const unsigned char* grayData, int width, int height,
+                            const PipelineParams& params, std::vector<ColumnRect>& columns,
+                            PageMetrics* metrics)
+{
+    PipelineParams fullParams = params;
+    fullParams.binarize = BINARIZE_NONE;
+    StripProcessor processor;
+    processor.Begin(width, fullParams, NULL, metrics);
+
+    processor.ProcessRows(grayData, NULL, height);
+    processor.Finish(columns);
+}
+
+// Sorts and merges bands, sets their offsets and returns the pixels they
+// hold per row
+static int MergeBands(std::vector<RefineBand>& bands)
+{
+    std::sort(bands.begin(), bands.end(), BandStartsBefore);
+    size_t merged = 0;
+    for (size_t i = 0; i < bands.size(); ++i) {
+        if (merged > 0 && bands[i].x0 <= bands[merged - 1].x1 + 1)
+            bands[merged - 1].x1 = std::max(bands[merged - 1].x1, bands[i].x1);
+        else bands[merged++] = bands[i];
+    }
+    bands.resize(merged);
+
+    int pixels = 0;
+    for (size_t i = 0; i < bands.size(); ++i) {
+        bands[i].offset = pixels;
+        pixels += bands[i].x1 - bands[i].x0 + 1;
+    }
+    return pixels;
+}
+
+// The full resolution profile of the bands' pixel columns, as
+// ColumnProfile::AddRow() would sum it for the whole page. The smear works
+// down each pixel column on its own, so smearing the bands side by side
+// gives exactly their part of the full smear. The paper level of each row
+// is the brightest smeared pixel in any of the bands or paper[y], whichever
+// is brighter, and is left in paper.
+static void ProfileBands(const unsigned char* grayData, int width, int height, int maxVert,
+                         const std::vector<RefineBand>& bands, int pixels,
+                         std::vector<int>& paper, std::vector<uint32_t>& darkness)
+{
+    darkness.assign(pixels, 0);
+    if (pixels == 0) return;
+
+    std::vector<unsigned char> row(pixels);
+    VerticalSmear smear;
+    smear.Reset(pixels, maxVert);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* source = grayData + (size_t)y * width;
+        unsigned char* out = &row[0];
+        for (size_t i = 0; i < bands.size(); ++i) {
+            for (int x = bands[i].x0; x <= bands[i].x1; ++x) *out++ = source[x];
+        }
+        smear.SmearRow(&row[0]);
+
+        paper[y] = std::max(paper[y], RowMax(&row[0], pixels));
+        for (int i = 0; i < pixels; ++i) darkness[i] += paper[y] - row[i];
+    }
+}
+
+// Refines one bound of a column the way ColumnProfile::FindColumns() finds
+// it, on the full resolution profile of a band around it: the end of the run
+// of the smoothed profile above the gutter level that starts on the inner
+// side of the band, then the outermost pixel column within the filter radius
+// of it that is above the gutter level on its own. Keeps the bound as it is
+// if there is no text in the band.
+static void RefineBound(const RefineBand& band, const std::vector<uint32_t>& darkness, int width,
+                        uint32_t gutterLevel, bool left, int& bound)
+{
+    int radius = ProfileSmoothRadius(width);
+    int minGutter = MinGutterWidth(width);
+    const uint32_t* raw = &darkness[band.offset];
+
+    std::vector<uint64_t> sums(band.x1 - band.x0 + 2, 0);
+    for (int x = band.x0; x <= band.x1; ++x)
+        sums[x - band.x0 + 1] = sums[x - band.x0] + raw[x - band.x0];
+
+    // Only where the whole filter lies inside the band, or is cut off by the
+    // page edge as in FindColumns()
+    int first = band.x0 == 0 ? 0 : band.x0 + radius;
+    int last = band.x1 == width - 1 ? width - 1 : band.x1 - radius;
+    int step = left ? -1 : 1;
+    int end = left ? first - 1 : last + 1;
+    int runEnd = -1;
+    for (int x = left ? last : first; x != end; x += step) {
+        int lo = std::max(0, x - radius);
+        int hi = std::min(width - 1, x + radius);
+        uint32_t smooth = (uint32_t)((sums[hi - band.x0 + 1] - sums[lo - band.x0]) / (hi - lo + 1));
+        if (smooth > gutterLevel) runEnd = x;
+        else if (runEnd >= 0 && (x - runEnd) * step >= minGutter) break;
+    }
+    if (runEnd < 0) return;
+
+    // Tightened from as far out as the filter could have blurred it, up to
+    // the inner end of the band
+    int x = left ? std::max(band.x0, runEnd - radius) : std::min(band.x1, runEnd + radius);
+    int inner = left ? band.x1 : band.x0;
+    while (x != inner && raw[x - band.x0] <= gutterLevel) x -= step;
+    bound = x;
+}
+
+// Refines the rows of a column to those ColumnProfile::FindColumns() takes:
+// the 25th percentile of the first ink row of its pixel columns and the 75th
+// of the last. Scanning from the top of the page, first rows turn up in
+// order, so the percentile is the row by which enough pixel columns have
+// had ink, and likewise from the bottom; this looks at the margins above
+// and below the column but nothing in between. Pixel columns without any ink
+// are left out of the count as the coarse profile has them.
+static void RefineRows(const unsigned char* grayData, int width, int height, int threshold,
+                       const ColumnProfile& coarse, int scale, std::vector<int>& grayMax,
+                       ColumnRect& column)
+{
+    int x0 = column.x0;
+    int x1 = column.x1;
+    int inked = 0;
+    for (int x = x0; x <= x1; ++x) {
+        if (coarse.FirstRow(std::min(x / scale, coarse.Width() - 1)) >= 0) ++inked;
+    }
+    if (inked == 0) return;
+
+    int markStart = std::max(0, x0 - 1);
+    int markEnd = std::min(width - 1, x1 + 1);
+    std::vector<unsigned char> ink(markEnd - markStart + 1);
+    std::vector<unsigned char> seen(x1 - x0 + 1);
+    for (int pass = 0; pass < 2; ++pass) {
+        // Pixel columns that must have had ink for the percentile to be
+        // reached, counting from this pass's end of the page
+        int index = (inked - 1) * (pass == 0 ? 25 : 75) / 100;
+        int needed = pass == 0 ? index + 1 : inked - index;
+        int count = 0;
+        std::fill(seen.begin(), seen.end(), 0);
+
+        int step = pass == 0 ? 1 : -1;
+        for (int y = pass == 0 ? 0 : height - 1; y >= 0 && y < height; y += step) {
+            const unsigned char* row = grayData + (size_t)y * width;
+            if (grayMax[y] < 0) grayMax[y] = RowMax(row, width);
+            MarkInk(row + markStart, markEnd - markStart + 1, grayMax[y] - threshold, &ink[0]);
+
+            // Ink needs a horizontal neighbour, as in ColumnProfile::AddRow()
+            for (int x = x0; x <= x1; ++x) {
+                int i = x - markStart;
+                if (seen[x - x0] || !ink[i] ||
+                    !((x > 0 && ink[i - 1]) || (x + 1 < width && ink[i + 1])))
+                    continue;
+                seen[x - x0] = 1;
+                ++count;
+            }
+            if (count >= needed) {
+                if (pass == 0) column.y0 = y;
+                else column.y1 = y;
+                break;
+            }
+        }
+    }
+    column.y1 = std::max(column.y0, column.y1);
+}
+
+void FindColumnsCoarseToFine(const unsigned char* grayData, int width, int height,
+                             const ThumbnailPyramid& pyramid, const PipelineParams& params,
+                             std::vector<ColumnRect>& columns, PageMetrics* metrics)
+{
+    columns.clear();
+    if (width == 0 || height == 0) return;
+
+    int level = PickCoarseLevel(pyramid);
+    if (level == 0) {
+        FindColumnsFull(grayData, width, height, params, columns, metrics);
+        return;
+    }
+
+    // The whole pipeline on the coarse level, with a smear that reaches as
+    // far down the page as it would in full resolution
+    int scale = 1 << level;
+    int coarseWidth = pyramid.LevelWidth(level);
+    int coarseHeight = pyramid.LevelHeight(level);
+    const unsigned char* coarse = pyramid.LevelData(level);
+    size_t coarsePixels = (size_t)coarseWidth * coarseHeight;
+
+    PooledArray<unsigned char> coarseSmear;
+    coarseSmear.Resize(coarsePixels);
+    memcpy(coarseSmear.Data(), coarse, coarsePixels);
+    {
+        StageTimer timer(metrics, STAGE_SMEAR, coarsePixels);
+        VerticalSmear smear;
+        smear.Reset(coarseWidth, (params.maxVert + scale / 2) / scale);
+        for (int y = 0; y < coarseHeight; ++y) smear.SmearRow(&coarseSmear[(size_t)y * coarseWidth]);
+    }
+    ColumnProfile profile;
+    profile.Reset(coarseWidth, params.threshold);
+    {
+        StageTimer timer(metrics, STAGE_PROFILE, coarsePixels);
+        for (int y = 0; y < coarseHeight; ++y) {
+            size_t offset = (size_t)y * coarseWidth;
+            profile.AddRow(coarse + offset, &coarseSmear[offset], y);
+        }
+    }
+
+    std::vector<ColumnRect> found;
+    {
+        StageTimer timer(metrics, STAGE_SEGMENT, coarseWidth);
+        profile.FindColumns(found);
+    }
+    if (found.empty()) return;
+
+    // The coarse profile only says where the columns roughly are; its levels
+    // do not carry over to full resolution, where the smear blends far
+    // fewer rows of paper into the text. So the full resolution profile is
+    // sampled across the page, giving the gutter level and where each bound
+    // crosses it to within a sample.
+    int sampleStep = std::max(1, scale / REFINE_SAMPLES);
+    std::vector<RefineBand> samples;
+    for (int x = sampleStep / 2; x < width; x += sampleStep) {
+        RefineBand sample;
+        sample.x0 = x;
+        sample.x1 = x;
+        sample.offset = 0;
+        samples.push_back(sample);
+    }
+    int sampleCount = MergeBands(samples);
+    std::vector<int> paper(height, 0);
+    std::vector<uint32_t> sampled;
+    {
+        StageTimer timer(metrics, STAGE_PROFILE, (uint64_t)sampleCount * height);
+        ProfileBands(grayData, width, height, params.maxVert, samples, sampleCount, paper, sampled);
+    }
+
+    // Smoothed as FindColumns() smooths, over the samples within the radius
+    int radius = ProfileSmoothRadius(width);
+    std::vector<uint32_t> smooth(sampleCount);
+    for (int i = 0; i < sampleCount; ++i) {
+        int lo = std::max(0, i - radius / sampleStep);
+        int hi = std::min(sampleCount - 1, i + radius / sampleStep);
+        uint64_t sum = 0;
+        for (int j = lo; j <= hi; ++j) sum += sampled[j];
+        smooth[i] = (uint32_t)(sum / (hi - lo + 1));
+    }
+    std::vector<uint32_t> sorted(smooth);
+    size_t index = (sorted.size() - 1) * 90 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    uint32_t gutterLevel = (uint32_t)((uint64_t)sorted[index] * GUTTER_LEVEL_PERCENT / 100);
+
+    // Moves each coarse bound to the sample where the sampled profile
+    // crosses the gutter level, then puts a band around it wide enough to
+    // smooth and tighten it in full resolution
+    std::vector<RefineBand> bands;
+    std::vector<int> crossings;
+    for (size_t c = 0; c < found.size(); ++c) {
+        int left = std::min(found[c].x0 * scale / sampleStep, sampleCount - 1);
+        int right = std::min(found[c].x1 * scale / sampleStep, sampleCount - 1);
+        for (int side = 0; side < 2; ++side) {
+            int i = side == 0 ? left : right;
+            int outward = side == 0 ? -1 : 1;
+            if (smooth[i] > gutterLevel) {
+                while (i + outward >= 0 && i + outward < sampleCount &&
+                       smooth[i + outward] > gutterLevel)
+                    i += outward;
+            }
+            else {
+                while (i != (side == 0 ? right : left) && smooth[i] <= gutterLevel) i -= outward;
+            }
+            crossings.push_back(samples[i].x0);
+
+            RefineBand band;
+            band.x0 = std::max(0, samples[i].x0 - (side == 0 ? 2 : 1) * scale - radius);
+            band.x1 = std::min(width - 1, samples[i].x0 + (side == 0 ? 1 : 2) * scale + radius);
+            band.offset = 0;
+            bands.push_back(band);
+        }
+    }
+    std::vector<RefineBand> merged(bands);
+    int bandPixels = MergeBands(merged);
+    std::vector<uint32_t> darkness;
+    {
+        StageTimer timer(metrics, STAGE_PROFILE, (uint64_t)bandPixels * height);
+        ProfileBands(grayData, width, height, params.maxVert, merged, bandPixels, paper, darkness);
+    }
+    if (metrics != NULL) {
+        metrics->Allocated(STAGE_SMEAR, coarsePixels);
+        metrics->Allocated(STAGE_PROFILE, profile.MemoryBytes() +
+                                          (sampleCount + bandPixels) * sizeof(uint32_t) +
+                                          height * sizeof(int));
+    }
+
+    StageTimer timer(metrics, STAGE_SEGMENT, bandPixels);
+    std::vector<int> grayMax(height, -1);
+    for (size_t c = 0; c < found.size(); ++c) {
+        ColumnRect column = found[c];
+        for (int side = 0; side < 2; ++side) {
+            // The band's own pixels among the merged ones
+            RefineBand band = bands[c * 2 + side];
+            size_t m = 0;
+            while (merged[m].x1 < band.x0) ++m;
+            band.offset = merged[m].offset + band.x0 - merged[m].x0;
+
+            int& bound = side == 0 ? column.x0 : column.x1;
+            bound = crossings[c * 2 + side];
+            RefineBound(band, darkness, width, gutterLevel, side == 0, bound);
+        }
+        column.x1 = std::max(column.x0, column.x1);
+
+        column.y0 = std::min(height - 1, found[c].y0 * scale);
+        column.y1 = std::min(height - 1, found[c].y1 * scale + scale - 1);
+        RefineRows(grayData, width, height, params.threshold, profile, scale, grayMax, column);
+
+        columns.push_back(column);
+    }
+}
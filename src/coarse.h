@@ -0,0 +1,45 @@
+// Coarse-to-fine column detection. Gutters are tens of pixels wide and
+// plain to see at an eighth of the scan resolution, so columns are first
+// found on a small level of the page's thumbnail pyramid, which the viewer
+// builds anyway, and only their bounds are then looked at again in full
+// resolution.
+#ifndef COLFIND_COARSE_H
+#define COLFIND_COARSE_H
+
+#include <vector>
+
+#include "metrics.h"
+#include "pipeline.h"
+#include "segment.h"
+#include "thumbnail.h"
+
+// Pyramid level columns are first looked for on, an eighth of the page size
+#define COARSE_LEVEL 3
+
+// Pixel columns per coarse pixel whose full resolution profile is sampled
+// for the gutter level. The level decides bounds on ragged edges, where the
+// profile falls off slowly, so fewer samples save time but can move those.
+#define REFINE_SAMPLES 2
+
+// Finer levels are used for pages whose coarse level would be narrower than
+// this, and full resolution when even level 1 would be
+#define COARSE_MIN_WIDTH 256
+
+// Finds the columns of a top-down luminance plane from a pyramid of the same
+// plane. The whole pipeline first runs on the coarse level, with the smear
+// shortened to match. The full resolution profile is then computed for
+// REFINE_SAMPLES pixel columns per coarse pixel, which give the gutter level,
+// and for bands a few coarse pixels wide around where each column's left and
+// right bound crosses it; ink is looked for only from the page's top and
+// bottom down to the rows that decide each column's top and bottom. Refined
+// bounds are usually within a pixel of what detection in full resolution
+// finds, but ragged edges, where the profile falls off slowly, can move with
+// the sampled gutter level.
+//
+// params.binarize is not used, detection is always on luminance. Metrics
+// may be NULL.
+void FindColumnsCoarseToFine(const unsigned char* grayData, int width, int height,
+                             const ThumbnailPyramid& pyramid, const PipelineParams& params,
+                             std::vector<ColumnRect>& columns, PageMetrics* metrics = NULL);
+
+#endif
@@ -6,15 +6,30 @@
 #include <commdlg.h>
 
 // Standard C++ library headers
+#include <stdio.h>  // For formatting slider labels
 #include <vector>   // For memory storage such as the list of loaded images in a particular window
 #include <string>   // Well, for strings
-#include <fstream>  // For file I/O
 
-// Constants
-#define THUMBNAIL_BASE_SIZE 500
+// Portable processing pipeline shared with the batch tool
+#include "pipeline.h"
+#include "image.h"
+#include "jobqueue.h"
+#include "layout.h"
+#include "metrics.h"
+#include "stages.h"
+#include "thumbnail.h"
 
 // Win32 object IDs
 #define ID_FILE_OPEN 1000
+#define ID_FILE_CANCEL 1001
+#define ID_VIEW_PARAMETERS 1002
+#define ID_PARAM_SLIDER 1100    // First of the parameter sliders, one ID each
+
+// Posted by the page loading thread, with the PageJob as lParam
+#define WM_PAGE_PROGRESS (WM_APP + 1)   // Some more rows are done
+#define WM_PAGE_DONE (WM_APP + 2)       // The job is over and can be finished
+
+#define PARAMS_CLASS_NAME "ColfindParameters"
 
 // Restore missing min and max features
 template <typename T>
@@ -35,85 +50,209 @@ struct WindowState {
     void* pBackbufferBits;
     HDC hdcBackbuffer;
     HBITMAP hBackbufferBitmap;
+    int backbufferWidth;
+    int backbufferHeight;
 
     WindowState() :
         bInitialized(false),
         hwnd(NULL),
         clientRect(),
         pBackbufferBits(NULL),
-        hdcBackbuffer(NULL) {}
+        hdcBackbuffer(NULL),
+        hBackbufferBitmap(NULL),
+        backbufferWidth(0),
+        backbufferHeight(0) {}
 };
 
-// Struct to hold image data
+// One pyramid level of a page as a bitmap selected into a memory DC, ready
+// to be drawn. Replaced when the zoom calls for another level.
+struct ThumbnailBitmap {
+    HDC hdcMem;
+    HBITMAP hBitmap;
+    int level;          // Pyramid level shown, -1 for none yet
+    int width;
+    int height;
+
+    ThumbnailBitmap() :
+        hdcMem(NULL),
+        hBitmap(NULL),
+        level(-1),
+        width(0),
+        height(0) {}
+
+    ~ThumbnailBitmap() {
+        Release();
+    }
+
+    void Release() {
+        // The bitmap is selected into the memory DC, so the DC goes first
+        if (hdcMem != NULL) DeleteDC(hdcMem);
+        if (hBitmap != NULL) DeleteObject(hBitmap);
+        hdcMem = NULL;
+        hBitmap = NULL;
+        level = -1;
+    }
+
+private:
+    ThumbnailBitmap(const ThumbnailBitmap&);
+    ThumbnailBitmap& operator=(const ThumbnailBitmap&);
+};
+
+struct PageJob;
+
+// Struct to hold image data. It owns its pixel planes and GDI objects and is
+// never copied: pages are allocated once and stay where they are.
 struct ImageData {
     std::string filename;
-    BYTE* originalData;
-    BYTE* processedData;
-    HDC hdcMemOriginal;
-    HBITMAP hOriginalBitmap;
-    HDC hdcMemProcessed;
-    HBITMAP hProcessedBitmap;
+    PooledArray<BYTE> grayData;     // Luminance plane, one byte per pixel
+    PooledArray<BYTE> smearData;    // Vertically smeared luminance, one byte per pixel
+    ThumbnailPyramid originalPyramid;       // Halvings of grayData
+    ThumbnailPyramid processedPyramid;      // Halvings of smearData
+    ThumbnailBitmap originalThumbnail;
+    ThumbnailBitmap processedThumbnail;
     int width;
     int height;
-    std::vector<int> detectedColumns; // Store detected columns here
-    HWND hwndVertLenEntry;
-
+    std::vector<ColumnRect> columns;  // Detected columns, in source pixels
+    PageStages stages;      // Profile kept for detecting again with other parameters
+    PageJob* job;           // Set while the page is loading or being redetected
 
     ImageData() :
-        originalData(NULL),
-        processedData(NULL),
         width(0),
         height(0),
-        hwndVertLenEntry(NULL) {}
+        job(NULL) {}
 
-    // Destructor to free allocated memory
-    ~ImageData() {
-        delete[] originalData;
-        delete[] processedData;
-    }
+    // Destructor to free the job, the planes go back to the shared buffer
+    // pool and the thumbnails free themselves. A page is only ever deleted
+    // while its job is not running.
+    ~ImageData();
 
-    // Copy constructor for deep copy
-    ImageData(const ImageData& other)
-        : width(other.width), height(other.height), detectedColumns(other.detectedColumns)
-    {
-        originalData = new BYTE[width * height * 4];
-        processedData = new BYTE[width * height * 4];
+private:
+    // Not copyable, copies of whole pages are what made loading slow
+    ImageData(const ImageData&);
+    ImageData& operator=(const ImageData&);
+};
+
+// Loaded images, in the order they were opened. Only pointers move when the
+// list grows, so adding a page costs the same however many are loaded.
+class ImageList {
+public:
+    ImageList() {}
 
-        memcpy(originalData, other.originalData, width * height * 4);
-        memcpy(processedData, other.processedData, width * height * 4);
+    ~ImageList() {
+        for (size_t i = 0; i < items.size(); ++i) delete items[i];
     }
 
-    // Copy assignment operator for deep copy
-    ImageData& operator=(const ImageData& other) {
-        if (this == &other) return *this;  // handle self-assignment
+    // Takes ownership of a page
+    void Add(ImageData* image) {
+        items.push_back(image);
+    }
 
-        delete[] originalData;
-        delete[] processedData;
+    // Deletes a page
+    void Remove(ImageData* image) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (items[i] == image) {
+                items.erase(items.begin() + i);
+                delete image;
+                return;
+            }
+        }
+    }
 
-        width = other.width;
-        height = other.height;
-        detectedColumns = other.detectedColumns; // Copy detected columns
+    size_t size() const { return items.size(); }
+    ImageData& operator[](size_t index) { return *items[index]; }
 
-        originalData = new BYTE[width * height * 4];
-        processedData = new BYTE[width * height * 4];
+private:
+    ImageList(const ImageList&);
+    ImageList& operator=(const ImageList&);
 
-        memcpy(originalData, other.originalData, width * height * 4);
-        memcpy(processedData, other.processedData, width * height * 4);
+    std::vector<ImageData*> items;
+};
 
-        return *this;
-    }
+// A page being loaded or redetected in the background. QueueImage() and
+// QueueRedetect() allocate everything it needs on the UI thread, the
+// loading thread only fills it in.
+struct PageJob {
+    ImageData* image;
+    HWND hwnd;                  // Told about progress and completion
+    int id;                     // In pageQueue
+    bool redetect;              // Redoing the stale stages of a loaded page
+    RowSource* reader;          // Owned, open at the page being loaded
+    StripProcessor processor;
+    PipelineParams params;      // The page is loaded with
+    PageMetrics metrics;
+    PageMetrics* pageMetrics;   // &metrics while metrics are enabled
+    double start;
+    volatile LONG rowsDone;
+    volatile LONG cancelled;    // Set by the UI thread to stop loading early
+    volatile LONG failed;       // The reader's Error() says why
+
+    PageJob() :
+        image(NULL),
+        hwnd(NULL),
+        id(0),
+        redetect(false),
+        reader(NULL),
+        pageMetrics(NULL),
+        start(0),
+        rowsDone(0),
+        cancelled(0),
+        failed(0) {}
+
+    ~PageJob() { delete reader; }
+
+private:
+    PageJob(const PageJob&);
+    PageJob& operator=(const PageJob&);
 };
 
+ImageData::~ImageData()
+{
+    delete job;
+}
+
 
 // Forward declarations
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
-void ProcessImage(const char* filename);
-void RenderThumbnails(HWND hwnd, HDC hdc);
+void QueueImage(HWND hwnd, const char* filename);
+void QueueImagePage(HWND hwnd, const char* filename, int page);
+void LoadPage(void* context);
+void QueueRedetect(HWND hwnd, ImageData* image);
+void RedetectPage(void* context);
+void FinishPage(HWND hwnd, PageJob* job);
+void CancelLoading(HWND hwnd);
+void ApplyParams(HWND hwnd);
+void ShowParamsWindow(HWND owner);
+LRESULT CALLBACK ParamsWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+void InvalidatePage(HWND hwnd, const ImageData* image);
+void RenderThumbnails(HWND hwnd, HDC hdc, const RECT& dirty);
 
 // Global variables
-std::vector<ImageData> images;
+ThreadPool pagePool;    // Spreads each page being loaded across all CPUs
+ImageList images;
+JobQueue pageQueue(1);  // Loads pages one at a time in the background. Declared
+                        // after the pages so its thread is stopped first.
+int paintStamp = 0;     // Counts paints, pages seen more recently load first
+ThumbnailLayout layout;
 float thumbnailScale = 1.0;
 int thumbnailSpacing = 10;
+PipelineParams viewParams;  // Every page is detected with these
+HWND hwndParams = NULL;     // Parameters window, made when first shown
+
+// A slider of the parameters window and the parameter it sets
+struct ParamSlider {
+    const char* label;
+    int minimum;
+    int maximum;
+    int* value;
+    HWND hwndLabel;
+    HWND hwndBar;
+};
+
+ParamSlider paramSliders[] = {
+    { "Ink threshold", 1, 255, &viewParams.threshold, NULL, NULL },
+    { "Rows smeared", 0, MAX_VERT_LIMIT, &viewParams.maxVert, NULL, NULL }
+};
+#define PARAM_SLIDER_COUNT (int)(sizeof(paramSliders) / sizeof(paramSliders[0]))
 
 // Helper function to create a DIB section
 HBITMAP CreateDIBSection(HDC hdc, int width, int height, void** ppvBits)
@@ -141,6 +280,15 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInstance */, LPSTR /*
     wc.lpszClassName = CLASS_NAME;
     RegisterClass(&wc);
 
+    // Class of the parameters window
+    WNDCLASS paramsClass;
+    ZeroMemory(&paramsClass, sizeof(WNDCLASS));
+    paramsClass.lpfnWndProc = ParamsWindowProc;
+    paramsClass.hInstance = hInstance;
+    paramsClass.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+    paramsClass.lpszClassName = PARAMS_CLASS_NAME;
+    RegisterClass(&paramsClass);
+
     // Create window
     HWND hwnd = CreateWindow(
         CLASS_NAME, "Image Processor",
@@ -161,6 +309,11 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInstance */, LPSTR /*
 
     if (hwnd == NULL) return 0;
 
+    // Per-stage metrics are recorded when COLFIND_METRICS names a file to
+    // save them to on exit
+    const char* metricsFile = getenv("COLFIND_METRICS");
+    if (metricsFile != NULL && metricsFile[0] != '\0') EnableMetrics(true);
+
     ShowWindow(hwnd, nCmdShow);
 
     // Message loop
@@ -171,6 +324,10 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInstance */, LPSTR /*
         DispatchMessage(&msg);
     }
 
+    std::string error;
+    if (MetricsEnabled() && !SaveMetrics(metricsFile, error))
+        MessageBox(NULL, error.c_str(), "Error", MB_OK);
+
     return 0;
 }
 
@@ -185,7 +342,11 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             if(!AppendMenu(hSubMenu, MF_STRING, ID_FILE_OPEN, "Open")) {
                 MessageBox(hwnd, "Open item could not be added correctly. ", "Error", MB_OK);
             }
+            AppendMenu(hSubMenu, MF_STRING, ID_FILE_CANCEL, "Cancel loading\tEsc");
             AppendMenu(hMenu, MF_POPUP, (UINT_PTR)hSubMenu, "File");
+            HMENU hViewMenu = CreatePopupMenu();
+            AppendMenu(hViewMenu, MF_STRING, ID_VIEW_PARAMETERS, "Detection parameters");
+            AppendMenu(hMenu, MF_POPUP, (UINT_PTR)hViewMenu, "View");
             SetMenu(hwnd, hMenu);
 
             // Register the window for drag-and-drop
@@ -194,6 +355,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         return 0;
 
     case WM_DESTROY:
+        CancelLoading(hwnd);
         PostQuitMessage(0);
         return 0;
 
@@ -207,7 +369,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         //SelectObject(hdc, GetStockObject(WHITE_BRUSH));
         //Rectangle(hdc, 0, 0, rect.right, rect.bottom);
 
-        RenderThumbnails(hwnd, hdc);
+        RenderThumbnails(hwnd, hdc, ps.rcPaint);
 
         EndPaint(hwnd, &ps);
         return 0;
@@ -229,7 +391,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             // use the contents of szFile to initialize itself.
             ofn.lpstrFile[0] = '\0';
             ofn.nMaxFile = sizeof(szFile);
-            ofn.lpstrFilter = "All\0*.*\0Text\0*.TXT\0";
+            ofn.lpstrFilter = "Images\0*.bmp;*.tif;*.tiff\0All\0*.*\0";
             ofn.nFilterIndex = 1;
             ofn.lpstrFileTitle = NULL;
             ofn.nMaxFileTitle = 0;
@@ -238,12 +400,18 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
             // Display the Open dialog box.
             if (GetOpenFileName(&ofn) == TRUE) {
-                // Process file if one was selected
-                ProcessImage(ofn.lpstrFile);
+                // Load the file in the background if one was selected
+                QueueImage(hwnd, ofn.lpstrFile);
             }
 
             InvalidateRect(hwnd, NULL, TRUE);
 
+            break;
+        case ID_FILE_CANCEL:
+            CancelLoading(hwnd);
+            break;
+        case ID_VIEW_PARAMETERS:
+            ShowParamsWindow(hwnd);
             break;
         default:
             MessageBox(hwnd, "Invalid command ID encountered.", "Error", MB_OK);
@@ -279,12 +447,21 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             {
                 char filename[MAX_PATH];
                 DragQueryFile(hDrop, i, filename, MAX_PATH);
-                ProcessImage(filename);
+                QueueImage(hwnd, filename);
             }
             DragFinish(hDrop);
             InvalidateRect(hwnd, NULL, TRUE);
         }
         return 0;
+    case WM_KEYDOWN:
+        if (wParam == VK_ESCAPE) CancelLoading(hwnd);
+        return 0;
+    case WM_PAGE_PROGRESS:
+        InvalidatePage(hwnd, ((PageJob*)lParam)->image);
+        return 0;
+    case WM_PAGE_DONE:
+        FinishPage(hwnd, (PageJob*)lParam);
+        return 0;
     case WM_SIZE:
     {
         // Invalidate the client area to force a redraw on resizing
@@ -318,151 +495,348 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     return DefWindowProc(hwnd, uMsg, wParam, lParam);
 }
 
-void SaveColumnDataToXML(const std::vector<int>& columnPositions, const char* filename)
+// Adds every page of an image file, each loaded on its own
+void QueueImage(HWND hwnd, const char* filename)
 {
-    std::ofstream xmlFile;
-    xmlFile.open(filename);
+    int pageCount = CountImagePages(filename);
+    for (int page = 0; page < pageCount; ++page) QueueImagePage(hwnd, filename, page);
+}
 
-    if (!xmlFile.is_open()) {
-        MessageBox(NULL, "Error opening XML file for writing.", "Error", MB_OK);
-        return;
+// Adds a page that shows as a placeholder right away and is loaded by
+// pageQueue. Everything the loading needs is allocated here, on the UI
+// thread.
+void QueueImagePage(HWND hwnd, const char* filename, int page)
+{
+    std::string error;
+    RowSource* reader = OpenImagePage(filename, page, error);
+    if (reader == NULL) return;
+
+    PageJob* job = new PageJob;
+    job->reader = reader;
+
+    // The page is built where it will stay, nothing is copied afterwards
+    ImageData* image = new ImageData;
+    ImageData& imgData = *image;
+    imgData.filename = filename;
+    imgData.width = job->reader->Width();
+    imgData.height = job->reader->Height();
+
+    // Closed pages leave their planes in the pool for the next ones
+    imgData.grayData.Resize((size_t)imgData.width * imgData.height);
+    imgData.smearData.Resize((size_t)imgData.width * imgData.height);
+
+    // Thumbnails for every zoom level, filled in as the rows are loaded, so
+    // zooming never has to go back to the full resolution planes
+    imgData.originalPyramid.Begin(imgData.width, imgData.height);
+    imgData.processedPyramid.Begin(imgData.width, imgData.height);
+
+    job->image = image;
+    job->hwnd = hwnd;
+    job->pageMetrics = MetricsEnabled() ? &job->metrics : NULL;
+    job->reader->ReserveStripScratch(&pagePool);
+    job->params = viewParams;
+    job->processor.Begin(imgData.width, job->params, &pagePool, job->pageMetrics);
+
+    if (job->pageMetrics != NULL) {
+        uint64_t pixels = (uint64_t)imgData.width * imgData.height;
+        job->metrics.Allocated(STAGE_DECODE, pixels);
+        job->metrics.Allocated(STAGE_SMEAR, pixels);
+        job->metrics.Allocated(STAGE_THUMBNAIL, imgData.originalPyramid.MemoryBytes() +
+                                                imgData.processedPyramid.MemoryBytes());
     }
 
-    xmlFile << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-    xmlFile << "<ImageColumns>\n";
+    imgData.job = job;
+    images.Add(image);
+
+    // Queued behind the pages already waiting, until a paint finds it on
+    // screen and moves it up
+    job->id = pageQueue.Submit(LoadPage, job);
+}
+
+// Decodes, smears and thumbnails a page strip by strip, each strip spread
+// across pagePool. Runs on pageQueue's thread, so it touches nothing but its
+// own job; the UI thread leaves the page alone until WM_PAGE_DONE.
+void LoadPage(void* context)
+{
+    PageJob* job = (PageJob*)context;
+    ImageData& imgData = *job->image;
+    job->start = GetTimeSeconds();
+
+    int lastPercent = 0;
+    for (int row = 0; row < imgData.height && !job->cancelled; row += STRIP_ROWS) {
+        int count = min(STRIP_ROWS, imgData.height - row);
+        size_t offset = (size_t)row * imgData.width;
+        uint64_t pixels = (uint64_t)count * imgData.width;
 
-    for (size_t i = 0; i < columnPositions.size(); ++i) {
-        xmlFile << "  <Column>" << columnPositions[i] << "</Column>\n";
+        {
+            StageTimer timer(job->pageMetrics, STAGE_DECODE, pixels);
+            if (!job->reader->ReadGrayRows(imgData.grayData.Data() + offset, count, &pagePool)) {
+                job->failed = 1;
+                break;
+            }
+        }
+        job->processor.ProcessRows(imgData.grayData.Data() + offset,
+                                   imgData.smearData.Data() + offset, count);
+        {
+            StageTimer timer(job->pageMetrics, STAGE_THUMBNAIL, pixels * 2);
+            imgData.originalPyramid.AddRows(imgData.grayData.Data() + offset, count);
+            imgData.processedPyramid.AddRows(imgData.smearData.Data() + offset, count);
+        }
+
+        // Repainting on every strip of a tall page would only slow it down
+        job->rowsDone = row + count;
+        int percent = (int)((long long)(row + count) * 100 / imgData.height);
+        if (percent != lastPercent) {
+            lastPercent = percent;
+            PostMessage(job->hwnd, WM_PAGE_PROGRESS, 0, (LPARAM)job);
+        }
     }
 
-    xmlFile << "</ImageColumns>\n";
-    xmlFile.close();
+    PostMessage(job->hwnd, WM_PAGE_DONE, 0, (LPARAM)job);
 }
 
-int bgrToGrayscale(int green, int blue, int red) {
-    // Convert to grayscale using luminosity method
-    return static_cast<int>(0.299 * red + 0.587 * green + 0.114 * blue);
+// Queues redoing the stages of a loaded page that the current parameters
+// make stale, if there are any
+void QueueRedetect(HWND hwnd, ImageData* image)
+{
+    PageJob* job = new PageJob;
+    job->pageMetrics = MetricsEnabled() ? &job->metrics : NULL;
+    if (image->stages.Prepare(viewParams, &pagePool, job->pageMetrics) == 0) {
+        delete job;
+        return;
+    }
+
+    job->image = image;
+    job->hwnd = hwnd;
+    job->redetect = true;
+    image->job = job;
+    job->id = pageQueue.Submit(RedetectPage, job);
 }
 
-void ProcessImage(const char* filename)
+// Redoes the stale stages of a page, and the thumbnails of its smeared plane
+// if that was smeared again. Runs on pageQueue's thread and touches nothing
+// but its own job, like LoadPage().
+void RedetectPage(void* context)
 {
-    HBITMAP hBitmap = (HBITMAP)LoadImage(NULL, filename, IMAGE_BITMAP, 0, 0, LR_LOADFROMFILE);
-    if (!hBitmap) return;
-
-    BITMAP bm;
-    GetObject(hBitmap, sizeof(BITMAP), &bm);
-
-    HDC hdcScreen = GetDC(NULL);
-    HDC hdcMem = CreateCompatibleDC(hdcScreen);
-    HBITMAP hOldBitmap = (HBITMAP)SelectObject(hdcMem, hBitmap);
-
-    ImageData imgData;
-    imgData.width = bm.bmWidth;
-    imgData.height = bm.bmHeight;
-
-    imgData.originalData = new BYTE[imgData.width * imgData.height * 4];
-    imgData.processedData = new BYTE[imgData.width * imgData.height * 4];
-
-    // Copy original image data into originalData buffer
-    for (int y = 0; y < imgData.height; ++y) {
-        for (int x = 0; x < imgData.width; ++x) {
-            COLORREF color = GetPixel(hdcMem, x, y);
-            int index = (y * imgData.width + x) * 4;
-            imgData.originalData[index] = GetBValue(color);         // Blue
-            imgData.originalData[index + 1] = GetGValue(color);     // Green
-            imgData.originalData[index + 2] = GetRValue(color);     // Red
-            imgData.originalData[index + 3] = 255;                  // Alpha
-
-            // Convert to greyscale and set in the processedData array
-            int grey = bgrToGrayscale(
-                imgData.originalData[index],
-                imgData.originalData[index+1],
-                imgData.originalData[index+2]);
-            imgData.processedData[index] = grey;                    // Blue
-            imgData.processedData[index + 1] = grey;                // Green
-            imgData.processedData[index + 2] = grey;                // Red
-            imgData.processedData[index + 3] = 255;                 // Alpha
-        }
+    PageJob* job = (PageJob*)context;
+    ImageData& imgData = *job->image;
+    job->start = GetTimeSeconds();
+
+    imgData.stages.Run(imgData.grayData.Data(), imgData.smearData.Data(), imgData.height);
+    if (imgData.stages.Stale() & PAGE_STAGE_SMEAR) {
+        StageTimer timer(job->pageMetrics, STAGE_THUMBNAIL, (uint64_t)imgData.width * imgData.height);
+        imgData.processedPyramid.Restart();
+        imgData.processedPyramid.AddRows(imgData.smearData.Data(), imgData.height);
     }
 
-    // Step 1: Vertical Smearing (Simple Copying Down the Column)
-    #define MAX_VERT 40
-    for (int x = 0; x < imgData.width; ++x) {
-        for (int y = 1; y < imgData.height; ++y) {
-            int currIndex = (y * imgData.width + x) * 4;
-
-            for (int vert = 1; vert <= min(y,MAX_VERT); ++vert) {
-                int prevIndex = ((y - vert) * imgData.width + x) * 4;
-                imgData.processedData[currIndex] /= 2;
-                imgData.processedData[currIndex + 1] /= 2;
-                imgData.processedData[currIndex + 2] /= 2;
-
-                imgData.processedData[currIndex] += imgData.processedData[prevIndex] / 2;             // Blue
-                imgData.processedData[currIndex + 1] += imgData.processedData[prevIndex + 1] / 2;     // Green
-                imgData.processedData[currIndex + 2] += imgData.processedData[prevIndex + 2] / 2;     // Red
-                imgData.processedData[currIndex + 3] = 255;                                     // Alpha
-            }
+    PostMessage(job->hwnd, WM_PAGE_DONE, 0, (LPARAM)job);
+}
+
+// Completes a page whose job is over. The columns are painted by the UI
+// thread, so they are found here rather than by LoadPage().
+// Redetection always gets this far, as it is only cancelled before it starts.
+void FinishPage(HWND hwnd, PageJob* job)
+{
+    ImageData* image = job->image;
+    if (!job->redetect && (job->cancelled || job->failed)) {
+        if (!job->cancelled) MessageBox(hwnd, job->reader->Error().c_str(), "Error", MB_OK);
+        images.Remove(image);
+        InvalidateRect(hwnd, NULL, TRUE);
+        return;
+    }
+
+    if (job->redetect) {
+        if (image->stages.Stale() & PAGE_STAGE_SMEAR) image->processedThumbnail.Release();
+        image->stages.Finish(image->columns);
+    }
+    else {
+        job->processor.Finish(image->columns);
+        image->stages.Adopt(job->processor.Profile(), job->params);
+    }
+    if (job->pageMetrics != NULL) {
+        // Only loading counts as a page
+        if (!job->redetect) {
+            job->metrics.Add(STAGE_PAGE, GetTimeSeconds() - job->start,
+                             (uint64_t)image->width * image->height);
         }
+        RecordPageMetrics(job->metrics);
     }
 
-    // Step 2: Column/Line Detection (Simple Edge Detection in Grayscale)
-    int threshold = 20;
-    for (int y = 0; y < imgData.height; ++y) {
-        for (int x = 1; x < imgData.width - 1; ++x) {
-            int currIndex = (y * imgData.width + x) * 4;
-            int leftIndex = (y * imgData.width + (x - 1)) * 4;
-            int rightIndex = (y * imgData.width + (x + 1)) * 4;
+    image->job = NULL;
+    delete job;
 
-            BYTE grayCurr = (imgData.originalData[currIndex] + imgData.originalData[currIndex + 1] + imgData.originalData[currIndex + 2]) / 3;
-            BYTE grayLeft = (imgData.originalData[leftIndex] + imgData.originalData[leftIndex + 1] + imgData.originalData[leftIndex + 2]) / 3;
-            BYTE grayRight = (imgData.originalData[rightIndex] + imgData.originalData[rightIndex + 1] + imgData.originalData[rightIndex + 2]) / 3;
+    // The parameters may have been changed while the job ran
+    QueueRedetect(hwnd, image);
+    InvalidatePage(hwnd, image);
+}
 
-            if (abs(grayCurr - grayLeft) > threshold || abs(grayCurr - grayRight) > threshold) {
-                imgData.detectedColumns.push_back(x);  // Save detected column
-                break;
-            }
+// Drops the pages still waiting to load and stops the one loading now, which
+// goes once its thread lets go of it
+void CancelLoading(HWND hwnd)
+{
+    std::vector<void*> cancelled;
+    pageQueue.CancelAll(&cancelled);
+    for (size_t i = 0; i < cancelled.size(); ++i) {
+        // Pages waiting to be redetected keep the columns they have
+        PageJob* job = (PageJob*)cancelled[i];
+        if (job->redetect) {
+            job->image->job = NULL;
+            delete job;
         }
+        else images.Remove(job->image);
     }
 
-    SelectObject(hdcMem, hOldBitmap);
-    DeleteDC(hdcMem);
-    ReleaseDC(NULL, hdcScreen);
-    DeleteObject(hBitmap);
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (images[i].job != NULL) images[i].job->cancelled = 1;
+    }
+    InvalidateRect(hwnd, NULL, TRUE);
+}
 
-    // Add parameter adjustment controls
+// Detects the columns of every page again with the parameters now set.
+// Pages still being loaded or redetected take them up when they are done.
+void ApplyParams(HWND hwnd)
+{
+    for (size_t i = 0; i < images.size(); ++i) {
+        ImageData& image = images[i];
+
+        // A redetection that has not started yet starts over
+        PageJob* job = image.job;
+        if (job != NULL && job->redetect && pageQueue.Cancel(job->id)) {
+            image.job = NULL;
+            delete job;
+        }
+        if (image.job == NULL) QueueRedetect(hwnd, &image);
+    }
 
+    // Painting moves the pages on screen up the queue
+    InvalidateRect(hwnd, NULL, FALSE);
+}
 
-    // Store image data via copy constructor
-    images.push_back(imgData);
+// Shows the parameters window, making it the first time
+void ShowParamsWindow(HWND owner)
+{
+    if (hwndParams == NULL) {
+        hwndParams = CreateWindowEx(
+            WS_EX_TOOLWINDOW, PARAMS_CLASS_NAME, "Detection parameters",
+            WS_CAPTION | WS_SYSMENU,
+            CW_USEDEFAULT, CW_USEDEFAULT, 300, 160,
+            owner, NULL, GetModuleHandle(NULL), NULL
+        );
+        if (hwndParams == NULL) return;
+    }
+    ShowWindow(hwndParams, SW_SHOW);
 }
 
-HBITMAP BitsToThumbnailBitmap(HDC hdc, int sourceWidth, int sourceHeight, BYTE* bytes)
+// Shows the name and value of a slider's parameter above it
+void UpdateSliderLabel(const ParamSlider& slider)
 {
-        void* pBits;
-        HBITMAP hBitmap = CreateDIBSection(hdc, THUMBNAIL_BASE_SIZE, THUMBNAIL_BASE_SIZE, &pBits);
-        HBITMAP hOldBitmap = (HBITMAP)SelectObject(hdc, hBitmap);
-
-        // Copy image data to bits array, while scaling image data to THUMBNAIL_BASE_SIZE (for
-        // both width and height) from the original file size
-        for (int ty = 0; ty < THUMBNAIL_BASE_SIZE; ++ty) {      // Target y = ty
-            for (int tx = 0; tx < THUMBNAIL_BASE_SIZE; ++tx) {  // Target x = tx
-                // Source sx,sy = target thumbnail position tx,ty; scaled to source size
-                int sx = tx * sourceWidth / THUMBNAIL_BASE_SIZE;
-                int sy = ty * sourceHeight / THUMBNAIL_BASE_SIZE;
-                // Scaled destination index (tx,ty converted to linear index in array)
-                int sIndex = (sy * sourceWidth + sx) * 4;
-                int tIndex = (ty * THUMBNAIL_BASE_SIZE + tx) * 4;
-                ((BYTE*)pBits)[tIndex] = bytes[sIndex];
-                ((BYTE*)pBits)[tIndex + 1] = bytes[sIndex + 1];
-                ((BYTE*)pBits)[tIndex + 2] = bytes[sIndex + 2];
-                ((BYTE*)pBits)[tIndex + 3] = bytes[sIndex + 3];
+    char text[64];
+    sprintf(text, "%s: %d", slider.label, *slider.value);
+    SetWindowText(slider.hwndLabel, text);
+}
+
+// Window procedure of the parameters window. Every slider move redetects
+// the pages right away, which only redoes the stages the parameter goes
+// into.
+LRESULT CALLBACK ParamsWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CREATE:
+        for (int i = 0; i < PARAM_SLIDER_COUNT; ++i) {
+            ParamSlider& slider = paramSliders[i];
+            int top = 10 + i * 56;
+            slider.hwndLabel = CreateWindow("STATIC", "", WS_CHILD | WS_VISIBLE,
+                                            10, top, 270, 20, hwnd, NULL, NULL, NULL);
+            slider.hwndBar = CreateWindow("SCROLLBAR", NULL, WS_CHILD | WS_VISIBLE | SBS_HORZ,
+                                          10, top + 22, 270, 18, hwnd,
+                                          (HMENU)(UINT_PTR)(ID_PARAM_SLIDER + i), NULL, NULL);
+            SetScrollRange(slider.hwndBar, SB_CTL, slider.minimum, slider.maximum, FALSE);
+            SetScrollPos(slider.hwndBar, SB_CTL, *slider.value, TRUE);
+            UpdateSliderLabel(slider);
+        }
+        return 0;
+
+    case WM_HSCROLL:
+        {
+            int index = GetDlgCtrlID((HWND)lParam) - ID_PARAM_SLIDER;
+            if (index < 0 || index >= PARAM_SLIDER_COUNT) return 0;
+            ParamSlider& slider = paramSliders[index];
+
+            int value = *slider.value;
+            switch (LOWORD(wParam))
+            {
+            case SB_LEFT: value = slider.minimum; break;
+            case SB_RIGHT: value = slider.maximum; break;
+            case SB_LINELEFT: --value; break;
+            case SB_LINERIGHT: ++value; break;
+            case SB_PAGELEFT: value -= 10; break;
+            case SB_PAGERIGHT: value += 10; break;
+            case SB_THUMBTRACK:
+            case SB_THUMBPOSITION: value = HIWORD(wParam); break;
             }
+            value = max(slider.minimum, min(value, slider.maximum));
+            if (value == *slider.value) return 0;
+
+            *slider.value = value;
+            SetScrollPos(slider.hwndBar, SB_CTL, value, TRUE);
+            UpdateSliderLabel(slider);
+            ApplyParams(GetWindow(hwnd, GW_OWNER));
         }
+        return 0;
+
+    case WM_CLOSE:
+        // Only hidden, it is shown again as it was
+        ShowWindow(hwnd, SW_HIDE);
+        return 0;
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+// Repaints the cells of one page, or everything if it has not been laid
+// out yet
+void InvalidatePage(HWND hwnd, const ImageData* image)
+{
+    size_t page = 0;
+    while (page < images.size() && &images[page] != image) ++page;
+    if (page == images.size() || (page + 1) * 2 > layout.CellCount()) {
+        InvalidateRect(hwnd, NULL, FALSE);
+        return;
+    }
+
+    SCROLLINFO si;
+    si.cbSize = sizeof(SCROLLINFO);
+    si.fMask = SIF_POS;
+    GetScrollInfo(hwnd, SB_VERT, &si);
+    for (size_t cell = page * 2; cell < page * 2 + 2; ++cell) {
+        const LayoutRect& rect = layout.Cell(cell);
+        RECT area = { rect.left, rect.top - si.nPos, rect.right, rect.bottom - si.nPos };
+        InvalidateRect(hwnd, &area, FALSE);
+    }
+}
+
+// Makes the bitmap show the given level of a page's pyramid, where level 0
+// is the full resolution plane itself
+void SelectThumbnailLevel(HDC hdc, ThumbnailBitmap& bitmap, const ThumbnailPyramid& pyramid,
+                          const BYTE* plane, int level)
+{
+    if (bitmap.level == level) return;
+    bitmap.Release();
+
+    bitmap.width = pyramid.LevelWidth(level);
+    bitmap.height = pyramid.LevelHeight(level);
+    bitmap.hdcMem = CreateCompatibleDC(hdc);
 
-        return hBitmap;
+    void* pBits;
+    bitmap.hBitmap = CreateDIBSection(bitmap.hdcMem, bitmap.width, bitmap.height, &pBits);
+    SelectObject(bitmap.hdcMem, bitmap.hBitmap);
+    bitmap.level = level;
+
+    const BYTE* gray = level == 0 ? plane : pyramid.LevelData(level);
+    GrayToBgra(gray, (size_t)bitmap.width * bitmap.height, (BYTE*)pBits);
 }
 
-void RenderThumbnails(HWND hwnd, HDC hdc)
+void RenderThumbnails(HWND hwnd, HDC hdc, const RECT& dirty)
 {
     WindowState* win;
     win = (WindowState*)GetWindowLong(hwnd, GWL_USERDATA);
@@ -473,7 +847,14 @@ void RenderThumbnails(HWND hwnd, HDC hdc)
 
     GetClientRect(hwnd, &(win->clientRect));
 
-    if(!win->bInitialized) {
+    // The backbuffer is kept between paints and only remade when the window
+    // size changes
+    if(!win->bInitialized || win->backbufferWidth != win->clientRect.right ||
+       win->backbufferHeight != win->clientRect.bottom) {
+        if(win->bInitialized) {
+            DeleteDC(win->hdcBackbuffer);
+            DeleteObject(win->hBackbufferBitmap);
+        }
         win->hdcBackbuffer = CreateCompatibleDC(hdc);
         win->hBackbufferBitmap = CreateDIBSection(
             win->hdcBackbuffer,
@@ -482,11 +863,13 @@ void RenderThumbnails(HWND hwnd, HDC hdc)
             &win->pBackbufferBits
         );
         SelectObject(win->hdcBackbuffer, win->hBackbufferBitmap);
+        win->backbufferWidth = win->clientRect.right;
+        win->backbufferHeight = win->clientRect.bottom;
+        win->bInitialized = true;
     }
 
-    // Clear backbuffer
-    SelectObject(win->hdcBackbuffer, GetStockObject(WHITE_BRUSH));
-    Rectangle(win->hdcBackbuffer, -1, -1, win->clientRect.right+1, win->clientRect.bottom+1);
+    // Clear the part of the backbuffer being repainted
+    FillRect(win->hdcBackbuffer, &dirty, (HBRUSH)GetStockObject(WHITE_BRUSH));
 
 
     // Get scroll pos
@@ -495,175 +878,149 @@ void RenderThumbnails(HWND hwnd, HDC hdc)
     si.fMask = SIF_ALL;
     GetScrollInfo(hwnd, SB_VERT, &si);
 
-    int xPos = thumbnailSpacing;
-    int yPos = thumbnailSpacing - si.nPos;
+    // Original and processed thumbnail of every page, only placed anew when
+    // the zoom, the window width or the pages change
     int thumbnailSize = THUMBNAIL_BASE_SIZE * thumbnailScale;
+    layout.Update(images.size(), 2, thumbnailSize, thumbnailSpacing, win->clientRect.right);
 
-    for (size_t i = 0; i < images.size(); ++i)
-    {
-        ImageData& img = images[i];
-
-        // Create memory DC and bitmap sections for original and processed image data
-        if(img.hdcMemOriginal == NULL) img.hdcMemOriginal = CreateCompatibleDC(hdc);
-        if(img.hOriginalBitmap == NULL)
-            img.hOriginalBitmap = BitsToThumbnailBitmap(img.hdcMemOriginal, img.width, img.height, img.originalData);
-
-        if(img.hdcMemProcessed == NULL) img.hdcMemProcessed = CreateCompatibleDC(hdc);
-        if(img.hProcessedBitmap == NULL)
-            img.hProcessedBitmap = BitsToThumbnailBitmap(img.hdcMemProcessed, img.width, img.height, img.processedData);
+    // Only what lies in the repainted part of the window gets drawn
+    static std::vector<size_t> visible;
+    layout.VisibleCells(LayoutRect(dirty.left, dirty.top + si.nPos, dirty.right, dirty.bottom + si.nPos),
+                        visible);
+    ++paintStamp;
 
-        //===================================================================//
-        // Render original thumbnail
-        StretchBlt(
-            win->hdcBackbuffer,     // hdcDest
-            xPos,                   // xDest
-            yPos,                   // yDest
-            thumbnailSize,          // wDest
-            thumbnailSize,          // hDest
-            img.hdcMemOriginal,     // hdcSrc
-            0,                      // xSrc
-            0,                      // ySrc
-            THUMBNAIL_BASE_SIZE,    // wSrc
-            THUMBNAIL_BASE_SIZE,    // hSrc
-            SRCCOPY
-        );
-
-        /*
-        // Renders unscaled thumbnail?
-        BitBlt(
-            hdcBackbuffer,          // hdcDest
-            xPos,                   // xDest
-            yPos,                   // yDest
-            thumbnailSize,          // wDest
-            thumbnailSize,          // hDest
-            img.hdcMem,             // hdcSrc
-            0,0, SRCCOPY);
-        */
-
-        // FPO / debug cross line
-        HPEN hPen = CreatePen(PS_SOLID, 1, RGB(255, 0, 0));  // Red for original
-        HPEN hOldPen = (HPEN)SelectObject(win->hdcBackbuffer, hPen);
-        MoveToEx(win->hdcBackbuffer, xPos, yPos, NULL);
-        LineTo(win->hdcBackbuffer, xPos + thumbnailSize, yPos + thumbnailSize);
-        SelectObject(win->hdcBackbuffer, hOldPen);
-        DeleteObject(hPen);
+    HPEN hRedPen = CreatePen(PS_SOLID, 1, RGB(255, 0, 0));      // Original cross, column top-left corners
+    HPEN hGreenPen = CreatePen(PS_SOLID, 1, RGB(0, 255, 0));    // Processed cross
+    HPEN hBluePen = CreatePen(PS_SOLID, 1, RGB(0, 0, 255));     // Column diagonals
+    HPEN hPurplePen = CreatePen(PS_SOLID, 1, RGB(128, 0, 128)); // Column bottom-right corners
+    HPEN hOldPen = (HPEN)SelectObject(win->hdcBackbuffer, hRedPen);
 
+    for (size_t v = 0; v < visible.size(); ++v)
+    {
+        size_t cell = visible[v];
+        ImageData& img = images[cell / 2];
+        bool processed = cell % 2 == 1;
+        const LayoutRect& rect = layout.Cell(cell);
+        int xPos = rect.left;
+        int yPos = rect.top - si.nPos;
+
+        // Fit the page into its square cell without distorting it, and draw
+        // it from the pyramid level closest above that size
+        int longSide = max(max(img.width, img.height), 1);
+        int drawWidth = max(1, (int)((long long)thumbnailSize * img.width / longSide));
+        int drawHeight = max(1, (int)((long long)thumbnailSize * img.height / longSide));
+
+        // Being on screen moves a page up the queue
+        if (img.job != NULL) pageQueue.SetPriority(img.job->id, paintStamp);
+
+        if (img.job != NULL && !img.job->redetect) {
+            // Still loading, so just the page's outline with a bar of how
+            // far it has got
+            RECT page = { xPos, yPos, xPos + drawWidth, yPos + drawHeight };
+            FillRect(win->hdcBackbuffer, &page, (HBRUSH)GetStockObject(LTGRAY_BRUSH));
+            RECT bar = page;
+            bar.top = max(page.top, page.bottom - max(4, drawHeight / 20));
+            bar.right = page.left + (int)((long long)drawWidth * img.job->rowsDone / img.height);
+            FillRect(win->hdcBackbuffer, &bar, (HBRUSH)GetStockObject(GRAY_BRUSH));
+            continue;
+        }
 
-        // Position next thumbnail
-        MoveToEx(win->hdcBackbuffer, xPos, yPos, NULL);
+        int level = img.originalPyramid.PickLevel(drawWidth, drawHeight);
+        ThumbnailBitmap& thumbnail = processed ? img.processedThumbnail : img.originalThumbnail;
 
-        xPos += thumbnailSize + thumbnailSpacing;
-        if (xPos + thumbnailSize > win->clientRect.right) {
-            xPos = thumbnailSpacing;
-            yPos += (thumbnailSize + thumbnailSpacing);
+        // The smeared plane and its pyramid are rewritten while the page is
+        // smeared again, so until then its bitmap stays as it is
+        bool resmearing = img.job != NULL && (img.stages.Stale() & PAGE_STAGE_SMEAR);
+        if (!processed || !resmearing) {
+            SelectThumbnailLevel(hdc, thumbnail, processed ? img.processedPyramid : img.originalPyramid,
+                                 processed ? img.smearData.Data() : img.grayData.Data(), level);
         }
 
         //===================================================================//
-        // Render processed thumbnail
+        // Render original or processed thumbnail
         StretchBlt(
-            win->hdcBackbuffer,          // hdcDest
+            win->hdcBackbuffer,     // hdcDest
             xPos,                   // xDest
             yPos,                   // yDest
-            thumbnailSize,          // wDest
-            thumbnailSize,          // hDest
-            img.hdcMemProcessed,    // hdcSrc
+            drawWidth,              // wDest
+            drawHeight,             // hDest
+            thumbnail.hdcMem,       // hdcSrc
             0,                      // xSrc
             0,                      // ySrc
-            THUMBNAIL_BASE_SIZE,    // wSrc
-            THUMBNAIL_BASE_SIZE,    // hSrc
+            thumbnail.width,        // wSrc
+            thumbnail.height,       // hSrc
             SRCCOPY
         );
 
-
-        // FPO / debug cross line
-        hPen = CreatePen(PS_SOLID, 1, RGB(0, 255, 0));  // Green for processed
-        hOldPen = (HPEN)SelectObject(win->hdcBackbuffer, hPen);
+        // FPO / debug cross line, red for original and green for processed
+        SelectObject(win->hdcBackbuffer, processed ? hGreenPen : hRedPen);
         MoveToEx(win->hdcBackbuffer, xPos, yPos, NULL);
-        LineTo(win->hdcBackbuffer, xPos + thumbnailSize, yPos + thumbnailSize);
-        SelectObject(win->hdcBackbuffer, hOldPen);
-        DeleteObject(hPen);
+        LineTo(win->hdcBackbuffer, xPos + drawWidth, yPos + drawHeight);
 
+        if (!processed) continue;
 
         // Draw column frames
-        hPen = CreatePen(PS_SOLID, 1, RGB(0, 0, 255));              // Blue for column
-        HPEN hRedPen = CreatePen(PS_SOLID, 1, RGB(255, 0, 0));      // Red for top-left corner of column
-        HPEN hPurplePen = CreatePen(PS_SOLID, 1, RGB(128, 0, 128));   // Purple for bottom-right of column
+        for(size_t col = 0; col < img.columns.size(); ++col) {
+            const ColumnRect& column = img.columns[col];
 
-        hOldPen = (HPEN)SelectObject(win->hdcBackbuffer, hPen);
-
-        int xOrigin, yOrigin;
-        for(int col = 0; col < img.detectedColumns.size()-1; col += 2) {
+            // Column bounds scaled from the source image onto the thumbnail
+            int left = xPos + (int)((long long)column.x0 * drawWidth / img.width);
+            int right = xPos + (int)((long long)(column.x1 + 1) * drawWidth / img.width);
+            int top = yPos + (int)((long long)column.y0 * drawHeight / img.height);
+            int bottom = yPos + (int)((long long)(column.y1 + 1) * drawHeight / img.height);
 
             // ========== Draw PURPLE bottom-right corner lines ========== //
             SelectObject(win->hdcBackbuffer, hPurplePen);
 
-            // Origin for bottom-right corner, from column `col` to column `col+1`
-            xOrigin = xPos + img.detectedColumns[col] * thumbnailScale
-                           + img.detectedColumns[col+1] * thumbnailScale;
-            yOrigin = yPos + thumbnailSize;
-
             // Bottom line
-            MoveToEx(win->hdcBackbuffer, xOrigin, yOrigin, NULL);
-            LineTo(win->hdcBackbuffer, xOrigin - 10 * thumbnailScale, yOrigin);
+            MoveToEx(win->hdcBackbuffer, right, bottom, NULL);
+            LineTo(win->hdcBackbuffer, right - 10 * thumbnailScale, bottom);
 
             // Right line
-            MoveToEx(win->hdcBackbuffer, xOrigin, yOrigin, NULL);
-            LineTo(win->hdcBackbuffer, xOrigin, yOrigin - 10 * thumbnailScale);
-
-            // Origin for top-left corner -- shared between corner lines and diagonal cross line
-            xOrigin = xPos + img.detectedColumns[col] * thumbnailScale;
-            yOrigin = yPos;
-
+            MoveToEx(win->hdcBackbuffer, right, bottom, NULL);
+            LineTo(win->hdcBackbuffer, right, bottom - 10 * thumbnailScale);
 
             // ========== Draw RED top-left corner lines ========== //
             SelectObject(win->hdcBackbuffer, hRedPen);
 
             // Top line
-            MoveToEx(win->hdcBackbuffer,    xOrigin,                        yOrigin, NULL);
-            LineTo(win->hdcBackbuffer,      xOrigin + 10 * thumbnailScale,  yOrigin);
+            MoveToEx(win->hdcBackbuffer,    left,                           top, NULL);
+            LineTo(win->hdcBackbuffer,      left + 10 * thumbnailScale,     top);
 
             // Left line
-            MoveToEx(win->hdcBackbuffer,    xOrigin,                        yOrigin, NULL);
-            LineTo(win->hdcBackbuffer,      xOrigin,                        yOrigin + 10 * thumbnailScale);
+            MoveToEx(win->hdcBackbuffer,    left,                           top, NULL);
+            LineTo(win->hdcBackbuffer,      left,                           top + 10 * thumbnailScale);
 
             // ========== Draw BLUE diagonal line across column ========== //
-            SelectObject(win->hdcBackbuffer, hPen);
+            SelectObject(win->hdcBackbuffer, hBluePen);
 
-            MoveToEx(win->hdcBackbuffer,    xOrigin,                        yOrigin, NULL);
-            LineTo(win->hdcBackbuffer,      xOrigin + img.detectedColumns[col+1]
-                                                    * thumbnailScale,       yOrigin + thumbnailSize);
+            MoveToEx(win->hdcBackbuffer,    left,                           top, NULL);
+            LineTo(win->hdcBackbuffer,      right,                          bottom);
         }
-        SelectObject(win->hdcBackbuffer, hOldPen);
-        DeleteObject(hPen);
-
-
-
-        // Position next thumbnail
-        xPos += thumbnailSize + thumbnailSpacing;
-        if (xPos + thumbnailSize > win->clientRect.right) {
-            xPos = thumbnailSpacing;
-            yPos += (thumbnailSize + thumbnailSpacing);
-        }
-
     }
+    SelectObject(win->hdcBackbuffer, hOldPen);
+    DeleteObject(hRedPen);
+    DeleteObject(hGreenPen);
+    DeleteObject(hBluePen);
+    DeleteObject(hPurplePen);
 
-    // Render backbuffer to window
+    // Render the repainted part of the backbuffer to the window
     BitBlt(
         hdc,                        // hdcDest
-        0,                          // xDest
-        0,                          // yDest
-        win->clientRect.right,           // wDest
-        win->clientRect.bottom,          // hDest
-        win->hdcBackbuffer,              // hdcSrc
-        0,                          // xSrc
-        0,                          // ySrc
+        dirty.left,                 // xDest
+        dirty.top,                  // yDest
+        dirty.right - dirty.left,   // wDest
+        dirty.bottom - dirty.top,   // hDest
+        win->hdcBackbuffer,         // hdcSrc
+        dirty.left,                 // xSrc
+        dirty.top,                  // ySrc
         SRCCOPY
     );
 
     // Update scrollbar
     si.fMask = SIF_RANGE | SIF_PAGE;
     si.nMin = 0;
-    si.nMax = yPos + thumbnailSize * thumbnailScale;
+    si.nMax = layout.ContentHeight();
     si.nPage = win->clientRect.bottom;
     SetScrollInfo(hwnd, SB_VERT, &si, TRUE);
 
@@ -0,0 +1,66 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "bmp.h"
+#include "tiff.h"
+
+static std::string LowerExtension(const std::string& path)
+{
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) return "";
+
+    std::string ext = path.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); ++i) ext[i] = (char)tolower((unsigned char)ext[i]);
+    return ext;
+}
+
+// Both byte orders of the TIFF header
+static bool IsTiffFile(const char* filename)
+{
+    unsigned char magic[4];
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return false;
+    bool tiff = fread(magic, 1, 4, file) == 4 &&
+                (memcmp(magic, "II*\0", 4) == 0 || memcmp(magic, "MM\0*", 4) == 0);
+    fclose(file);
+    return tiff;
+}
+
+bool IsImageFileName(const std::string& path)
+{
+    std::string ext = LowerExtension(path);
+    return ext == "bmp" || ext == "tif" || ext == "tiff";
+}
+
+int CountImagePages(const char* filename)
+{
+    if (!IsTiffFile(filename)) return 1;
+
+    TiffReader reader;
+    if (!reader.Open(filename)) return 1;
+    return reader.PageCount();
+}
+
+RowSource* OpenImagePage(const char* filename, int page, std::string& error)
+{
+    if (IsTiffFile(filename)) {
+        TiffReader* reader = new TiffReader;
+        if (reader->Open(filename, page)) return reader;
+        error = reader->Error();
+        delete reader;
+        return NULL;
+    }
+
+    if (page != 0) {
+        error = "no such page";
+        return NULL;
+    }
+    BmpReader* reader = new BmpReader;
+    if (reader->Open(filename)) return reader;
+    error = reader->Error();
+    delete reader;
+    return NULL;
+}
@@ -0,0 +1,22 @@
+// Choosing a decoder for an image file. A file holds one or more pages,
+// each of which is opened as its own RowSource.
+#ifndef COLFIND_IMAGE_H
+#define COLFIND_IMAGE_H
+
+#include <string>
+
+#include "rowsource.h"
+
+// Returns true for file names the decoders know how to read
+bool IsImageFileName(const std::string& path);
+
+// Number of pages in an image file, at least 1. Files that cannot be read
+// count as one page, whose opening then reports the problem.
+int CountImagePages(const char* filename);
+
+// Opens one page of an image file, counting from 0, picking the decoder by
+// the file's contents rather than its name. On failure returns NULL and
+// describes why in error; otherwise the caller deletes the source.
+RowSource* OpenImagePage(const char* filename, int page, std::string& error);
+
+#endif
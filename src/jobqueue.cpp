@@ -0,0 +1,126 @@
+#include "jobqueue.h"
+
+JobQueue::JobQueue(int threadCount) :
+    nextId(1),
+    nextSequence(0),
+    quit(false)
+{
+    for (int i = 0; i < threadCount; ++i) {
+        Thread* thread = new Thread;
+        if (!thread->Start(WorkerMain, this)) {
+            // Keep whatever we managed to start
+            delete thread;
+            break;
+        }
+        threads.push_back(thread);
+    }
+}
+
+JobQueue::~JobQueue()
+{
+    {
+        ScopedLock lock(mutex);
+        pending.clear();
+        quit = true;
+    }
+    signal.Post((int)threads.size());
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->Join();
+        delete threads[i];
+    }
+}
+
+int JobQueue::Submit(JobProc proc, void* job, int priority)
+{
+    Entry entry;
+    entry.proc = proc;
+    entry.job = job;
+    entry.priority = priority;
+    {
+        ScopedLock lock(mutex);
+        entry.id = nextId++;
+        if (nextId <= 0) nextId = 1;
+        entry.sequence = nextSequence++;
+        if (!threads.empty()) pending.push_back(entry);
+    }
+
+    if (threads.empty()) proc(job);
+    else signal.Post();
+    return entry.id;
+}
+
+int JobQueue::Find(int id) const
+{
+    for (size_t i = 0; i < pending.size(); ++i) {
+        if (pending[i].id == id) return (int)i;
+    }
+    return -1;
+}
+
+bool JobQueue::SetPriority(int id, int priority)
+{
+    ScopedLock lock(mutex);
+    int index = Find(id);
+    if (index < 0) return false;
+    pending[index].priority = priority;
+    return true;
+}
+
+bool JobQueue::Cancel(int id)
+{
+    // The job's signal stays posted, a worker wakes up to an empty queue
+    // and goes back to waiting
+    ScopedLock lock(mutex);
+    int index = Find(id);
+    if (index < 0) return false;
+    pending.erase(pending.begin() + index);
+    return true;
+}
+
+void JobQueue::CancelAll(std::vector<void*>* cancelled)
+{
+    ScopedLock lock(mutex);
+    if (cancelled != NULL) {
+        for (size_t i = 0; i < pending.size(); ++i) cancelled->push_back(pending[i].job);
+    }
+    pending.clear();
+}
+
+int JobQueue::PendingCount()
+{
+    ScopedLock lock(mutex);
+    return (int)pending.size();
+}
+
+// Picks the job to run next. Runs on the workers, so it only ever shrinks
+// the queue and never allocates.
+bool JobQueue::TakeNext(Entry& entry)
+{
+    ScopedLock lock(mutex);
+    if (pending.empty()) return false;
+
+    size_t best = 0;
+    for (size_t i = 1; i < pending.size(); ++i) {
+        if (pending[i].priority > pending[best].priority ||
+            (pending[i].priority == pending[best].priority &&
+             pending[i].sequence < pending[best].sequence))
+            best = i;
+    }
+    entry = pending[best];
+    pending.erase(pending.begin() + best);
+    return true;
+}
+
+void JobQueue::WorkerMain(void* arg)
+{
+    JobQueue* queue = (JobQueue*)arg;
+    for (;;) {
+        queue->signal.Wait();
+        {
+            ScopedLock lock(queue->mutex);
+            if (queue->quit) return;
+        }
+        Entry entry;
+        if (queue->TakeNext(entry)) entry.proc(entry.job);
+    }
+}
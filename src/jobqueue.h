@@ -0,0 +1,69 @@
+// Queue of jobs run in the background by threads of its own, for work that
+// must not hold up the caller, like the viewer loading dropped pages. Jobs
+// run highest priority first, and in the order they were submitted among
+// equals. A job that has not started yet can be reprioritized or cancelled.
+#ifndef COLFIND_JOBQUEUE_H
+#define COLFIND_JOBQUEUE_H
+
+#include <vector>
+
+#include "platform.h"
+
+// Job body, called once on one of the queue's threads
+typedef void (*JobProc)(void* job);
+
+class JobQueue {
+public:
+    // Starts threadCount threads, or runs jobs inline in Submit() if none
+    // could be started
+    explicit JobQueue(int threadCount = 1);
+
+    // Drops the jobs that have not started and waits for the running ones
+    ~JobQueue();
+
+    // Queues proc(job) and returns an id for it, never 0
+    int Submit(JobProc proc, void* job, int priority = 0);
+
+    // Changes the priority of a job that has not started yet. Returns false
+    // if it has started or is unknown.
+    bool SetPriority(int id, int priority);
+
+    // Removes a job that has not started yet, so it never runs. Returns
+    // false if it has started or is unknown; it is then up to the job to
+    // notice it is no longer wanted.
+    bool Cancel(int id);
+
+    // Removes every job that has not started, handing back their job
+    // pointers so the caller can free them
+    void CancelAll(std::vector<void*>* cancelled = NULL);
+
+    int PendingCount();
+
+private:
+    JobQueue(const JobQueue&);
+    JobQueue& operator=(const JobQueue&);
+
+    struct Entry {
+        int id;
+        int priority;
+        unsigned sequence;      // Submission order, breaks priority ties
+        JobProc proc;
+        void* job;
+    };
+
+    static void WorkerMain(void* arg);
+    bool TakeNext(Entry& entry);
+    int Find(int id) const;
+
+    std::vector<Thread*> threads;
+    Mutex mutex;
+    Semaphore signal;           // Posted once per submitted job
+
+    // Guarded by mutex
+    std::vector<Entry> pending;
+    int nextId;
+    unsigned nextSequence;
+    bool quit;
+};
+
+#endif
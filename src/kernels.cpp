@@ -0,0 +1,245 @@
+#include "kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if defined(COLFIND_X86_KERNELS) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//===========================================================================//
+// Scalar references
+
+void BgrRowToGrayScalar(const unsigned char* src, int pixelSize, unsigned char* gray, int count)
+{
+    for (int x = 0; x < count; ++x, src += pixelSize)
+        gray[x] = (unsigned char)bgrToGrayscale(src[0], src[1], src[2]);
+}
+
+int RowMaxScalar(const unsigned char* row, int width)
+{
+    int brightest = 0;
+    for (int x = 0; x < width; ++x) {
+        if (row[x] > brightest) brightest = row[x];
+    }
+    return brightest;
+}
+
+void MarkInkScalar(const unsigned char* row, int width, int level, unsigned char* ink)
+{
+    for (int x = 0; x < width; ++x) ink[x] = row[x] < level;
+}
+
+void PackInkScalar(const unsigned char* row, int width, int level, uint64_t* words)
+{
+    for (int x0 = 0; x0 < width; x0 += 64) {
+        int count = width - x0 < 64 ? width - x0 : 64;
+        uint64_t word = 0;
+        for (int i = 0; i < count; ++i) word |= (uint64_t)(row[x0 + i] < level) << i;
+        words[x0 / 64] = word;
+    }
+}
+
+//===========================================================================//
+// Dispatch
+
+// Vectorized versions, built from kernels_sse2.cpp and kernels_avx2.cpp with
+// the matching compiler flags. MarkInk ones expect a level in [1, 255].
+#ifdef COLFIND_X86_KERNELS
+void BgrRowToGraySse2(const unsigned char* src, int pixelSize, unsigned char* gray, int count);
+int RowMaxSse2(const unsigned char* row, int width);
+void MarkInkSse2(const unsigned char* row, int width, int level, unsigned char* ink);
+void PackInkSse2(const unsigned char* row, int width, int level, uint64_t* words);
+void BgrRowToGrayAvx2(const unsigned char* src, int pixelSize, unsigned char* gray, int count);
+int RowMaxAvx2(const unsigned char* row, int width);
+void MarkInkAvx2(const unsigned char* row, int width, int level, unsigned char* ink);
+void PackInkAvx2(const unsigned char* row, int width, int level, uint64_t* words);
+#endif
+
+struct RowKernels {
+    void (*bgrRowToGray)(const unsigned char* src, int pixelSize, unsigned char* gray, int count);
+    int (*rowMax)(const unsigned char* row, int width);
+    void (*markInk)(const unsigned char* row, int width, int level, unsigned char* ink);
+    void (*packInk)(const unsigned char* row, int width, int level, uint64_t* words);
+};
+
+static const RowKernels scalarKernels = { BgrRowToGrayScalar, RowMaxScalar, MarkInkScalar,
+                                          PackInkScalar };
+#ifdef COLFIND_X86_KERNELS
+static const RowKernels sse2Kernels = { BgrRowToGraySse2, RowMaxSse2, MarkInkSse2, PackInkSse2 };
+static const RowKernels avx2Kernels = { BgrRowToGrayAvx2, RowMaxAvx2, MarkInkAvx2, PackInkAvx2 };
+#endif
+
+static const RowKernels* KernelsFor(KernelLevel level)
+{
+#ifdef COLFIND_X86_KERNELS
+    if (level == KERNELS_AVX2) return &avx2Kernels;
+    if (level == KERNELS_SSE2) return &sse2Kernels;
+#endif
+    (void)level;
+    return &scalarKernels;
+}
+
+#ifdef COLFIND_X86_KERNELS
+static bool CpuHasAvx2()
+{
+#if defined(__GNUC__)
+    // Also checks that the OS saves the YMM registers
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+#endif
+
+KernelLevel GetSupportedKernelLevel()
+{
+#ifdef COLFIND_X86_KERNELS
+    // SSE2 is part of every x86-64 CPU and the baseline for 32-bit builds
+    static const KernelLevel supported = CpuHasAvx2() ? KERNELS_AVX2 : KERNELS_SSE2;
+    return supported;
+#else
+    return KERNELS_SCALAR;
+#endif
+}
+
+static KernelLevel activeLevel = GetSupportedKernelLevel();
+static const RowKernels* activeKernels = KernelsFor(activeLevel);
+
+KernelLevel GetKernelLevel()
+{
+    return activeLevel;
+}
+
+void SetKernelLevel(KernelLevel level)
+{
+    if (level > GetSupportedKernelLevel()) level = GetSupportedKernelLevel();
+    activeLevel = level;
+    activeKernels = KernelsFor(level);
+}
+
+const char* KernelLevelName(KernelLevel level)
+{
+    switch (level) {
+    case KERNELS_SSE2: return "sse2";
+    case KERNELS_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+void BgrRowToGray(const unsigned char* src, int pixelSize, unsigned char* gray, int count)
+{
+    activeKernels->bgrRowToGray(src, pixelSize, gray, count);
+}
+
+int RowMax(const unsigned char* row, int width)
+{
+    return activeKernels->rowMax(row, width);
+}
+
+void MarkInk(const unsigned char* row, int width, int level, unsigned char* ink)
+{
+    // Levels outside [1, 255] mark everything or nothing
+    if (level <= 0 || level > 255) {
+        memset(ink, level > 255, width);
+        return;
+    }
+    activeKernels->markInk(row, width, level, ink);
+}
+
+void PackInk(const unsigned char* row, int width, int level, uint64_t* words)
+{
+    if (level <= 0 || level > 255) {
+        int words64 = (width + 63) / 64;
+        for (int i = 0; i < words64; ++i) words[i] = level > 255 ? ~0ULL : 0;
+        if (level > 255 && width % 64 != 0) words[width / 64] = ~0ULL >> (64 - width % 64);
+        return;
+    }
+    activeKernels->packInk(row, width, level, words);
+}
+
+//===========================================================================//
+// Self check
+
+bool VerifyKernels(std::string& report)
+{
+    // Small deterministic generator so failures can be reproduced
+    unsigned int seed = 12345;
+    char message[160];
+
+    for (int level = KERNELS_SSE2; level <= GetSupportedKernelLevel(); ++level) {
+        const RowKernels* kernels = KernelsFor((KernelLevel)level);
+
+        for (int count = 0; count <= 300; ++count) {
+            // Extra slack so kernels that read past the end would be caught
+            // by a memory checker rather than silently pass
+            std::vector<unsigned char> src(count * 4 + 1), expected(count + 1), actual(count + 1);
+            for (size_t i = 0; i < src.size(); ++i) {
+                seed = seed * 1103515245 + 12345;
+                src[i] = (unsigned char)(seed >> 16);
+            }
+
+            for (int pixelSize = 3; pixelSize <= 4; ++pixelSize) {
+                BgrRowToGrayScalar(&src[0], pixelSize, &expected[0], count);
+                kernels->bgrRowToGray(&src[0], pixelSize, &actual[0], count);
+                for (int x = 0; x < count; ++x) {
+                    if (expected[x] == actual[x]) continue;
+                    sprintf(message, "%s gray conversion differs at x=%d of %d (pixel size %d)",
+                            KernelLevelName((KernelLevel)level), x, count, pixelSize);
+                    report = message;
+                    return false;
+                }
+            }
+
+            // Mostly flat rows with a sparse mix of values, ending anywhere
+            std::vector<unsigned char> row(count + 1);
+            for (int x = 0; x < count; ++x) {
+                seed = seed * 1103515245 + 12345;
+                row[x] = (seed >> 16) % 16 == 0 ? (unsigned char)(seed >> 8) : 128;
+            }
+            if (kernels->rowMax(&row[0], count) != RowMaxScalar(&row[0], count)) {
+                sprintf(message, "%s row maximum differs for width %d",
+                        KernelLevelName((KernelLevel)level), count);
+                report = message;
+                return false;
+            }
+            std::vector<uint64_t> expectedWords(count / 64 + 1), actualWords(count / 64 + 1);
+            for (int inkLevel = 1; inkLevel <= 255; inkLevel += 17) {
+                PackInkScalar(&row[0], count, inkLevel, &expectedWords[0]);
+                kernels->packInk(&row[0], count, inkLevel, &actualWords[0]);
+                for (int i = 0; i < (count + 63) / 64; ++i) {
+                    if (expectedWords[i] == actualWords[i]) continue;
+                    sprintf(message, "%s ink packing differs in word %d of width %d (level %d)",
+                            KernelLevelName((KernelLevel)level), i, count, inkLevel);
+                    report = message;
+                    return false;
+                }
+
+                MarkInkScalar(&row[0], count, inkLevel, &expected[0]);
+                kernels->markInk(&row[0], count, inkLevel, &actual[0]);
+                for (int x = 0; x < count; ++x) {
+                    if (expected[x] == actual[x]) continue;
+                    sprintf(message, "%s ink marking differs at x=%d of %d (level %d)",
+                            KernelLevelName((KernelLevel)level), x, count, inkLevel);
+                    report = message;
+                    return false;
+                }
+            }
+        }
+    }
+
+    report = std::string("kernels match the scalar reference up to ") +
+             KernelLevelName(GetSupportedKernelLevel());
+    return true;
+}
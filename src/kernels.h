@@ -0,0 +1,66 @@
+// Per-row pixel kernels with runtime instruction set dispatch. Every kernel
+// has a portable scalar reference, and on x86 SSE2 and AVX2 versions that
+// produce exactly the same output; the fastest one the CPU supports is
+// picked at startup.
+#ifndef COLFIND_KERNELS_H
+#define COLFIND_KERNELS_H
+
+#include <stdint.h>
+#include <string>
+
+// Fixed-point luminance weights (0.114, 0.587, 0.299 scaled by 2^14). They
+// sum to 2^14 so white stays 255, and fit the signed 16-bit multipliers.
+#define GRAY_WEIGHT_BLUE 1868
+#define GRAY_WEIGHT_GREEN 9617
+#define GRAY_WEIGHT_RED 4899
+#define GRAY_SHIFT 14
+
+inline int bgrToGrayscale(int blue, int green, int red) {
+    // Convert to grayscale using luminosity method, rounded to nearest
+    return (blue * GRAY_WEIGHT_BLUE + green * GRAY_WEIGHT_GREEN + red * GRAY_WEIGHT_RED +
+            (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT;
+}
+
+enum KernelLevel {
+    KERNELS_SCALAR,
+    KERNELS_SSE2,
+    KERNELS_AVX2
+};
+
+// Best level this CPU (and build) supports
+KernelLevel GetSupportedKernelLevel();
+
+// Level currently in use
+KernelLevel GetKernelLevel();
+
+// Switches to another level, clamped to what is supported. Not thread safe,
+// meant for start-up options and testing.
+void SetKernelLevel(KernelLevel level);
+
+const char* KernelLevelName(KernelLevel level);
+
+// Converts count pixels of interleaved B, G, R (and optionally more)
+// channels, pixelSize bytes apart, into one gray byte each
+void BgrRowToGray(const unsigned char* src, int pixelSize, unsigned char* gray, int count);
+
+// Returns the brightest value in a row, 0 for an empty one
+int RowMax(const unsigned char* row, int width);
+
+// Sets ink[x] to 1 where the gray value is below level and to 0 elsewhere
+void MarkInk(const unsigned char* row, int width, int level, unsigned char* ink);
+
+// Packs the same marks as bits, bit x % 64 of words[x / 64] set where the
+// gray value is below level, leaving the bits past the width clear
+void PackInk(const unsigned char* row, int width, int level, uint64_t* words);
+
+// Scalar references the vectorized kernels are checked against
+void BgrRowToGrayScalar(const unsigned char* src, int pixelSize, unsigned char* gray, int count);
+int RowMaxScalar(const unsigned char* row, int width);
+void MarkInkScalar(const unsigned char* row, int width, int level, unsigned char* ink);
+void PackInkScalar(const unsigned char* row, int width, int level, uint64_t* words);
+
+// Runs every supported level against the scalar references on random rows of
+// many lengths. Returns false and describes the first mismatch in report.
+bool VerifyKernels(std::string& report);
+
+#endif
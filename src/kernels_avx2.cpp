@@ -0,0 +1,117 @@
+// AVX2 versions of the row kernels, 32 pixels per iteration. Built with
+// -mavx2 and only on x86; see kernels.cpp for dispatch.
+#include "kernels.h"
+
+#include <immintrin.h>
+
+// Gray values of eight pixels held as 32-bit B, G, R, x lanes
+static inline __m256i GrayOf8(__m256i pixels, __m256i weights, __m256i rounding)
+{
+    __m256i zero = _mm256_setzero_si256();
+
+    // Per pixel: B*wb + G*wg and R*wr + x*0, then the two halves added
+    // together, which leaves the pixels in order within each lane
+    __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), weights);
+    __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), weights);
+    __m256i sum = _mm256_hadd_epi32(lo, hi);
+
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, rounding), GRAY_SHIFT);
+}
+
+// Loads eight pixels as 32-bit lanes. Three-byte pixels are gathered as four
+// bytes each, picking up the next pixel's blue, which gets a zero weight.
+static inline __m256i Load8(const unsigned char* src, int pixelSize, __m256i offsets)
+{
+    if (pixelSize == 4) return _mm256_loadu_si256((const __m256i*)src);
+    return _mm256_i32gather_epi32((const int*)src, offsets, 1);
+}
+
+void BgrRowToGrayAvx2(const unsigned char* src, int pixelSize, unsigned char* gray, int count)
+{
+    if (pixelSize != 3 && pixelSize != 4) {
+        BgrRowToGrayScalar(src, pixelSize, gray, count);
+        return;
+    }
+
+    __m256i weights = _mm256_setr_epi16(
+        GRAY_WEIGHT_BLUE, GRAY_WEIGHT_GREEN, GRAY_WEIGHT_RED, 0,
+        GRAY_WEIGHT_BLUE, GRAY_WEIGHT_GREEN, GRAY_WEIGHT_RED, 0,
+        GRAY_WEIGHT_BLUE, GRAY_WEIGHT_GREEN, GRAY_WEIGHT_RED, 0,
+        GRAY_WEIGHT_BLUE, GRAY_WEIGHT_GREEN, GRAY_WEIGHT_RED, 0);
+    __m256i rounding = _mm256_set1_epi32(1 << (GRAY_SHIFT - 1));
+    __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+    // The packs below interleave 4-pixel groups across the two lanes
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    // Three-byte pixels read one byte past the block, so keep a pixel spare
+    int blockEnd = pixelSize == 4 ? count - 32 : count - 33;
+    int x = 0;
+    for (; x <= blockEnd; x += 32) {
+        const unsigned char* p = src + x * pixelSize;
+        __m256i a = GrayOf8(Load8(p, pixelSize, offsets), weights, rounding);
+        __m256i b = GrayOf8(Load8(p + 8 * pixelSize, pixelSize, offsets), weights, rounding);
+        __m256i c = GrayOf8(Load8(p + 16 * pixelSize, pixelSize, offsets), weights, rounding);
+        __m256i d = GrayOf8(Load8(p + 24 * pixelSize, pixelSize, offsets), weights, rounding);
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256((__m256i*)(gray + x), _mm256_permutevar8x32_epi32(packed, order));
+    }
+
+    BgrRowToGrayScalar(src + x * pixelSize, pixelSize, gray + x, count - x);
+}
+
+int RowMaxAvx2(const unsigned char* row, int width)
+{
+    __m256i best = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+        best = _mm256_max_epu8(best, _mm256_loadu_si256((const __m256i*)(row + x)));
+
+    // Fold the 32 lanes down to one
+    __m128i half = _mm_max_epu8(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    half = _mm_max_epu8(half, _mm_srli_si128(half, 8));
+    half = _mm_max_epu8(half, _mm_srli_si128(half, 4));
+    half = _mm_max_epu8(half, _mm_srli_si128(half, 2));
+    half = _mm_max_epu8(half, _mm_srli_si128(half, 1));
+    int brightest = _mm_cvtsi128_si32(half) & 0xff;
+    for (; x < width; ++x) {
+        if (row[x] > brightest) brightest = row[x];
+    }
+    return brightest;
+}
+
+void MarkInkAvx2(const unsigned char* row, int width, int level, unsigned char* ink)
+{
+    // row < level exactly where min(row, level - 1) == row
+    __m256i below = _mm256_set1_epi8((char)(level - 1));
+    __m256i one = _mm256_set1_epi8(1);
+
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(row + x));
+        __m256i marks = _mm256_cmpeq_epi8(_mm256_min_epu8(pixels, below), pixels);
+        _mm256_storeu_si256((__m256i*)(ink + x), _mm256_and_si256(marks, one));
+    }
+
+    for (; x < width; ++x) ink[x] = row[x] < level;
+}
+
+void PackInkAvx2(const unsigned char* row, int width, int level, uint64_t* words)
+{
+    // row < level exactly where min(row, level - 1) == row, and movemask
+    // packs the comparisons 32 at a time
+    __m256i below = _mm256_set1_epi8((char)(level - 1));
+
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(row + x));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(row + x + 32));
+        unsigned int loMarks = (unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(lo, below), lo));
+        unsigned int hiMarks = (unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(hi, below), hi));
+        words[x / 64] = (uint64_t)hiMarks << 32 | loMarks;
+    }
+
+    PackInkScalar(row + x, width - x, level, words + x / 64);
+}
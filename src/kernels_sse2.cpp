@@ -0,0 +1,120 @@
+// SSE2 versions of the row kernels, 16 pixels per iteration. Built with
+// -msse2 and only on x86; see kernels.cpp for dispatch.
+#include "kernels.h"
+
+#include <string.h>
+#include <emmintrin.h>
+
+static inline int Load32(const unsigned char* p)
+{
+    int value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// Gray values of four pixels held as 32-bit B, G, R, x lanes
+static inline __m128i GrayOf4(__m128i pixels, __m128i weights, __m128i rounding)
+{
+    __m128i zero = _mm_setzero_si128();
+
+    // Per pixel: B*wb + G*wg and R*wr + x*0
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+
+    // Add the two halves of each pixel
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i sum = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+
+    return _mm_srai_epi32(_mm_add_epi32(sum, rounding), GRAY_SHIFT);
+}
+
+// Loads four pixels as 32-bit lanes. Three-byte pixels are read as four
+// bytes each, picking up the next pixel's blue, which gets a zero weight.
+static inline __m128i Load4(const unsigned char* src, int pixelSize)
+{
+    if (pixelSize == 4) return _mm_loadu_si128((const __m128i*)src);
+    return _mm_set_epi32(Load32(src + 9), Load32(src + 6), Load32(src + 3), Load32(src));
+}
+
+void BgrRowToGraySse2(const unsigned char* src, int pixelSize, unsigned char* gray, int count)
+{
+    if (pixelSize != 3 && pixelSize != 4) {
+        BgrRowToGrayScalar(src, pixelSize, gray, count);
+        return;
+    }
+
+    __m128i weights = _mm_setr_epi16(GRAY_WEIGHT_BLUE, GRAY_WEIGHT_GREEN, GRAY_WEIGHT_RED, 0,
+                                     GRAY_WEIGHT_BLUE, GRAY_WEIGHT_GREEN, GRAY_WEIGHT_RED, 0);
+    __m128i rounding = _mm_set1_epi32(1 << (GRAY_SHIFT - 1));
+
+    // Three-byte pixels read one byte past the block, so keep a pixel spare
+    int blockEnd = pixelSize == 4 ? count - 16 : count - 17;
+    int x = 0;
+    for (; x <= blockEnd; x += 16) {
+        const unsigned char* p = src + x * pixelSize;
+        __m128i a = GrayOf4(Load4(p, pixelSize), weights, rounding);
+        __m128i b = GrayOf4(Load4(p + 4 * pixelSize, pixelSize), weights, rounding);
+        __m128i c = GrayOf4(Load4(p + 8 * pixelSize, pixelSize), weights, rounding);
+        __m128i d = GrayOf4(Load4(p + 12 * pixelSize, pixelSize), weights, rounding);
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i*)(gray + x), packed);
+    }
+
+    BgrRowToGrayScalar(src + x * pixelSize, pixelSize, gray + x, count - x);
+}
+
+int RowMaxSse2(const unsigned char* row, int width)
+{
+    __m128i best = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+        best = _mm_max_epu8(best, _mm_loadu_si128((const __m128i*)(row + x)));
+
+    // Fold the 16 lanes down to one
+    best = _mm_max_epu8(best, _mm_srli_si128(best, 8));
+    best = _mm_max_epu8(best, _mm_srli_si128(best, 4));
+    best = _mm_max_epu8(best, _mm_srli_si128(best, 2));
+    best = _mm_max_epu8(best, _mm_srli_si128(best, 1));
+    int brightest = _mm_cvtsi128_si32(best) & 0xff;
+    for (; x < width; ++x) {
+        if (row[x] > brightest) brightest = row[x];
+    }
+    return brightest;
+}
+
+void MarkInkSse2(const unsigned char* row, int width, int level, unsigned char* ink)
+{
+    // row < level exactly where min(row, level - 1) == row
+    __m128i below = _mm_set1_epi8((char)(level - 1));
+    __m128i one = _mm_set1_epi8(1);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i marks = _mm_cmpeq_epi8(_mm_min_epu8(pixels, below), pixels);
+        _mm_storeu_si128((__m128i*)(ink + x), _mm_and_si128(marks, one));
+    }
+
+    for (; x < width; ++x) ink[x] = row[x] < level;
+}
+
+void PackInkSse2(const unsigned char* row, int width, int level, uint64_t* words)
+{
+    // row < level exactly where min(row, level - 1) == row, and movemask
+    // packs the comparisons 16 at a time
+    __m128i below = _mm_set1_epi8((char)(level - 1));
+
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        uint64_t word = 0;
+        for (int i = 0; i < 4; ++i) {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x + 16 * i));
+            __m128i marks = _mm_cmpeq_epi8(_mm_min_epu8(pixels, below), pixels);
+            word |= (uint64_t)(unsigned int)_mm_movemask_epi8(marks) << (16 * i);
+        }
+        words[x / 64] = word;
+    }
+
+    PackInkScalar(row + x, width - x, level, words + x / 64);
+}
@@ -0,0 +1,70 @@
+#include "layout.h"
+
+#include <algorithm>
+
+ThumbnailLayout::ThumbnailLayout() :
+    pageCount(0),
+    cellsPerPage(0),
+    cellSize(0),
+    spacing(0),
+    viewWidth(0),
+    cellsPerRow(1)
+{
+}
+
+bool ThumbnailLayout::Update(size_t pageCount, int cellsPerPage, int cellSize, int spacing,
+                             int viewWidth)
+{
+    if (pageCount == this->pageCount && cellsPerPage == this->cellsPerPage &&
+        cellSize == this->cellSize && spacing == this->spacing && viewWidth == this->viewWidth)
+        return false;
+
+    this->pageCount = pageCount;
+    this->cellsPerPage = cellsPerPage;
+    this->cellSize = cellSize;
+    this->spacing = spacing;
+    this->viewWidth = viewWidth;
+
+    // A row holds as many cells as fit, but always at least one
+    int pitch = std::max(1, cellSize + spacing);
+    int room = viewWidth - spacing - cellSize;
+    cellsPerRow = room < 0 ? 1 : 1 + room / pitch;
+
+    cells.resize(pageCount * cellsPerPage);
+    for (size_t i = 0; i < cells.size(); ++i) {
+        int row = (int)(i / cellsPerRow);
+        int column = (int)(i % cellsPerRow);
+        int left = spacing + column * pitch;
+        int top = spacing + row * pitch;
+        cells[i] = LayoutRect(left, top, left + cellSize, top + cellSize);
+    }
+    return true;
+}
+
+int ThumbnailLayout::ContentHeight() const
+{
+    int rows = (int)((cells.size() + cellsPerRow - 1) / cellsPerRow);
+    return spacing + rows * (cellSize + spacing);
+}
+
+void ThumbnailLayout::VisibleCells(const LayoutRect& area, std::vector<size_t>& visible) const
+{
+    visible.clear();
+    if (cells.empty() || area.IsEmpty()) return;
+
+    // Rows are evenly spaced, so the ones that can touch the area follow
+    // from its top and bottom; this may take in one row too many at each
+    // end, which the intersection test below drops
+    int pitch = std::max(1, cellSize + spacing);
+    int rows = (int)((cells.size() + cellsPerRow - 1) / cellsPerRow);
+    int firstRow = std::max(0, (area.top - spacing) / pitch - 1);
+    int lastRow = std::min(rows - 1, (area.bottom - spacing) / pitch);
+
+    for (int row = firstRow; row <= lastRow; ++row) {
+        size_t begin = (size_t)row * cellsPerRow;
+        size_t end = std::min(cells.size(), begin + cellsPerRow);
+        for (size_t i = begin; i < end; ++i) {
+            if (cells[i].Intersects(area)) visible.push_back(i);
+        }
+    }
+}
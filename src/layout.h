@@ -0,0 +1,70 @@
+// Placement of the viewer's thumbnails, kept apart from the window code so it
+// needs no GDI. Every page shows as a few square cells (the original and the
+// processed thumbnail) that flow left to right and wrap at the width of the
+// view. The positions are cached and only recomputed when the number of
+// pages, the cell size, the spacing or the view width change, and painting
+// asks only for the cells inside the area being repainted.
+#ifndef COLFIND_LAYOUT_H
+#define COLFIND_LAYOUT_H
+
+#include <stddef.h>
+#include <vector>
+
+// Rectangle in content coordinates, right and bottom exclusive
+struct LayoutRect {
+    int left;
+    int top;
+    int right;
+    int bottom;
+
+    LayoutRect() :
+        left(0),
+        top(0),
+        right(0),
+        bottom(0) {}
+
+    LayoutRect(int left, int top, int right, int bottom) :
+        left(left),
+        top(top),
+        right(right),
+        bottom(bottom) {}
+
+    bool IsEmpty() const { return right <= left || bottom <= top; }
+
+    // Whether the rectangles share any pixel, which empty ones never do
+    bool Intersects(const LayoutRect& other) const {
+        return !IsEmpty() && !other.IsEmpty() && left < other.right && other.left < right &&
+               top < other.bottom && other.top < bottom;
+    }
+};
+
+class ThumbnailLayout {
+public:
+    ThumbnailLayout();
+
+    // Lays out cellsPerPage cells of cellSize pixels for every page, with
+    // spacing pixels around them. Returns whether anything moved.
+    bool Update(size_t pageCount, int cellsPerPage, int cellSize, int spacing, int viewWidth);
+
+    // Cells are numbered page by page, cell i belongs to page i / cellsPerPage
+    size_t CellCount() const { return cells.size(); }
+    const LayoutRect& Cell(size_t index) const { return cells[index]; }
+
+    // Height of everything laid out, spacing included
+    int ContentHeight() const;
+
+    // Collects the cells that intersect area, in order. Only the rows of
+    // cells that can reach the area are looked at.
+    void VisibleCells(const LayoutRect& area, std::vector<size_t>& visible) const;
+
+private:
+    size_t pageCount;
+    int cellsPerPage;
+    int cellSize;
+    int spacing;
+    int viewWidth;
+    int cellsPerRow;
+    std::vector<LayoutRect> cells;
+};
+
+#endif
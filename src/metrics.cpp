@@ -0,0 +1,248 @@
+#include "metrics.h"
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "bufferpool.h"
+
+// Time histograms have this many buckets per doubling, starting at
+// METRIC_MIN_SECONDS; the last bucket also takes anything slower
+#define METRIC_BUCKETS_PER_OCTAVE 4
+#define METRIC_BUCKETS 120
+#define METRIC_MIN_SECONDS 1e-6
+
+// Aggregate of one stage over all recorded pages
+struct StageHistogram {
+    uint64_t pages;         // Pages the stage ran for
+    uint64_t calls;
+    double seconds;
+    double maxSeconds;
+    uint64_t pixels;
+    uint64_t bytes;
+    uint64_t maxBytes;      // Most working memory allocated for one page
+    uint64_t buckets[METRIC_BUCKETS];
+};
+
+static const char* const stageNames[STAGE_COUNT] = {
+    "decode", "binarize", "smear", "profile", "segment", "thumbnail", "skew", "page"
+};
+
+static bool enabled = false;
+static volatile sig_atomic_t dumpRequested = 0;
+static Mutex histogramMutex;
+static StageHistogram histograms[STAGE_COUNT];
+
+void EnableMetrics(bool enable)
+{
+    enabled = enable;
+}
+
+bool MetricsEnabled()
+{
+    return enabled;
+}
+
+const char* MetricStageName(MetricStage stage)
+{
+    return stageNames[stage];
+}
+
+// Bucket i holds times in (min * 2^((i-1)/n), min * 2^(i/n)]
+static int BucketIndex(double seconds)
+{
+    if (seconds <= METRIC_MIN_SECONDS) return 0;
+    double index = ceil(log(seconds / METRIC_MIN_SECONDS) / log(2.0) * METRIC_BUCKETS_PER_OCTAVE);
+    return (int)std::min(index, (double)(METRIC_BUCKETS - 1));
+}
+
+static double BucketLimit(int index)
+{
+    return METRIC_MIN_SECONDS * pow(2.0, (double)index / METRIC_BUCKETS_PER_OCTAVE);
+}
+
+void RecordPageMetrics(const PageMetrics& page)
+{
+    ScopedLock lock(histogramMutex);
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        const StageMetrics& s = page.stages[stage];
+        if (s.calls == 0) continue;
+
+        StageHistogram& h = histograms[stage];
+        ++h.pages;
+        h.calls += s.calls;
+        h.seconds += s.seconds;
+        h.maxSeconds = std::max(h.maxSeconds, s.seconds);
+        h.pixels += s.pixels;
+        h.bytes += s.bytes;
+        h.maxBytes = std::max(h.maxBytes, s.bytes);
+        ++h.buckets[BucketIndex(s.seconds)];
+    }
+}
+
+void ResetMetrics()
+{
+    ScopedLock lock(histogramMutex);
+    memset(histograms, 0, sizeof(histograms));
+}
+
+// Upper limit of the bucket holding the given fraction of pages, capped at
+// the slowest page actually seen
+static double Percentile(const StageHistogram& h, double fraction)
+{
+    if (h.pages == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(h.pages * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRIC_BUCKETS; ++i) {
+        seen += h.buckets[i];
+        if (seen >= rank) return std::min(BucketLimit(i), h.maxSeconds);
+    }
+    return h.maxSeconds;
+}
+
+void FormatMetrics(MetricsFormat format, std::string& text)
+{
+    StageHistogram copy[STAGE_COUNT];
+    {
+        ScopedLock lock(histogramMutex);
+        memcpy(copy, histograms, sizeof(copy));
+    }
+
+    BufferPoolStats pool = SharedBufferPool().Stats();
+
+    text.clear();
+    char line[512];
+
+    if (format == METRICS_JSON) {
+        text += "{\n  \"stages\": [\n";
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            const StageHistogram& h = copy[stage];
+            sprintf(line,
+                "    {\"name\": \"%s\", \"pages\": %lu, \"calls\": %lu, \"seconds_total\": %.6f, "
+                "\"seconds_max\": %.6f, \"seconds_p50\": %.6f, \"seconds_p95\": %.6f, "
+                "\"seconds_p99\": %.6f, \"pixels_total\": %.0f, \"allocated_bytes_total\": %.0f, "
+                "\"allocated_bytes_max\": %.0f}%s\n",
+                stageNames[stage], (unsigned long)h.pages, (unsigned long)h.calls,
+                h.seconds, h.maxSeconds, Percentile(h, 0.50), Percentile(h, 0.95),
+                Percentile(h, 0.99), (double)h.pixels, (double)h.bytes, (double)h.maxBytes,
+                stage + 1 < STAGE_COUNT ? "," : "");
+            text += line;
+        }
+        sprintf(line,
+            "  ],\n  \"buffer_pool\": {\"in_use_bytes\": %.0f, \"idle_bytes\": %.0f, "
+            "\"high_water_bytes\": %.0f, \"borrows\": %.0f, \"allocations\": %.0f, "
+            "\"allocated_bytes\": %.0f}\n}\n",
+            (double)pool.inUseBytes, (double)pool.idleBytes, (double)pool.highWaterBytes,
+            (double)pool.borrows, (double)pool.allocations, (double)pool.allocatedBytes);
+        text += line;
+        return;
+    }
+
+    // Prometheus text exposition format: the times as a summary, the rest
+    // as counters and a gauge
+    text += "# HELP colfind_stage_seconds Wall time each pipeline stage took per page.\n";
+    text += "# TYPE colfind_stage_seconds summary\n";
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        const StageHistogram& h = copy[stage];
+        const char* name = stageNames[stage];
+        sprintf(line,
+            "colfind_stage_seconds{stage=\"%s\",quantile=\"0.5\"} %.6f\n"
+            "colfind_stage_seconds{stage=\"%s\",quantile=\"0.95\"} %.6f\n"
+            "colfind_stage_seconds{stage=\"%s\",quantile=\"0.99\"} %.6f\n"
+            "colfind_stage_seconds_sum{stage=\"%s\"} %.6f\n"
+            "colfind_stage_seconds_count{stage=\"%s\"} %lu\n",
+            name, Percentile(h, 0.50), name, Percentile(h, 0.95), name, Percentile(h, 0.99),
+            name, h.seconds, name, (unsigned long)h.pages);
+        text += line;
+    }
+
+    struct Counter {
+        const char* name;
+        const char* type;
+        const char* help;
+    };
+    static const Counter counters[] = {
+        { "colfind_stage_calls_total", "counter", "Times each pipeline stage ran." },
+        { "colfind_stage_pixels_total", "counter", "Pixels each pipeline stage went through." },
+        { "colfind_stage_allocated_bytes_total", "counter", "Working memory each pipeline stage allocated." },
+        { "colfind_stage_allocated_bytes_max", "gauge", "Most working memory a pipeline stage allocated for one page." }
+    };
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c) {
+        sprintf(line, "# HELP %s %s\n# TYPE %s %s\n",
+                counters[c].name, counters[c].help, counters[c].name, counters[c].type);
+        text += line;
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            const StageHistogram& h = copy[stage];
+            uint64_t values[] = { h.calls, h.pixels, h.bytes, h.maxBytes };
+            sprintf(line, "%s{stage=\"%s\"} %.0f\n", counters[c].name, stageNames[stage],
+                    (double)values[c]);
+            text += line;
+        }
+    }
+
+    // The shared buffer pool, whose allocations stop growing once every
+    // worker has seen a page of each size
+    static const Counter poolCounters[] = {
+        { "colfind_buffer_pool_in_use_bytes", "gauge", "Working memory lent out by the buffer pool." },
+        { "colfind_buffer_pool_idle_bytes", "gauge", "Working memory the buffer pool keeps for reuse." },
+        { "colfind_buffer_pool_high_water_bytes", "gauge", "Most working memory the buffer pool lent out at once." },
+        { "colfind_buffer_pool_borrows_total", "counter", "Buffers borrowed from the buffer pool." },
+        { "colfind_buffer_pool_allocations_total", "counter", "Buffers the buffer pool had to allocate." },
+        { "colfind_buffer_pool_allocated_bytes_total", "counter", "Bytes the buffer pool had to allocate." }
+    };
+    uint64_t poolValues[] = { pool.inUseBytes, pool.idleBytes, pool.highWaterBytes, pool.borrows,
+                              pool.allocations, pool.allocatedBytes };
+    for (size_t c = 0; c < sizeof(poolCounters) / sizeof(poolCounters[0]); ++c) {
+        sprintf(line, "# HELP %s %s\n# TYPE %s %s\n%s %.0f\n",
+                poolCounters[c].name, poolCounters[c].help, poolCounters[c].name,
+                poolCounters[c].type, poolCounters[c].name, (double)poolValues[c]);
+        text += line;
+    }
+}
+
+bool SaveMetrics(const char* filename, std::string& error)
+{
+    size_t length = strlen(filename);
+    bool json = length >= 5 && strcmp(filename + length - 5, ".json") == 0;
+    std::string text;
+    FormatMetrics(json ? METRICS_JSON : METRICS_PROMETHEUS, text);
+
+    std::string temporary = std::string(filename) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == NULL) {
+        error = "cannot create " + temporary;
+        return false;
+    }
+    bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+    if (fclose(file) != 0) written = false;
+    if (!written) {
+        remove(temporary.c_str());
+        error = "cannot write " + temporary;
+        return false;
+    }
+
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows
+    remove(filename);
+#endif
+    if (rename(temporary.c_str(), filename) != 0) {
+        remove(temporary.c_str());
+        error = std::string("cannot replace ") + filename;
+        return false;
+    }
+    return true;
+}
+
+void RequestMetricsDump()
+{
+    dumpRequested = 1;
+}
+
+bool TakeMetricsDumpRequest()
+{
+    if (!dumpRequested) return false;
+    dumpRequested = 0;
+    return true;
+}
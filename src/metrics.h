@@ -0,0 +1,115 @@
+// Optional per-stage instrumentation of the pipeline. While a page is
+// processed, every stage adds its wall time, the pixels it went through and
+// the working memory it allocated to a PageMetrics of that page; finished
+// pages are folded into process-wide histograms, which can be saved as JSON
+// or in the Prometheus text format at any time.
+//
+// Metrics are off by default. The pipeline then gets a NULL PageMetrics and
+// does nothing but test that pointer once per strip.
+#ifndef COLFIND_METRICS_H
+#define COLFIND_METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+#include "platform.h"
+
+enum MetricStage {
+    STAGE_DECODE,       // Reading rows and converting them to luminance
+    STAGE_BINARIZE,     // Thresholding luminance into ink bits, binarized pipeline only
+    STAGE_SMEAR,
+    STAGE_PROFILE,      // Ink projection of the smeared rows
+    STAGE_SEGMENT,      // Splitting the profile into columns
+    STAGE_THUMBNAIL,
+    STAGE_SKEW,         // Estimating a page's skew and shearing its rows along it
+    STAGE_PAGE,         // A whole page, end to end
+    STAGE_COUNT
+};
+
+enum MetricsFormat {
+    METRICS_JSON,
+    METRICS_PROMETHEUS
+};
+
+// Totals of one stage for one page
+struct StageMetrics {
+    int calls;              // 0 if the stage did not run for the page
+    double seconds;
+    uint64_t pixels;
+    uint64_t bytes;         // Working memory allocated
+
+    StageMetrics() :
+        calls(0),
+        seconds(0),
+        pixels(0),
+        bytes(0) {}
+};
+
+// Everything measured for one page
+struct PageMetrics {
+    StageMetrics stages[STAGE_COUNT];
+
+    void Add(MetricStage stage, double seconds, uint64_t pixels) {
+        StageMetrics& s = stages[stage];
+        ++s.calls;
+        s.seconds += seconds;
+        s.pixels += pixels;
+    }
+
+    void Allocated(MetricStage stage, uint64_t bytes) { stages[stage].bytes += bytes; }
+};
+
+// Times a scope into a stage of a page, or does nothing for a NULL page
+class StageTimer {
+public:
+    StageTimer(PageMetrics* metrics, MetricStage stage, uint64_t pixels) :
+        metrics(metrics),
+        stage(stage),
+        pixels(pixels),
+        start(metrics != NULL ? GetTimeSeconds() : 0) {}
+
+    ~StageTimer() {
+        if (metrics != NULL) metrics->Add(stage, GetTimeSeconds() - start, pixels);
+    }
+
+private:
+    StageTimer(const StageTimer&);
+    StageTimer& operator=(const StageTimer&);
+
+    PageMetrics* metrics;
+    MetricStage stage;
+    uint64_t pixels;
+    double start;
+};
+
+void EnableMetrics(bool enable);
+bool MetricsEnabled();
+
+const char* MetricStageName(MetricStage stage);
+
+// Folds a finished page into the histograms, from any thread. Stages that
+// did not run for the page are left out.
+void RecordPageMetrics(const PageMetrics& page);
+
+// Forgets every page recorded so far
+void ResetMetrics();
+
+// Writes the histograms of every stage: calls, time (total, maximum and
+// p50/p95/p99), pixels and allocated bytes. Percentiles come from buckets a
+// quarter octave wide, so they can be up to 19% high.
+void FormatMetrics(MetricsFormat format, std::string& text);
+
+// Saves FormatMetrics() output by writing a temporary file next to filename
+// and renaming it over, so readers never see a partial file. The format is
+// JSON for names ending in .json and Prometheus text otherwise. On failure
+// returns false and describes why in error.
+bool SaveMetrics(const char* filename, std::string& error);
+
+// Asks for the metrics to be saved at the next convenient point. Safe to
+// call from a signal handler.
+void RequestMetricsDump();
+
+// Returns whether a dump was requested since the last call
+bool TakeMetricsDumpRequest();
+
+#endif
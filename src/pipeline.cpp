@@ -0,0 +1,472 @@
+#include "pipeline.h"
+
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+
+#include "coarse.h"
+#include "image.h"
+#include "kernels.h"
+#include "skew.h"
+#include "thumbnail.h"
+
+StripProcessor::StripProcessor() :
+    width(0),
+    rows(0),
+    pool(NULL),
+    metrics(NULL),
+    rowCapacity(0),
+    paperSum(0),
+    binarize(BINARIZE_NONE),
+    threshold(0),
+    adaptiveRadius(0),
+    words(0),
+    inkCapacity(0),
+    gray(NULL),
+    smear(NULL),
+    ink(NULL),
+    count(0),
+    parts(1)
+{
+}
+
+void StripProcessor::Begin(int width, const PipelineParams& params, ThreadPool* pool,
+                           PageMetrics* metrics)
+{
+    this->width = width;
+    this->pool = pool;
+    this->metrics = metrics;
+    rows = 0;
+    binarize = params.binarize;
+    threshold = params.threshold;
+
+    int threads = pool != NULL ? pool->ThreadCount() : 1;
+    if (Binarizing()) {
+        // Bands of whole words, each smearing and profiling its columns of a
+        // strip, one profile written by all of them
+        words = WordsForWidth(width);
+        int bands = std::max(1, std::min(threads, width / MIN_BAND_WIDTH));
+        bandWord.resize(bands + 1);
+        bitSmears.resize(bands);
+        for (int band = 0; band <= bands; ++band)
+            bandWord[band] = (int)((long long)words * band / bands);
+        for (int band = 0; band < bands; ++band)
+            bitSmears[band].Reset(bandWord[band + 1] - bandWord[band], params.maxVert);
+        profiles.resize(1);
+        profiles[0].Reset(width, params.threshold);
+
+        adaptiveRadius = std::max(1, width / ADAPTIVE_RADIUS_DIVISOR);
+        inkCapacity = STRIP_ROWS * threads;
+        inkRows.Assign((size_t)words * inkCapacity, 0);
+        smearRows.Assign(inkRows.Size(), 0);
+        histograms.assign(256 * threads, 0);
+        pageHistogram.assign(256, 0);
+        inkLevels.assign(threads, 0);
+
+        if (metrics != NULL) {
+            metrics->Allocated(STAGE_BINARIZE, inkRows.Size() * sizeof(uint64_t) +
+                                               (histograms.size() + 256) * sizeof(uint32_t));
+            metrics->Allocated(STAGE_SMEAR, smearRows.Size() * sizeof(uint64_t));
+            for (int band = 0; band < bands; ++band)
+                metrics->Allocated(STAGE_SMEAR, bitSmears[band].MemoryBytes());
+            metrics->Allocated(STAGE_PROFILE, profiles[0].MemoryBytes());
+        }
+        return;
+    }
+
+    int bands = std::max(1, std::min(threads, width / MIN_BAND_WIDTH));
+    bandStart.resize(bands + 1);
+    smears.resize(bands);
+    for (int band = 0; band <= bands; ++band)
+        bandStart[band] = (int)((long long)width * band / bands);
+    for (int band = 0; band < bands; ++band)
+        smears[band].Reset(bandStart[band + 1] - bandStart[band], params.maxVert);
+
+    profiles.resize(threads);
+    for (int part = 0; part < threads; ++part)
+        profiles[part].Reset(width, params.threshold);
+
+    rowCapacity = STRIP_ROWS * threads;
+    columnSums.Assign(width, 0);
+    rowBrightest.Resize((size_t)bands * rowCapacity);
+    paperSum = 0;
+
+    if (metrics != NULL) {
+        metrics->Allocated(STAGE_SMEAR, columnSums.Size() * sizeof(uint32_t) + rowBrightest.Size());
+        for (int band = 0; band < bands; ++band)
+            metrics->Allocated(STAGE_SMEAR, smears[band].MemoryBytes());
+        for (int part = 0; part < threads; ++part)
+            metrics->Allocated(STAGE_PROFILE, profiles[part].MemoryBytes());
+    }
+}
+
+void StripProcessor::SmearTask(void* context, int band)
+{
+    StripProcessor* processor = (StripProcessor*)context;
+    int x0 = processor->bandStart[band];
+    VerticalSmear& bandSmear = processor->smears[band];
+    uint32_t* sums = &processor->columnSums[x0];
+    unsigned char* brightest = &processor->rowBrightest[(size_t)band * processor->rowCapacity];
+
+    for (int y = 0; y < processor->count; ++y) {
+        size_t offset = (size_t)y * processor->width + x0;
+        unsigned char* smear = processor->smear != NULL ? processor->smear + offset : NULL;
+        brightest[y] = (unsigned char)bandSmear.SmearRowSums(processor->gray + offset, smear, sums);
+    }
+}
+
+void StripProcessor::ProfileTask(void* context, int part)
+{
+    StripProcessor* processor = (StripProcessor*)context;
+    int parts = processor->parts;
+    int begin = (int)((long long)processor->count * part / parts);
+    int end = (int)((long long)processor->count * (part + 1) / parts);
+
+    for (int y = begin; y < end; ++y) {
+        processor->profiles[part].AddInkRow(processor->gray + (size_t)y * processor->width,
+                                            processor->rows + y);
+    }
+}
+
+void StripProcessor::HistogramTask(void* context, int part)
+{
+    StripProcessor* processor = (StripProcessor*)context;
+    int begin = part * STRIP_ROWS;
+    int end = std::min(processor->count, begin + STRIP_ROWS);
+
+    uint32_t* histogram = &processor->histograms[256 * part];
+    memset(histogram, 0, 256 * sizeof(uint32_t));
+    for (int y = begin; y < end; ++y)
+        AddToHistogram(processor->gray + (size_t)y * processor->width, processor->width, histogram);
+}
+
+void StripProcessor::BinarizeTask(void* context, int part)
+{
+    StripProcessor* processor = (StripProcessor*)context;
+    int parts = processor->parts;
+    int begin = (int)((long long)processor->count * part / parts);
+    int end = (int)((long long)processor->count * (part + 1) / parts);
+    int width = processor->width;
+
+    for (int y = begin; y < end; ++y) {
+        const unsigned char* row = processor->gray + (size_t)y * width;
+        uint64_t* words = &processor->inkRows[(size_t)y * processor->words];
+        if (processor->binarize == BINARIZE_ADAPTIVE) {
+            AdaptiveInkRow(row, width, processor->adaptiveRadius, processor->threshold, words);
+        }
+        else {
+            int paperLevel = RowMax(row, width) - processor->threshold;
+            PackInk(row, width, std::min(processor->inkLevels[y / STRIP_ROWS], paperLevel), words);
+        }
+    }
+}
+
+void StripProcessor::InkSmearTask(void* context, int band)
+{
+    StripProcessor* processor = (StripProcessor*)context;
+    int firstWord = processor->bandWord[band];
+    int endWord = processor->bandWord[band + 1];
+    int words = processor->words;
+    BitSmear& bandSmear = processor->bitSmears[band];
+
+    for (int y = 0; y < processor->count; ++y) {
+        size_t offset = (size_t)y * words + firstWord;
+        memcpy(&processor->smearRows[offset], processor->ink + offset,
+               (endWord - firstWord) * sizeof(uint64_t));
+        bandSmear.SmearRow(&processor->smearRows[offset]);
+    }
+
+    if (processor->smear == NULL) return;
+    int width = processor->width;
+    int x0 = firstWord * BITS_PER_WORD;
+    int bandWidth = std::min(endWord * BITS_PER_WORD, width) - x0;
+    for (int y = 0; y < processor->count; ++y) {
+        UnpackInkRow(&processor->smearRows[(size_t)y * words + firstWord], bandWidth,
+                     processor->smear + (size_t)y * width + x0);
+    }
+}
+
+void StripProcessor::InkProfileTask(void* context, int band)
+{
+    StripProcessor* processor = (StripProcessor*)context;
+    int words = processor->words;
+
+    // 64 rows at a time, as the profile turns them on their side
+    for (int y = 0; y < processor->count; y += BITS_PER_WORD) {
+        int blockRows = std::min(BITS_PER_WORD, processor->count - y);
+        processor->profiles[0].AddInkRows(processor->ink + (size_t)y * words,
+                                          &processor->smearRows[(size_t)y * words], words,
+                                          processor->bandWord[band], processor->bandWord[band + 1],
+                                          processor->rows + y, blockRows);
+    }
+}
+
+void StripProcessor::ProcessInkChunk(const uint64_t* ink, unsigned char* smear, int count)
+{
+    this->ink = ink;
+    this->smear = smear;
+    this->count = count;
+
+    // Both by bands of words, the profile taking its columns of every row
+    uint64_t pixels = (uint64_t)width * count;
+    {
+        StageTimer timer(metrics, STAGE_SMEAR, pixels);
+        if (pool != NULL) pool->Run(InkSmearTask, this, (int)bitSmears.size());
+        else InkSmearTask(this, 0);
+    }
+    {
+        StageTimer timer(metrics, STAGE_PROFILE, pixels);
+        if (pool != NULL) pool->Run(InkProfileTask, this, (int)bitSmears.size());
+        else InkProfileTask(this, 0);
+    }
+    rows += count;
+}
+
+void StripProcessor::ProcessInkRows(const uint64_t* ink, unsigned char* smear, int count)
+{
+    for (int y = 0; y < count; y += inkCapacity) {
+        int chunk = std::min(inkCapacity, count - y);
+        ProcessInkChunk(ink + (size_t)y * words, smear != NULL ? smear + (size_t)y * width : NULL,
+                        chunk);
+    }
+}
+
+void StripProcessor::ProcessRows(const unsigned char* gray, unsigned char* smear, int count)
+{
+    if (Binarizing()) {
+        for (int y = 0; y < count; y += inkCapacity) {
+            this->gray = gray + (size_t)y * width;
+            this->count = std::min(inkCapacity, count - y);
+            parts = std::min(this->count, (int)histograms.size() / 256);
+
+            {
+                // The Otsu threshold of every STRIP_ROWS rows needs their
+                // histogram first, and those of all rows above. It moves on
+                // by the same steps whatever the thread count.
+                StageTimer timer(metrics, STAGE_BINARIZE, (uint64_t)width * this->count);
+                if (binarize == BINARIZE_OTSU) {
+                    int strips = (this->count + STRIP_ROWS - 1) / STRIP_ROWS;
+                    if (pool != NULL) pool->Run(HistogramTask, this, strips);
+                    else {
+                        for (int strip = 0; strip < strips; ++strip) HistogramTask(this, strip);
+                    }
+                    for (int strip = 0; strip < strips; ++strip) {
+                        for (int v = 0; v < 256; ++v) pageHistogram[v] += histograms[256 * strip + v];
+                        inkLevels[strip] = OtsuThreshold(&pageHistogram[0]) + 1;
+                    }
+                }
+                if (pool != NULL) pool->Run(BinarizeTask, this, parts);
+                else BinarizeTask(this, 0);
+            }
+
+            ProcessInkChunk(inkRows.Data(), smear != NULL ? smear + (size_t)y * width : NULL,
+                            this->count);
+        }
+        return;
+    }
+
+    int bands = (int)smears.size();
+    for (int y = 0; y < count; y += rowCapacity) {
+        this->gray = gray + (size_t)y * width;
+        this->smear = smear != NULL ? smear + (size_t)y * width : NULL;
+        this->count = std::min(rowCapacity, count - y);
+
+        // Smearing and darkness by bands of columns, then the ink by ranges
+        // of rows once the whole strip is smeared
+        uint64_t pixels = (uint64_t)width * this->count;
+        {
+            StageTimer timer(metrics, STAGE_SMEAR, pixels);
+            if (pool != NULL) pool->Run(SmearTask, this, bands);
+            else SmearTask(this, 0);
+
+            // The paper level of a row is its brightest pixel in any band
+            for (int row = 0; row < this->count; ++row) {
+                unsigned char paper = 0;
+                for (int band = 0; band < bands; ++band)
+                    paper = std::max(paper, rowBrightest[(size_t)band * rowCapacity + row]);
+                paperSum += paper;
+            }
+        }
+        {
+            StageTimer timer(metrics, STAGE_PROFILE, pixels);
+            parts = std::max(1, std::min(this->count, (int)profiles.size()));
+            if (pool != NULL) pool->Run(ProfileTask, this, parts);
+            else ProfileTask(this, 0);
+        }
+        rows += this->count;
+    }
+}
+
+void StripProcessor::Finish(std::vector<ColumnRect>& columns)
+{
+    StageTimer timer(metrics, STAGE_SEGMENT, (uint64_t)width * profiles.size());
+
+    // Gutters and column bounds from the merged profile
+    if (!Binarizing()) profiles[0].AddDarknessSums(columnSums.Data(), paperSum, rows);
+    for (size_t part = 1; part < profiles.size(); ++part)
+        profiles[0].Merge(profiles[part]);
+    profiles[0].FindColumns(columns);
+}
+
+void ProcessPlane(const unsigned char* grayData, unsigned char* smearData,
+                  int width, int height, const PipelineParams& params,
+                  std::vector<ColumnRect>& columns, ThreadPool* pool,
+                  PageMetrics* metrics)
+{
+    StripProcessor processor;
+    processor.Begin(width, params, pool, metrics);
+    processor.ProcessRows(grayData, smearData, height);
+    processor.Finish(columns);
+}
+
+bool ProcessStream(RowSource& source, const PipelineParams& params,
+                   std::vector<ColumnRect>& columns, std::string& error,
+                   ThreadPool* pool, PageMetrics* metrics)
+{
+    int width = source.Width();
+    int height = source.Height();
+
+    // Coarse-to-fine detection and deskewing need the whole page, and its
+    // pyramid, at once
+    if (params.coarse || params.deskew) {
+        PooledArray<unsigned char> plane;
+        plane.Resize((size_t)width * height);
+        ThumbnailPyramid pyramid;
+        pyramid.Begin(width, height);
+        if (metrics != NULL) {
+            metrics->Allocated(STAGE_DECODE, plane.Size());
+            metrics->Allocated(STAGE_THUMBNAIL, pyramid.MemoryBytes());
+        }
+        for (int y = 0; y < height; y += STRIP_ROWS) {
+            int count = std::min(STRIP_ROWS, height - y);
+            unsigned char* rows = &plane[(size_t)y * width];
+            bool read;
+            {
+                StageTimer timer(metrics, STAGE_DECODE, (uint64_t)width * count);
+                read = source.ReadGrayRows(rows, count, pool);
+            }
+            if (!read) {
+                error = source.Error().empty() ? "image data ends early" : source.Error();
+                return false;
+            }
+            StageTimer timer(metrics, STAGE_THUMBNAIL, (uint64_t)width * count);
+            pyramid.AddRows(rows, count);
+        }
+
+        double slope = 0;
+        if (params.deskew) {
+            StageTimer timer(metrics, STAGE_SKEW, (uint64_t)width * height);
+            slope = EstimateSkew(plane.Data(), width, height, pyramid);
+        }
+
+        // Skewed pages are detected in full resolution along the skew, as
+        // the pyramid is of the page as it is
+        if (slope != 0) {
+            FindColumnsAlongSkew(plane.Data(), width, height, slope, params, columns, pool,
+                                 metrics);
+        }
+        else if (params.coarse) {
+            FindColumnsCoarseToFine(plane.Data(), width, height, pyramid,
+                                    params, columns, metrics);
+        }
+        else ProcessPlane(plane.Data(), NULL, width, height, params, columns, pool, metrics);
+        return true;
+    }
+
+    StripProcessor processor;
+    processor.Begin(width, params, pool, metrics);
+
+    // Each thread gets a strip's worth of rows, so memory stays bounded by
+    // the width while there is enough work per hand-off
+    int stripRows = STRIP_ROWS * (pool != NULL ? pool->ThreadCount() : 1);
+
+    // Bilevel pages go straight to ink bits when binarizing, without ever
+    // being expanded to luminance
+    if (processor.Binarizing() && source.HasInkRows()) {
+        int words = WordsForWidth(width);
+        PooledArray<uint64_t> inkStrip;
+        inkStrip.Resize((size_t)words * stripRows);
+        if (metrics != NULL) metrics->Allocated(STAGE_DECODE, inkStrip.Size() * sizeof(uint64_t));
+        for (int y = 0; y < height; y += stripRows) {
+            int count = std::min(stripRows, height - y);
+            bool read = true;
+            {
+                StageTimer timer(metrics, STAGE_DECODE, (uint64_t)width * count);
+                for (int i = 0; i < count && read; ++i)
+                    read = source.ReadInkRow(&inkStrip[(size_t)i * words]);
+            }
+            if (!read) {
+                error = source.Error().empty() ? "image data ends early" : source.Error();
+                return false;
+            }
+            processor.ProcessInkRows(inkStrip.Data(), NULL, count);
+        }
+
+        processor.Finish(columns);
+        return true;
+    }
+    // Nothing needs the smeared rows, they only go into the profile
+    PooledArray<unsigned char> grayStrip;
+    grayStrip.Resize((size_t)width * stripRows);
+    if (metrics != NULL) metrics->Allocated(STAGE_DECODE, grayStrip.Size());
+    for (int y = 0; y < height; y += stripRows) {
+        int count = std::min(stripRows, height - y);
+        bool read;
+        {
+            StageTimer timer(metrics, STAGE_DECODE, (uint64_t)width * count);
+            read = source.ReadGrayRows(grayStrip.Data(), count, pool);
+        }
+        if (!read) {
+            error = source.Error().empty() ? "image data ends early" : source.Error();
+            return false;
+        }
+        processor.ProcessRows(grayStrip.Data(), NULL, count);
+    }
+
+    processor.Finish(columns);
+    return true;
+}
+
+bool ProcessFile(const char* filename, int page, const PipelineParams& params,
+                 PageResult& result, std::string& error, ThreadPool* pool)
+{
+    PageMetrics* metrics = MetricsEnabled() ? &result.metrics : NULL;
+    double start = metrics != NULL ? GetTimeSeconds() : 0;
+
+    RowSource* reader = OpenImagePage(filename, page, error);
+    if (reader == NULL) return false;
+
+    result.filename = filename;
+    result.page = page;
+    result.width = reader->Width();
+    result.height = reader->Height();
+    bool ok = ProcessStream(*reader, params, result.columns, error, pool, metrics);
+    delete reader;
+    if (!ok) return false;
+
+    if (metrics != NULL)
+        metrics->Add(STAGE_PAGE, GetTimeSeconds() - start, (uint64_t)result.width * result.height);
+    return true;
+}
+
+bool SaveColumnDataToXML(const std::vector<ColumnRect>& columns, const char* filename)
+{
+    std::ofstream xmlFile;
+    xmlFile.open(filename);
+
+    if (!xmlFile.is_open()) return false;
+
+    xmlFile << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    xmlFile << "<ImageColumns>\n";
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        const ColumnRect& column = columns[i];
+        xmlFile << "  <Column x0=\"" << column.x0 << "\" x1=\"" << column.x1
+                << "\" y0=\"" << column.y0 << "\" y1=\"" << column.y1
+                << "\" confidence=\"" << column.confidence << "\"/>\n";
+    }
+
+    xmlFile << "</ImageColumns>\n";
+    xmlFile.close();
+    return !xmlFile.fail();
+}
@@ -0,0 +1,195 @@
+// Platform-independent column finding pipeline. These are the processing
+// steps that used to live inside ProcessImage(), separated from the window,
+// the device contexts and the global image list so they can run headless.
+#ifndef COLFIND_PIPELINE_H
+#define COLFIND_PIPELINE_H
+
+#include <string>
+#include <vector>
+
+#include "binarize.h"
+#include "bitplane.h"
+#include "bufferpool.h"
+#include "metrics.h"
+#include "rowsource.h"
+#include "segment.h"
+#include "smear.h"
+#include "threadpool.h"
+
+// Bumped whenever a change alters the columns found for some page, so that
+// stored results of older versions are not reused
+#define PIPELINE_VERSION 2
+
+// Default amount a pixel must be darker than the paper to count as ink
+#define DEFAULT_THRESHOLD 20
+
+// Default number of rows above a pixel that the vertical smear blends in
+#define DEFAULT_MAX_VERT 40
+
+// Rows decoded and processed together when streaming a page
+#define STRIP_ROWS 64
+
+// Narrowest band of columns worth handing to a thread of its own
+#define MIN_BAND_WIDTH 64
+
+// Parameters that control processing of a single page
+struct PipelineParams {
+    int threshold;
+    int maxVert;        // Clamped to MAX_VERT_LIMIT by the smear
+    BinarizeMode binarize;  // Anything but BINARIZE_NONE runs on ink bits
+    bool coarse;        // Detect on a scaled down page first, see coarse.h
+    bool deskew;        // Detect along the page's skew, see skew.h
+
+    PipelineParams() :
+        threshold(DEFAULT_THRESHOLD),
+        maxVert(DEFAULT_MAX_VERT),
+        binarize(BINARIZE_NONE),
+        coarse(false),
+        deskew(false) {}
+};
+
+// Outcome of processing one page, without any pixel data attached
+struct PageResult {
+    std::string filename;
+    int page;           // Within the file, counting from 0
+    int width;
+    int height;
+    std::vector<ColumnRect> columns;
+    PageMetrics metrics;    // Filled in only while metrics are enabled
+
+    PageResult() :
+        page(0),
+        width(0),
+        height(0) {}
+};
+
+// The per-row stages of the pipeline, the vertical smear and the ink
+// projection, fed one horizontal strip of a page at a time. Between strips
+// it only keeps the smear's maxVert rows of history and the per-column
+// accumulators, so memory does not grow with the page height.
+//
+// Every row is smeared and folded into the darkness half of the profile in
+// one go, while it is in the first level cache: the smear adds each pixel
+// to its column's sum and keeps the row's brightest pixel, and the darkness
+// comes from those sums at the end (see ColumnProfile::AddDarknessSums()),
+// so the smeared rows are never written out unless the caller wants them.
+// The ink half then goes over the unsmeared rows of the strip once more.
+//
+// Given a thread pool, each strip is processed in parallel with the same
+// result as on one thread. The smear is recursive down every column (each
+// row depends on all smeared rows above it, not just maxVert of them), so
+// it cannot be split into row ranges with overlapping halo rows; it is split
+// into bands of columns instead, each keeping its own brightest pixel of
+// every row. The ink needs whole rows and is split into row ranges, each
+// added to its own profile, and the profiles are merged at the end.
+//
+// With params.binarize set, rows are binarized as they arrive and the rest
+// runs on ink bits instead (see bitplane.h): the smear becomes the OR of
+// the ink above each pixel and the profile counts smeared ink with
+// popcounts, 64 pixels at a time. Both then work a band of words across
+// all the rows of a strip. The Otsu threshold comes from the histogram of
+// all rows seen so far, and is never closer than params.threshold to the
+// brightest pixel of a row, so blank paper at the top of a page does not
+// turn its grain into ink.
+class StripProcessor {
+public:
+    StripProcessor();
+
+    // Prepares for a new page. The pool and metrics, if any, must outlive
+    // processing.
+    void Begin(int width, const PipelineParams& params, ThreadPool* pool = NULL,
+               PageMetrics* metrics = NULL);
+
+    // Smears the next count rows of gray into smear, both width*count bytes,
+    // and adds them to the profile. Strips must arrive top to bottom. When
+    // binarizing, smear gets the smeared ink as 0 and the rest as 255. It
+    // can be NULL if the smeared rows are not needed. The Otsu threshold
+    // moves on every STRIP_ROWS rows from the first of each call, so strips
+    // other than the last should be multiples of STRIP_ROWS rows tall for
+    // the ink not to depend on how a page is cut into them.
+    void ProcessRows(const unsigned char* gray, unsigned char* smear, int count);
+
+    // Same for rows that are ink bits already, WordsForWidth(width) words
+    // apart, such as those of bilevel pages. Only when binarizing.
+    void ProcessInkRows(const uint64_t* ink, unsigned char* smear, int count);
+
+    bool Binarizing() const { return binarize != BINARIZE_NONE; }
+
+    // Segments everything seen since Begin() into columns
+    void Finish(std::vector<ColumnRect>& columns);
+
+    // Everything seen since Begin(), merged by Finish()
+    const ColumnProfile& Profile() const { return profiles[0]; }
+
+private:
+    StripProcessor(const StripProcessor&);
+    StripProcessor& operator=(const StripProcessor&);
+
+    static void SmearTask(void* context, int band);
+    static void ProfileTask(void* context, int part);
+    static void HistogramTask(void* context, int part);
+    static void BinarizeTask(void* context, int part);
+    static void InkSmearTask(void* context, int band);
+    static void InkProfileTask(void* context, int band);
+    void ProcessInkChunk(const uint64_t* ink, unsigned char* smear, int count);
+
+    int width;
+    int rows;                               // Rows processed so far
+    ThreadPool* pool;
+    PageMetrics* metrics;
+    std::vector<int> bandStart;             // First column of each smear band, plus width
+    std::vector<VerticalSmear> smears;      // One per band
+    std::vector<ColumnProfile> profiles;    // One per row range of a strip
+    int rowCapacity;                        // Rows smeared at once
+    PooledArray<uint32_t> columnSums;       // Of every smeared pixel column so far
+    PooledArray<unsigned char> rowBrightest;    // Per band, of every row smeared at once
+    uint64_t paperSum;                      // Brightest smeared pixels of all rows so far
+
+    // Binarized pipeline
+    BinarizeMode binarize;
+    int threshold;
+    int adaptiveRadius;
+    int words;                              // Per row of ink bits
+    int inkCapacity;                        // Rows of ink bits handled at once
+    PooledArray<uint64_t> inkRows;          // Binarized rows of a strip
+    PooledArray<uint64_t> smearRows;        // The same rows smeared
+    std::vector<int> bandWord;              // First word of each band, plus words
+    std::vector<BitSmear> bitSmears;        // One per band
+    std::vector<uint32_t> histograms;       // 256 bins per STRIP_ROWS rows of a strip
+    std::vector<uint32_t> pageHistogram;    // Of all rows so far
+    std::vector<int> inkLevels;             // Per STRIP_ROWS rows, values below it are ink, for Otsu
+
+    // Strip being processed
+    const unsigned char* gray;
+    unsigned char* smear;
+    const uint64_t* ink;
+    int count;
+    int parts;                              // Row ranges the strip is split into
+};
+
+// Applies the vertical smear to a top-down luminance plane, writing the
+// result into smearData, and segments the smeared rows into columns as they
+// are produced. Both planes hold width*height bytes, smearData can be NULL
+// if the smeared plane is not needed. The pool and metrics may be NULL.
+void ProcessPlane(const unsigned char* grayData, unsigned char* smearData,
+                  int width, int height, const PipelineParams& params,
+                  std::vector<ColumnRect>& columns, ThreadPool* pool = NULL,
+                  PageMetrics* metrics = NULL);
+
+// Decodes a page strip by strip and segments it without keeping any pixel
+// planes, using memory proportional to width * maxVert whatever the height.
+// With params.coarse or params.deskew set it holds the whole page instead.
+// On a decoding error returns false and describes why in error.
+bool ProcessStream(RowSource& source, const PipelineParams& params,
+                   std::vector<ColumnRect>& columns, std::string& error,
+                   ThreadPool* pool = NULL, PageMetrics* metrics = NULL);
+
+// Opens a page of an image file, counting from 0, and streams it through
+// ProcessStream(), keeping only the columns, and the page's metrics while
+// they are enabled. On failure returns false and describes why in error.
+bool ProcessFile(const char* filename, int page, const PipelineParams& params,
+                 PageResult& result, std::string& error, ThreadPool* pool = NULL);
+
+bool SaveColumnDataToXML(const std::vector<ColumnRect>& columns, const char* filename);
+
+#endif
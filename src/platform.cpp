@@ -0,0 +1,752 @@
+#include "platform.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+//===========================================================================//
+// Threads
+#ifdef _WIN32
+
+struct ThreadStart {
+    ThreadProc proc;
+    void* arg;
+};
+
+static DWORD WINAPI ThreadTrampoline(LPVOID param)
+{
+    ThreadStart* start = (ThreadStart*)param;
+    start->proc(start->arg);
+    return 0;
+}
+
+Thread::Thread() : handle(NULL), start(NULL) {}
+
+Thread::~Thread()
+{
+    Join();
+}
+
+bool Thread::Start(ThreadProc proc, void* arg)
+{
+    ThreadStart* start = new ThreadStart;
+    start->proc = proc;
+    start->arg = arg;
+    handle = CreateThread(NULL, 0, ThreadTrampoline, start, 0, NULL);
+    if (handle == NULL) {
+        delete start;
+        return false;
+    }
+    this->start = start;
+    return true;
+}
+
+void Thread::Join()
+{
+    if (handle == NULL) return;
+    WaitForSingleObject((HANDLE)handle, INFINITE);
+    CloseHandle((HANDLE)handle);
+    handle = NULL;
+    delete (ThreadStart*)start;
+    start = NULL;
+}
+
+Mutex::Mutex()
+{
+    CRITICAL_SECTION* cs = new CRITICAL_SECTION;
+    InitializeCriticalSection(cs);
+    handle = cs;
+}
+
+Mutex::~Mutex()
+{
+    DeleteCriticalSection((CRITICAL_SECTION*)handle);
+    delete (CRITICAL_SECTION*)handle;
+}
+
+void Mutex::Lock()
+{
+    EnterCriticalSection((CRITICAL_SECTION*)handle);
+}
+
+void Mutex::Unlock()
+{
+    LeaveCriticalSection((CRITICAL_SECTION*)handle);
+}
+
+Semaphore::Semaphore(int initialCount)
+{
+    handle = CreateSemaphore(NULL, initialCount, 0x7fffffff, NULL);
+}
+
+Semaphore::~Semaphore()
+{
+    CloseHandle((HANDLE)handle);
+}
+
+void Semaphore::Wait()
+{
+    WaitForSingleObject((HANDLE)handle, INFINITE);
+}
+
+void Semaphore::Post(int count)
+{
+    ReleaseSemaphore((HANDLE)handle, count, NULL);
+}
+
+int GetCpuCount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return std::max((int)info.dwNumberOfProcessors, 1);
+}
+
+double GetTimeSeconds()
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+size_t GetPeakMemoryBytes()
+{
+    // Would need psapi, which the viewer does not otherwise link
+    return 0;
+}
+
+#else
+
+struct ThreadStart {
+    ThreadProc proc;
+    void* arg;
+};
+
+static void* ThreadTrampoline(void* param)
+{
+    ThreadStart* start = (ThreadStart*)param;
+    start->proc(start->arg);
+    return NULL;
+}
+
+Thread::Thread() : handle(NULL), start(NULL) {}
+
+Thread::~Thread()
+{
+    Join();
+}
+
+bool Thread::Start(ThreadProc proc, void* arg)
+{
+    ThreadStart* start = new ThreadStart;
+    start->proc = proc;
+    start->arg = arg;
+    pthread_t* thread = new pthread_t;
+    if (pthread_create(thread, NULL, ThreadTrampoline, start) != 0) {
+        delete start;
+        delete thread;
+        return false;
+    }
+    handle = thread;
+    this->start = start;
+    return true;
+}
+
+void Thread::Join()
+{
+    if (handle == NULL) return;
+    pthread_join(*(pthread_t*)handle, NULL);
+    delete (pthread_t*)handle;
+    handle = NULL;
+    delete (ThreadStart*)start;
+    start = NULL;
+}
+
+Mutex::Mutex()
+{
+    pthread_mutex_t* m = new pthread_mutex_t;
+    pthread_mutex_init(m, NULL);
+    handle = m;
+}
+
+Mutex::~Mutex()
+{
+    pthread_mutex_destroy((pthread_mutex_t*)handle);
+    delete (pthread_mutex_t*)handle;
+}
+
+void Mutex::Lock()
+{
+    pthread_mutex_lock((pthread_mutex_t*)handle);
+}
+
+void Mutex::Unlock()
+{
+    pthread_mutex_unlock((pthread_mutex_t*)handle);
+}
+
+// POSIX unnamed semaphores are not available everywhere (macOS), so build
+// one from a mutex and a condition variable instead
+struct SemaphoreState {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+};
+
+Semaphore::Semaphore(int initialCount)
+{
+    SemaphoreState* s = new SemaphoreState;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->count = initialCount;
+    handle = s;
+}
+
+Semaphore::~Semaphore()
+{
+    SemaphoreState* s = (SemaphoreState*)handle;
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    delete s;
+}
+
+void Semaphore::Wait()
+{
+    SemaphoreState* s = (SemaphoreState*)handle;
+    pthread_mutex_lock(&s->mutex);
+    while (s->count == 0)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    --s->count;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void Semaphore::Post(int count)
+{
+    SemaphoreState* s = (SemaphoreState*)handle;
+    pthread_mutex_lock(&s->mutex);
+    s->count += count;
+    if (count == 1) pthread_cond_signal(&s->cond);
+    else pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+int GetCpuCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+double GetTimeSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+size_t GetPeakMemoryBytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;             // Bytes
+#else
+    return (size_t)usage.ru_maxrss * 1024;      // Kilobytes
+#endif
+}
+
+#endif
+
+//===========================================================================//
+// File system
+#ifdef _WIN32
+
+bool IsDirectory(const std::string& path)
+{
+    DWORD attributes = GetFileAttributes(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+bool ListDirectory(const std::string& path, std::vector<std::string>& files)
+{
+    WIN32_FIND_DATA findData;
+    HANDLE hFind = FindFirstFile((path + "\\*").c_str(), &findData);
+    if (hFind == INVALID_HANDLE_VALUE) return false;
+
+    std::vector<std::string> found;
+    do {
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        found.push_back(path + PATH_SEPARATOR + findData.cFileName);
+    } while (FindNextFile(hFind, &findData));
+    FindClose(hFind);
+
+    std::sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+    return true;
+}
+
+bool MakeDirectory(const std::string& path)
+{
+    return CreateDirectory(path.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+bool GetFileInfo(const std::string& path, size_t& size, double& modified)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data)) return false;
+    if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || data.nFileSizeHigh != 0) return false;
+
+    size = data.nFileSizeLow;
+    // FILETIME counts 100 ns intervals
+    modified = (data.ftLastWriteTime.dwHighDateTime * 4294967296.0 +
+                data.ftLastWriteTime.dwLowDateTime) / 1e7;
+    return true;
+}
+
+double GetFileTimeNow()
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return (now.dwHighDateTime * 4294967296.0 + now.dwLowDateTime) / 1e7;
+}
+
+bool TouchFile(const std::string& path)
+{
+    HANDLE hFile = CreateFile(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    BOOL ok = SetFileTime(hFile, NULL, NULL, &now);
+    CloseHandle(hFile);
+    return ok != FALSE;
+}
+
+bool TruncateFile(const std::string& path, size_t size)
+{
+    HANDLE hFile = CreateFile(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    BOOL ok = SetFilePointer(hFile, (LONG)size, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+              SetEndOfFile(hFile);
+    CloseHandle(hFile);
+    return ok != FALSE;
+}
+
+int GetProcessNumber()
+{
+    return (int)GetCurrentProcessId();
+}
+
+#else
+
+bool IsDirectory(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool ListDirectory(const std::string& path, std::vector<std::string>& files)
+{
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) return false;
+
+    std::vector<std::string> found;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        std::string fullPath = path + PATH_SEPARATOR + entry->d_name;
+        struct stat st;
+        if (stat(fullPath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        found.push_back(fullPath);
+    }
+    closedir(dir);
+
+    std::sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+    return true;
+}
+
+bool MakeDirectory(const std::string& path)
+{
+    return mkdir(path.c_str(), 0777) == 0 || (errno == EEXIST && IsDirectory(path));
+}
+
+bool GetFileInfo(const std::string& path, size_t& size, double& modified)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    size = (size_t)st.st_size;
+    modified = (double)st.st_mtime;
+    return true;
+}
+
+double GetFileTimeNow()
+{
+    return (double)time(NULL);
+}
+
+bool TouchFile(const std::string& path)
+{
+    return utime(path.c_str(), NULL) == 0;
+}
+
+bool TruncateFile(const std::string& path, size_t size)
+{
+    return truncate(path.c_str(), (off_t)size) == 0;
+}
+
+int GetProcessNumber()
+{
+    return (int)getpid();
+}
+
+#endif
+
+//===========================================================================//
+// Memory-mapped files
+MappedFile::MappedFile() :
+    data(NULL),
+    size(0),
+    fileHandle(NULL),
+    mappingHandle(NULL) {}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const char* filename)
+{
+    Close();
+
+    HANDLE hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD sizeHigh = 0;
+    DWORD sizeLow = GetFileSize(hFile, &sizeHigh);
+    if (sizeHigh != 0) {
+        // Anything beyond 4 GB cannot be a page we handle
+        CloseHandle(hFile);
+        return false;
+    }
+    fileHandle = hFile;
+    size = sizeLow;
+    if (size == 0) return true;
+
+    mappingHandle = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mappingHandle != NULL)
+        data = (const unsigned char*)MapViewOfFile((HANDLE)mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data != NULL) UnmapViewOfFile((LPCVOID)data);
+    if (mappingHandle != NULL) CloseHandle((HANDLE)mappingHandle);
+    if (fileHandle != NULL) CloseHandle((HANDLE)fileHandle);
+    data = NULL;
+    size = 0;
+    fileHandle = NULL;
+    mappingHandle = NULL;
+}
+
+bool MappedFile::OpenShared(const char* name)
+{
+    Close();
+
+    mappingHandle = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+    if (mappingHandle == NULL) return false;
+    data = (const unsigned char*)MapViewOfFile((HANDLE)mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        Close();
+        return false;
+    }
+
+    // The mapping does not tell its size, the view's region does
+    MEMORY_BASIC_INFORMATION info;
+    if (VirtualQuery((LPCVOID)data, &info, sizeof(info)) == 0) {
+        Close();
+        return false;
+    }
+    size = info.RegionSize;
+    return true;
+}
+
+void MappedFile::Release(size_t /* offset */, size_t /* length */)
+{
+    // Windows trims the working set of a read-only view on its own
+}
+
+#else
+
+bool MappedFile::Open(const char* filename)
+{
+    Close();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        size = 0;
+        return false;
+    }
+    // Pages are read front to back
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    data = (const unsigned char*)mapped;
+    return true;
+}
+
+bool MappedFile::OpenShared(const char* name)
+{
+    Close();
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    data = (const unsigned char*)mapped;
+    size = (size_t)st.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data != NULL) munmap((void*)data, size);
+    data = NULL;
+    size = 0;
+}
+
+void MappedFile::Release(size_t offset, size_t length)
+{
+    if (data == NULL || offset >= size) return;
+    length = std::min(length, size - offset);
+
+    // Only whole pages inside the range can go
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (offset + pageSize - 1) / pageSize * pageSize;
+    size_t end = (offset + length) / pageSize * pageSize;
+    if (end > start) madvise((void*)(data + start), end - start, MADV_DONTNEED);
+}
+
+#endif
+
+std::string BaseName(const std::string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+//===========================================================================//
+// Descriptors and local sockets
+LocalListener::LocalListener() :
+    fd(-1),
+    stopped(0) {}
+
+LocalListener::~LocalListener()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+int ReadDescriptor(int fd, char* buffer, int size)
+{
+    return _read(fd, buffer, size);
+}
+
+bool WriteDescriptor(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        int written = _write(fd, data, (unsigned)size);
+        if (written <= 0) return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+void CloseDescriptor(int fd)
+{
+    _close(fd);
+}
+
+void ShutdownReading(int /* fd */)
+{
+}
+
+bool LocalListener::Open(const std::string& /* path */, std::string& error)
+{
+    error = "local sockets are not supported on Windows";
+    return false;
+}
+
+int LocalListener::Accept()
+{
+    return -1;
+}
+
+void LocalListener::Stop()
+{
+    stopped = 1;
+}
+
+void LocalListener::Close()
+{
+}
+
+#else
+
+int ReadDescriptor(int fd, char* buffer, int size)
+{
+    for (;;) {
+        ssize_t count = read(fd, buffer, (size_t)size);
+        if (count >= 0 || errno != EINTR) return (int)count;
+    }
+}
+
+bool WriteDescriptor(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+void CloseDescriptor(int fd)
+{
+    close(fd);
+}
+
+void ShutdownReading(int fd)
+{
+    shutdown(fd, SHUT_RD);
+}
+
+bool LocalListener::Open(const std::string& path, std::string& error)
+{
+    Close();
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        error = "socket path is empty or too long: " + path;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error = std::string("cannot create socket: ") + strerror(errno);
+        return false;
+    }
+
+    // A socket file nobody answers on was left by a process that is gone
+    int bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+    if (bound != 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool answered = probe >= 0 && connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+        if (probe >= 0) close(probe);
+        if (answered) {
+            error = "another server is listening at " + path;
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        unlink(path.c_str());
+        bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+    }
+    if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+        error = "cannot listen at " + path + ": " + strerror(errno);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    this->path = path;
+    stopped = 0;
+    return true;
+}
+
+int LocalListener::Accept()
+{
+    while (!stopped) {
+        int client = accept(fd, NULL, NULL);
+        if (client >= 0) {
+            if (!stopped) return client;
+            close(client);
+        }
+        else if (errno != EINTR && errno != ECONNABORTED) {
+            break;
+        }
+    }
+    return -1;
+}
+
+void LocalListener::Stop()
+{
+    // Shutting the socket down wakes a thread blocked in accept(), which
+    // closing it would not
+    stopped = 1;
+    if (fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
+void LocalListener::Close()
+{
+    if (fd < 0) return;
+    close(fd);
+    unlink(path.c_str());
+    fd = -1;
+}
+
+#endif
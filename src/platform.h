@@ -0,0 +1,200 @@
+// Thin portability layer over the few operating system services needed by the
+// processing engine: threads, locks, files and directories, clocks and the
+// CPU count.
+// Implemented on top of Win32 or POSIX, selected at compile time.
+#ifndef COLFIND_PLATFORM_H
+#define COLFIND_PLATFORM_H
+
+#include <string>
+#include <vector>
+
+// Entry point for a thread started with Thread::Start()
+typedef void (*ThreadProc)(void* arg);
+
+// A joinable operating system thread
+class Thread {
+public:
+    Thread();
+    ~Thread();
+
+    bool Start(ThreadProc proc, void* arg);
+    void Join();
+
+private:
+    // Not copyable
+    Thread(const Thread&);
+    Thread& operator=(const Thread&);
+
+    void* handle;       // HANDLE on Win32, pthread_t* elsewhere
+    void* start;        // What the thread runs, freed by Join() so the new
+                        // thread itself never touches the heap
+};
+
+// Non-recursive mutual exclusion lock
+class Mutex {
+public:
+    Mutex();
+    ~Mutex();
+
+    void Lock();
+    void Unlock();
+
+private:
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+    void* handle;
+};
+
+// Locks a mutex for the lifetime of the object
+class ScopedLock {
+public:
+    explicit ScopedLock(Mutex& m) : mutex(m) { mutex.Lock(); }
+    ~ScopedLock() { mutex.Unlock(); }
+
+private:
+    ScopedLock(const ScopedLock&);
+    ScopedLock& operator=(const ScopedLock&);
+
+    Mutex& mutex;
+};
+
+// Counting semaphore, used to hand work to and collect it from threads
+class Semaphore {
+public:
+    explicit Semaphore(int initialCount = 0);
+    ~Semaphore();
+
+    void Wait();
+    void Post(int count = 1);
+
+private:
+    Semaphore(const Semaphore&);
+    Semaphore& operator=(const Semaphore&);
+
+    void* handle;
+};
+
+// Read-only view of a whole file mapped into memory
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(const char* filename);
+    void Close();
+
+    // Maps a named shared memory object read-only instead: a POSIX shm_open()
+    // name such as "/pages", or a Win32 file mapping name. Its size may be
+    // rounded up to whole pages.
+    bool OpenShared(const char* name);
+
+    const unsigned char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+    // Hints that a range will not be read again soon, so its pages can be
+    // dropped from memory. Reading it later is still fine, just slower.
+    void Release(size_t offset, size_t length);
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const unsigned char* data;
+    size_t size;
+    void* fileHandle;       // Win32 only
+    void* mappingHandle;    // Win32 only
+};
+
+// Reads up to size bytes from a descriptor, a client of a LocalListener or
+// 0 for standard input. Returns the bytes read, 0 at the end of the stream
+// and -1 on an error.
+int ReadDescriptor(int fd, char* buffer, int size);
+
+// Writes all of data to a descriptor, 1 being standard output, and returns
+// false on an error
+bool WriteDescriptor(int fd, const char* data, size_t size);
+
+void CloseDescriptor(int fd);
+
+// Makes reads from a socket see the end of the stream, while writes still
+// go through
+void ShutdownReading(int fd);
+
+// Unix domain socket that local clients connect to. Not available on Win32,
+// where Open() always fails.
+class LocalListener {
+public:
+    LocalListener();
+    ~LocalListener();
+
+    // Listens at path, replacing a socket left there by a process that is
+    // gone. On failure returns false and describes why in error.
+    bool Open(const std::string& path, std::string& error);
+
+    // Waits for the next client and returns its descriptor, or -1 once
+    // Stop() has been called
+    int Accept();
+
+    // Makes Accept() return -1 from now on. Safe to call from a signal
+    // handler or another thread.
+    void Stop();
+
+    // Stops listening and removes the socket file
+    void Close();
+
+private:
+    LocalListener(const LocalListener&);
+    LocalListener& operator=(const LocalListener&);
+
+    int fd;
+    volatile int stopped;
+    std::string path;
+};
+
+// Number of logical processors, at least 1
+int GetCpuCount();
+
+// Seconds since an arbitrary fixed point, for timing intervals
+double GetTimeSeconds();
+
+// Most memory the process has had resident so far, in bytes, or 0 where the
+// platform does not say
+size_t GetPeakMemoryBytes();
+
+bool IsDirectory(const std::string& path);
+
+// Lists the regular files directly inside a directory (full paths, sorted)
+bool ListDirectory(const std::string& path, std::vector<std::string>& files);
+
+// Creates a directory, succeeding if it exists already
+bool MakeDirectory(const std::string& path);
+
+// Size and last modification time, in seconds since some fixed point, of a
+// regular file
+bool GetFileInfo(const std::string& path, size_t& size, double& modified);
+
+// The current time, on the same scale as the modification times from
+// GetFileInfo()
+double GetFileTimeNow();
+
+// Sets the modification time of a file to now
+bool TouchFile(const std::string& path);
+
+// Cuts a file down to its first size bytes
+bool TruncateFile(const std::string& path, size_t size);
+
+// Number of the running process, unique among running processes
+int GetProcessNumber();
+
+// Directory separator used when building paths
+#ifdef _WIN32
+#define PATH_SEPARATOR '\\'
+#else
+#define PATH_SEPARATOR '/'
+#endif
+
+// Returns the file name part of a path
+std::string BaseName(const std::string& path);
+
+#endif
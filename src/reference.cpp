@@ -0,0 +1,178 @@
+#include "reference.h"
+
+#include <algorithm>
+
+#include "binarize.h"
+#include "skew.h"
+#include "smear.h"
+
+// Sizes the result for a page, with an empty profile
+static void StartResult(int width, int height, ReferenceResult& result)
+{
+    result.width = width;
+    result.height = height;
+    result.smear.assign((size_t)width * height, 0);
+    result.darkness.assign(width, 0);
+    result.firstRow.assign(width, -1);
+    result.lastRow.assign(width, -1);
+    result.columns.clear();
+}
+
+static int RowBrightest(const unsigned char* row, int width)
+{
+    int brightest = 0;
+    for (int x = 0; x < width; ++x) brightest = std::max(brightest, (int)row[x]);
+    return brightest;
+}
+
+// Extends the rows of the pixel columns with ink in row y, one byte per
+// pixel, that have ink next to them as well
+static void AddInkRow(const unsigned char* ink, int y, ReferenceResult& result)
+{
+    int width = result.width;
+    for (int x = 0; x < width; ++x) {
+        bool left = x > 0 && ink[x - 1];
+        bool right = x + 1 < width && ink[x + 1];
+        if (!ink[x] || !(left || right)) continue;
+        if (result.firstRow[x] < 0) result.firstRow[x] = y;
+        result.lastRow[x] = y;
+    }
+}
+
+static void FinishResult(ReferenceResult& result)
+{
+    if (result.width == 0 || result.height == 0) return;
+    FindProfileColumns(&result.darkness[0], &result.firstRow[0], &result.lastRow[0],
+                       result.width, result.columns);
+}
+
+void RunReferencePipeline(const unsigned char* gray, int width, int height,
+                          const PipelineParams& params, ReferenceResult& result)
+{
+    if (params.binarize != BINARIZE_NONE) {
+        std::vector<unsigned char> ink;
+        ReferenceBinarize(gray, width, height, params, ink);
+        RunReferenceInkPipeline(ink.empty() ? NULL : &ink[0], width, height, params, result);
+        return;
+    }
+
+    StartResult(width, height, result);
+    int maxVert = std::max(0, std::min(params.maxVert, MAX_VERT_LIMIT));
+    std::vector<unsigned char>& smear = result.smear;
+    std::copy(gray, gray + smear.size(), smear.begin());
+
+    // Every pixel halved and blended with each of the up to maxVert smeared
+    // pixels above it in turn, the nearest first
+    for (int x = 0; x < width; ++x) {
+        for (int y = 1; y < height; ++y) {
+            unsigned char& pixel = smear[(size_t)y * width + x];
+            for (int vert = 1; vert <= std::min(y, maxVert); ++vert)
+                pixel = (unsigned char)(pixel / 2 + smear[(size_t)(y - vert) * width + x] / 2);
+        }
+    }
+
+    std::vector<unsigned char> ink(width);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* smearRow = &smear[(size_t)y * width];
+        int paper = RowBrightest(smearRow, width);
+        for (int x = 0; x < width; ++x) result.darkness[x] += paper - smearRow[x];
+
+        const unsigned char* grayRow = gray + (size_t)y * width;
+        int level = RowBrightest(grayRow, width) - params.threshold;
+        for (int x = 0; x < width; ++x) ink[x] = grayRow[x] < level;
+        AddInkRow(&ink[0], y, result);
+    }
+    FinishResult(result);
+}
+
+void RunReferenceInkPipeline(const unsigned char* ink, int width, int height,
+                             const PipelineParams& params, ReferenceResult& result)
+{
+    StartResult(width, height, result);
+    int maxVert = std::max(0, params.maxVert);
+
+    // A pixel is smeared ink if it or any of the maxVert pixels above it is
+    // ink, and each one counts once towards the darkness of its column
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            bool smeared = false;
+            for (int above = std::max(0, y - maxVert); above <= y && !smeared; ++above)
+                smeared = ink[(size_t)above * width + x] != 0;
+            result.smear[(size_t)y * width + x] = smeared ? 0 : 255;
+            if (smeared) ++result.darkness[x];
+        }
+        AddInkRow(ink + (size_t)y * width, y, result);
+    }
+    FinishResult(result);
+}
+
+void RunReferenceSkewPipeline(const unsigned char* gray, int width, int height, double slope,
+                              const PipelineParams& params, ReferenceResult& result)
+{
+    int last = height > 0 ? ShearOffset(height - 1, slope) : 0;
+    int pad = std::max(0, last);
+    int shearedWidth = width + (last < 0 ? -last : last);
+    std::vector<unsigned char> sheared((size_t)shearedWidth * height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < shearedWidth; ++x) {
+            int source = std::max(0, std::min(width - 1, x + ShearOffset(y, slope) - pad));
+            sheared[(size_t)y * shearedWidth + x] = gray[(size_t)y * width + source];
+        }
+    }
+    RunReferencePipeline(sheared.empty() ? NULL : &sheared[0], shearedWidth, height, params, result);
+
+    // The page's pixels a column covers, from its top row to its bottom
+    std::vector<ColumnRect> columns;
+    for (size_t i = 0; i < result.columns.size(); ++i) {
+        ColumnRect column = result.columns[i];
+        int x0 = width;
+        int x1 = -1;
+        for (int y = column.y0; y <= column.y1; ++y) {
+            x0 = std::min(x0, column.x0 + ShearOffset(y, slope) - pad);
+            x1 = std::max(x1, column.x1 + ShearOffset(y, slope) - pad);
+        }
+        column.x0 = std::max(0, x0);
+        column.x1 = std::min(width - 1, x1);
+        if (column.x0 <= column.x1) columns.push_back(column);
+    }
+    result.columns.swap(columns);
+}
+
+void ReferenceBinarize(const unsigned char* gray, int width, int height,
+                       const PipelineParams& params, std::vector<unsigned char>& ink)
+{
+    ink.assign((size_t)width * height, 0);
+
+    if (params.binarize == BINARIZE_ADAPTIVE) {
+        // Ink is darker than the mean of the pixels up to radius away in its
+        // row by more than the threshold, the window cut short at the ends
+        int radius = std::max(1, width / ADAPTIVE_RADIUS_DIVISOR);
+        for (int y = 0; y < height; ++y) {
+            const unsigned char* row = gray + (size_t)y * width;
+            for (int x = 0; x < width; ++x) {
+                int x0 = std::max(0, x - radius);
+                int x1 = std::min(width - 1, x + radius);
+                int64_t sum = 0;
+                for (int i = x0; i <= x1; ++i) sum += row[i];
+                ink[(size_t)y * width + x] = (int64_t)(row[x] + params.threshold) * (x1 - x0 + 1) < sum;
+            }
+        }
+        return;
+    }
+
+    // Each strip of STRIP_ROWS rows from the top is binarized with the Otsu
+    // threshold of the page down to the strip's last row, and like the
+    // grayscale ink never above the row's paper level less the threshold
+    uint32_t histogram[256] = { 0 };
+    for (int y0 = 0; y0 < height; y0 += STRIP_ROWS) {
+        int y1 = std::min(height, y0 + STRIP_ROWS);
+        for (size_t i = (size_t)y0 * width; i < (size_t)y1 * width; ++i) ++histogram[gray[i]];
+        int inkLevel = OtsuThreshold(histogram) + 1;
+
+        for (int y = y0; y < y1; ++y) {
+            const unsigned char* row = gray + (size_t)y * width;
+            int level = std::min(inkLevel, RowBrightest(row, width) - params.threshold);
+            for (int x = 0; x < width; ++x) ink[(size_t)y * width + x] = row[x] < level;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+// Plain reference version of the column finding pipeline, written to be
+// obviously right rather than fast. The smear is the nested halving loop of
+// the original ProcessImage(), run down one pixel column at a time; every
+// profile sum, ink mark and binarization threshold is taken pixel by pixel
+// straight from its definition; nothing is vectorized, threaded, streamed
+// or fused. Whatever the optimized paths do, they must come to exactly the
+// same smeared planes, profiles and columns, which colfind_verify checks.
+#ifndef COLFIND_REFERENCE_H
+#define COLFIND_REFERENCE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "pipeline.h"
+#include "segment.h"
+
+// Everything the reference pipeline makes of a page
+struct ReferenceResult {
+    int width;
+    int height;
+    std::vector<unsigned char> smear;   // Smeared plane, when binarizing ink as 0 and the rest as 255
+    std::vector<uint32_t> darkness;     // Per column, as in ColumnProfile
+    std::vector<int> firstRow;
+    std::vector<int> lastRow;
+    std::vector<ColumnRect> columns;
+
+    ReferenceResult() :
+        width(0),
+        height(0) {}
+};
+
+// Runs the grayscale pipeline on a top-down luminance plane of width*height
+// bytes, or the binarized one if params.binarize is set. params.coarse and
+// params.deskew are not used.
+void RunReferencePipeline(const unsigned char* gray, int width, int height,
+                          const PipelineParams& params, ReferenceResult& result);
+
+// Runs the binarized pipeline on a page that is ink bits already, one byte
+// per pixel that is not 0 for ink, as bilevel pages are read
+void RunReferenceInkPipeline(const unsigned char* ink, int width, int height,
+                             const PipelineParams& params, ReferenceResult& result);
+
+// Runs the pipeline on a copy of the page sheared along slope, pixel x of
+// sheared row y taken from x + ShearOffset(y) less the shear's padding,
+// clamped to the row, then moves each column back onto the page as the
+// bounds of the pixels it covers there. The profile and smear are those of
+// the sheared page.
+void RunReferenceSkewPipeline(const unsigned char* gray, int width, int height, double slope,
+                              const PipelineParams& params, ReferenceResult& result);
+
+// Which pixels of a luminance plane the binarized pipeline takes for ink,
+// as one byte per pixel, 1 for ink
+void ReferenceBinarize(const unsigned char* gray, int width, int height,
+                       const PipelineParams& params, std::vector<unsigned char>& ink);
+
+#endif
@@ -0,0 +1,589 @@
+#include "results.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "cache.h"
+
+// Start of every binary result file, followed by RESULTS_VERSION
+#define RESULTS_MAGIC "CFRB"
+#define RESULTS_VERSION 2
+#define RESULTS_HEADER_SIZE 8
+
+// Start of every binary record
+#define RECORD_TAG "PAGE"
+
+// Larger records are taken for damage rather than read
+#define MAX_RECORD_BYTES (64 << 20)
+
+ResultsFormat ResultsFormatOf(const std::string& path)
+{
+    size_t length = strlen(RESULTS_BINARY_EXTENSION);
+    if (path.size() >= length &&
+        path.compare(path.size() - length, length, RESULTS_BINARY_EXTENSION) == 0)
+        return RESULTS_BINARY;
+    return RESULTS_JSONL;
+}
+
+std::string ResultsPartPath(const std::string& path, int part)
+{
+    if (part == 0) return path;
+
+    char number[16];
+    sprintf(number, ".%d", part);
+    size_t dot = path.find_last_of('.');
+    size_t separator = path.find_last_of("/\\");
+    if (dot == std::string::npos || (separator != std::string::npos && dot < separator))
+        return path + number;
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+//===========================================================================//
+// Encoding, little-endian whatever the machine
+
+static void Put32(std::vector<char>& out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) out.push_back((char)(value >> (8 * i)));
+}
+
+static uint32_t Get32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static void Put64(std::vector<char>& out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) out.push_back((char)(value >> (8 * i)));
+}
+
+static uint64_t Get64(const unsigned char* p)
+{
+    return (uint64_t)Get32(p) | ((uint64_t)Get32(p + 4) << 32);
+}
+
+static void Append(std::vector<char>& out, const char* text)
+{
+    out.insert(out.end(), text, text + strlen(text));
+}
+
+void AppendJsonString(std::vector<char>& out, const std::string& text)
+{
+    out.push_back('"');
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back((char)c);
+        }
+        else if (c < 0x20) {
+            char escape[8];
+            sprintf(escape, "\\u%04x", c);
+            Append(out, escape);
+        }
+        else {
+            out.push_back((char)c);
+        }
+    }
+    out.push_back('"');
+}
+
+bool ReadJsonHex4(const char* digits, unsigned int& code)
+{
+    code = 0;
+    for (int i = 0; i < 4; ++i) {
+        int c = (unsigned char)digits[i];
+        if (!isxdigit(c)) return false;
+        code = code * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    return true;
+}
+
+void EncodeJsonRecord(const PageResult& result, std::vector<char>& out)
+{
+    char text[160];
+    Append(out, "{\"file\":");
+    AppendJsonString(out, result.filename);
+    sprintf(text, ",\"page\":%d,\"width\":%d,\"height\":%d,\"columns\":[", result.page,
+            result.width, result.height);
+    Append(out, text);
+    for (size_t i = 0; i < result.columns.size(); ++i) {
+        const ColumnRect& column = result.columns[i];
+        sprintf(text, "%s{\"x0\":%d,\"x1\":%d,\"y0\":%d,\"y1\":%d,\"confidence\":%.9g}",
+                i > 0 ? "," : "", column.x0, column.x1, column.y0, column.y1, column.confidence);
+        Append(out, text);
+    }
+    Append(out, "]}\n");
+}
+
+// Tag, payload size, payload and the low half of the payload's hash. The
+// payload is the file name, the page number and size and the column count, then all
+// x0, all x1, all y0, all y1 and all confidences of the columns.
+static void EncodeBinary(const PageResult& result, std::vector<char>& out)
+{
+    size_t start = out.size();
+    Append(out, RECORD_TAG);
+    Put32(out, 0);
+
+    size_t payload = out.size();
+    Put32(out, (uint32_t)result.filename.size());
+    out.insert(out.end(), result.filename.begin(), result.filename.end());
+    Put32(out, (uint32_t)result.page);
+    Put32(out, (uint32_t)result.width);
+    Put32(out, (uint32_t)result.height);
+    Put32(out, (uint32_t)result.columns.size());
+    const std::vector<ColumnRect>& columns = result.columns;
+    for (size_t i = 0; i < columns.size(); ++i) Put32(out, (uint32_t)columns[i].x0);
+    for (size_t i = 0; i < columns.size(); ++i) Put32(out, (uint32_t)columns[i].x1);
+    for (size_t i = 0; i < columns.size(); ++i) Put32(out, (uint32_t)columns[i].y0);
+    for (size_t i = 0; i < columns.size(); ++i) Put32(out, (uint32_t)columns[i].y1);
+    for (size_t i = 0; i < columns.size(); ++i) {
+        uint32_t bits;
+        memcpy(&bits, &columns[i].confidence, sizeof(bits));
+        Put32(out, bits);
+    }
+
+    size_t payloadSize = out.size() - payload;
+    std::vector<char> size;
+    Put32(size, (uint32_t)payloadSize);
+    memcpy(&out[start + 4], &size[0], 4);
+    Put32(out, (uint32_t)HashBytes(&out[payload], payloadSize, 0));
+}
+
+static bool DecodeJson(const std::vector<unsigned char>& record, PageResult& result)
+{
+    std::string text(record.begin(), record.end());
+    const char* p = text.c_str();
+    const char* prefix = "{\"file\":\"";
+    if (strncmp(p, prefix, strlen(prefix)) != 0) return false;
+    p += strlen(prefix);
+
+    std::string filename;
+    while (*p != '"') {
+        if (*p == '\0') return false;
+        if (*p == '\\') {
+            ++p;
+            if (*p == 'u') {
+                // AppendJsonString() only escapes single bytes this way
+                unsigned int code;
+                if (!ReadJsonHex4(p + 1, code) || code > 0xff) return false;
+                filename += (char)code;
+                p += 5;
+                continue;
+            }
+            if (*p == '\0') return false;
+        }
+        filename += *p++;
+    }
+    ++p;
+
+    // %n only counts once everything before it matched
+    int page, width, height, consumed = 0;
+    if (sscanf(p, ",\"page\":%d,\"width\":%d,\"height\":%d,\"columns\":[%n", &page, &width,
+               &height, &consumed) != 3 ||
+        consumed == 0)
+        return false;
+    p += consumed;
+
+    std::vector<ColumnRect> columns;
+    while (*p != ']') {
+        ColumnRect column;
+        consumed = 0;
+        if (sscanf(p, "{\"x0\":%d,\"x1\":%d,\"y0\":%d,\"y1\":%d,\"confidence\":%f}%n", &column.x0,
+                   &column.x1, &column.y0, &column.y1, &column.confidence, &consumed) != 5 ||
+            consumed == 0)
+            return false;
+        p += consumed;
+        columns.push_back(column);
+        if (*p == ',') ++p;
+    }
+    if (strcmp(p, "]}\n") != 0) return false;
+
+    result.filename = filename;
+    result.page = page;
+    result.width = width;
+    result.height = height;
+    result.columns.swap(columns);
+    return true;
+}
+
+static bool DecodeBinary(const std::vector<unsigned char>& record, PageResult& result)
+{
+    // The record was checked by ReadRecord(), only its contents are left
+    const unsigned char* p = &record[8];
+    const unsigned char* end = &record[0] + record.size() - 4;
+
+    if (end - p < 4) return false;
+    uint32_t nameLength = Get32(p);
+    p += 4;
+    if ((size_t)(end - p) < (size_t)nameLength + 16) return false;
+    std::string filename((const char*)p, nameLength);
+    p += nameLength;
+
+    int page = (int)Get32(p);
+    int width = (int)Get32(p + 4);
+    int height = (int)Get32(p + 8);
+    uint32_t count = Get32(p + 12);
+    p += 16;
+    if ((size_t)(end - p) != (size_t)count * 20) return false;
+
+    std::vector<ColumnRect> columns(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        columns[i].x0 = (int)Get32(p + 4 * i);
+        columns[i].x1 = (int)Get32(p + 4 * (count + i));
+        columns[i].y0 = (int)Get32(p + 4 * (2 * count + i));
+        columns[i].y1 = (int)Get32(p + 4 * (3 * count + i));
+        uint32_t bits = Get32(p + 4 * (4 * count + i));
+        memcpy(&columns[i].confidence, &bits, sizeof(bits));
+    }
+
+    result.filename = filename;
+    result.page = page;
+    result.width = width;
+    result.height = height;
+    result.columns.swap(columns);
+    return true;
+}
+
+//===========================================================================//
+// Reading records back
+
+// Reads the record at the current position whole. Returns false at the end
+// of the file and for incomplete or damaged records.
+static bool ReadRecord(FILE* file, ResultsFormat format, std::vector<unsigned char>& record)
+{
+    record.clear();
+    if (format == RESULTS_JSONL) {
+        // Complete once its newline is there
+        int c;
+        while ((c = getc(file)) != EOF) {
+            record.push_back((unsigned char)c);
+            if (c == '\n') return record[0] == '{';
+            if (record.size() > MAX_RECORD_BYTES) return false;
+        }
+        return false;
+    }
+
+    unsigned char head[8];
+    if (fread(head, 1, 8, file) != 8 || memcmp(head, RECORD_TAG, 4) != 0) return false;
+    uint32_t payloadSize = Get32(head + 4);
+    if (payloadSize > MAX_RECORD_BYTES) return false;
+
+    record.resize(8 + (size_t)payloadSize + 4);
+    memcpy(&record[0], head, 8);
+    if (fread(&record[8], 1, payloadSize + 4, file) != payloadSize + 4) return false;
+    uint32_t hash = (uint32_t)HashBytes(&record[8], payloadSize, 0);
+    return Get32(&record[8 + payloadSize]) == hash;
+}
+
+static uint64_t HeaderSize(ResultsFormat format)
+{
+    return format == RESULTS_BINARY ? RESULTS_HEADER_SIZE : 0;
+}
+
+// Whether a file of the given size holds no more than the start of a
+// header, as after a crash right after the file was created
+static bool PartialHeader(FILE* file, ResultsFormat format, size_t fileSize)
+{
+    if (fileSize >= HeaderSize(format)) return false;
+
+    unsigned char header[RESULTS_HEADER_SIZE];
+    std::vector<char> expected;
+    Append(expected, RESULTS_MAGIC);
+    Put32(expected, RESULTS_VERSION);
+    return fread(header, 1, fileSize, file) == fileSize && memcmp(header, &expected[0], fileSize) == 0;
+}
+
+static bool CheckHeader(FILE* file, ResultsFormat format)
+{
+    if (format != RESULTS_BINARY) return true;
+
+    unsigned char header[RESULTS_HEADER_SIZE];
+    return fread(header, 1, RESULTS_HEADER_SIZE, file) == RESULTS_HEADER_SIZE &&
+           memcmp(header, RESULTS_MAGIC, 4) == 0 && Get32(header + 4) == RESULTS_VERSION;
+}
+
+// Reads as many whole index entries as there are
+static void ReadIndex(const std::string& path, std::vector<uint64_t>& offsets)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) return;
+
+    unsigned char entry[8];
+    while (fread(entry, 1, 8, file) == 8) offsets.push_back(Get64(entry));
+    fclose(file);
+}
+
+// Completes the offsets read from an index of a file of fileSize bytes with
+// the records that follow the last one it names, and returns where the last
+// complete record ends. The index may be missing, short or, after a crash,
+// point past the records that made it to disk.
+static uint64_t FindRecords(FILE* file, ResultsFormat format, size_t fileSize,
+                            std::vector<uint64_t>& offsets)
+{
+    while (!offsets.empty() && offsets.back() >= fileSize) offsets.pop_back();
+
+    // The last indexed record is checked again along with the rest
+    uint64_t offset = HeaderSize(format);
+    if (!offsets.empty()) {
+        offset = offsets.back();
+        offsets.pop_back();
+    }
+
+    // Result files stay well below 2 GB unless rotation is turned off
+    if (fseek(file, (long)offset, SEEK_SET) != 0) return offset;
+    std::vector<unsigned char> record;
+    while (ReadRecord(file, format, record)) {
+        offsets.push_back(offset);
+        offset += record.size();
+    }
+    return offset;
+}
+
+//===========================================================================//
+// Writer
+
+ResultWriter::ResultWriter() :
+    format(RESULTS_JSONL),
+    rotateBytes(0),
+    part(0),
+    data(NULL),
+    index(NULL),
+    dataSize(0),
+    lostRecords(0)
+{
+}
+
+ResultWriter::~ResultWriter()
+{
+    std::string error;
+    Close(error);
+}
+
+bool ResultWriter::Open(const std::string& path, size_t rotateBytes, std::string& error)
+{
+    if (IsOpen() && !Close(error)) return false;
+
+    ScopedLock lock(mutex);
+    this->path = path;
+    this->rotateBytes = rotateBytes;
+    format = ResultsFormatOf(path);
+
+    // Carry on in the newest part
+    part = 0;
+    size_t size;
+    double modified;
+    while (GetFileInfo(ResultsPartPath(path, part + 1), size, modified)) ++part;
+    return OpenPart(error);
+}
+
+bool ResultWriter::OpenPart(std::string& error)
+{
+    std::string dataPath = ResultsPartPath(path, part);
+    std::string indexPath = dataPath + ".idx";
+
+    size_t fileSize = 0;
+    double modified;
+    bool exists = GetFileInfo(dataPath, fileSize, modified) && fileSize > 0;
+
+    std::vector<uint64_t> offsets;
+    uint64_t end = HeaderSize(format);
+    if (exists) {
+        FILE* file = fopen(dataPath.c_str(), "rb");
+        if (file == NULL) {
+            error = "cannot read " + dataPath;
+            return false;
+        }
+        // A header cut short is written again, like a file never started
+        bool partial = PartialHeader(file, format, fileSize);
+        bool valid = partial || (fseek(file, 0, SEEK_SET) == 0 && CheckHeader(file, format));
+        if (valid && !partial) {
+            ReadIndex(indexPath, offsets);
+            end = FindRecords(file, format, fileSize, offsets);
+        }
+        fclose(file);
+        if (!valid) {
+            error = dataPath + " is not a result file";
+            return false;
+        }
+        if (partial) {
+            exists = false;
+            end = 0;
+        }
+
+        // Whatever follows the last complete record was cut short
+        if (end < fileSize && !TruncateFile(dataPath, (size_t)end)) {
+            error = "cannot repair " + dataPath;
+            return false;
+        }
+    }
+
+    data = fopen(dataPath.c_str(), "ab");
+    if (data == NULL) {
+        error = "cannot write " + dataPath;
+        return false;
+    }
+    bool ok = true;
+    if (!exists && format == RESULTS_BINARY) {
+        end = HeaderSize(format);
+        std::vector<char> header;
+        Append(header, RESULTS_MAGIC);
+        Put32(header, RESULTS_VERSION);
+        ok = fwrite(&header[0], 1, header.size(), data) == header.size() && fflush(data) == 0;
+    }
+
+    // The index is written anew to match the records
+    std::vector<char> entries;
+    for (size_t i = 0; i < offsets.size(); ++i) Put64(entries, offsets[i]);
+    index = fopen(indexPath.c_str(), "wb");
+    if (ok && index == NULL) ok = false;
+    if (ok && !entries.empty())
+        ok = fwrite(&entries[0], 1, entries.size(), index) == entries.size() && fflush(index) == 0;
+    if (!ok) {
+        error = "cannot write " + (index == NULL ? indexPath : dataPath);
+        CloseFiles();
+        return false;
+    }
+
+    dataSize = (size_t)end;
+    return true;
+}
+
+bool ResultWriter::Write(const PageResult& result, std::string& error)
+{
+    ScopedLock lock(mutex);
+    if (data == NULL) {
+        error = "result file is not open";
+        ++lostRecords;
+        return false;
+    }
+
+    bufferRecords.push_back(buffer.size());
+    if (format == RESULTS_BINARY) EncodeBinary(result, buffer);
+    else EncodeJsonRecord(result, buffer);
+
+    if (buffer.size() < RESULTS_BUFFER_BYTES) return true;
+    return FlushLocked(error);
+}
+
+bool ResultWriter::Flush(std::string& error)
+{
+    ScopedLock lock(mutex);
+    return FlushLocked(error);
+}
+
+bool ResultWriter::FlushLocked(std::string& error)
+{
+    if (data == NULL || buffer.empty()) return true;
+
+    // Records go first so the index never names one that is not on disk. If
+    // writing them fails the file is closed; opening it again cuts off the
+    // part that did get written.
+    std::string dataPath = ResultsPartPath(path, part);
+    if (fwrite(&buffer[0], 1, buffer.size(), data) != buffer.size() || fflush(data) != 0) {
+        error = "cannot write " + dataPath;
+        lostRecords += (int)bufferRecords.size();
+        CloseFiles();
+        return false;
+    }
+
+    std::vector<char> entries;
+    for (size_t i = 0; i < bufferRecords.size(); ++i) Put64(entries, dataSize + bufferRecords[i]);
+    dataSize += buffer.size();
+    buffer.clear();
+    bufferRecords.clear();
+    if (fwrite(&entries[0], 1, entries.size(), index) != entries.size() || fflush(index) != 0) {
+        error = "cannot write " + dataPath + ".idx";
+        CloseFiles();
+        return false;
+    }
+
+    if (rotateBytes > 0 && dataSize >= rotateBytes) {
+        CloseFiles();
+        ++part;
+        return OpenPart(error);
+    }
+    return true;
+}
+
+bool ResultWriter::Close(std::string& error)
+{
+    ScopedLock lock(mutex);
+    bool ok = FlushLocked(error);
+    CloseFiles();
+    return ok;
+}
+
+int ResultWriter::LostRecords()
+{
+    ScopedLock lock(mutex);
+    return lostRecords;
+}
+
+void ResultWriter::CloseFiles()
+{
+    if (data != NULL) fclose(data);
+    if (index != NULL) fclose(index);
+    data = NULL;
+    index = NULL;
+    buffer.clear();
+    bufferRecords.clear();
+}
+
+//===========================================================================//
+// Reader
+
+ResultReader::ResultReader() :
+    file(NULL),
+    format(RESULTS_JSONL)
+{
+}
+
+ResultReader::~ResultReader()
+{
+    Close();
+}
+
+bool ResultReader::Open(const std::string& path, std::string& error)
+{
+    Close();
+    format = ResultsFormatOf(path);
+
+    size_t fileSize;
+    double modified;
+    if (!GetFileInfo(path, fileSize, modified) || (file = fopen(path.c_str(), "rb")) == NULL) {
+        error = "cannot open " + path;
+        return false;
+    }
+    if (PartialHeader(file, format, fileSize)) return true;
+    if (fseek(file, 0, SEEK_SET) != 0 || !CheckHeader(file, format)) {
+        error = path + " is not a result file";
+        Close();
+        return false;
+    }
+
+    ReadIndex(path + ".idx", offsets);
+    FindRecords(file, format, fileSize, offsets);
+    return true;
+}
+
+void ResultReader::Close()
+{
+    if (file != NULL) fclose(file);
+    file = NULL;
+    offsets.clear();
+}
+
+bool ResultReader::ReadPage(size_t page, PageResult& result, std::string& error)
+{
+    if (file == NULL || page >= offsets.size()) {
+        error = "no such page";
+        return false;
+    }
+
+    std::vector<unsigned char> record;
+    bool ok = fseek(file, (long)offsets[page], SEEK_SET) == 0 && ReadRecord(file, format, record);
+    if (ok) ok = format == RESULTS_BINARY ? DecodeBinary(record, result) : DecodeJson(record, result);
+    if (!ok) error = "damaged record";
+    return ok;
+}
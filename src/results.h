@@ -0,0 +1,136 @@
+// Results of a whole batch streamed into one file instead of an XML file
+// per page. Two formats are written: JSON Lines, one object per page, for
+// people and scripts, and a compact binary format that keeps each page's
+// columns as arrays of fixed-size values.
+//
+// Records are only ever appended, and a crash or a full disk can at worst
+// leave one incomplete record at the end. Opening the file again cuts that
+// record off, so the file is always valid up to its last complete record.
+// Next to every result file is an index, FILE.idx, holding the offset of
+// each record as a little-endian 64-bit integer, so any page can be read
+// without going through the ones before it. The index is written after the
+// records it points to and rebuilt from the records where it falls short.
+//
+// Once a file grows past the rotation size, the writer goes on in a new one
+// named after it with a part number before the extension, so results.jsonl
+// is followed by results.1.jsonl, results.2.jsonl and so on.
+#ifndef COLFIND_RESULTS_H
+#define COLFIND_RESULTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+#include "platform.h"
+
+// Result files with this extension use the binary format, all others JSON
+// Lines
+#define RESULTS_BINARY_EXTENSION ".cfb"
+
+// Default size after which the writer moves on to a new file
+#define DEFAULT_RESULTS_MEGABYTES 256
+
+// Records are collected in memory and written out together once this many
+// bytes are waiting
+#define RESULTS_BUFFER_BYTES 65536
+
+enum ResultsFormat {
+    RESULTS_JSONL,
+    RESULTS_BINARY
+};
+
+// Format of a result file, going by its name
+ResultsFormat ResultsFormatOf(const std::string& path);
+
+class ResultWriter {
+public:
+    ResultWriter();
+    ~ResultWriter();
+
+    // Appends to the result file at path, or to its last part if it was
+    // rotated before, creating it if needed. A rotation size of 0 never
+    // rotates. On failure returns false and describes why in error.
+    bool Open(const std::string& path, size_t rotateBytes, std::string& error);
+
+    // Adds the record of one page. Safe to call from several threads at once.
+    // Records are collected and written out together; when writing them
+    // fails, this returns false and every record collected is lost.
+    bool Write(const PageResult& result, std::string& error);
+
+    // Writes out the records collected so far
+    bool Flush(std::string& error);
+
+    // Flushes and closes the file
+    bool Close(std::string& error);
+
+    bool IsOpen() const { return data != NULL; }
+
+    // Records that were written but never reached the file, this one
+    // included when Write() fails
+    int LostRecords();
+
+private:
+    ResultWriter(const ResultWriter&);
+    ResultWriter& operator=(const ResultWriter&);
+
+    bool OpenPart(std::string& error);
+    bool FlushLocked(std::string& error);
+    void CloseFiles();
+
+    Mutex mutex;
+    std::string path;
+    ResultsFormat format;
+    size_t rotateBytes;
+    int part;                           // Number of the file being written
+    FILE* data;
+    FILE* index;
+    size_t dataSize;                    // Bytes in the file, the buffer excluded
+    std::vector<char> buffer;           // Complete records not written yet
+    std::vector<size_t> bufferRecords;  // Where each of them starts in buffer
+    int lostRecords;
+};
+
+// Random access to the pages of one result file. A binary file cut off
+// inside its header has no pages.
+class ResultReader {
+public:
+    ResultReader();
+    ~ResultReader();
+
+    // Reads the index of a result file, picking up records it is missing.
+    // On failure returns false and describes why in error.
+    bool Open(const std::string& path, std::string& error);
+    void Close();
+
+    size_t PageCount() const { return offsets.size(); }
+
+    // Reads the filename, size and columns of the given page
+    bool ReadPage(size_t page, PageResult& result, std::string& error);
+
+private:
+    ResultReader(const ResultReader&);
+    ResultReader& operator=(const ResultReader&);
+
+    FILE* file;
+    ResultsFormat format;
+    std::vector<uint64_t> offsets;
+};
+
+// Appends the JSON Lines record of a page, newline included:
+// {"file":...,"page":...,"width":...,"height":...,"columns":[{"x0":...},...]}
+void EncodeJsonRecord(const PageResult& result, std::vector<char>& out);
+
+// Appends text as a quoted JSON string
+void AppendJsonString(std::vector<char>& out, const std::string& text);
+
+// Reads the four hex digits of a \u escape starting at digits. Returns false
+// unless all four are there, without looking past the first that is not.
+bool ReadJsonHex4(const char* digits, unsigned int& code);
+
+// Name of the given part of a result file, the file itself for part 0
+std::string ResultsPartPath(const std::string& path, int part);
+
+#endif
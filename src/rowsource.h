@@ -0,0 +1,55 @@
+// Interface between image decoders and the pipeline
+#ifndef COLFIND_ROWSOURCE_H
+#define COLFIND_ROWSOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class ThreadPool;
+
+// Most pixels a page may have. Decoders refuse larger pages, so a plane of
+// four bytes per pixel still fits a 32-bit size_t, as in the 32-bit viewer.
+#define MAX_PAGE_PIXELS 0x10000000
+
+// Something that hands out the rows of an image as luminance, one at a time
+// and top to bottom, so a page can be processed without ever holding all of
+// it in memory
+class RowSource {
+public:
+    virtual ~RowSource() {}
+
+    virtual int Width() const = 0;
+    virtual int Height() const = 0;
+
+    // Decodes the next row to width bytes of luminance. Returns false once
+    // all rows have been read, or if decoding failed and Error() says why.
+    virtual bool ReadGrayRow(unsigned char* gray) = 0;
+
+    // Decodes the next count rows into count*width bytes. Decoders that can
+    // split the work across a thread pool override this; the pool may be
+    // NULL.
+    virtual bool ReadGrayRows(unsigned char* gray, int count, ThreadPool* /* pool */) {
+        for (int i = 0; i < count; ++i) {
+            if (!ReadGrayRow(gray + (size_t)i * Width())) return false;
+        }
+        return true;
+    }
+
+    // Whether ReadInkRow() works, which bilevel pages can do without ever
+    // producing luminance
+    virtual bool HasInkRows() const { return false; }
+
+    // Decodes the next row as ink bits, bit x % 64 of ink[x / 64] set where
+    // pixel x is black and the bits past the width clear (see bitplane.h).
+    // Returns false like ReadGrayRow().
+    virtual bool ReadInkRow(uint64_t* /* ink */) { return false; }
+
+    // Allocates up front whatever ReadGrayRows() needs with this pool, so
+    // that it can then run on a thread that must not allocate
+    virtual void ReserveStripScratch(ThreadPool* /* pool */) {}
+
+    virtual const std::string& Error() const = 0;
+};
+
+#endif
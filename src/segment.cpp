@@ -0,0 +1,242 @@
+#include "segment.h"
+
+#include <algorithm>
+
+#include "bitplane.h"
+#include "kernels.h"
+
+ColumnProfile::ColumnProfile() :
+    width(0),
+    threshold(0),
+    rows(0)
+{
+}
+
+void ColumnProfile::Reset(int width, int threshold)
+{
+    this->width = width;
+    this->threshold = threshold;
+    rows = 0;
+    darkness.Assign(width, 0);
+    firstRow.Assign(width, -1);
+    lastRow.Assign(width, -1);
+    ink.Resize(width);
+}
+
+void ColumnProfile::AddRow(const unsigned char* grayRow, const unsigned char* smearRow, int y)
+{
+    if (width > 0) {
+        AddDarknessRow(smearRow);
+        AddInkRow(grayRow, y);
+    }
+    ++rows;
+}
+
+void ColumnProfile::AddDarknessRow(const unsigned char* smearRow)
+{
+    if (width == 0) return;
+
+    // The brightest pixel of a row stands in for the paper, which keeps the
+    // profile independent of the scan's exposure and of the smear's drift
+    int paper = RowMax(smearRow, width);
+    for (int x = 0; x < width; ++x) darkness[x] += paper - smearRow[x];
+}
+
+void ColumnProfile::AddInkRow(const unsigned char* grayRow, int y)
+{
+    if (width == 0) return;
+
+    // Ink needs a horizontal neighbour, so lone specks of dust do not count
+    MarkInk(grayRow, width, RowMax(grayRow, width) - threshold, ink.Data());
+    for (int x = 0; x < width; ++x) {
+        if (!ink[x] || !((x > 0 && ink[x - 1]) || (x + 1 < width && ink[x + 1]))) continue;
+        if (firstRow[x] < 0 || y < firstRow[x]) firstRow[x] = y;
+        if (y > lastRow[x]) lastRow[x] = y;
+    }
+}
+
+void ColumnProfile::AddDarknessSums(const uint32_t* columnSums, uint64_t paperSum, int rows)
+{
+    // Wraps around exactly where the row by row sums would
+    for (int x = 0; x < width; ++x) darkness[x] += (uint32_t)paperSum - columnSums[x];
+    this->rows += rows;
+}
+
+void ColumnProfile::ClearDarkness()
+{
+    std::fill(darkness.Data(), darkness.Data() + darkness.Size(), 0u);
+}
+
+void ColumnProfile::ClearInk(int threshold)
+{
+    this->threshold = threshold;
+    std::fill(firstRow.Data(), firstRow.Data() + firstRow.Size(), -1);
+    std::fill(lastRow.Data(), lastRow.Data() + lastRow.Size(), -1);
+}
+
+void ColumnProfile::AddInkRows(const uint64_t* inkRows, const uint64_t* smearRows, size_t stride,
+                               int firstWord, int endWord, int y, int count)
+{
+    int words = WordsForWidth(width);
+    uint64_t block[BITS_PER_WORD];
+
+    for (int w = firstWord; w < endWord; ++w) {
+        int x0 = w * BITS_PER_WORD;
+        int columns = std::min(BITS_PER_WORD, width - x0);
+
+        // Turned on their side, the rows of a word give one word per pixel
+        // column, whose set bits are its ink pixels from row y down
+        uint64_t any = 0;
+        for (int r = 0; r < count; ++r) any |= block[r] = smearRows[r * stride + w];
+        if (any != 0) {
+            for (int r = count; r < BITS_PER_WORD; ++r) block[r] = 0;
+            TransposeBits64(block);
+            for (int c = 0; c < columns; ++c) darkness[x0 + c] += PopCount64(block[c]);
+        }
+
+        // Ink needs a horizontal neighbour, so lone specks of dust do not
+        // count; the neighbours of the end bits are in the adjacent words
+        any = 0;
+        for (int r = 0; r < count; ++r) {
+            const uint64_t* row = inkRows + r * stride;
+            uint64_t left = (row[w] << 1) | (w > 0 ? row[w - 1] >> 63 : 0);
+            uint64_t right = (row[w] >> 1) | (w + 1 < words ? row[w + 1] << 63 : 0);
+            any |= block[r] = row[w] & (left | right);
+        }
+        if (any == 0) continue;
+        for (int r = count; r < BITS_PER_WORD; ++r) block[r] = 0;
+        TransposeBits64(block);
+        for (int c = 0; c < columns; ++c) {
+            if (block[c] == 0) continue;
+            int x = x0 + c;
+            int first = y + LowestBit64(block[c]);
+            int last = y + HighestBit64(block[c]);
+            if (firstRow[x] < 0 || first < firstRow[x]) firstRow[x] = first;
+            if (last > lastRow[x]) lastRow[x] = last;
+        }
+    }
+    if (firstWord == 0) rows += count;
+}
+
+void ColumnProfile::Merge(const ColumnProfile& other)
+{
+    for (int x = 0; x < width; ++x) {
+        darkness[x] += other.darkness[x];
+        if (other.firstRow[x] >= 0 && (firstRow[x] < 0 || other.firstRow[x] < firstRow[x]))
+            firstRow[x] = other.firstRow[x];
+        lastRow[x] = std::max(lastRow[x], other.lastRow[x]);
+    }
+    rows += other.rows;
+}
+
+// Value below which the given fraction of values lies. Reorders values.
+template <class T>
+static T Percentile(std::vector<T>& values, int percent)
+{
+    size_t index = (values.size() - 1) * percent / 100;
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+// Mean profile value over [x0, x1], or 0 for an empty range
+static double MeanCount(const uint32_t* counts, int x0, int x1)
+{
+    if (x1 < x0) return 0;
+    double sum = 0;
+    for (int x = x0; x <= x1; ++x) sum += counts[x];
+    return sum / (x1 - x0 + 1);
+}
+
+void ColumnProfile::FindColumns(std::vector<ColumnRect>& columns) const
+{
+    columns.clear();
+    if (rows == 0) return;
+    FindProfileColumns(darkness.Data(), firstRow.Data(), lastRow.Data(), width, columns);
+}
+
+void FindProfileColumns(const uint32_t* darkness, const int* firstRow, const int* lastRow,
+                        int width, std::vector<ColumnRect>& columns)
+{
+    columns.clear();
+    if (width == 0) return;
+
+    int minGutter = MinGutterWidth(width);
+    int minColumn = std::max(4, width / MIN_COLUMN_DIVISOR);
+    int radius = ProfileSmoothRadius(width);
+
+    // Box filter the profile with a running sum, so narrow gaps between
+    // letters do not read as gutters
+    std::vector<uint32_t> smooth(width);
+    uint64_t sum = 0;
+    for (int x = 0; x < radius && x < width; ++x) sum += darkness[x];
+    for (int x = 0; x < width; ++x) {
+        if (x + radius < width) sum += darkness[x + radius];
+        if (x - radius - 1 >= 0) sum -= darkness[x - radius - 1];
+        int span = std::min(width - 1, x + radius) - std::max(0, x - radius) + 1;
+        smooth[x] = (uint32_t)(sum / span);
+    }
+
+    // Level typical for text, robust against a few rules or dense lines
+    std::vector<uint32_t> sorted(smooth);
+    uint32_t textLevel = Percentile(sorted, 90);
+    if (textLevel == 0) return;
+    uint32_t gutterLevel = (uint32_t)((uint64_t)textLevel * GUTTER_LEVEL_PERCENT / 100);
+
+    // Runs of text, merging those separated by less than a gutter
+    std::vector<int> runStart, runEnd;
+    for (int x = 0; x < width; ++x) {
+        if (smooth[x] <= gutterLevel) continue;
+        int start = x;
+        while (x + 1 < width && smooth[x + 1] > gutterLevel) ++x;
+        if (!runEnd.empty() && start - runEnd.back() - 1 < minGutter) runEnd.back() = x;
+        else {
+            runStart.push_back(start);
+            runEnd.push_back(x);
+        }
+    }
+
+    std::vector<int> rowValues;
+    for (size_t i = 0; i < runStart.size(); ++i) {
+        if (runEnd[i] - runStart[i] + 1 < minColumn) continue;
+
+        // Smoothing blurs the bounds by up to the filter radius, so tighten
+        // them to the outermost pixel columns that are dense on their own
+        ColumnRect column;
+        int searchStart = std::max(0, runStart[i] - radius);
+        int searchEnd = std::min(width - 1, runEnd[i] + radius);
+        column.x0 = searchStart;
+        while (column.x0 < searchEnd && darkness[column.x0] <= gutterLevel) ++column.x0;
+        column.x1 = searchEnd;
+        while (column.x1 > column.x0 && darkness[column.x1] <= gutterLevel) --column.x1;
+
+        // Vertical extent from the rows most pixel columns agree on, so a
+        // stray mark above or below the text does not stretch the column
+        rowValues.clear();
+        for (int x = column.x0; x <= column.x1; ++x) {
+            if (firstRow[x] >= 0) rowValues.push_back(firstRow[x]);
+        }
+        if (rowValues.empty()) continue;
+        column.y0 = Percentile(rowValues, 25);
+        rowValues.clear();
+        for (int x = column.x0; x <= column.x1; ++x) {
+            if (lastRow[x] >= 0) rowValues.push_back(lastRow[x]);
+        }
+        column.y1 = std::max(column.y0, Percentile(rowValues, 75));
+
+        // Confidence combines the contrast against the busier of the two
+        // neighbouring gutters with how much of the column is solid text
+        int gutterLeft = i > 0 ? runEnd[i - 1] + 1 : 0;
+        int gutterRight = i + 1 < runStart.size() ? runStart[i + 1] - 1 : width - 1;
+        double inside = MeanCount(darkness, column.x0, column.x1);
+        double gutter = std::max(MeanCount(darkness, gutterLeft, column.x0 - 1),
+                                 MeanCount(darkness, column.x1 + 1, gutterRight));
+        int solid = 0;
+        for (int x = column.x0; x <= column.x1; ++x) {
+            if (smooth[x] > gutterLevel) ++solid;
+        }
+        double contrast = inside > 0 ? 1.0 - std::min(1.0, gutter / inside) : 0;
+        column.confidence = (float)(contrast * solid / (column.x1 - column.x0 + 1));
+
+        columns.push_back(column);
+    }
+}
@@ -0,0 +1,132 @@
+// Column segmentation from a vertical projection profile. Rows are streamed
+// through a ColumnProfile, which sums how much darker than the paper every
+// pixel column of the smeared plane is; text columns show up as plateaus of
+// that profile and the gutters between them as valleys.
+#ifndef COLFIND_SEGMENT_H
+#define COLFIND_SEGMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "bufferpool.h"
+
+// Gutters are where the smoothed profile drops to this percentage of the
+// level typical for text (its 90th percentile)
+#define GUTTER_LEVEL_PERCENT 25
+
+// Gaps narrower than this part of the page width are treated as spacing
+// inside a column rather than as gutters
+#define MIN_GUTTER_DIVISOR 100
+
+// Columns narrower than this part of the page width are dropped as noise
+#define MIN_COLUMN_DIVISOR 50
+
+// Narrowest gap that counts as a gutter on a page of the given width
+inline int MinGutterWidth(int width) {
+    return width / MIN_GUTTER_DIVISOR > 2 ? width / MIN_GUTTER_DIVISOR : 2;
+}
+
+// Radius of the box filter the profile is smoothed with before looking for
+// gutters, half the narrowest gutter
+inline int ProfileSmoothRadius(int width) {
+    return MinGutterWidth(width) / 2 > 1 ? MinGutterWidth(width) / 2 : 1;
+}
+
+// A detected column, bounds inclusive, in pixels of the source image
+struct ColumnRect {
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+    float confidence;   // 0 to 1, how clearly the column stands out from its gutters
+
+    ColumnRect() :
+        x0(0),
+        x1(0),
+        y0(0),
+        y1(0),
+        confidence(0) {}
+};
+
+// Accumulates the ink projection profile one row at a time, in a single
+// pass and with memory proportional to the width only. The smear is what
+// joins the text of a column into a solid band, but it also carries ink far
+// below where the text ends, so the vertical extent of each column comes
+// from the unsmeared rows instead.
+class ColumnProfile {
+public:
+    ColumnProfile();
+
+    // Prepares for a new image. An unsmeared pixel is ink where it is darker
+    // than the brightest pixel of its row by more than threshold.
+    void Reset(int width, int threshold);
+
+    // Adds row y of the page, both before and after smearing. Rows can
+    // arrive in any order, and be spread over several profiles that are
+    // merged afterwards.
+    void AddRow(const unsigned char* grayRow, const unsigned char* smearRow, int y);
+
+    // The two halves of AddRow(), for redoing one of them while keeping the
+    // other: the darkness of a smeared row, or the ink of an unsmeared one.
+    // Neither counts the row. Clear the half being redone first.
+    void AddDarknessRow(const unsigned char* smearRow);
+    void AddInkRow(const unsigned char* grayRow, int y);
+    void ClearDarkness();
+    void ClearInk(int threshold);
+
+    // Adds the darkness of that many smeared rows from the sum of every
+    // pixel column and the sum of the rows' brightest pixels, and counts them.
+    // Summing the paper level minus each pixel row by row comes to the same,
+    // but needs the smeared rows themselves.
+    void AddDarknessSums(const uint32_t* columnSums, uint64_t paperSum, int rows);
+
+    // Adds up to 64 rows from row y on, as ink bits (see bitplane.h) before
+    // and after smearing, rows stride words apart. Smeared ink counts one
+    // per pixel instead of its darkness. Only the pixel columns of words
+    // [firstWord, endWord) are touched, so threads can add separate ranges
+    // to one profile at once; the rows are counted by the range that starts
+    // at word 0.
+    void AddInkRows(const uint64_t* inkRows, const uint64_t* smearRows, size_t stride,
+                    int firstWord, int endWord, int y, int count);
+
+    // Adds in everything another profile of the same width has seen
+    void Merge(const ColumnProfile& other);
+
+    // Splits the profile into columns, ordered left to right. Runs in time
+    // linear in the width.
+    void FindColumns(std::vector<ColumnRect>& columns) const;
+
+    int Width() const { return width; }
+    int Rows() const { return rows; }
+
+    // Sum of the darkness of a pixel column, or of its smeared ink pixels
+    // when binarizing
+    uint32_t Darkness(int x) const { return darkness[x]; }
+
+    // First and last row with ink in a pixel column, or -1
+    int FirstRow(int x) const { return firstRow[x]; }
+    int LastRow(int x) const { return lastRow[x]; }
+
+    // Bytes of working memory held for the current image
+    size_t MemoryBytes() const {
+        return darkness.Size() * sizeof(uint32_t) + (firstRow.Size() + lastRow.Size()) * sizeof(int)
+               + ink.Size();
+    }
+
+private:
+    int width;
+    int threshold;
+    int rows;                               // Rows added so far
+    PooledArray<uint32_t> darkness;         // Per column sum of paper level minus smear
+    PooledArray<int> firstRow;              // Per column first row with ink, or -1
+    PooledArray<int> lastRow;               // Per column last row with ink, or -1
+    PooledArray<unsigned char> ink;         // Ink marks of the current row
+};
+
+// What ColumnProfile::FindColumns() does with its sums, for a profile held
+// in plain arrays of width values each
+void FindProfileColumns(const uint32_t* darkness, const int* firstRow, const int* lastRow,
+                        int width, std::vector<ColumnRect>& columns);
+
+#endif
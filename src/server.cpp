@@ -0,0 +1,738 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "jobqueue.h"
+#include "metrics.h"
+#include "platform.h"
+#include "results.h"
+
+// A plane of luminance in memory, handed out row by row
+class PlaneSource : public RowSource {
+public:
+    PlaneSource(const unsigned char* data, int width, int height, size_t stride) :
+        data(data),
+        width(width),
+        height(height),
+        stride(stride),
+        row(0) {}
+
+    virtual int Width() const { return width; }
+    virtual int Height() const { return height; }
+
+    virtual bool ReadGrayRow(unsigned char* gray) {
+        if (row >= height) return false;
+        memcpy(gray, data + (size_t)row++ * stride, width);
+        return true;
+    }
+
+    virtual const std::string& Error() const { return error; }
+
+private:
+    const unsigned char* data;
+    int width;
+    int height;
+    size_t stride;
+    int row;
+    std::string error;      // Never set, rows cannot fail
+};
+
+static void SkipSpace(const char*& p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ++p;
+}
+
+// Appends a code point as UTF-8
+static void AppendUtf8(std::string& text, unsigned int code)
+{
+    if (code < 0x80) {
+        text += (char)code;
+    }
+    else if (code < 0x800) {
+        text += (char)(0xc0 | (code >> 6));
+        text += (char)(0x80 | (code & 0x3f));
+    }
+    else if (code < 0x10000) {
+        text += (char)(0xe0 | (code >> 12));
+        text += (char)(0x80 | ((code >> 6) & 0x3f));
+        text += (char)(0x80 | (code & 0x3f));
+    }
+    else {
+        text += (char)(0xf0 | (code >> 18));
+        text += (char)(0x80 | ((code >> 12) & 0x3f));
+        text += (char)(0x80 | ((code >> 6) & 0x3f));
+        text += (char)(0x80 | (code & 0x3f));
+    }
+}
+
+// Reads the code point of a \u escape at its 'u', leaving p on its last
+// digit. A UTF-16 surrogate pair takes two escapes, a lone half is refused.
+static bool ParseEscapedCode(const char*& p, unsigned int& code)
+{
+    if (!ReadJsonHex4(p + 1, code)) return false;
+    p += 4;
+    if (code >= 0xdc00 && code <= 0xdfff) return false;
+    if (code < 0xd800 || code > 0xdbff) return true;
+
+    unsigned int low;
+    if (p[1] != '\\' || p[2] != 'u' || !ReadJsonHex4(p + 3, low) || low < 0xdc00 || low > 0xdfff)
+        return false;
+    p += 6;
+    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+    return true;
+}
+
+// Reads a JSON string starting at its opening quote
+static bool ParseString(const char*& p, std::string& text)
+{
+    if (*p++ != '"') return false;
+    text.clear();
+    while (*p != '"') {
+        if (*p == '\0') return false;
+        if (*p != '\\') {
+            text += *p++;
+            continue;
+        }
+        ++p;
+        switch (*p) {
+        case '"': case '\\': case '/': text += *p; break;
+        case 'b': text += '\b'; break;
+        case 'f': text += '\f'; break;
+        case 'n': text += '\n'; break;
+        case 'r': text += '\r'; break;
+        case 't': text += '\t'; break;
+        case 'u': {
+            unsigned int code;
+            if (!ParseEscapedCode(p, code)) return false;
+            AppendUtf8(text, code);
+            break;
+        }
+        default: return false;
+        }
+        ++p;
+    }
+    ++p;
+    return true;
+}
+
+// Reads a JSON number, true, false or null as its text
+static bool ParseScalar(const char*& p, std::string& text)
+{
+    const char* start = p;
+    const char* literals[] = { "true", "false", "null" };
+    for (int i = 0; i < 3; ++i) {
+        size_t length = strlen(literals[i]);
+        if (strncmp(p, literals[i], length) == 0) {
+            p += length;
+            text.assign(start, length);
+            return true;
+        }
+    }
+
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    if (*p == '-') ++p;
+    if (*p == '0') ++p;
+    else if (*p >= '1' && *p <= '9') {
+        while (*p >= '0' && *p <= '9') ++p;
+    }
+    else return false;
+    if (*p == '.') {
+        ++p;
+        if (*p < '0' || *p > '9') return false;
+        while (*p >= '0' && *p <= '9') ++p;
+    }
+    if (*p == 'e' || *p == 'E') {
+        ++p;
+        if (*p == '+' || *p == '-') ++p;
+        if (*p < '0' || *p > '9') return false;
+        while (*p >= '0' && *p <= '9') ++p;
+    }
+    text.assign(start, p - start);
+    return true;
+}
+
+bool ParseRequest(const std::string& line, Request& request, std::string& error)
+{
+    request.clear();
+    const char* p = line.c_str();
+    SkipSpace(p);
+    if (*p++ != '{') {
+        error = "request is not a JSON object";
+        return false;
+    }
+    SkipSpace(p);
+    if (*p == '}') ++p;
+    else for (;;) {
+        std::string name;
+        SkipSpace(p);
+        if (!ParseString(p, name)) {
+            error = "malformed field name";
+            return false;
+        }
+        SkipSpace(p);
+        if (*p++ != ':') {
+            error = "missing ':' after \"" + name + "\"";
+            return false;
+        }
+        SkipSpace(p);
+
+        RequestField field;
+        field.isString = *p == '"';
+        if (field.isString) {
+            if (!ParseString(p, field.text)) {
+                error = "malformed string in \"" + name + "\"";
+                return false;
+            }
+        }
+        else if (!ParseScalar(p, field.text)) {
+            error = "\"" + name + "\" must be a string, number, boolean or null";
+            return false;
+        }
+        request[name] = field;
+
+        SkipSpace(p);
+        if (*p == ',') {
+            ++p;
+            continue;
+        }
+        if (*p++ != '}') {
+            error = "missing ',' or '}' after \"" + name + "\"";
+            return false;
+        }
+        break;
+    }
+    SkipSpace(p);
+    if (*p != '\0') {
+        error = "text after the request object";
+        return false;
+    }
+    return true;
+}
+
+// Reads an integer field into value, which keeps its default if the field
+// is missing
+static bool GetIntField(const Request& request, const char* name, int& value, std::string& error)
+{
+    Request::const_iterator it = request.find(name);
+    if (it == request.end()) return true;
+
+    char* end;
+    long number = strtol(it->second.text.c_str(), &end, 10);
+    if (it->second.isString || it->second.text.empty() || *end != '\0' ||
+        number < -0x7fffffffL || number > 0x7fffffffL) {
+        error = std::string("\"") + name + "\" must be an integer";
+        return false;
+    }
+    value = (int)number;
+    return true;
+}
+
+static bool GetBoolField(const Request& request, const char* name, bool& value, std::string& error)
+{
+    Request::const_iterator it = request.find(name);
+    if (it == request.end()) return true;
+
+    if (!it->second.isString && it->second.text == "true") value = true;
+    else if (!it->second.isString && it->second.text == "false") value = false;
+    else {
+        error = std::string("\"") + name + "\" must be true or false";
+        return false;
+    }
+    return true;
+}
+
+static std::string GetStringField(const Request& request, const char* name)
+{
+    Request::const_iterator it = request.find(name);
+    return it != request.end() && it->second.isString ? it->second.text : std::string();
+}
+
+struct Client;
+
+// State shared by all clients and jobs
+struct Server {
+    const ServerOptions* options;
+    ResultCache* cache;         // NULL without a cache
+    JobQueue* queue;
+    Semaphore* slots;           // Free places for requests in flight
+    int clientDepth;            // Responses one client can have pending
+    Mutex mutex;                // Guards the rest, and keeps reports whole
+    int failures;
+    bool stopping;
+    std::vector<Client*> clients;
+};
+
+// A connection, or the standard streams. A thread of its own reads the
+// requests and another writes the responses, so the workers never wait on
+// a client that does not read them.
+struct Client {
+    Server* server;
+    int inFd;
+    int outFd;
+    Semaphore responseSlots;    // Free places for responses not yet written
+    Mutex outboxMutex;          // Guards outbox and closing
+    Semaphore outboxSignal;     // Posted once per response put in the outbox
+    std::deque<std::vector<char> > outbox;
+    bool closing;               // Set once every response is written
+    Thread thread;
+    Thread writer;
+    bool finished;              // Guarded by the server's mutex
+
+    Client(Server* server, int inFd, int outFd) :
+        server(server),
+        inFd(inFd),
+        outFd(outFd),
+        responseSlots(server->clientDepth),
+        closing(false),
+        finished(false) {}
+
+private:
+    Client(const Client&);
+    Client& operator=(const Client&);
+};
+
+// A request waiting for or running on a worker
+struct ServerJob {
+    Client* client;
+    std::string id;             // As JSON, ready to go into the response
+    std::string path;
+    int page;
+    std::string shm;
+    int width;
+    int height;
+    int stride;
+    PipelineParams params;
+};
+
+// Hands a response line to the client's writer. Every response takes one
+// of the client's pending places first, which the writer gives back once
+// the response is written. The client can be gone from then on, so this is
+// the last a worker does with it.
+static void Respond(Client* client, const std::vector<char>& response)
+{
+    {
+        ScopedLock lock(client->outboxMutex);
+        client->outbox.push_back(response);
+    }
+    client->outboxSignal.Post();
+}
+
+// Body of a client's writer thread. Responses of a client that has gone
+// are dropped.
+static void WriteResponses(void* arg)
+{
+    Client* client = (Client*)arg;
+    bool broken = false;
+    for (;;) {
+        client->outboxSignal.Wait();
+        std::vector<char> response;
+        {
+            ScopedLock lock(client->outboxMutex);
+            if (client->outbox.empty()) {
+                if (client->closing) break;
+                continue;
+            }
+            response.swap(client->outbox.front());
+            client->outbox.pop_front();
+        }
+        if (!broken) broken = !WriteDescriptor(client->outFd, &response[0], response.size());
+        client->responseSlots.Post();
+    }
+}
+
+// Builds the response to a request that failed, reporting and counting it
+static void ErrorResponse(Server* server, const std::string& id, const std::string& error,
+                          std::vector<char>& response)
+{
+    std::string head = "{\"id\":" + id + ",\"error\":";
+    response.insert(response.end(), head.begin(), head.end());
+    AppendJsonString(response, error);
+    response.push_back('}');
+    response.push_back('\n');
+
+    ScopedLock lock(server->mutex);
+    fprintf(stderr, "request %s: %s\n", id.c_str(), error.c_str());
+    ++server->failures;
+}
+
+// Answers a request that failed. Like Respond(), this must be the last the
+// caller does with the client, which may go as soon as the response is out.
+static void RespondError(Client* client, const std::string& id, const std::string& error)
+{
+    std::vector<char> response;
+    ErrorResponse(client->server, id, error, response);
+    Respond(client, response);
+}
+
+// Detects the columns of a file's page, going by the cache first
+static bool ProcessPathJob(Server* server, const ServerJob& job, PageResult& result,
+                           std::string& error, bool& cached)
+{
+    std::string key;
+    cached = false;
+    if (server->cache != NULL) {
+        MappedFile file;
+        if (file.Open(job.path.c_str())) {
+            key = ResultCache::Key(file.Data(), file.Size(), job.page, job.params);
+            cached = server->cache->Lookup(key, result);
+            result.filename = job.path;
+            result.page = job.page;
+        }
+    }
+    if (cached) return true;
+
+    if (!ProcessFile(job.path.c_str(), job.page, job.params, result, error)) return false;
+    if (MetricsEnabled()) RecordPageMetrics(result.metrics);
+    if (!key.empty()) server->cache->Store(key, result);
+    return true;
+}
+
+// Detects the columns of a plane in shared memory
+static bool ProcessSharedJob(const ServerJob& job, PageResult& result, std::string& error)
+{
+    MappedFile plane;
+    if (!plane.OpenShared(job.shm.c_str())) {
+        error = "cannot open shared memory " + job.shm;
+        return false;
+    }
+    if (job.height > 0 && plane.Size() < (size_t)job.stride * (job.height - 1) + job.width) {
+        error = "shared memory " + job.shm + " is smaller than the plane";
+        return false;
+    }
+
+    result.filename = job.shm;
+    result.page = 0;
+    result.width = job.width;
+    result.height = job.height;
+    PageMetrics* metrics = MetricsEnabled() ? &result.metrics : NULL;
+    double start = metrics != NULL ? GetTimeSeconds() : 0;
+    PlaneSource source(plane.Data(), job.width, job.height, job.stride);
+    if (!ProcessStream(source, job.params, result.columns, error, NULL, metrics)) return false;
+    if (metrics != NULL) {
+        metrics->Add(STAGE_PAGE, GetTimeSeconds() - start, (uint64_t)job.width * job.height);
+        RecordPageMetrics(*metrics);
+    }
+    return true;
+}
+
+// Runs a request on a worker thread and answers it. The server outlives
+// its workers, the client only lasts until its last response is written.
+static void RunJob(void* context)
+{
+    ServerJob* job = (ServerJob*)context;
+    Client* client = job->client;
+    Server* server = client->server;
+
+    PageResult result;
+    std::string error;
+    bool cached = false;
+    bool ok = job->shm.empty() ? ProcessPathJob(server, *job, result, error, cached) :
+                                 ProcessSharedJob(*job, result, error);
+
+    std::vector<char> response;
+    if (ok) {
+        // The record of the page with the id put in front
+        std::string head = "{\"id\":" + job->id + ",";
+        response.insert(response.end(), head.begin(), head.end());
+        EncodeJsonRecord(result, response);
+        response.erase(response.begin() + head.size());
+
+        ScopedLock lock(server->mutex);
+        if (!server->options->quiet) {
+            fprintf(stderr, "%s: %dx%d, %d columns%s\n", result.filename.c_str(), result.width,
+                    result.height, (int)result.columns.size(), cached ? " (cached)" : "");
+        }
+    }
+    else {
+        ErrorResponse(server, job->id, error, response);
+    }
+
+    {
+        // Requested dumps are written between requests, one at a time
+        ScopedLock lock(server->mutex);
+        const std::string& metricsFile = server->options->metricsFile;
+        if (!metricsFile.empty() && TakeMetricsDumpRequest() && !SaveMetrics(metricsFile.c_str(), error))
+            fprintf(stderr, "colfindc: %s\n", error.c_str());
+    }
+
+    delete job;
+    Respond(client, response);
+    server->slots->Post();
+}
+
+// Turns a request line into a job and queues it, waiting for a place for
+// its response and then for a free place in the queue
+static void HandleRequest(Client* client, const std::string& line)
+{
+    client->responseSlots.Wait();
+    Server* server = client->server;
+    Request request;
+    std::string error;
+    if (!ParseRequest(line, request, error)) {
+        RespondError(client, "null", error);
+        return;
+    }
+
+    ServerJob* job = new ServerJob;
+    job->client = client;
+    job->id = "null";
+    Request::const_iterator id = request.find("id");
+    if (id != request.end()) {
+        std::vector<char> text;
+        if (id->second.isString) AppendJsonString(text, id->second.text);
+        else text.assign(id->second.text.begin(), id->second.text.end());
+        job->id.assign(text.begin(), text.end());
+    }
+
+    job->path = GetStringField(request, "path");
+    job->shm = GetStringField(request, "shm");
+    job->page = 0;
+    job->width = 0;
+    job->height = 0;
+    job->stride = 0;
+    job->params = server->options->params;
+    std::string binarize = GetStringField(request, "binarize");
+
+    bool ok = GetIntField(request, "page", job->page, error) &&
+              GetIntField(request, "width", job->width, error) &&
+              GetIntField(request, "height", job->height, error) &&
+              GetIntField(request, "stride", job->stride, error) &&
+              GetIntField(request, "threshold", job->params.threshold, error) &&
+              GetIntField(request, "max_vert", job->params.maxVert, error) &&
+              GetBoolField(request, "coarse", job->params.coarse, error) &&
+              GetBoolField(request, "deskew", job->params.deskew, error);
+    if (ok && job->path.empty() == job->shm.empty()) {
+        error = "a request needs either \"path\" or \"shm\"";
+        ok = false;
+    }
+    if (ok && !job->shm.empty() && (job->width <= 0 || job->height <= 0)) {
+        error = "\"shm\" needs a positive \"width\" and \"height\"";
+        ok = false;
+    }
+    if (ok && job->stride == 0) job->stride = job->width;
+    if (ok && (job->page < 0 || job->stride < job->width || job->params.maxVert < 0 ||
+               job->params.maxVert > MAX_VERT_LIMIT)) {
+        error = "\"page\", \"stride\" or \"max_vert\" out of range";
+        ok = false;
+    }
+    if (ok && !binarize.empty()) {
+        ok = false;
+        for (int m = BINARIZE_NONE; m <= BINARIZE_ADAPTIVE; ++m) {
+            if (binarize == BinarizeModeName((BinarizeMode)m)) {
+                job->params.binarize = (BinarizeMode)m;
+                ok = true;
+            }
+        }
+        if (!ok) error = "unknown \"binarize\" mode " + binarize;
+    }
+    if (ok && job->params.coarse && job->params.binarize != BINARIZE_NONE) {
+        error = "\"coarse\" cannot be combined with \"binarize\"";
+        ok = false;
+    }
+    if (!ok) {
+        RespondError(client, job->id, error);
+        delete job;
+        return;
+    }
+
+    server->slots->Wait();
+    server->queue->Submit(RunJob, job);
+}
+
+// Reads and queues a client's requests until its input ends, then waits
+// for all of them to be answered
+static void ReadRequests(Client* client)
+{
+    // Without a writer nothing could be answered
+    if (!client->writer.Start(WriteResponses, client)) return;
+
+    std::string pending;
+    bool discarding = false;    // Rest of a line that was too long
+    char buffer[4096];
+
+    for (;;) {
+        int count = ReadDescriptor(client->inFd, buffer, sizeof(buffer));
+        if (count <= 0) break;
+        pending.append(buffer, count);
+
+        size_t start = 0;
+        size_t end;
+        while ((end = pending.find('\n', start)) != std::string::npos) {
+            std::string line = pending.substr(start, end - start);
+            start = end + 1;
+            if (discarding) discarding = false;
+            else if (line.find_first_not_of(" \t\r") != std::string::npos) HandleRequest(client, line);
+        }
+        pending.erase(0, start);
+
+        if (pending.size() > MAX_REQUEST_BYTES) {
+            if (!discarding) {
+                client->responseSlots.Wait();
+                RespondError(client, "null", "request longer than the limit");
+            }
+            discarding = true;
+            pending.clear();
+        }
+    }
+
+    // A last request without its newline still counts
+    if (!discarding && pending.find_first_not_of(" \t\r") != std::string::npos)
+        HandleRequest(client, pending);
+
+    // Every place back means every response is written
+    Server* server = client->server;
+    for (int i = 0; i < server->clientDepth; ++i) client->responseSlots.Wait();
+    {
+        ScopedLock lock(client->outboxMutex);
+        client->closing = true;
+    }
+    client->outboxSignal.Post();
+    client->writer.Join();
+}
+
+// Body of a socket client's thread
+static void ClientMain(void* arg)
+{
+    Client* client = (Client*)arg;
+    Server* server = client->server;
+    ReadRequests(client);
+
+    // Finished first, so that stopping never shuts down a descriptor that
+    // is closed and maybe reused
+    {
+        ScopedLock lock(server->mutex);
+        client->finished = true;
+    }
+    CloseDescriptor(client->inFd);
+}
+
+// Runs serve() with a server set up from the options
+static int RunServer(const ServerOptions& options, Server& server, void (*serve)(Server&))
+{
+    server.options = &options;
+    server.cache = NULL;
+    server.failures = 0;
+    server.stopping = false;
+
+    // A cache that cannot be used only makes the requests slower
+    ResultCache cache;
+    if (!options.cacheDir.empty()) {
+        std::string error;
+        if (cache.Open(options.cacheDir, options.cacheBytes, error)) server.cache = &cache;
+        else fprintf(stderr, "colfindc: %s, continuing without it\n", error.c_str());
+    }
+
+    int workers = options.workers > 0 ? options.workers : GetCpuCount();
+    int depth = options.queueDepth > 0 ? options.queueDepth : 2 * workers;
+    Semaphore slots(depth);
+    server.slots = &slots;
+    server.clientDepth = depth;
+    {
+        // Gone before the semaphore, the workers may still be finishing
+        // jobs that are answered already
+        JobQueue queue(workers);
+        server.queue = &queue;
+        serve(server);
+    }
+    return server.failures;
+}
+
+static void ServeStreams(Server& server)
+{
+    Client client(&server, 0, 1);
+    ReadRequests(&client);
+}
+
+int ServeStandardStreams(const ServerOptions& options)
+{
+    Server server;
+    return RunServer(options, server, ServeStreams);
+}
+
+static LocalListener* activeListener = NULL;
+
+void StopServer()
+{
+    if (activeListener != NULL) activeListener->Stop();
+}
+
+// Joins and deletes the clients that are done, or all of them
+static void ReapClients(Server& server, bool all)
+{
+    std::vector<Client*> done;
+    {
+        ScopedLock lock(server.mutex);
+        size_t kept = 0;
+        for (size_t i = 0; i < server.clients.size(); ++i) {
+            if (all || server.clients[i]->finished) done.push_back(server.clients[i]);
+            else server.clients[kept++] = server.clients[i];
+        }
+        server.clients.resize(kept);
+    }
+    for (size_t i = 0; i < done.size(); ++i) {
+        done[i]->thread.Join();
+        delete done[i];
+    }
+}
+
+static void AcceptClients(Server& server)
+{
+    int maxClients = server.options->maxClients > 0 ? server.options->maxClients : 1;
+    for (;;) {
+        int fd = activeListener->Accept();
+        if (fd < 0) break;
+
+        // Clients over the limit are turned away rather than given threads
+        // to wait in
+        ReapClients(server, false);
+        int connected;
+        {
+            ScopedLock lock(server.mutex);
+            connected = (int)server.clients.size();
+        }
+        if (connected >= maxClients) {
+            const char* busy = "{\"id\":null,\"error\":\"too many clients\"}\n";
+            WriteDescriptor(fd, busy, strlen(busy));
+            CloseDescriptor(fd);
+            continue;
+        }
+
+        Client* client = new Client(&server, fd, fd);
+        {
+            ScopedLock lock(server.mutex);
+            server.clients.push_back(client);
+        }
+        if (!client->thread.Start(ClientMain, client)) {
+            CloseDescriptor(fd);
+            ScopedLock lock(server.mutex);
+            client->finished = true;
+        }
+    }
+
+    // Clients still connected see their input end
+    {
+        ScopedLock lock(server.mutex);
+        server.stopping = true;
+        for (size_t i = 0; i < server.clients.size(); ++i) {
+            if (!server.clients[i]->finished) ShutdownReading(server.clients[i]->inFd);
+        }
+    }
+    ReapClients(server, true);
+}
+
+int ServeLocalSocket(const std::string& path, const ServerOptions& options, std::string& error)
+{
+    LocalListener listener;
+    if (!listener.Open(path, error)) return -1;
+    activeListener = &listener;
+
+    Server server;
+    int failures = RunServer(options, server, AcceptClients);
+    activeListener = NULL;
+    return failures;
+}
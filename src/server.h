@@ -0,0 +1,93 @@
+// Long-lived column detection service, so that a pipeline sending one page
+// at a time does not start a process for each: the worker threads, the
+// result cache and the metrics stay warm between requests.
+//
+// Requests and responses are JSON objects, one per line. A request names
+// an image file, or a plane of 8-bit luminance in shared memory, and can
+// override the server's parameters:
+//
+//     {"id": 7, "path": "scan.tif", "page": 0, "threshold": 20, "max_vert": 40,
+//      "binarize": "otsu", "coarse": false, "deskew": false}
+//     {"id": "a", "shm": "/pages", "width": 2550, "height": 3300, "stride": 2560}
+//
+// Only path or shm with width and height are required. Values must be JSON
+// strings, numbers, true, false or null. The response is the page's record
+// as in a JSON Lines result file (see results.h) with the request's id in
+// front, or the id and an error:
+//
+//     {"id":7,"file":"scan.tif","page":0,"width":2550,"height":3300,"columns":[...]}
+//     {"id":"a","error":"cannot open /pages"}
+//
+// Requests of one client are worked on concurrently and answered as they
+// finish, so responses can come in another order. At most queueDepth
+// requests of all clients are in flight, and each client has at most
+// queueDepth requests whose responses are not yet written to it. A client
+// over either limit is not read from until it is under again, which leaves
+// its next requests in the socket and so holds that client back. Responses
+// are written by a thread of the client's own, so one that does not read
+// them holds up no worker and no other client. At most maxClients are
+// served at once, others that connect meanwhile are answered
+// {"id":null,"error":"too many clients"} and closed.
+#ifndef COLFIND_SERVER_H
+#define COLFIND_SERVER_H
+
+#include <stddef.h>
+#include <map>
+#include <string>
+
+#include "cache.h"
+#include "pipeline.h"
+
+// Longest request line accepted, longer ones are answered with an error
+#define MAX_REQUEST_BYTES 65536
+
+// Default number of clients served at once
+#define DEFAULT_MAX_CLIENTS 64
+
+struct ServerOptions {
+    int workers;            // Worker threads, 0 = one per CPU
+    int queueDepth;         // Requests in flight at most, 0 = twice the workers
+    int maxClients;
+    PipelineParams params;  // For requests that do not set their own
+    std::string cacheDir;   // Result cache shared between runs, empty = no cache
+    size_t cacheBytes;      // Size limit of the cache directory
+    std::string metricsFile;    // Where to save metrics on request, empty = not collected
+    bool quiet;             // Only report failures
+
+    ServerOptions() :
+        workers(0),
+        queueDepth(0),
+        maxClients(DEFAULT_MAX_CLIENTS),
+        cacheBytes((size_t)DEFAULT_CACHE_MEGABYTES << 20),
+        quiet(false) {}
+};
+
+// A field of a request, with strings unescaped and anything else as its
+// JSON text
+struct RequestField {
+    bool isString;
+    std::string text;
+};
+
+typedef std::map<std::string, RequestField> Request;
+
+// Parses a request line, which must be a JSON object of strings, numbers,
+// booleans and nulls. On failure returns false with error saying why.
+bool ParseRequest(const std::string& line, Request& request, std::string& error);
+
+// Serves requests read from standard input, writing the responses to
+// standard output, until the input ends and every request is answered.
+// Returns the number of requests that failed.
+int ServeStandardStreams(const ServerOptions& options);
+
+// Serves clients of a Unix domain socket at path until StopServer() is
+// called, then answers the requests already read and returns the number of
+// requests that failed, or -1 if the socket could not be set up, with
+// error saying why.
+int ServeLocalSocket(const std::string& path, const ServerOptions& options, std::string& error);
+
+// Makes ServeLocalSocket() stop accepting clients and reading requests.
+// Safe to call from a signal handler.
+void StopServer();
+
+#endif
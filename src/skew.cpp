@@ -0,0 +1,179 @@
+#include "skew.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "kernels.h"
+
+// Candidate shears tried either way of the best one when refining it on the
+// next finer level, where one pixel of the coarser level is two
+#define SKEW_REFINE_STEPS 3
+
+// Finest level at most the wanted one that is still SKEW_MIN_HEIGHT tall
+static int PickSkewLevel(const ThumbnailPyramid& pyramid, int wanted)
+{
+    int level = std::min(wanted, pyramid.Levels() - 1);
+    while (level > 0 && pyramid.LevelHeight(level) < SKEW_MIN_HEIGHT) --level;
+    return level;
+}
+
+// How much darker than the brightest pixel of its row every pixel of a
+// level is, so grey paper and uneven lighting add nothing to the profile
+static void LevelDarkness(const unsigned char* pixels, int width, int height,
+                          std::vector<unsigned char>& darkness)
+{
+    darkness.resize((size_t)width * height);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = pixels + (size_t)y * width;
+        unsigned char* out = &darkness[(size_t)y * width];
+        int paper = RowMax(row, width);
+        for (int x = 0; x < width; ++x) out[x] = (unsigned char)(paper - row[x]);
+    }
+}
+
+// Sum of the squares of the column projection profile of a level's
+// darkness, with every row moved back by its ShearOffset(), less that of
+// the same darkness spread evenly over the level's width. Shearing moves
+// darkness between columns but keeps its total, so this is largest when it
+// piles up in as few columns as possible: text on text and paper on paper.
+// Without the even part, which is most of the sum, gains over the page as
+// it is would all look alike.
+static double ShearScore(const std::vector<unsigned char>& darkness, int width, int height,
+                         double slope, std::vector<uint32_t>& profile)
+{
+    int last = ShearOffset(height - 1, slope);
+    int pad = std::max(0, last);
+    profile.assign(width + abs(last), 0);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = &darkness[(size_t)y * width];
+        uint32_t* sums = &profile[pad - ShearOffset(y, slope)];
+        for (int x = 0; x < width; ++x) sums[x] += row[x];
+    }
+
+    double sum = 0;
+    double squares = 0;
+    for (size_t i = 0; i < profile.size(); ++i) {
+        sum += profile[i];
+        squares += (double)profile[i] * profile[i];
+    }
+    return squares - sum * sum / width;
+}
+
+// Tries whole pixels of shear over a level's height from first to last,
+// nearest to 0 first so that ties go to the smaller skew, and returns the
+// best and its score
+static int BestShear(const std::vector<unsigned char>& darkness, int width, int height,
+                     int first, int last, std::vector<uint32_t>& profile, double& bestScore)
+{
+    int center = std::max(first, std::min(last, 0));
+    int best = center;
+    bestScore = ShearScore(darkness, width, height, (double)center / height, profile);
+    for (int step = 1; center - step >= first || center + step <= last; ++step) {
+        for (int side = 0; side < 2; ++side) {
+            int shear = side == 0 ? center - step : center + step;
+            if (shear < first || shear > last) continue;
+            double score = ShearScore(darkness, width, height, (double)shear / height, profile);
+            if (score > bestScore) {
+                bestScore = score;
+                best = shear;
+            }
+        }
+    }
+    return best;
+}
+
+double EstimateSkew(const unsigned char* grayData, int width, int height,
+                    const ThumbnailPyramid& pyramid)
+{
+    if (width < 2 || height < 2) return 0;
+
+    int searchLevel = PickSkewLevel(pyramid, SKEW_SEARCH_LEVEL);
+    int refineLevel = PickSkewLevel(pyramid, SKEW_REFINE_LEVEL);
+    double maxSlope = tan(MAX_SKEW_DEGREES * 3.14159265358979323846 / 180);
+
+    std::vector<unsigned char> darkness;
+    std::vector<uint32_t> profile;
+    double slope = 0;
+    int shear = 0;
+    int levelHeight = 0;
+    double bestScore = 0;
+    for (int level = searchLevel; level >= refineLevel; --level) {
+        int levelWidth = pyramid.LevelWidth(level);
+        levelHeight = pyramid.LevelHeight(level);
+        LevelDarkness(level == 0 ? grayData : pyramid.LevelData(level), levelWidth, levelHeight,
+                      darkness);
+
+        // Everything up to the largest skew on the search level, and around
+        // the best shear of the coarser level after that
+        int range = (int)ceil(levelHeight * maxSlope);
+        int first = -range;
+        int last = range;
+        if (level < searchLevel) {
+            int center = (int)floor(slope * levelHeight + 0.5);
+            first = std::max(first, center - SKEW_REFINE_STEPS);
+            last = std::min(last, center + SKEW_REFINE_STEPS);
+        }
+        shear = BestShear(darkness, levelWidth, levelHeight, first, last, profile, bestScore);
+        slope = (double)shear / levelHeight;
+    }
+    if (shear == 0) return 0;
+
+    // Only a clear gain over the page as it is, and none on blank paper
+    double straightScore = ShearScore(darkness, pyramid.LevelWidth(refineLevel), levelHeight,
+                                        0, profile);
+    if (straightScore <= 0 || bestScore * 100 < straightScore * (100 + SKEW_MIN_GAIN)) return 0;
+    return slope;
+}
+
+void FindColumnsAlongSkew(const unsigned char* grayData, int width, int height, double slope,
+                          const PipelineParams& params, std::vector<ColumnRect>& columns,
+                          ThreadPool* pool, PageMetrics* metrics)
+{
+    int last = height > 0 ? ShearOffset(height - 1, slope) : 0;
+    if (last == 0) {
+        ProcessPlane(grayData, NULL, width, height, params, columns, pool, metrics);
+        return;
+    }
+
+    // Row y starts pad - ShearOffset(y) pixels into the sheared row
+    int pad = std::max(0, last);
+    int shearedWidth = width + abs(last);
+    StripProcessor processor;
+    processor.Begin(shearedWidth, params, pool, metrics);
+
+    int stripRows = STRIP_ROWS * (pool != NULL ? pool->ThreadCount() : 1);
+    PooledArray<unsigned char> strip;
+    strip.Resize((size_t)shearedWidth * stripRows);
+    if (metrics != NULL) metrics->Allocated(STAGE_SKEW, strip.Size());
+    for (int y = 0; y < height; y += stripRows) {
+        int count = std::min(stripRows, height - y);
+        {
+            StageTimer timer(metrics, STAGE_SKEW, (uint64_t)width * count);
+            for (int i = 0; i < count; ++i) {
+                const unsigned char* source = grayData + (size_t)(y + i) * width;
+                unsigned char* row = &strip[(size_t)i * shearedWidth];
+                int start = pad - ShearOffset(y + i, slope);
+                memset(row, source[0], start);
+                memcpy(row + start, source, width);
+                memset(row + start + width, source[width - 1], shearedWidth - start - width);
+            }
+        }
+        processor.ProcessRows(strip.Data(), NULL, count);
+    }
+
+    std::vector<ColumnRect> sheared;
+    processor.Finish(sheared);
+
+    // A column's bound at row y lies ShearOffset(y) - pad from its sheared
+    // bound, furthest out at its top or bottom row
+    columns.clear();
+    for (size_t i = 0; i < sheared.size(); ++i) {
+        ColumnRect column = sheared[i];
+        int top = ShearOffset(column.y0, slope) - pad;
+        int bottom = ShearOffset(column.y1, slope) - pad;
+        column.x0 = std::max(0, column.x0 + std::min(top, bottom));
+        column.x1 = std::min(width - 1, column.x1 + std::max(top, bottom));
+        if (column.x0 <= column.x1) columns.push_back(column);
+    }
+}
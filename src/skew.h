@@ -0,0 +1,83 @@
+// Skew estimation and detection along a skewed page. The smear copies
+// straight down and the profile sums straight down, so on a page scanned
+// even half a degree off text runs across the gutters at the bottom that
+// were clear at the top. Rather than rotating the image, each row is moved
+// sideways by a whole number of pixels, which straightens vertical
+// structure as well as a rotation would for the few degrees scans are off
+// by. The slope is found on a small level of the page's pyramid by trying
+// such shears on its column projection profile, and the pipeline then runs
+// on the sheared rows.
+#ifndef COLFIND_SKEW_H
+#define COLFIND_SKEW_H
+
+#include <math.h>
+#include <vector>
+
+#include "metrics.h"
+#include "pipeline.h"
+#include "segment.h"
+#include "thumbnail.h"
+
+// Largest skew looked for, in degrees either way
+#define MAX_SKEW_DEGREES 5
+
+// Pyramid level the skew is first searched on, a sixteenth of the page size
+#define SKEW_SEARCH_LEVEL 4
+
+// Level the search is refined down to, an eighth of the page size. One
+// pixel of shear over its height is a slope of about 0.15 degrees on a
+// letter page at 300 dpi, which moves a gutter by a few pixels over the
+// whole page.
+#define SKEW_REFINE_LEVEL 3
+
+// Finer levels are searched for pages whose search level would be shorter
+// than this, and the plane itself when even level 1 would be. On shorter
+// levels chance alignments of a few words can outscore the real skew.
+#define SKEW_MIN_HEIGHT 128
+
+// Percent the profile's variance must gain over leaving the page as it is
+// for a skew to be taken, so a straight page is not sheared by noise. Skews
+// of a degree or more gain several times this on pages with columns.
+#define SKEW_MIN_GAIN 2
+
+// Pixels row y of a page with the given slope is moved sideways by,
+// rounded to the nearest pixel
+inline int ShearOffset(int y, double slope)
+{
+    return (int)floor(y * slope + 0.5);
+}
+
+// The slope of a page's vertical structure, in pixels to the right per row
+// down, found from the pyramid of its top-down luminance plane. Each
+// candidate shear moves every row of a pyramid level back by its offset,
+// and the one whose column projection profile varies the most is taken:
+// sheared along the text, the columns stack up on themselves and the
+// gutters stay clear. The search tries every whole pixel of shear over the
+// height of a sixteenth of the page, up to MAX_SKEW_DEGREES, and refines
+// the best on each finer level down to SKEW_REFINE_LEVEL. Returns 0 for
+// pages with no clear skew.
+double EstimateSkew(const unsigned char* grayData, int width, int height,
+                    const ThumbnailPyramid& pyramid);
+
+// Degrees a page with the given slope is turned clockwise, as
+// SynthParams::skew turns it
+inline double SkewDegrees(double slope)
+{
+    return -atan(slope) * 180 / 3.14159265358979323846;
+}
+
+// Finds the columns of a top-down luminance plane along the given slope.
+// Every row is moved back by its ShearOffset() into a plane wider by the
+// shear and runs through the pipeline as in ProcessPlane(), so the smear
+// and the profile follow the slope. The rows are padded with their first
+// and last pixel, which smear like the page's margins: padding brighter
+// than the smeared paper would raise the paper level of every row.
+// Columns are then moved back onto the page as the bounds of the
+// parallelograms they cover there, which for neighbouring columns can
+// overlap by up to the shear over their height. The pool and metrics may
+// be NULL.
+void FindColumnsAlongSkew(const unsigned char* grayData, int width, int height, double slope,
+                          const PipelineParams& params, std::vector<ColumnRect>& columns,
+                          ThreadPool* pool = NULL, PageMetrics* metrics = NULL);
+
+#endif
@@ -0,0 +1,96 @@
+#include "smear.h"
+
+#include <string.h>
+
+VerticalSmear::VerticalSmear() :
+    width(0),
+    maxVert(0),
+    y(0) {}
+
+void VerticalSmear::Reset(int width, int maxVert)
+{
+    if (maxVert < 0) maxVert = 0;
+    if (maxVert > MAX_VERT_LIMIT) maxVert = MAX_VERT_LIMIT;
+
+    this->width = width;
+    this->maxVert = maxVert;
+    y = 0;
+    weightedSum.Assign(width, 0);
+    history.Assign((size_t)width * maxVert, 0);
+}
+
+void VerticalSmear::SmearRow(unsigned char* row)
+{
+    if (maxVert == 0) return;
+
+    // Rows above the first maxVert ones blend in fewer neighbours
+    int shift = y < maxVert ? y : maxVert;
+    bool historyFull = y >= maxVert;
+
+    // The ring slot for this row still holds the row maxVert above it, which
+    // drops out of the window after this row
+    unsigned char* oldest = &history[(size_t)(y % maxVert) * width];
+    uint64_t* sum = weightedSum.Data();
+
+    for (int x = 0; x < width; ++x) {
+        unsigned char s = (unsigned char)((row[x] + sum[x]) >> shift);
+        row[x] = s;
+
+        uint64_t next = sum[x];
+        if (historyFull) next -= (uint64_t)oldest[x] << maxVert;
+        sum[x] = (next + (s >> 1)) << 1;
+        oldest[x] = s >> 1;
+    }
+    ++y;
+}
+
+// The loop of SmearRowSums() for one combination of its cases, so that the
+// compiler drops the tests that do not apply instead of making them per pixel
+template <bool historyFull, bool keepSmear>
+static int SmearSumsLoop(const unsigned char* gray, unsigned char* smear, uint32_t* columnSums,
+                         uint64_t* sum, unsigned char* oldest, int width, int shift, int maxVert)
+{
+    unsigned char brightest = 0;
+    for (int x = 0; x < width; ++x) {
+        unsigned char s = (unsigned char)((gray[x] + sum[x]) >> shift);
+        columnSums[x] += s;
+        if (s > brightest) brightest = s;
+        if (keepSmear) smear[x] = s;
+
+        uint64_t next = sum[x];
+        if (historyFull) next -= (uint64_t)oldest[x] << maxVert;
+        sum[x] = (next + (s >> 1)) << 1;
+        oldest[x] = s >> 1;
+    }
+    return brightest;
+}
+
+int VerticalSmear::SmearRowSums(const unsigned char* gray, unsigned char* smear,
+                                uint32_t* columnSums)
+{
+    if (maxVert == 0) {
+        unsigned char brightest = 0;
+        for (int x = 0; x < width; ++x) {
+            columnSums[x] += gray[x];
+            if (gray[x] > brightest) brightest = gray[x];
+        }
+        if (smear != NULL) memcpy(smear, gray, width);
+        return brightest;
+    }
+
+    // The same steps as SmearRow(), keeping the sums on the way
+    int shift = y < maxVert ? y : maxVert;
+    unsigned char* oldest = &history[(size_t)(y % maxVert) * width];
+    uint64_t* sum = weightedSum.Data();
+    int brightest;
+    if (y < maxVert) {
+        if (smear != NULL) brightest = SmearSumsLoop<false, true>(gray, smear, columnSums, sum, oldest, width, shift, maxVert);
+        else brightest = SmearSumsLoop<false, false>(gray, smear, columnSums, sum, oldest, width, shift, maxVert);
+    }
+    else {
+        if (smear != NULL) brightest = SmearSumsLoop<true, true>(gray, smear, columnSums, sum, oldest, width, shift, maxVert);
+        else brightest = SmearSumsLoop<true, false>(gray, smear, columnSums, sum, oldest, width, shift, maxVert);
+    }
+    ++y;
+    return brightest;
+}
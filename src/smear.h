@@ -0,0 +1,57 @@
+// Vertical smear with constant work per pixel and row-major traversal
+#ifndef COLFIND_SMEAR_H
+#define COLFIND_SMEAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bufferpool.h"
+
+// Largest smear length the 64-bit column accumulators can hold
+#define MAX_VERT_LIMIT 55
+
+// The original smear blended every pixel with the up to maxVert already
+// smeared pixels above it, truncating at each step:
+//
+//     for (vert = 1; vert <= min(y, maxVert); ++vert)
+//         p = p / 2 + above[vert] / 2;
+//
+// Since floor(floor(a) / 2 + b) == floor(a / 2 + b) for integer b, those
+// nested truncations collapse into one:
+//
+//     s[y] = (g + sum(k = 1..v) (s[y - k] / 2) << k) >> v,  v = min(y, maxVert)
+//
+// The sum is kept per column and updated in O(1) when moving down a row, so
+// this produces the original output bit for bit at a fraction of the cost.
+// Rows are processed whole, top to bottom, keeping maxVert rows of history.
+class VerticalSmear {
+public:
+    VerticalSmear();
+
+    // Prepares for a new image, maxVert is clamped to [0, MAX_VERT_LIMIT]
+    void Reset(int width, int maxVert);
+
+    // Smears the next row in place, rows must arrive top to bottom
+    void SmearRow(unsigned char* row);
+
+    // Smears the next row of gray into smear, which may be NULL to keep
+    // only what the profile needs: every smeared pixel is added to its
+    // column's sum and the row's brightest smeared pixel is returned. The
+    // row then never has to be written out and read back in.
+    int SmearRowSums(const unsigned char* gray, unsigned char* smear, uint32_t* columnSums);
+
+    int MaxVert() const { return maxVert; }
+
+    // Bytes of working memory held for the current image
+    size_t MemoryBytes() const {
+        return weightedSum.Size() * sizeof(uint64_t) + history.Size();
+    }
+
+private:
+    int width;
+    int maxVert;
+    int y;                                  // Index of the next row
+    PooledArray<uint64_t> weightedSum;      // Per column sum of (s >> 1) << k
+    PooledArray<unsigned char> history;     // Last maxVert smeared rows, halved
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "stages.h"
+
+#include <string.h>
+#include <algorithm>
+
+// What each stage is made from, by bit. Every stage comes after its inputs,
+// so one pass in this order carries staleness all the way down.
+static const unsigned stageInputs[PAGE_STAGE_COUNT] = {
+    0,                                          // PAGE_STAGE_SMEAR
+    PAGE_STAGE_SMEAR,                           // PAGE_STAGE_DARKNESS
+    0,                                          // PAGE_STAGE_INK
+    PAGE_STAGE_DARKNESS | PAGE_STAGE_INK        // PAGE_STAGE_COLUMNS
+};
+
+PageStages::PageStages() :
+    stale(0),
+    pool(NULL),
+    metrics(NULL),
+    gray(NULL),
+    smear(NULL),
+    height(0)
+{
+}
+
+void PageStages::Adopt(const ColumnProfile& profile, const PipelineParams& params)
+{
+    this->profile = profile;
+    this->params = params;
+    stale = 0;
+}
+
+unsigned PageStages::Prepare(const PipelineParams& params, ThreadPool* pool, PageMetrics* metrics)
+{
+    next = params;
+    this->pool = pool;
+    this->metrics = metrics;
+
+    // Stages using a changed parameter, then everything made from them
+    stale = 0;
+    if (std::min(params.maxVert, MAX_VERT_LIMIT) != std::min(this->params.maxVert, MAX_VERT_LIMIT))
+        stale |= PAGE_STAGE_SMEAR;
+    if (params.threshold != this->params.threshold) stale |= PAGE_STAGE_INK;
+    for (int stage = 0; stage < PAGE_STAGE_COUNT; ++stage) {
+        if (stale & stageInputs[stage]) stale |= 1u << stage;
+    }
+    if (stale == 0) return 0;
+
+    int width = profile.Width();
+    int threads = pool != NULL ? pool->ThreadCount() : 1;
+    if (stale & PAGE_STAGE_SMEAR) {
+        // Bands of columns, as StripProcessor smears them
+        int bands = std::max(1, std::min(threads, width / MIN_BAND_WIDTH));
+        bandStart.resize(bands + 1);
+        smears.resize(bands);
+        for (int band = 0; band <= bands; ++band)
+            bandStart[band] = (int)((long long)width * band / bands);
+        for (int band = 0; band < bands; ++band)
+            smears[band].Reset(bandStart[band + 1] - bandStart[band], params.maxVert);
+    }
+
+    // Each row range adds the stale halves into a profile of its own, whose
+    // other half stays empty and so merges as nothing
+    parts.resize(threads);
+    for (int part = 0; part < threads; ++part) parts[part].Reset(width, params.threshold);
+
+    if (metrics != NULL) {
+        for (size_t band = 0; band < smears.size(); ++band)
+            metrics->Allocated(STAGE_SMEAR, smears[band].MemoryBytes());
+        for (int part = 0; part < threads; ++part)
+            metrics->Allocated(STAGE_PROFILE, parts[part].MemoryBytes());
+    }
+    return stale;
+}
+
+void PageStages::SmearTask(void* context, int band)
+{
+    PageStages* stages = (PageStages*)context;
+    int width = stages->profile.Width();
+    int x0 = stages->bandStart[band];
+    int bandWidth = stages->bandStart[band + 1] - x0;
+    VerticalSmear& bandSmear = stages->smears[band];
+
+    for (int y = 0; y < stages->height; ++y) {
+        size_t offset = (size_t)y * width + x0;
+        memcpy(stages->smear + offset, stages->gray + offset, bandWidth);
+        bandSmear.SmearRow(stages->smear + offset);
+    }
+}
+
+void PageStages::ProfileTask(void* context, int part)
+{
+    PageStages* stages = (PageStages*)context;
+    int width = stages->profile.Width();
+    int count = (int)stages->parts.size();
+    int begin = (int)((long long)stages->height * part / count);
+    int end = (int)((long long)stages->height * (part + 1) / count);
+    ColumnProfile& partProfile = stages->parts[part];
+
+    for (int y = begin; y < end; ++y) {
+        size_t offset = (size_t)y * width;
+        if (stages->stale & PAGE_STAGE_DARKNESS) partProfile.AddDarknessRow(stages->smear + offset);
+        if (stages->stale & PAGE_STAGE_INK) partProfile.AddInkRow(stages->gray + offset, y);
+    }
+}
+
+void PageStages::Run(const unsigned char* grayData, unsigned char* smearData, int height)
+{
+    gray = grayData;
+    smear = smearData;
+    this->height = height;
+    uint64_t pixels = (uint64_t)profile.Width() * height;
+
+    if (stale & PAGE_STAGE_SMEAR) {
+        StageTimer timer(metrics, STAGE_SMEAR, pixels);
+        if (pool != NULL) pool->Run(SmearTask, this, (int)smears.size());
+        else SmearTask(this, 0);
+    }
+    if (stale & (PAGE_STAGE_DARKNESS | PAGE_STAGE_INK)) {
+        StageTimer timer(metrics, STAGE_PROFILE, pixels);
+        if (pool != NULL) pool->Run(ProfileTask, this, (int)parts.size());
+        else ProfileTask(this, 0);
+    }
+}
+
+void PageStages::Finish(std::vector<ColumnRect>& columns)
+{
+    if (stale == 0) return;
+    StageTimer timer(metrics, STAGE_SEGMENT, (uint64_t)profile.Width() * parts.size());
+
+    if (stale & PAGE_STAGE_DARKNESS) profile.ClearDarkness();
+    if (stale & PAGE_STAGE_INK) profile.ClearInk(next.threshold);
+    for (size_t part = 0; part < parts.size(); ++part) profile.Merge(parts[part]);
+    profile.FindColumns(columns);
+
+    // Nothing but the profile is kept between runs
+    params = next;
+    stale = 0;
+    std::vector<int>().swap(bandStart);
+    std::vector<VerticalSmear>().swap(smears);
+    std::vector<ColumnProfile>().swap(parts);
+}
@@ -0,0 +1,87 @@
+// Intermediate results of a page kept between runs of the pipeline, so that
+// changing a parameter only redoes the stages that depend on it
+#ifndef COLFIND_STAGES_H
+#define COLFIND_STAGES_H
+
+#include <vector>
+
+#include "metrics.h"
+#include "pipeline.h"
+#include "segment.h"
+#include "smear.h"
+#include "threadpool.h"
+
+// Stages kept for a page, as bits of a mask. The gray plane they all start
+// from does not depend on any parameter and is never stale.
+#define PAGE_STAGE_SMEAR 1      // Smeared plane, from the gray plane and maxVert
+#define PAGE_STAGE_DARKNESS 2   // Darkness half of the profile, from the smeared plane
+#define PAGE_STAGE_INK 4        // Ink half of the profile, from the gray plane and threshold
+#define PAGE_STAGE_COLUMNS 8    // Columns, from both halves of the profile
+#define PAGE_STAGE_COUNT 4
+
+// Keeps the column profile of a page whose gray and smeared planes the
+// caller holds on to, along with the parameters they were made with. When
+// the parameters change, the stages that depend on a changed one are stale,
+// and so is every stage computed from a stale one; only those are redone.
+// A new threshold thus only takes another look at the ink in the gray
+// plane, a new maxVert smears it again but keeps the ink.
+//
+// As with StripProcessor, everything that allocates happens in Prepare()
+// and Finish(), so Run() can go to a thread that must not allocate. Only
+// the grayscale pipeline is kept: params.binarize and params.coarse are not
+// used.
+class PageStages {
+public:
+    PageStages();
+
+    // Takes the profile of a page just processed with the given parameters,
+    // which smeared its planes
+    void Adopt(const ColumnProfile& profile, const PipelineParams& params);
+
+    // Parameters the kept stages were made with
+    const PipelineParams& Params() const { return params; }
+
+    // Works out which stages the given parameters make stale and gets ready
+    // to redo them, returning them as a mask, 0 if they are all up to date.
+    // The pool and metrics, if any, must outlive Finish().
+    unsigned Prepare(const PipelineParams& params, ThreadPool* pool = NULL,
+                     PageMetrics* metrics = NULL);
+
+    // Stages Prepare() found stale and Finish() has not redone yet
+    unsigned Stale() const { return stale; }
+
+    // Redoes the stale smear and profile stages. Both planes hold
+    // width*height bytes, smearData is rewritten if the smear is stale.
+    void Run(const unsigned char* grayData, unsigned char* smearData, int height);
+
+    // Finds the columns again and makes the prepared parameters the kept
+    // ones. Must follow Run() once Prepare() returned anything but 0.
+    void Finish(std::vector<ColumnRect>& columns);
+
+    // Bytes held between runs
+    size_t MemoryBytes() const { return profile.MemoryBytes(); }
+
+private:
+    PageStages(const PageStages&);
+    PageStages& operator=(const PageStages&);
+
+    static void SmearTask(void* context, int band);
+    static void ProfileTask(void* context, int part);
+
+    ColumnProfile profile;                  // Both halves, as of params
+    PipelineParams params;
+    unsigned stale;
+
+    // Only between Prepare() and Finish()
+    PipelineParams next;
+    ThreadPool* pool;
+    PageMetrics* metrics;
+    std::vector<int> bandStart;             // First column of each smear band, plus width
+    std::vector<VerticalSmear> smears;      // One per band
+    std::vector<ColumnProfile> parts;       // Stale halves of the profile, one per row range
+    const unsigned char* gray;
+    unsigned char* smear;
+    int height;
+};
+
+#endif
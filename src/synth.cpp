@@ -0,0 +1,213 @@
+#include "synth.h"
+
+#include <math.h>
+#include <algorithm>
+
+// Gray levels of the rendered page before grain
+#define SYNTH_PAPER 236
+#define SYNTH_INK 30
+
+// Small generator of its own, so pages do not depend on the C library's rand()
+class SynthRandom {
+public:
+    explicit SynthRandom(unsigned int seed) : state(seed * 2654435761u + 1) {}
+
+    unsigned int Next() {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+
+    // Uniform in [low, high]
+    int Range(int low, int high) {
+        return high <= low ? low : low + (int)(Next() % (unsigned int)(high - low + 1));
+    }
+
+private:
+    unsigned int state;
+};
+
+// Page being drawn, with the ink bounds of the column being drawn
+struct SynthPage {
+    std::vector<unsigned char>* gray;
+    int width;
+    int height;
+    int inkX0, inkX1, inkY0, inkY1;
+};
+
+static void FillRect(SynthPage& page, SynthRandom& random, int x0, int y0, int x1, int y1)
+{
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, page.width - 1);
+    y1 = std::min(y1, page.height - 1);
+    if (x1 < x0 || y1 < y0) return;
+
+    // Slightly uneven ink, like toner
+    unsigned char value = (unsigned char)(SYNTH_INK + random.Range(-10, 10));
+    for (int y = y0; y <= y1; ++y) {
+        unsigned char* row = &(*page.gray)[(size_t)y * page.width];
+        for (int x = x0; x <= x1; ++x) row[x] = value;
+    }
+
+    page.inkX0 = std::min(page.inkX0, x0);
+    page.inkX1 = std::max(page.inkX1, x1);
+    page.inkY0 = std::min(page.inkY0, y0);
+    page.inkY1 = std::max(page.inkY1, y1);
+}
+
+// Draws one glyph-like shape with its x-height box starting at (x, baseline -
+// xHeight), and returns its width
+static int DrawGlyph(SynthPage& page, SynthRandom& random, int x, int baseline,
+                     int xHeight, int stroke)
+{
+    int width = xHeight * random.Range(5, 10) / 10;
+    int top = baseline - xHeight;
+    int shape = random.Range(0, 9);
+
+    // Ascenders and descenders on some letters
+    int stemTop = shape == 0 || shape == 1 ? baseline - xHeight * 3 / 2 : top;
+    int stemBottom = shape == 2 ? baseline + xHeight / 2 : baseline;
+
+    FillRect(page, random, x, stemTop, x + stroke - 1, stemBottom - 1);
+    if (shape >= 3) FillRect(page, random, x + width - stroke, top, x + width - 1, baseline - 1);
+    if (shape >= 5) FillRect(page, random, x, top, x + width - 1, top + stroke - 1);
+    if (shape >= 7) FillRect(page, random, x, baseline - stroke, x + width - 1, baseline - 1);
+    return width;
+}
+
+// Fills one column with paragraphs of text down to bottom, returns the ink
+// bounds it produced
+static ColumnRect DrawColumn(SynthPage& page, SynthRandom& random, int x0, int x1,
+                             int top, int bottom, int dpi)
+{
+    int lineHeight = std::max(4, dpi * 14 / 72);
+    int xHeight = std::max(2, dpi * 5 / 72);
+    int stroke = std::max(1, dpi / 100);
+    int letterGap = std::max(1, dpi / 150);
+    int wordGap = xHeight / 2 + 1;
+
+    page.inkX0 = page.inkY0 = 0x7fffffff;
+    page.inkX1 = page.inkY1 = -1;
+
+    bool paragraphStart = true;
+    for (int baseline = top + lineHeight; baseline <= bottom; baseline += lineHeight) {
+        // Indented first lines, and a short last line ending each paragraph
+        int x = x0 + (paragraphStart ? xHeight * 2 : 0);
+        bool paragraphEnd = random.Range(0, 7) == 0;
+        int end = paragraphEnd ? x0 + (x1 - x0) * random.Range(20, 90) / 100 : x1;
+        paragraphStart = paragraphEnd;
+
+        while (x < end) {
+            int letters = random.Range(1, 9);
+            int wordEnd = x + letters * (xHeight + letterGap);
+            if (wordEnd > end) break;
+            for (int i = 0; i < letters; ++i)
+                x += DrawGlyph(page, random, x, baseline, xHeight, stroke) + letterGap;
+            x += wordGap;
+        }
+        if (paragraphEnd) baseline += lineHeight / 2;
+    }
+
+    ColumnRect column;
+    if (page.inkX1 >= 0) {
+        column.x0 = page.inkX0;
+        column.x1 = page.inkX1;
+        column.y0 = page.inkY0;
+        column.y1 = page.inkY1;
+        column.confidence = 1;
+    }
+    return column;
+}
+
+// Turns the page about its centre by the given angle, by looking up where
+// each output pixel comes from so the result has no holes
+static void SkewPage(std::vector<unsigned char>& gray, int width, int height, double degrees)
+{
+    std::vector<unsigned char> source(gray);
+    double angle = degrees * 3.14159265358979323846 / 180;
+    double c = cos(angle);
+    double s = sin(angle);
+    double cx = width / 2.0;
+    double cy = height / 2.0;
+
+    for (int y = 0; y < height; ++y) {
+        unsigned char* row = &gray[(size_t)y * width];
+        for (int x = 0; x < width; ++x) {
+            double dx = x - cx;
+            double dy = y - cy;
+            int sx = (int)floor(cx + dx * c + dy * s + 0.5);
+            int sy = (int)floor(cy - dx * s + dy * c + 0.5);
+            bool inside = sx >= 0 && sx < width && sy >= 0 && sy < height;
+            row[x] = inside ? source[(size_t)sy * width + sx] : SYNTH_PAPER;
+        }
+    }
+}
+
+void RenderSyntheticPage(const SynthParams& params, std::vector<unsigned char>& gray,
+                         std::vector<ColumnRect>* truth)
+{
+    int width = std::max(params.width, 1);
+    int height = std::max(params.height, 1);
+    int dpi = std::max(params.dpi, 10);
+    int columns = std::max(params.columns, 1);
+    int gutter = params.gutter > 0 ? params.gutter : dpi / 6;
+    int margin = std::min(dpi * 3 / 4, std::min(width, height) / 8);
+
+    SynthRandom random(params.seed);
+    gray.assign((size_t)width * height, SYNTH_PAPER);
+    if (truth != NULL) truth->clear();
+
+    SynthPage page;
+    page.gray = &gray;
+    page.width = width;
+    page.height = height;
+
+    int left = margin;
+    int right = width - 1 - margin;
+    int top = margin;
+    int bottom = height - 1 - margin;
+    int ruleWidth = std::max(1, dpi / 150);
+
+    // A header line across the page, underlined
+    if (params.rules) {
+        DrawColumn(page, random, left, right, top, top + dpi * 14 / 72, dpi);
+        top += dpi * 14 / 72 + dpi / 8;
+        FillRect(page, random, left, top, right, top + ruleWidth - 1);
+        top += dpi / 8;
+    }
+
+    int columnWidth = std::max(1, (right - left + 1 - (columns - 1) * gutter) / columns);
+    for (int i = 0; i < columns; ++i) {
+        int x0 = left + i * (columnWidth + gutter);
+        int x1 = x0 + columnWidth - 1;
+
+        // The last column often runs out early
+        int columnBottom = i == columns - 1 ? top + (bottom - top) * random.Range(60, 100) / 100 : bottom;
+        ColumnRect column = DrawColumn(page, random, x0, x1, top, columnBottom, dpi);
+        if (truth != NULL && column.confidence > 0) truth->push_back(column);
+
+        if (params.rules && i + 1 < columns) {
+            int ruleX = x1 + gutter / 2;
+            FillRect(page, random, ruleX, top, ruleX + ruleWidth - 1, bottom);
+        }
+    }
+
+    if (params.skew != 0) SkewPage(gray, width, height, params.skew);
+
+    // Paper grain
+    if (params.grain > 0) {
+        for (size_t i = 0; i < gray.size(); ++i) {
+            int value = gray[i] + random.Range(-params.grain, params.grain);
+            gray[i] = (unsigned char)std::max(0, std::min(255, value));
+        }
+    }
+
+    // Specks of dirt, one to three pixels across
+    long long specks = (long long)params.specks * width * height / 1000000;
+    for (long long i = 0; i < specks; ++i) {
+        int x = random.Range(0, width - 1);
+        int y = random.Range(0, height - 1);
+        int size = random.Range(1, 3);
+        FillRect(page, random, x, y, x + size - 1, y + size - 1);
+    }
+}
@@ -0,0 +1,45 @@
+// Deterministic synthetic scans for benchmarks and regression checks. Pages
+// are laid out like printed text: columns of lines of word-shaped blocks of
+// glyph strokes, with optional paper grain, specks, skew and rule lines.
+#ifndef COLFIND_SYNTH_H
+#define COLFIND_SYNTH_H
+
+#include <vector>
+
+#include "segment.h"
+
+// Default resolution, a US letter page at this many dots per inch
+#define SYNTH_DEFAULT_DPI 300
+
+struct SynthParams {
+    int width;
+    int height;
+    int dpi;            // Scales glyphs, lines and margins
+    int columns;
+    int gutter;         // Pixels between columns, 0 = a sixth of an inch
+    int grain;          // Amplitude of the paper grain, 0 = clean paper
+    int specks;         // Specks of dirt per megapixel
+    double skew;        // Degrees, positive turns the text clockwise
+    bool rules;         // Vertical rules in the gutters and one under the header
+    unsigned int seed;
+
+    SynthParams() :
+        width(SYNTH_DEFAULT_DPI * 17 / 2),
+        height(SYNTH_DEFAULT_DPI * 11),
+        dpi(SYNTH_DEFAULT_DPI),
+        columns(3),
+        gutter(0),
+        grain(8),
+        specks(20),
+        skew(0),
+        rules(false),
+        seed(1) {}
+};
+
+// Renders a page into a top-down luminance plane of width*height bytes.
+// The same parameters always give the same page. If truth is not NULL it
+// receives the bounds of the text columns, before any skew.
+void RenderSyntheticPage(const SynthParams& params, std::vector<unsigned char>& gray,
+                         std::vector<ColumnRect>* truth);
+
+#endif
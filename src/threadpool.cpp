@@ -0,0 +1,87 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threadCount) :
+    threadCount(threadCount > 0 ? threadCount : GetCpuCount()),
+    proc(NULL),
+    context(NULL),
+    count(0),
+    next(0),
+    quit(false)
+{
+    if (this->threadCount == 1) return;
+
+    for (int i = 0; i < this->threadCount; ++i) {
+        Thread* thread = new Thread;
+        if (!thread->Start(WorkerMain, this)) {
+            // Keep whatever we managed to start
+            delete thread;
+            break;
+        }
+        threads.push_back(thread);
+    }
+    if (threads.empty()) this->threadCount = 1;
+    else this->threadCount = (int)threads.size();
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        ScopedLock lock(mutex);
+        quit = true;
+    }
+    startSignal.Post((int)threads.size());
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->Join();
+        delete threads[i];
+    }
+}
+
+void ThreadPool::Run(TaskProc proc, void* context, int count)
+{
+    if (count <= 0) return;
+
+    // Nothing to gain from a hand-off for a single thread or a single task
+    if (threads.empty() || count == 1) {
+        for (int i = 0; i < count; ++i) proc(context, i);
+        return;
+    }
+
+    ScopedLock runLock(runMutex);
+    {
+        ScopedLock lock(mutex);
+        this->proc = proc;
+        this->context = context;
+        this->count = count;
+        this->next = 0;
+    }
+
+    startSignal.Post((int)threads.size());
+    for (size_t i = 0; i < threads.size(); ++i) doneSignal.Wait();
+}
+
+void ThreadPool::WorkerMain(void* arg)
+{
+    ThreadPool* pool = (ThreadPool*)arg;
+    for (;;) {
+        pool->startSignal.Wait();
+        {
+            ScopedLock lock(pool->mutex);
+            if (pool->quit) return;
+        }
+        pool->RunTasks();
+        pool->doneSignal.Post();
+    }
+}
+
+void ThreadPool::RunTasks()
+{
+    for (;;) {
+        int index;
+        {
+            ScopedLock lock(mutex);
+            if (next >= count) return;
+            index = next++;
+        }
+        proc(context, index);
+    }
+}
@@ -0,0 +1,46 @@
+// Fixed-size pool of worker threads that run indexed tasks in parallel
+#ifndef COLFIND_THREADPOOL_H
+#define COLFIND_THREADPOOL_H
+
+#include <vector>
+
+#include "platform.h"
+
+// Task body, called once for every index handed to ThreadPool::Run()
+typedef void (*TaskProc)(void* context, int index);
+
+class ThreadPool {
+public:
+    // A thread count of 0 uses one thread per CPU, 1 runs tasks inline
+    explicit ThreadPool(int threadCount = 0);
+    ~ThreadPool();
+
+    int ThreadCount() const { return threadCount; }
+
+    // Calls proc(context, i) for every i in [0, count) spread across the
+    // workers and returns once all of them have finished
+    void Run(TaskProc proc, void* context, int count);
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    static void WorkerMain(void* arg);
+    void RunTasks();
+
+    int threadCount;
+    std::vector<Thread*> threads;
+    Mutex mutex;
+    Semaphore startSignal;  // Posted once per worker when a job is ready
+    Semaphore doneSignal;   // Posted by each worker when it runs out of tasks
+    Mutex runMutex;         // Serializes callers of Run()
+
+    // Current job, guarded by mutex
+    TaskProc proc;
+    void* context;
+    int count;
+    int next;
+    bool quit;
+};
+
+#endif
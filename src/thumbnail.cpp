@@ -0,0 +1,107 @@
+#include "thumbnail.h"
+
+#include <algorithm>
+
+ThumbnailPyramid::ThumbnailPyramid() :
+    width(0),
+    height(0)
+{
+}
+
+void ThumbnailPyramid::Begin(int width, int height)
+{
+    this->width = width;
+    this->height = height;
+
+    // Counted first, so the levels are sized in place and never copied
+    int count = 0;
+    for (int side = std::max(width, height); side > PYRAMID_MIN_SIZE; side = (side + 1) / 2) ++count;
+    levels.resize(count);
+
+    int levelWidth = width;
+    int levelHeight = height;
+    for (int i = 0; i < count; ++i) {
+        levelWidth = (levelWidth + 1) / 2;
+        levelHeight = (levelHeight + 1) / 2;
+
+        Level& level = levels[i];
+        level.width = levelWidth;
+        level.height = levelHeight;
+        level.inputRows = 0;
+        level.sums.Resize(levelWidth);
+        level.pixels.Resize((size_t)levelWidth * levelHeight);
+    }
+}
+
+void ThumbnailPyramid::Restart()
+{
+    for (size_t i = 0; i < levels.size(); ++i) levels[i].inputRows = 0;
+}
+
+void ThumbnailPyramid::AddRows(const unsigned char* rows, int count)
+{
+    if (levels.empty()) return;
+    for (int y = 0; y < count; ++y) AddRow(0, rows + (size_t)y * width);
+}
+
+// Pixels on the right and bottom edge of an odd sized level stand in for
+// the missing half of their block, which averages exactly the pixels that
+// are there
+void ThumbnailPyramid::AddRow(size_t index, const unsigned char* row)
+{
+    Level& level = levels[index];
+    int inputWidth = LevelWidth((int)index);
+    int inputHeight = LevelHeight((int)index);
+    int last = inputWidth - 1;
+    unsigned short* sums = level.sums.Data();
+    bool pairStart = level.inputRows % 2 == 0;
+    ++level.inputRows;
+
+    if (pairStart) {
+        for (int x = 0; x < level.width; ++x)
+            sums[x] = (unsigned short)(row[2 * x] + row[std::min(2 * x + 1, last)]);
+        if (level.inputRows < inputHeight) return;
+
+        // Odd last row, paired with itself
+        for (int x = 0; x < level.width; ++x) sums[x] = (unsigned short)(sums[x] * 2);
+    }
+    else {
+        for (int x = 0; x < level.width; ++x)
+            sums[x] = (unsigned short)(sums[x] + row[2 * x] + row[std::min(2 * x + 1, last)]);
+    }
+
+    // Rounded mean of the four pixels, passed straight on down
+    int y = (level.inputRows - 1) / 2;
+    unsigned char* out = &level.pixels[(size_t)y * level.width];
+    for (int x = 0; x < level.width; ++x) out[x] = (unsigned char)((sums[x] + 2) >> 2);
+    if (index + 1 < levels.size()) AddRow(index + 1, out);
+}
+
+int ThumbnailPyramid::PickLevel(int drawWidth, int drawHeight) const
+{
+    int level = 0;
+    while (level + 1 < Levels() && LevelWidth(level + 1) >= drawWidth &&
+           LevelHeight(level + 1) >= drawHeight)
+        ++level;
+    return level;
+}
+
+size_t ThumbnailPyramid::MemoryBytes() const
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < levels.size(); ++i)
+        bytes += levels[i].pixels.Size() + levels[i].sums.Size() * sizeof(unsigned short);
+    return bytes;
+}
+
+void GrayToBgra(const unsigned char* gray, size_t count, unsigned char* bgra)
+{
+    // The pipeline only keeps one gray byte per pixel, so this is where it
+    // gets expanded to BGRA for display
+    for (size_t i = 0; i < count; ++i) {
+        bgra[i * 4] = gray[i];
+        bgra[i * 4 + 1] = gray[i];
+        bgra[i * 4 + 2] = gray[i];
+        bgra[i * 4 + 3] = 255;
+    }
+}
@@ -0,0 +1,72 @@
+// Thumbnails of processed pages, shared by the viewer and the benchmarks
+#ifndef COLFIND_THUMBNAIL_H
+#define COLFIND_THUMBNAIL_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "bufferpool.h"
+
+// Side of the square cells the viewer draws thumbnails in, before zooming
+#define THUMBNAIL_BASE_SIZE 500
+
+// The smallest pyramid level has no side longer than this
+#define PYRAMID_MIN_SIZE 64
+
+// Successive halvings of a luminance plane, each pixel the average of a 2x2
+// block of the level above, keeping the aspect ratio. Level 0 is the plane
+// itself, which the pyramid does not store; level 1 is half its size, and
+// so on down to PYRAMID_MIN_SIZE. Rows are added top to bottom as they are
+// decoded and flow through every level at once, so building the pyramid
+// reads the plane a single time.
+class ThumbnailPyramid {
+public:
+    ThumbnailPyramid();
+
+    // Prepares the levels for a plane of the given size
+    void Begin(int width, int height);
+
+    // Starts the levels over for another plane of the same size, without
+    // allocating
+    void Restart();
+
+    // Adds the next count rows of the plane, width*count bytes
+    void AddRows(const unsigned char* rows, int count);
+
+    // Number of levels, including level 0
+    int Levels() const { return (int)levels.size() + 1; }
+
+    int LevelWidth(int level) const { return level == 0 ? width : levels[level - 1].width; }
+    int LevelHeight(int level) const { return level == 0 ? height : levels[level - 1].height; }
+
+    // Pixels of a level from 1 up, complete once all rows are added
+    const unsigned char* LevelData(int level) const { return levels[level - 1].pixels.Data(); }
+
+    // The smallest level at least as large as the given size on both sides,
+    // so drawing it there never shrinks by more than half. 0 when only the
+    // full plane is large enough.
+    int PickLevel(int drawWidth, int drawHeight) const;
+
+    // Bytes held by the stored levels
+    size_t MemoryBytes() const;
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int inputRows;                      // Rows received from the level above
+        PooledArray<unsigned short> sums;   // Pixel pair sums of an unpaired input row
+        PooledArray<unsigned char> pixels;
+    };
+
+    void AddRow(size_t level, const unsigned char* row);
+
+    int width;
+    int height;
+    std::vector<Level> levels;              // Levels 1 and up
+};
+
+// Expands count luminance bytes to opaque BGRA pixels for display
+void GrayToBgra(const unsigned char* gray, size_t count, unsigned char* bgra);
+
+#endif
@@ -0,0 +1,509 @@
+#include "tiff.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "bitplane.h"
+#include "kernels.h"
+
+// Tags used
+#define TAG_IMAGE_WIDTH 256
+#define TAG_IMAGE_LENGTH 257
+#define TAG_BITS_PER_SAMPLE 258
+#define TAG_COMPRESSION 259
+#define TAG_PHOTOMETRIC 262
+#define TAG_FILL_ORDER 266
+#define TAG_STRIP_OFFSETS 273
+#define TAG_SAMPLES_PER_PIXEL 277
+#define TAG_ROWS_PER_STRIP 278
+#define TAG_STRIP_BYTE_COUNTS 279
+#define TAG_PLANAR_CONFIG 284
+#define TAG_T4_OPTIONS 292
+#define TAG_COLOR_MAP 320
+#define TAG_TILE_WIDTH 322
+#define TAG_TILE_LENGTH 323
+#define TAG_TILE_OFFSETS 324
+#define TAG_TILE_BYTE_COUNTS 325
+
+// Compression values
+#define TIFF_UNCOMPRESSED 1
+#define TIFF_CCITT_RLE 2
+#define TIFF_CCITT_T4 3
+#define TIFF_CCITT_T6 4
+#define TIFF_PACKBITS 32773
+
+// Photometric interpretations
+#define TIFF_WHITE_IS_ZERO 0
+#define TIFF_BLACK_IS_ZERO 1
+#define TIFF_RGB 2
+#define TIFF_PALETTE 3
+
+// Field types
+#define TIFF_BYTE 1
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+
+#define TIFF_HEADER_SIZE 8
+#define TIFF_ENTRY_SIZE 12
+
+TiffReader::TiffReader() :
+    bigEndian(false),
+    pageCount(0),
+    width(0),
+    height(0),
+    compression(TIFF_UNCOMPRESSED),
+    photometric(TIFF_BLACK_IS_ZERO),
+    bitsPerSample(1),
+    samplesPerPixel(1),
+    reverseBits(false),
+    inkSample(1),
+    blockWidth(0),
+    blockHeight(0),
+    blocksAcross(0),
+    blockRowBytes(0),
+    currentBlockRow(-1),
+    nextRow(0)
+{
+    memset(grayLevels, 0, sizeof(grayLevels));
+}
+
+// For FillOrder 2, whose bytes hold their first bit lowest
+static unsigned char ReverseBits(unsigned char b)
+{
+    b = (unsigned char)((b & 0xf0) >> 4 | (b & 0x0f) << 4);
+    b = (unsigned char)((b & 0xcc) >> 2 | (b & 0x33) << 2);
+    return (unsigned char)((b & 0xaa) >> 1 | (b & 0x55) << 1);
+}
+
+bool TiffReader::Fail(const char* message)
+{
+    error = message;
+    Close();
+    return false;
+}
+
+unsigned int TiffReader::Read16(size_t offset) const
+{
+    const unsigned char* p = file.Data() + offset;
+    return bigEndian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+uint32_t TiffReader::Read32(size_t offset) const
+{
+    const unsigned char* p = file.Data() + offset;
+    if (bigEndian)
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool TiffReader::Open(const char* filename, int page)
+{
+    Close();
+    error.clear();
+
+    if (!file.Open(filename)) return Fail("cannot open file");
+    const unsigned char* data = file.Data();
+    size_t size = file.Size();
+    if (size < TIFF_HEADER_SIZE || !((data[0] == 'I' && data[1] == 'I') || (data[0] == 'M' && data[1] == 'M')))
+        return Fail("not a TIFF file");
+    bigEndian = data[0] == 'M';
+    if (Read16(2) != 42) return Fail("not a TIFF file");
+
+    // Walk the chain of pages to count them, keeping the one asked for
+    size_t pageIfd = 0;
+    size_t ifd = Read32(4);
+    while (ifd != 0 && pageCount < TIFF_MAX_PAGES) {
+        if (ifd > size - 2) return Fail("damaged TIFF page list");
+        size_t entries = Read16(ifd);
+        size_t next = ifd + 2 + entries * TIFF_ENTRY_SIZE;
+        if (next > size - 4) return Fail("damaged TIFF page list");
+        if (pageCount == page) pageIfd = ifd;
+        ++pageCount;
+        ifd = Read32(next);
+    }
+    if (page < 0 || page >= pageCount) return Fail("no such page in TIFF file");
+
+    int pages = pageCount;
+    if (!ParsePage(pageIfd)) return false;
+    pageCount = pages;
+    return true;
+}
+
+void TiffReader::Close()
+{
+    file.Close();
+    pageCount = 0;
+    width = 0;
+    height = 0;
+    nextRow = 0;
+    currentBlockRow = -1;
+    blockOffsets.clear();
+    blockSizes.clear();
+}
+
+bool TiffReader::FindField(size_t ifd, int tag, Field& field) const
+{
+    size_t entries = Read16(ifd);
+    for (size_t i = 0; i < entries; ++i) {
+        size_t entry = ifd + 2 + i * TIFF_ENTRY_SIZE;
+        if ((int)Read16(entry) != tag) continue;
+
+        field.type = (int)Read16(entry + 2);
+        field.count = Read32(entry + 4);
+        size_t valueSize = field.type == TIFF_LONG ? 4 : field.type == TIFF_SHORT ? 2 : 1;
+        if (field.count > file.Size() / valueSize) return false;
+
+        // Values that fit in four bytes are kept in the entry itself
+        size_t bytes = field.count * valueSize;
+        field.offset = bytes <= 4 ? entry + 8 : Read32(entry + 8);
+        return field.offset <= file.Size() && bytes <= file.Size() - field.offset;
+    }
+    return false;
+}
+
+bool TiffReader::ReadValues(size_t ifd, int tag, std::vector<uint32_t>& values) const
+{
+    values.clear();
+    Field field;
+    if (!FindField(ifd, tag, field)) return false;
+    if (field.type != TIFF_BYTE && field.type != TIFF_SHORT && field.type != TIFF_LONG) return false;
+
+    values.resize(field.count);
+    for (uint32_t i = 0; i < field.count; ++i) {
+        switch (field.type) {
+        case TIFF_BYTE: values[i] = file.Data()[field.offset + i]; break;
+        case TIFF_SHORT: values[i] = Read16(field.offset + 2 * (size_t)i); break;
+        default: values[i] = Read32(field.offset + 4 * (size_t)i); break;
+        }
+    }
+    return true;
+}
+
+uint32_t TiffReader::ReadValue(size_t ifd, int tag, uint32_t defaultValue) const
+{
+    std::vector<uint32_t> values;
+    if (!ReadValues(ifd, tag, values) || values.empty()) return defaultValue;
+    return values[0];
+}
+
+bool TiffReader::ParsePage(size_t ifd)
+{
+    width = (int)ReadValue(ifd, TAG_IMAGE_WIDTH, 0);
+    height = (int)ReadValue(ifd, TAG_IMAGE_LENGTH, 0);
+    if (width <= 0 || height <= 0 || width > TIFF_MAX_DIMENSION || height > TIFF_MAX_DIMENSION ||
+        (uint64_t)width * height > MAX_PAGE_PIXELS)
+        return Fail("invalid TIFF dimensions");
+
+    compression = (int)ReadValue(ifd, TAG_COMPRESSION, TIFF_UNCOMPRESSED);
+    bitsPerSample = (int)ReadValue(ifd, TAG_BITS_PER_SAMPLE, 1);
+    samplesPerPixel = (int)ReadValue(ifd, TAG_SAMPLES_PER_PIXEL, 1);
+    reverseBits = ReadValue(ifd, TAG_FILL_ORDER, 1) == 2;
+
+    // Fax pages often leave it out, and are then white on zero
+    photometric = (int)ReadValue(ifd, TAG_PHOTOMETRIC,
+                                 bitsPerSample == 1 ? TIFF_WHITE_IS_ZERO : TIFF_BLACK_IS_ZERO);
+
+    bool validFormat;
+    switch (photometric) {
+    case TIFF_WHITE_IS_ZERO:
+    case TIFF_BLACK_IS_ZERO:
+        // An extra alpha sample is skipped
+        validFormat = (bitsPerSample == 8 && (samplesPerPixel == 1 || samplesPerPixel == 2)) ||
+                      ((bitsPerSample == 1 || bitsPerSample == 4) && samplesPerPixel == 1);
+        break;
+    case TIFF_PALETTE:
+        validFormat = (bitsPerSample == 1 || bitsPerSample == 4 || bitsPerSample == 8) &&
+                      samplesPerPixel == 1;
+        break;
+    case TIFF_RGB:
+        validFormat = bitsPerSample == 8 && (samplesPerPixel == 3 || samplesPerPixel == 4);
+        break;
+    default:
+        validFormat = false;
+    }
+    if (!validFormat) return Fail("unsupported TIFF pixel format");
+    if (samplesPerPixel > 1 && ReadValue(ifd, TAG_PLANAR_CONFIG, 1) != 1)
+        return Fail("unsupported TIFF planar layout");
+
+    bool ccitt = compression == TIFF_CCITT_RLE || compression == TIFF_CCITT_T4 ||
+                 compression == TIFF_CCITT_T6;
+    if (!ccitt && compression != TIFF_UNCOMPRESSED && compression != TIFF_PACKBITS)
+        return Fail("unsupported TIFF compression");
+    if (ccitt && bitsPerSample != 1) return Fail("unsupported TIFF pixel format");
+
+    // Strips are tiles as wide as the page
+    Field field;
+    bool tiled = FindField(ifd, TAG_TILE_WIDTH, field);
+    if (tiled) {
+        blockWidth = (int)ReadValue(ifd, TAG_TILE_WIDTH, 0);
+        blockHeight = (int)ReadValue(ifd, TAG_TILE_LENGTH, 0);
+        ReadValues(ifd, TAG_TILE_OFFSETS, blockOffsets);
+        ReadValues(ifd, TAG_TILE_BYTE_COUNTS, blockSizes);
+    }
+    else {
+        blockWidth = width;
+        blockHeight = (int)std::min<uint32_t>(ReadValue(ifd, TAG_ROWS_PER_STRIP, height), height);
+        ReadValues(ifd, TAG_STRIP_OFFSETS, blockOffsets);
+        ReadValues(ifd, TAG_STRIP_BYTE_COUNTS, blockSizes);
+    }
+    if (blockWidth <= 0 || blockHeight <= 0 || blockWidth > TIFF_MAX_DIMENSION ||
+        blockHeight > TIFF_MAX_DIMENSION)
+        return Fail("invalid TIFF strip or tile size");
+
+    blocksAcross = (width + blockWidth - 1) / blockWidth;
+    size_t blocksDown = ((size_t)height + blockHeight - 1) / blockHeight;
+    size_t blockCount = blocksAcross * blocksDown;
+    blockRowBytes = ((size_t)blockWidth * bitsPerSample * samplesPerPixel + 7) / 8;
+
+    // Uncompressed strips may leave out their sizes, which are known anyway
+    // and cut to the file below
+    if (blockSizes.empty() && compression == TIFF_UNCOMPRESSED) {
+        uint64_t blockBytes = (uint64_t)blockRowBytes * blockHeight;
+        blockSizes.assign(blockOffsets.size(), (uint32_t)std::min<uint64_t>(blockBytes, 0xffffffffu));
+    }
+    if (blockOffsets.size() < blockCount || blockSizes.size() < blockCount)
+        return Fail("TIFF page is missing strips or tiles");
+
+    // Blocks that run past the end of the file are cut short, their rows
+    // then fail to decode
+    for (size_t i = 0; i < blockCount; ++i) {
+        if (blockOffsets[i] > file.Size()) return Fail("damaged TIFF strip or tile offsets");
+        blockSizes[i] = (uint32_t)std::min<size_t>(blockSizes[i], file.Size() - blockOffsets[i]);
+    }
+
+    BlockState empty;
+    memset(&empty, 0, sizeof(empty));
+    blocks.assign(blocksAcross, empty);
+    rowBuffer.resize(blockRowBytes);
+    decoders.clear();
+    if (ccitt) {
+        CcittCoding coding = compression == TIFF_CCITT_RLE ? CCITT_MODIFIED_HUFFMAN :
+                             compression == TIFF_CCITT_T4 ? CCITT_T4 : CCITT_T6;
+        bool twoDimensional = (ReadValue(ifd, TAG_T4_OPTIONS, 0) & 1) != 0;
+        decoders.resize(blocksAcross);
+        for (int i = 0; i < blocksAcross; ++i)
+            decoders[i].Begin(blockWidth, coding, twoDimensional, reverseBits);
+    }
+
+    BuildGrayLevels(ifd);
+    currentBlockRow = -1;
+    nextRow = 0;
+    return true;
+}
+
+// Luminance of every value a gray or palette sample can take
+void TiffReader::BuildGrayLevels(size_t ifd)
+{
+    if (photometric == TIFF_RGB) return;
+
+    int levels = 1 << bitsPerSample;
+    std::vector<uint32_t> colorMap;
+    bool palette = photometric == TIFF_PALETTE && ReadValues(ifd, TAG_COLOR_MAP, colorMap) &&
+                   colorMap.size() >= (size_t)levels * 3;
+
+    for (int i = 0; i < levels; ++i) {
+        if (palette) {
+            // 16-bit red, then green, then blue entries
+            grayLevels[i] = (unsigned char)bgrToGrayscale(colorMap[2 * levels + i] >> 8,
+                                                          colorMap[levels + i] >> 8,
+                                                          colorMap[i] >> 8);
+        }
+        else {
+            int level = i * 255 / (levels - 1);
+            grayLevels[i] = (unsigned char)(photometric == TIFF_WHITE_IS_ZERO ? 255 - level : level);
+        }
+    }
+    inkSample = grayLevels[1] < grayLevels[0] ? 1 : 0;
+}
+
+bool TiffReader::StartBlockRow(int blockRow)
+{
+    // The blocks above are done with and can leave memory
+    for (int i = 0; currentBlockRow >= 0 && i < blocksAcross; ++i)
+        file.Release(blocks[i].data - file.Data(), blocks[i].size);
+
+    for (int i = 0; i < blocksAcross; ++i) {
+        size_t index = (size_t)blockRow * blocksAcross + i;
+        BlockState& block = blocks[i];
+        block.data = file.Data() + blockOffsets[index];
+        block.size = blockSizes[index];
+        block.position = 0;
+        block.runLeft = 0;
+        if (!decoders.empty()) decoders[i].Reset(block.data, block.size);
+    }
+    currentBlockRow = blockRow;
+    return true;
+}
+
+// Decodes the next row of an uncompressed or PackBits block into bytes as
+// they would be stored uncompressed, in the order of FillOrder 1. Returns
+// NULL if the data ends first.
+const unsigned char* TiffReader::DecodeBlockBytes(int index)
+{
+    BlockState& block = blocks[index];
+
+    if (compression == TIFF_UNCOMPRESSED) {
+        if (blockRowBytes > block.size - block.position) {
+            error = "TIFF data ends early";
+            return NULL;
+        }
+        const unsigned char* src = block.data + block.position;
+        block.position += blockRowBytes;
+        if (!reverseBits) return src;
+        for (size_t i = 0; i < blockRowBytes; ++i) rowBuffer[i] = ReverseBits(src[i]);
+        return &rowBuffer[0];
+    }
+
+    // PackBits: a count byte n, then n + 1 bytes to copy, or for negative n
+    // one byte to repeat 1 - n times. Runs are not meant to cross rows, but
+    // carrying them over costs nothing. The fill order applies to the coded
+    // bytes, count bytes included, as libtiff has it.
+    unsigned char* row = &rowBuffer[0];
+    size_t done = 0;
+    while (done < blockRowBytes) {
+        if (block.runLeft == 0) {
+            if (block.position >= block.size) break;
+            unsigned char code = block.data[block.position++];
+            int n = (signed char)(reverseBits ? ReverseBits(code) : code);
+            if (n >= 0) {
+                block.runLeft = n + 1;
+                block.literal = true;
+            }
+            else if (n != -128) {
+                if (block.position >= block.size) break;
+                block.runLeft = 1 - n;
+                block.literal = false;
+                block.repeat = block.data[block.position++];
+                if (reverseBits) block.repeat = ReverseBits(block.repeat);
+            }
+            continue;
+        }
+
+        size_t take = std::min((size_t)block.runLeft, blockRowBytes - done);
+        if (block.literal) {
+            if (take > block.size - block.position) break;
+            const unsigned char* src = block.data + block.position;
+            if (reverseBits) {
+                for (size_t i = 0; i < take; ++i) row[done + i] = ReverseBits(src[i]);
+            }
+            else {
+                memcpy(row + done, src, take);
+            }
+            block.position += take;
+        }
+        else {
+            memset(row + done, block.repeat, take);
+        }
+        block.runLeft -= (int)take;
+        done += take;
+    }
+    if (done < blockRowBytes) {
+        error = "TIFF data ends early";
+        return NULL;
+    }
+    return row;
+}
+
+// Decodes the next row of a block, of which count pixels are on the page
+bool TiffReader::DecodeBlockRow(int index, unsigned char* gray, int count)
+{
+    if (!decoders.empty()) {
+        // Runs go straight into the row, black ones are the 1 bits
+        if (!decoders[index].DecodeRow()) {
+            error = "damaged CCITT data";
+            return false;
+        }
+        decoders[index].FillRow(gray, count, grayLevels[0], grayLevels[1]);
+        return true;
+    }
+
+    const unsigned char* src = DecodeBlockBytes(index);
+    if (src == NULL) return false;
+    ConvertRow(src, gray, count);
+    return true;
+}
+
+// Same for a bilevel page, into ink bits from pixel x on
+bool TiffReader::DecodeBlockInkRow(int index, uint64_t* ink, int x, int count)
+{
+    if (!decoders.empty()) {
+        if (!decoders[index].DecodeRow()) {
+            error = "damaged CCITT data";
+            return false;
+        }
+        decoders[index].MarkRuns(ink, x, count, inkSample == 1);
+        return true;
+    }
+
+    const unsigned char* src = DecodeBlockBytes(index);
+    if (src == NULL) return false;
+
+    // Eight pixels a byte, the first one in its top bit where ink bits have
+    // it in the bottom one. Blocks start on whole bytes of the row except in
+    // odd tiled files, whose bytes can straddle two words.
+    unsigned char flip = inkSample == 1 ? 0 : 0xff;
+    for (int i = 0; 8 * i < count; ++i) {
+        uint64_t bits = ReverseBits((unsigned char)(src[i] ^ flip));
+        if (count - 8 * i < 8) bits &= (1u << (count - 8 * i)) - 1;
+        int position = x + 8 * i;
+        int shift = position % BITS_PER_WORD;
+        ink[position / BITS_PER_WORD] |= bits << shift;
+        if (shift > BITS_PER_WORD - 8 && (bits >> (BITS_PER_WORD - shift)) != 0)
+            ink[position / BITS_PER_WORD + 1] |= bits >> (BITS_PER_WORD - shift);
+    }
+    return true;
+}
+
+void TiffReader::ConvertRow(const unsigned char* src, unsigned char* gray, int count) const
+{
+    if (photometric == TIFF_RGB) {
+        for (int x = 0; x < count; ++x) {
+            const unsigned char* pixel = src + (size_t)x * samplesPerPixel;
+            gray[x] = (unsigned char)bgrToGrayscale(pixel[2], pixel[1], pixel[0]);
+        }
+        return;
+    }
+
+    switch (bitsPerSample) {
+    case 8:
+        for (int x = 0; x < count; ++x) gray[x] = grayLevels[src[(size_t)x * samplesPerPixel]];
+        break;
+    case 4:
+        for (int x = 0; x < count; ++x) gray[x] = grayLevels[(src[x >> 1] >> (x & 1 ? 0 : 4)) & 15];
+        break;
+    default:
+        for (int x = 0; x < count; ++x) gray[x] = grayLevels[(src[x >> 3] >> (7 - (x & 7))) & 1];
+        break;
+    }
+}
+
+bool TiffReader::ReadGrayRow(unsigned char* gray)
+{
+    if (nextRow >= height) return false;
+
+    int blockRow = nextRow / blockHeight;
+    if (blockRow != currentBlockRow) StartBlockRow(blockRow);
+
+    for (int i = 0; i < blocksAcross; ++i) {
+        int x = i * blockWidth;
+        if (!DecodeBlockRow(i, gray + x, std::min(blockWidth, width - x))) return false;
+    }
+    ++nextRow;
+    return true;
+}
+
+bool TiffReader::ReadInkRow(uint64_t* ink)
+{
+    if (nextRow >= height) return false;
+
+    int blockRow = nextRow / blockHeight;
+    if (blockRow != currentBlockRow) StartBlockRow(blockRow);
+
+    memset(ink, 0, WordsForWidth(width) * sizeof(uint64_t));
+    for (int i = 0; i < blocksAcross; ++i) {
+        int x = i * blockWidth;
+        if (!DecodeBlockInkRow(i, ink, x, std::min(blockWidth, width - x))) return false;
+    }
+    ++nextRow;
+    return true;
+}
@@ -0,0 +1,111 @@
+// Streaming reader for the pages of TIFF files, with no external library.
+// Handles strips and tiles, uncompressed, PackBits and CCITT (Modified
+// Huffman, Group 3 and Group 4) data, in bilevel, grayscale, palette and RGB
+// pages. The file is memory mapped and each row is decoded straight to
+// luminance when it is read, so a long multi-page file streams through a
+// page at a time and rows are never expanded to BGRA.
+#ifndef COLFIND_TIFF_H
+#define COLFIND_TIFF_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ccitt.h"
+#include "platform.h"
+#include "rowsource.h"
+
+// Largest width or height accepted, to keep buffer sizes sane on bad input
+#define TIFF_MAX_DIMENSION 1000000
+
+// Pages beyond this many are ignored, which also stops looping page chains
+#define TIFF_MAX_PAGES 65536
+
+class TiffReader : public RowSource {
+public:
+    TiffReader();
+
+    // Maps the file and parses the headers of the given page, counting from
+    // 0. On failure returns false and Error() describes why.
+    bool Open(const char* filename, int page = 0);
+    void Close();
+
+    // Pages in the file, known once it is open
+    int PageCount() const { return pageCount; }
+
+    virtual int Width() const { return width; }
+    virtual int Height() const { return height; }
+    virtual const std::string& Error() const { return error; }
+
+    // Decodes the next row of the page to width bytes of luminance
+    virtual bool ReadGrayRow(unsigned char* gray);
+
+    // Bilevel pages can also be read as ink bits, CCITT ones run by run
+    virtual bool HasInkRows() const { return bitsPerSample == 1; }
+    virtual bool ReadInkRow(uint64_t* ink);
+
+private:
+    TiffReader(const TiffReader&);
+    TiffReader& operator=(const TiffReader&);
+
+    // What is known about a tag of the page being parsed
+    struct Field {
+        int type;
+        uint32_t count;
+        size_t offset;      // Of the values, within the entry itself if they fit
+    };
+
+    bool Fail(const char* message);
+    unsigned int Read16(size_t offset) const;
+    uint32_t Read32(size_t offset) const;
+    bool FindField(size_t ifd, int tag, Field& field) const;
+    bool ReadValues(size_t ifd, int tag, std::vector<uint32_t>& values) const;
+    uint32_t ReadValue(size_t ifd, int tag, uint32_t defaultValue) const;
+    bool ParsePage(size_t ifd);
+    void BuildGrayLevels(size_t ifd);
+    bool StartBlockRow(int blockRow);
+    const unsigned char* DecodeBlockBytes(int block);
+    bool DecodeBlockRow(int block, unsigned char* gray, int count);
+    bool DecodeBlockInkRow(int block, uint64_t* ink, int x, int count);
+    void ConvertRow(const unsigned char* src, unsigned char* gray, int count) const;
+
+    MappedFile file;
+    std::string error;
+    bool bigEndian;
+    int pageCount;
+
+    int width;
+    int height;
+    int compression;
+    int photometric;
+    int bitsPerSample;
+    int samplesPerPixel;
+    bool reverseBits;           // FillOrder 2, lowest bit first
+    unsigned char grayLevels[256];  // Luminance of every sample value
+    int inkSample;              // Value of the darker pixels of a bilevel page
+
+    // Strips are handled as tiles as wide as the page
+    int blockWidth;
+    int blockHeight;
+    int blocksAcross;
+    size_t blockRowBytes;       // Bytes of one row of a block, uncompressed
+    std::vector<uint32_t> blockOffsets;
+    std::vector<uint32_t> blockSizes;
+
+    // Decoding state of the blocks in the current row of blocks
+    struct BlockState {
+        const unsigned char* data;
+        size_t size;
+        size_t position;        // Bytes used so far, PackBits and uncompressed
+        int runLeft;            // Bytes left of the current PackBits run
+        bool literal;           // Whether that run copies bytes or repeats one
+        unsigned char repeat;
+    };
+    std::vector<BlockState> blocks;
+    std::vector<CcittDecoder> decoders;
+    std::vector<unsigned char> rowBuffer;   // One decoded row of a block
+    int currentBlockRow;
+    int nextRow;
+};
+
+#endif
@@ -0,0 +1,1251 @@
+// Differential checks of every optimized path of the pipeline against the
+// reference version (see reference.h), on random and synthetic pages of
+// awkward sizes, and a fuzzer for the image decoders. Runs headless; exits
+// with 1 if anything differs, so every change to a fast path can show that
+// it still finds exactly the same columns.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bmp.h"
+#include "image.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "platform.h"
+#include "reference.h"
+#include "server.h"
+#include "skew.h"
+#include "stages.h"
+#include "synth.h"
+#include "threadpool.h"
+
+#define DEFAULT_PAGES 200
+#define DEFAULT_FUZZ_RUNS 2000
+#define DEFAULT_TEMP_FILE "colfind_verify.tmp"
+
+// Largest random page, kept small so that the reference smear stays quick
+#define MAX_RANDOM_WIDTH 700
+#define MAX_RANDOM_HEIGHT 300
+
+// Pixels decoded from a fuzzed page at most, as damaged headers can claim
+// pages of a million by a million
+#define FUZZ_MAX_PIXELS (1 << 22)
+
+// Pages of a fuzzed file looked at, at most
+#define FUZZ_MAX_PAGES 4
+
+// Widths and heights where vector loops, words of ink bits, bands of
+// columns and the smear's start-up rows have their edges
+static const int edgeWidths[] = { 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                                  127, 128, 129, 191, 255, 257 };
+static const int edgeHeights[] = { 1, 2, 3, 39, 40, 41, 54, 55, 56, 63, 64, 65, 127, 129 };
+
+#define COUNT_OF(array) ((int)(sizeof(array) / sizeof(array[0])))
+
+// Small deterministic generator, so a seed gives the same pages everywhere
+class Random {
+public:
+    explicit Random(unsigned int seed) : state(seed * 2654435761u + 1) {}
+
+    uint32_t Next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // Uniform in [0, n)
+    int Below(int n) { return n > 0 ? (int)(Next() % (uint32_t)n) : 0; }
+
+    int Between(int low, int high) { return low + Below(high - low + 1); }
+
+private:
+    uint32_t state;
+};
+
+// Mismatches found so far, each reported as it is found
+static int failures = 0;
+
+// Pages of the decoder checks that opened, and that decoded in full
+static int openedPages = 0;
+static int decodedPages = 0;
+
+static void Fail(const std::string& what, const char* format, ...)
+{
+    ++failures;
+    char detail[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(detail, sizeof(detail), format, args);
+    va_end(args);
+    fprintf(stderr, "MISMATCH %s: %s\n", what.c_str(), detail);
+}
+
+// A luminance plane handed out row by row, as a decoder would, optionally
+// as ink bits of the pixels darker than mid-gray, as bilevel pages are
+class MemoryRowSource : public RowSource {
+public:
+    MemoryRowSource(const std::vector<unsigned char>& gray, int width, int height, bool inkRows) :
+        gray(gray),
+        width(width),
+        height(height),
+        inkRows(inkRows),
+        nextRow(0) {}
+
+    virtual int Width() const { return width; }
+    virtual int Height() const { return height; }
+    virtual const std::string& Error() const { return error; }
+
+    virtual bool ReadGrayRow(unsigned char* row) {
+        if (nextRow >= height) return false;
+        memcpy(row, &gray[(size_t)nextRow++ * width], width);
+        return true;
+    }
+
+    virtual bool HasInkRows() const { return inkRows; }
+
+    virtual bool ReadInkRow(uint64_t* ink) {
+        if (nextRow >= height) return false;
+        memset(ink, 0, WordsForWidth(width) * sizeof(uint64_t));
+        const unsigned char* row = &gray[(size_t)nextRow++ * width];
+        for (int x = 0; x < width; ++x) {
+            if (row[x] < 128) ink[x / BITS_PER_WORD] |= (uint64_t)1 << (x % BITS_PER_WORD);
+        }
+        return true;
+    }
+
+private:
+    const std::vector<unsigned char>& gray;
+    int width;
+    int height;
+    bool inkRows;
+    int nextRow;
+    std::string error;
+};
+
+// A page to check and the parameters to check it with
+struct TestPage {
+    std::string name;
+    int width;
+    int height;
+    std::vector<unsigned char> gray;
+    PipelineParams params;
+};
+
+static void MakeTestPage(int index, Random& random, TestPage& page)
+{
+    page.width = random.Below(3) == 0 ? edgeWidths[random.Below(COUNT_OF(edgeWidths))] :
+                                        random.Between(1, MAX_RANDOM_WIDTH);
+    page.height = random.Below(3) == 0 ? edgeHeights[random.Below(COUNT_OF(edgeHeights))] :
+                                         random.Between(1, MAX_RANDOM_HEIGHT);
+    size_t pixels = (size_t)page.width * page.height;
+    page.gray.resize(pixels);
+
+    const char* kind;
+    switch (random.Below(5)) {
+    case 0:
+        kind = "noise";
+        for (size_t i = 0; i < pixels; ++i) page.gray[i] = (unsigned char)random.Below(256);
+        break;
+    case 1: {
+        // Blocks of dark text in lines and columns on grainy paper
+        kind = "blocks";
+        int lineHeight = random.Between(2, 30);
+        int columnWidth = random.Between(2, 80);
+        int gutter = random.Between(1, 30);
+        for (int y = 0; y < page.height; ++y) {
+            for (int x = 0; x < page.width; ++x) {
+                bool text = y % lineHeight < lineHeight * 2 / 3 && x % (columnWidth + gutter) < columnWidth;
+                page.gray[(size_t)y * page.width + x] =
+                    (unsigned char)(text ? random.Below(90) : random.Between(180, 255));
+            }
+        }
+        break;
+    }
+    case 2: {
+        kind = "bilevel";
+        int density = random.Between(1, 99);
+        for (size_t i = 0; i < pixels; ++i) page.gray[i] = random.Below(100) < density ? 0 : 255;
+        break;
+    }
+    case 3: {
+        kind = "flat";
+        unsigned char value = (unsigned char)random.Below(256);
+        for (size_t i = 0; i < pixels; ++i) page.gray[i] = value;
+        break;
+    }
+    default: {
+        // Rendered text, possibly skewed, scaled down to a few pixels a glyph
+        kind = "synthetic";
+        SynthParams synth;
+        synth.dpi = random.Between(20, 80);
+        synth.width = std::max(page.width, 16);
+        synth.height = std::max(page.height, 16);
+        synth.columns = random.Between(1, 4);
+        synth.grain = random.Below(20);
+        synth.specks = random.Below(200);
+        synth.skew = random.Below(3) == 0 ? (random.Below(41) - 20) / 10.0 : 0;
+        synth.rules = random.Below(2) == 0;
+        synth.seed = random.Next();
+        std::vector<unsigned char> rendered;
+        RenderSyntheticPage(synth, rendered, NULL);
+        for (int y = 0; y < page.height; ++y)
+            memcpy(&page.gray[(size_t)y * page.width], &rendered[(size_t)y * synth.width], page.width);
+        break;
+    }
+    }
+
+    // Smear lengths of 0, 1 and past the limit included
+    static const int maxVerts[] = { 0, 1, 2, DEFAULT_MAX_VERT, MAX_VERT_LIMIT, MAX_VERT_LIMIT + 5 };
+    page.params.maxVert = random.Below(2) == 0 ? maxVerts[random.Below(COUNT_OF(maxVerts))] :
+                                                 random.Between(0, MAX_VERT_LIMIT);
+    page.params.threshold = random.Below(81);
+    page.params.binarize = (BinarizeMode)random.Below(3);
+
+    char name[128];
+    sprintf(name, "page %d (%s %dx%d, -v %d -t %d -b %s)", index, kind,
+             page.width, page.height, page.params.maxVert, page.params.threshold,
+             BinarizeModeName(page.params.binarize));
+    page.name = name;
+}
+
+static void CompareColumns(const std::string& what, const std::vector<ColumnRect>& expected,
+                           const std::vector<ColumnRect>& actual)
+{
+    if (actual.size() != expected.size()) {
+        Fail(what, "%d columns instead of %d", (int)actual.size(), (int)expected.size());
+        return;
+    }
+    for (size_t i = 0; i < actual.size(); ++i) {
+        const ColumnRect& e = expected[i];
+        const ColumnRect& a = actual[i];
+        if (a.x0 != e.x0 || a.x1 != e.x1 || a.y0 != e.y0 || a.y1 != e.y1 || a.confidence != e.confidence) {
+            Fail(what, "column %d is %d,%d-%d,%d (%g) instead of %d,%d-%d,%d (%g)", (int)i,
+                 a.x0, a.y0, a.x1, a.y1, a.confidence, e.x0, e.y0, e.x1, e.y1, e.confidence);
+            return;
+        }
+    }
+}
+
+static void ComparePlanes(const std::string& what, const char* plane, const unsigned char* expected,
+                          const unsigned char* actual, int width, int height)
+{
+    for (size_t i = 0; i < (size_t)width * height; ++i) {
+        if (actual[i] != expected[i]) {
+            Fail(what, "%s pixel %d,%d is %d instead of %d", plane, (int)(i % width), (int)(i / width),
+                 actual[i], expected[i]);
+            return;
+        }
+    }
+}
+
+static void CompareProfile(const std::string& what, const ReferenceResult& expected,
+                           const ColumnProfile& actual)
+{
+    if (actual.Rows() != expected.height) {
+        Fail(what, "profile has %d rows instead of %d", actual.Rows(), expected.height);
+        return;
+    }
+    for (int x = 0; x < expected.width; ++x) {
+        if (actual.Darkness(x) != expected.darkness[x] || actual.FirstRow(x) != expected.firstRow[x] ||
+            actual.LastRow(x) != expected.lastRow[x]) {
+            Fail(what, "profile column %d is %u, rows %d-%d instead of %u, rows %d-%d", x,
+                 actual.Darkness(x), actual.FirstRow(x), actual.LastRow(x),
+                 expected.darkness[x], expected.firstRow[x], expected.lastRow[x]);
+            return;
+        }
+    }
+}
+
+static std::string Describe(const TestPage& page, const char* path, KernelLevel level, ThreadPool* pool)
+{
+    char text[96];
+    sprintf(text, ", %s, %s kernels, %d threads", path, KernelLevelName(level),
+             pool != NULL ? pool->ThreadCount() : 1);
+    return page.name + text;
+}
+
+// Cuts a page into strips of random heights, multiples of STRIP_ROWS when
+// the Otsu threshold needs them, and feeds them to a StripProcessor
+static void CheckStrips(const TestPage& page, const ReferenceResult& expected, KernelLevel level,
+                        ThreadPool* pool, bool keepSmear, Random& random)
+{
+    std::string what = Describe(page, keepSmear ? "strips" : "strips without smear", level, pool);
+    StripProcessor processor;
+    processor.Begin(page.width, page.params, pool);
+    std::vector<unsigned char> smear(keepSmear ? page.gray.size() : 0);
+
+    for (int y = 0; y < page.height;) {
+        int count = page.params.binarize == BINARIZE_OTSU ? STRIP_ROWS * random.Between(1, 3) :
+                                                            random.Between(1, 3 * STRIP_ROWS);
+        count = std::min(count, page.height - y);
+        processor.ProcessRows(&page.gray[(size_t)y * page.width],
+                              keepSmear ? &smear[(size_t)y * page.width] : NULL, count);
+        y += count;
+    }
+    std::vector<ColumnRect> columns;
+    processor.Finish(columns);
+
+    CompareProfile(what, expected, processor.Profile());
+    CompareColumns(what, expected.columns, columns);
+    if (keepSmear) ComparePlanes(what, "smeared", &expected.smear[0], &smear[0], page.width, page.height);
+}
+
+// Redoes the page's stages with other parameters, as the viewer does when a
+// slider moves, and compares with the reference run with those
+static void CheckStages(const TestPage& page, const ReferenceResult& before, KernelLevel level,
+                        ThreadPool* pool, Random& random)
+{
+    PipelineParams next = page.params;
+    int change = random.Between(1, 3);
+    if (change & 1) next.maxVert = random.Between(0, MAX_VERT_LIMIT);
+    if (change & 2) next.threshold = random.Below(81);
+
+    ReferenceResult expected;
+    RunReferencePipeline(&page.gray[0], page.width, page.height, next, expected);
+
+    // The profile kept from the first run, rebuilt from the reference
+    StripProcessor processor;
+    processor.Begin(page.width, page.params, pool);
+    std::vector<unsigned char> smear(before.smear);
+    processor.ProcessRows(&page.gray[0], NULL, page.height);
+    std::vector<ColumnRect> columns;
+    processor.Finish(columns);
+
+    PageStages stages;
+    stages.Adopt(processor.Profile(), page.params);
+    char text[64];
+    sprintf(text, "stages to -v %d -t %d", next.maxVert, next.threshold);
+    std::string what = Describe(page, text, level, pool);
+    if (stages.Prepare(next, pool) != 0) {
+        stages.Run(&page.gray[0], &smear[0], page.height);
+        stages.Finish(columns);
+    }
+    CompareColumns(what, expected.columns, columns);
+    ComparePlanes(what, "smeared", &expected.smear[0], &smear[0], page.width, page.height);
+}
+
+static bool WriteFile(const std::string& path, const std::vector<unsigned char>& data)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) return false;
+    bool written = data.empty() || fwrite(&data[0], 1, data.size(), file) == data.size();
+    return fclose(file) == 0 && written;
+}
+
+// Runs one page through every path at every kernel level and thread count
+static void CheckPage(const TestPage& page, const std::vector<ThreadPool*>& pools,
+                      const std::string& tempFile, Random& random)
+{
+    ReferenceResult expected;
+    RunReferencePipeline(&page.gray[0], page.width, page.height, page.params, expected);
+    bool binarizing = page.params.binarize != BINARIZE_NONE;
+
+    for (int l = KERNELS_SCALAR; l <= GetSupportedKernelLevel(); ++l) {
+        KernelLevel level = (KernelLevel)l;
+        SetKernelLevel(level);
+        for (size_t p = 0; p < pools.size(); ++p) {
+            ThreadPool* pool = pools[p];
+
+            // The whole plane at once, smeared into a plane of its own
+            std::string what = Describe(page, "plane", level, pool);
+            std::vector<unsigned char> smear(page.gray.size(), 7);
+            std::vector<ColumnRect> columns;
+            ProcessPlane(&page.gray[0], &smear[0], page.width, page.height, page.params, columns, pool);
+            CompareColumns(what, expected.columns, columns);
+            ComparePlanes(what, "smeared", &expected.smear[0], &smear[0], page.width, page.height);
+
+            CheckStrips(page, expected, level, pool, random.Below(2) == 0, random);
+
+            // Streamed from a decoder
+            what = Describe(page, "stream", level, pool);
+            MemoryRowSource source(page.gray, page.width, page.height, false);
+            std::string error;
+            if (!ProcessStream(source, page.params, columns, error, pool)) Fail(what, "%s", error.c_str());
+            else CompareColumns(what, expected.columns, columns);
+
+            if (binarizing) {
+                // Bilevel pages skip the binarization
+                what = Describe(page, "ink rows", level, pool);
+                std::vector<unsigned char> ink(page.gray.size());
+                for (size_t i = 0; i < ink.size(); ++i) ink[i] = page.gray[i] < 128;
+                ReferenceResult inkExpected;
+                RunReferenceInkPipeline(&ink[0], page.width, page.height, page.params, inkExpected);
+                MemoryRowSource inkSource(page.gray, page.width, page.height, true);
+                if (!ProcessStream(inkSource, page.params, columns, error, pool)) Fail(what, "%s", error.c_str());
+                else CompareColumns(what, inkExpected.columns, columns);
+            }
+            else {
+                CheckStages(page, expected, level, pool, random);
+            }
+        }
+    }
+
+    // Through the file decoder, at the best kernel level only
+    int bitCount = random.Below(2) == 0 ? 8 : 24;
+    std::string error;
+    if (!SaveBmpGray(tempFile.c_str(), &page.gray[0], page.width, page.height, bitCount, error)) {
+        Fail(page.name, "%s", error.c_str());
+        return;
+    }
+    for (size_t p = 0; p < pools.size(); ++p) {
+        PageResult result;
+        std::string what = Describe(page, bitCount == 8 ? "8-bit file" : "24-bit file",
+                                    GetKernelLevel(), pools[p]);
+        if (!ProcessFile(tempFile.c_str(), 0, page.params, result, error, pools[p])) Fail(what, "%s", error.c_str());
+        else CompareColumns(what, expected.columns, result.columns);
+    }
+
+    // Along a random skew, and deskewed along the one estimated for the page
+    double slope = random.Between(-30, 30) / 100.0;
+    ReferenceResult skewed;
+    RunReferenceSkewPipeline(&page.gray[0], page.width, page.height, slope, page.params, skewed);
+    ThumbnailPyramid pyramid;
+    pyramid.Begin(page.width, page.height);
+    pyramid.AddRows(&page.gray[0], page.height);
+    double estimated = EstimateSkew(&page.gray[0], page.width, page.height, pyramid);
+    ReferenceResult deskewed;
+    RunReferenceSkewPipeline(&page.gray[0], page.width, page.height, estimated, page.params, deskewed);
+    PipelineParams deskewParams = page.params;
+    deskewParams.deskew = true;
+    for (size_t p = 0; p < pools.size(); ++p) {
+        char text[64];
+        sprintf(text, "slope %g", slope);
+        std::string what = Describe(page, text, GetKernelLevel(), pools[p]);
+        std::vector<ColumnRect> columns;
+        FindColumnsAlongSkew(&page.gray[0], page.width, page.height, slope, page.params, columns,
+                             pools[p]);
+        CompareColumns(what, skewed.columns, columns);
+
+        sprintf(text, "deskewed stream, slope %g", estimated);
+        what = Describe(page, text, GetKernelLevel(), pools[p]);
+        MemoryRowSource source(page.gray, page.width, page.height, false);
+        if (!ProcessStream(source, deskewParams, columns, error, pools[p])) Fail(what, "%s", error.c_str());
+        else CompareColumns(what, deskewed.columns, columns);
+    }
+}
+
+// Appends little or big-endian integers to a file being built
+static void Put16(std::vector<unsigned char>& data, uint32_t value, bool bigEndian = false)
+{
+    data.push_back((unsigned char)(bigEndian ? value >> 8 : value));
+    data.push_back((unsigned char)(bigEndian ? value : value >> 8));
+}
+
+static void Put32(std::vector<unsigned char>& data, uint32_t value, bool bigEndian = false)
+{
+    if (bigEndian) {
+        Put16(data, value >> 16, true);
+        Put16(data, value & 0xffff, true);
+    }
+    else {
+        Put16(data, value & 0xffff);
+        Put16(data, value >> 16);
+    }
+}
+
+static void Set32(std::vector<unsigned char>& data, size_t offset, uint32_t value, bool bigEndian)
+{
+    std::vector<unsigned char> bytes;
+    Put32(bytes, value, bigEndian);
+    memcpy(&data[offset], &bytes[0], 4);
+}
+
+// A file for the decoders, and what they should make of its first page if
+// that is known exactly
+struct DecoderSeed {
+    std::string name;
+    std::vector<unsigned char> data;
+    int width;
+    int height;
+    std::vector<unsigned char> gray;    // Empty if the luminance is not checked
+
+    DecoderSeed() :
+        width(0),
+        height(0) {}
+};
+
+// A .bmp of random pixels, which runs of equal pixels in compressed ones
+#define BMP_CORE 100    // OS/2 header, for the compression argument
+static void MakeBmpSeed(const char* name, int width, int height, int bitCount, int compression,
+                        bool topDown, Random& random, std::vector<DecoderSeed>& seeds)
+{
+    DecoderSeed seed;
+    seed.name = name;
+    seed.width = width;
+    seed.height = height;
+    bool core = compression == BMP_CORE;
+    if (core) compression = 0;
+    bool rle = compression == 1 || compression == 2;
+    bool bitfields = compression == 3;
+    int colors = bitCount <= 8 ? 1 << bitCount : 0;
+
+    // Palette entries, then per pixel a palette index or a packed color
+    std::vector<unsigned char> palette((size_t)colors * 3);
+    for (size_t i = 0; i < palette.size(); ++i) palette[i] = (unsigned char)random.Below(256);
+    std::vector<uint32_t> pixels((size_t)width * height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width;) {
+            uint32_t value = colors > 0 ? (uint32_t)random.Below(colors) : random.Next();
+            int run = rle ? random.Between(1, 12) : 1;
+            for (; run > 0 && x < width; --run) pixels[(size_t)y * width + x++] = value;
+        }
+    }
+    if (colors > 0 || bitCount == 24 || (bitCount == 32 && !bitfields)) {
+        seed.gray.resize(pixels.size());
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            const unsigned char* bgr = colors > 0 ? &palette[pixels[i] * 3] : NULL;
+            int blue = bgr ? bgr[0] : (int)(pixels[i] & 0xff);
+            int green = bgr ? bgr[1] : (int)(pixels[i] >> 8 & 0xff);
+            int red = bgr ? bgr[2] : (int)(pixels[i] >> 16 & 0xff);
+            seed.gray[i] = (unsigned char)bgrToGrayscale(blue, green, red);
+        }
+    }
+
+    // Pixel data, stored bottom-up unless topDown
+    std::vector<unsigned char> bits;
+    for (int i = 0; i < height; ++i) {
+        const uint32_t* row = &pixels[(size_t)(topDown ? i : height - 1 - i) * width];
+        if (rle) {
+            for (int x = 0; x < width;) {
+                int run = 1;
+                while (x + run < width && run < 255 && row[x + run] == row[x]) ++run;
+                if (run == 1 && width - x >= 4) {
+                    // Four pixels in absolute mode, which keeps it word aligned
+                    bits.push_back(0);
+                    bits.push_back(4);
+                    if (compression == 1) {
+                        for (int k = 0; k < 4; ++k) bits.push_back((unsigned char)row[x + k]);
+                    }
+                    else {
+                        bits.push_back((unsigned char)(row[x] << 4 | row[x + 1]));
+                        bits.push_back((unsigned char)(row[x + 2] << 4 | row[x + 3]));
+                    }
+                    x += 4;
+                    continue;
+                }
+                bits.push_back((unsigned char)run);
+                bits.push_back((unsigned char)(compression == 1 ? row[x] : row[x] << 4 | row[x]));
+                x += run;
+            }
+            bits.push_back(0);
+            bits.push_back(i + 1 < height ? 0 : 1);     // End of line, or of the bitmap
+            continue;
+        }
+        std::vector<unsigned char> packed((((size_t)width * bitCount + 31) / 32) * 4, 0);
+        for (int x = 0; x < width; ++x) {
+            uint32_t value = row[x];
+            if (bitCount < 8) {
+                int bit = x * bitCount;
+                packed[bit / 8] |= (unsigned char)(value << (8 - bitCount - bit % 8));
+            }
+            else {
+                for (int b = 0; b < bitCount / 8; ++b)
+                    packed[(size_t)x * (bitCount / 8) + b] = (unsigned char)(value >> (8 * b));
+            }
+        }
+        bits.insert(bits.end(), packed.begin(), packed.end());
+    }
+
+    std::vector<unsigned char>& data = seed.data;
+    int infoSize = core ? 12 : 40;
+    size_t dataOffset = 14 + infoSize + (bitfields ? 12 : 0) + (size_t)colors * (core ? 3 : 4);
+    data.push_back('B');
+    data.push_back('M');
+    Put32(data, (uint32_t)(dataOffset + bits.size()));
+    Put32(data, 0);
+    Put32(data, (uint32_t)dataOffset);
+    Put32(data, infoSize);
+    if (core) {
+        Put16(data, width);
+        Put16(data, height);
+        Put16(data, 1);
+        Put16(data, bitCount);
+    }
+    else {
+        Put32(data, width);
+        Put32(data, topDown ? (uint32_t)-height : (uint32_t)height);
+        Put16(data, 1);
+        Put16(data, bitCount);
+        Put32(data, compression);
+        Put32(data, rle ? (uint32_t)bits.size() : 0);
+        Put32(data, 2835);
+        Put32(data, 2835);
+        Put32(data, colors);
+        Put32(data, 0);
+    }
+    if (bitfields) {
+        // 5-6-5 for 16-bit pixels, and an unusual order for 32-bit ones
+        Put32(data, bitCount == 16 ? 0xf800 : 0x0000ff00);
+        Put32(data, bitCount == 16 ? 0x07e0 : 0x00ff0000);
+        Put32(data, bitCount == 16 ? 0x001f : 0xff000000);
+    }
+    for (int i = 0; i < colors; ++i) {
+        data.insert(data.end(), &palette[i * 3], &palette[i * 3] + 3);
+        if (!core) data.push_back(0);
+    }
+    data.insert(data.end(), bits.begin(), bits.end());
+    seeds.push_back(seed);
+}
+
+// A tag of a TIFF page being built
+struct TiffField {
+    int tag;
+    int type;       // 3 for SHORT, 4 for LONG
+    std::vector<uint32_t> values;
+};
+
+// A TIFF page: its tags without the strip or tile offsets and sizes, which
+// are filled in for the given blocks
+struct TiffPage {
+    std::vector<TiffField> fields;
+    std::vector<std::vector<unsigned char> > blocks;
+    bool tiled;
+
+    TiffPage() : tiled(false) {}
+
+    void Add(int tag, uint32_t value) { Add(tag, 3, std::vector<uint32_t>(1, value)); }
+
+    void Add(int tag, int type, const std::vector<uint32_t>& values) {
+        TiffField field;
+        field.tag = tag;
+        field.type = type;
+        field.values = values;
+        fields.push_back(field);
+    }
+};
+
+static bool TagBefore(const TiffField& a, const TiffField& b)
+{
+    return a.tag < b.tag;
+}
+
+static void BuildTiff(std::vector<TiffPage> pages, bool bigEndian, std::vector<unsigned char>& data)
+{
+    data.clear();
+    data.push_back(bigEndian ? 'M' : 'I');
+    data.push_back(bigEndian ? 'M' : 'I');
+    Put16(data, 42, bigEndian);
+    Put32(data, 0, bigEndian);
+    size_t nextLink = 4;
+
+    for (size_t p = 0; p < pages.size(); ++p) {
+        TiffPage& page = pages[p];
+        std::vector<uint32_t> offsets, sizes;
+        for (size_t b = 0; b < page.blocks.size(); ++b) {
+            offsets.push_back((uint32_t)data.size());
+            sizes.push_back((uint32_t)page.blocks[b].size());
+            data.insert(data.end(), page.blocks[b].begin(), page.blocks[b].end());
+        }
+        page.Add(page.tiled ? 324 : 273, 4, offsets);
+        page.Add(page.tiled ? 325 : 279, 4, sizes);
+        std::sort(page.fields.begin(), page.fields.end(), TagBefore);
+
+        if (data.size() % 2) data.push_back(0);
+        Set32(data, nextLink, (uint32_t)data.size(), bigEndian);
+        size_t ifd = data.size();
+        size_t extra = ifd + 2 + page.fields.size() * 12 + 4;
+        std::vector<unsigned char> values;
+        Put16(data, (uint32_t)page.fields.size(), bigEndian);
+        for (size_t f = 0; f < page.fields.size(); ++f) {
+            const TiffField& field = page.fields[f];
+            std::vector<unsigned char> packed;
+            for (size_t v = 0; v < field.values.size(); ++v) {
+                if (field.type == 3) Put16(packed, field.values[v], bigEndian);
+                else Put32(packed, field.values[v], bigEndian);
+            }
+            Put16(data, field.tag, bigEndian);
+            Put16(data, field.type, bigEndian);
+            Put32(data, (uint32_t)field.values.size(), bigEndian);
+            if (packed.size() <= 4) {
+                packed.resize(4, 0);
+                data.insert(data.end(), packed.begin(), packed.end());
+            }
+            else {
+                Put32(data, (uint32_t)(extra + values.size()), bigEndian);
+                values.insert(values.end(), packed.begin(), packed.end());
+            }
+        }
+        nextLink = data.size();
+        Put32(data, 0, bigEndian);
+        data.insert(data.end(), values.begin(), values.end());
+    }
+}
+
+// Basic tags of a page of the given format
+static TiffPage MakeTiffPage(int width, int height, int bitsPerSample, int samples, int compression,
+                             int photometric)
+{
+    TiffPage page;
+    page.Add(256, 4, std::vector<uint32_t>(1, width));
+    page.Add(257, 4, std::vector<uint32_t>(1, height));
+    page.Add(258, 3, std::vector<uint32_t>(samples, bitsPerSample));
+    page.Add(259, compression);
+    page.Add(262, photometric);
+    page.Add(277, samples);
+    return page;
+}
+
+// Packs rows of samples of the given bits into strips of stripRows rows
+static void AddStrips(TiffPage& page, const std::vector<unsigned char>& samples, int rowSamples,
+                      int height, int bitsPerSample, int stripRows, bool packBits)
+{
+    page.Add(278, stripRows);
+    size_t rowBytes = ((size_t)rowSamples * bitsPerSample + 7) / 8;
+    for (int y0 = 0; y0 < height; y0 += stripRows) {
+        std::vector<unsigned char> strip;
+        for (int y = y0; y < std::min(height, y0 + stripRows); ++y) {
+            std::vector<unsigned char> row(rowBytes, 0);
+            for (int i = 0; i < rowSamples; ++i) {
+                int bit = i * bitsPerSample;
+                unsigned char value = samples[(size_t)y * rowSamples + i];
+                if (bitsPerSample == 8) row[i] = value;
+                else row[bit / 8] |= (unsigned char)(value << (8 - bitsPerSample - bit % 8));
+            }
+            if (!packBits) {
+                strip.insert(strip.end(), row.begin(), row.end());
+                continue;
+            }
+            // Runs of equal bytes as repeats, the rest as literals
+            for (size_t i = 0; i < rowBytes;) {
+                size_t run = 1;
+                while (i + run < rowBytes && run < 128 && row[i + run] == row[i]) ++run;
+                if (run > 1) {
+                    strip.push_back((unsigned char)(257 - run));
+                    strip.push_back(row[i]);
+                }
+                else {
+                    size_t literal = 1;
+                    while (i + literal < rowBytes && literal < 128 &&
+                           (i + literal + 1 >= rowBytes || row[i + literal + 1] != row[i + literal]))
+                        ++literal;
+                    strip.push_back((unsigned char)(literal - 1));
+                    strip.insert(strip.end(), row.begin() + i, row.begin() + i + literal);
+                    run = literal;
+                }
+                i += run;
+            }
+        }
+        page.blocks.push_back(strip);
+    }
+}
+
+static void MakeTiffSeeds(Random& random, std::vector<DecoderSeed>& seeds)
+{
+    int width = random.Between(20, 90);
+    int height = random.Between(10, 70);
+    std::vector<unsigned char> gray((size_t)width * height);
+    for (size_t i = 0; i < gray.size(); ++i) gray[i] = (unsigned char)random.Below(256);
+
+    static const char* grayNames[] = { "8-bit TIFF", "8-bit PackBits TIFF", "big-endian 8-bit TIFF" };
+    for (int variant = 0; variant < 3; ++variant) {
+        TiffPage page = MakeTiffPage(width, height, 8, 1, variant == 1 ? 32773 : 1, 1);
+        AddStrips(page, gray, width, height, 8, random.Between(1, height), variant == 1);
+        DecoderSeed seed;
+        seed.name = grayNames[variant];
+        BuildTiff(std::vector<TiffPage>(1, page), variant == 2, seed.data);
+        seed.width = width;
+        seed.height = height;
+        seed.gray = gray;
+        seeds.push_back(seed);
+    }
+
+    // Bilevel, white as 0, on two pages of which the second is inverted
+    {
+        std::vector<unsigned char> bits(gray.size());
+        for (size_t i = 0; i < bits.size(); ++i) bits[i] = gray[i] < 100;
+        std::vector<TiffPage> pages(2, MakeTiffPage(width, height, 1, 1, 1, 0));
+        pages[1] = MakeTiffPage(width, height, 1, 1, 1, 1);
+        AddStrips(pages[0], bits, width, height, 1, random.Between(1, height), false);
+        AddStrips(pages[1], bits, width, height, 1, height, true);
+        DecoderSeed seed;
+        seed.name = "bilevel two-page TIFF";
+        BuildTiff(pages, false, seed.data);
+        seed.width = width;
+        seed.height = height;
+        seed.gray.resize(bits.size());
+        for (size_t i = 0; i < bits.size(); ++i) seed.gray[i] = bits[i] ? 0 : 255;
+        seeds.push_back(seed);
+    }
+
+    // 4-bit palette
+    {
+        std::vector<unsigned char> indices(gray.size());
+        for (size_t i = 0; i < indices.size(); ++i) indices[i] = gray[i] >> 4;
+        std::vector<uint32_t> colorMap(3 * 16);
+        for (size_t i = 0; i < colorMap.size(); ++i) colorMap[i] = random.Below(256) * 257;
+        TiffPage page = MakeTiffPage(width, height, 4, 1, 1, 3);
+        page.Add(320, 3, colorMap);
+        AddStrips(page, indices, width, height, 4, random.Between(1, height), false);
+        DecoderSeed seed;
+        seed.name = "4-bit palette TIFF";
+        BuildTiff(std::vector<TiffPage>(1, page), false, seed.data);
+        seed.width = width;
+        seed.height = height;
+        seed.gray.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); ++i) {
+            int entry = indices[i];
+            seed.gray[i] = (unsigned char)bgrToGrayscale(colorMap[32 + entry] >> 8, colorMap[16 + entry] >> 8,
+                                                         colorMap[entry] >> 8);
+        }
+        seeds.push_back(seed);
+    }
+
+    // RGB in 16x16 tiles, which overhang the page on the right and bottom
+    {
+        int tilesAcross = (width + 15) / 16;
+        int tilesDown = (height + 15) / 16;
+        std::vector<unsigned char> rgb((size_t)width * height * 3);
+        for (size_t i = 0; i < rgb.size(); ++i) rgb[i] = (unsigned char)random.Below(256);
+        TiffPage page = MakeTiffPage(width, height, 8, 3, 1, 2);
+        page.tiled = true;
+        page.Add(322, 16);
+        page.Add(323, 16);
+        for (int ty = 0; ty < tilesDown; ++ty) {
+            for (int tx = 0; tx < tilesAcross; ++tx) {
+                std::vector<unsigned char> tile(16 * 16 * 3, 0);
+                for (int y = 0; y < 16 && ty * 16 + y < height; ++y) {
+                    for (int x = 0; x < 16 && tx * 16 + x < width; ++x)
+                        memcpy(&tile[(y * 16 + x) * 3], &rgb[((size_t)(ty * 16 + y) * width + tx * 16 + x) * 3], 3);
+                }
+                page.blocks.push_back(tile);
+            }
+        }
+        DecoderSeed seed;
+        seed.name = "tiled RGB TIFF";
+        BuildTiff(std::vector<TiffPage>(1, page), false, seed.data);
+        seed.width = width;
+        seed.height = height;
+        seed.gray.resize(gray.size());
+        for (size_t i = 0; i < gray.size(); ++i)
+            seed.gray[i] = (unsigned char)bgrToGrayscale(rgb[i * 3 + 2], rgb[i * 3 + 1], rgb[i * 3]);
+        seeds.push_back(seed);
+    }
+
+    // CCITT pages 8 pixels wide, of a white row, two rows black from pixel
+    // 2 to 4 and another white row. Modified Huffman codes every row on its
+    // own from a byte boundary: white 8, or white 2, black 3, white 3.
+    static const unsigned char huffmanRows[] = { 0x98, 0x7a, 0x00, 0x7a, 0x00, 0x98 };
+    // Group 4 codes each row against the one above: V0; horizontal mode
+    // and V0; three times V0; pass mode and V0
+    static const unsigned char group4Rows[] = { 0x97, 0xbc, 0x70 };
+    for (int variant = 0; variant < 2; ++variant) {
+        TiffPage page = MakeTiffPage(8, 4, 1, 1, variant == 0 ? 2 : 4, 0);
+        page.Add(278, 4);
+        const unsigned char* rows = variant == 0 ? huffmanRows : group4Rows;
+        size_t size = variant == 0 ? sizeof(huffmanRows) : sizeof(group4Rows);
+        page.blocks.push_back(std::vector<unsigned char>(rows, rows + size));
+        DecoderSeed seed;
+        seed.name = variant == 0 ? "Modified Huffman TIFF" : "Group 4 TIFF";
+        BuildTiff(std::vector<TiffPage>(1, page), false, seed.data);
+        seed.width = 8;
+        seed.height = 4;
+        seed.gray.assign(32, 255);
+        for (int y = 1; y <= 2; ++y) {
+            for (int x = 2; x < 5; ++x) seed.gray[y * 8 + x] = 0;
+        }
+        seeds.push_back(seed);
+    }
+}
+
+static void MakeDecoderSeeds(Random& random, std::vector<DecoderSeed>& seeds)
+{
+    struct BmpFormat {
+        const char* name;
+        int bitCount;
+        int compression;
+        bool topDown;
+    };
+    static const BmpFormat formats[] = {
+        { "1-bit BMP", 1, 0, false },
+        { "4-bit BMP", 4, 0, false },
+        { "8-bit BMP", 8, 0, false },
+        { "top-down 8-bit BMP", 8, 0, true },
+        { "RLE4 BMP", 4, 2, false },
+        { "RLE8 BMP", 8, 1, false },
+        { "16-bit BMP", 16, 0, false },
+        { "16-bit bitfields BMP", 16, 3, false },
+        { "24-bit BMP", 24, 0, false },
+        { "top-down 24-bit BMP", 24, 0, true },
+        { "32-bit BMP", 32, 0, false },
+        { "32-bit bitfields BMP", 32, 3, false },
+        { "OS/2 8-bit BMP", 8, BMP_CORE, false }
+    };
+    for (int i = 0; i < COUNT_OF(formats); ++i) {
+        MakeBmpSeed(formats[i].name, random.Between(1, 70), random.Between(1, 50), formats[i].bitCount,
+                    formats[i].compression, formats[i].topDown, random, seeds);
+    }
+    MakeTiffSeeds(random, seeds);
+}
+
+// Damages a file the way a bad disk, a cut-off download or a careless
+// writer might: flipped bits, odd values in header fields, cut or repeated
+// stretches
+static void Mutate(std::vector<unsigned char>& data, Random& random)
+{
+    static const uint32_t oddValues[] = { 0, 1, 2, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff,
+                                          0x10000, 0x7fffffff, 0x80000000u, 0xffffffffu };
+    int mutations = random.Between(1, 4);
+    for (int m = 0; m < mutations && !data.empty(); ++m) {
+        size_t at = random.Below((int)data.size());
+        switch (random.Below(6)) {
+        case 0:
+            data[at] ^= (unsigned char)(1 << random.Below(8));
+            break;
+        case 1:
+            data[at] = (unsigned char)oddValues[random.Below(COUNT_OF(oddValues))];
+            break;
+        case 2: {
+            // Most header fields are 16 or 32 bits, in either byte order
+            uint32_t value = random.Below(4) == 0 ? (uint32_t)data.size() + random.Below(3) - 1 :
+                                                    oddValues[random.Below(COUNT_OF(oddValues))];
+            int bytes = random.Below(2) == 0 ? 2 : 4;
+            bool bigEndian = random.Below(2) == 0;
+            at &= ~(size_t)1;
+            for (int b = 0; b < bytes && at + b < data.size(); ++b) {
+                int shift = 8 * (bigEndian ? bytes - 1 - b : b);
+                data[at + b] = (unsigned char)(value >> shift);
+            }
+            break;
+        }
+        case 3:
+            data.resize(at);
+            break;
+        case 4: {
+            size_t length = std::min(data.size() - at, (size_t)random.Between(1, 64));
+            std::vector<unsigned char> stretch(data.begin() + at, data.begin() + at + length);
+            data.insert(data.begin() + random.Below((int)data.size()), stretch.begin(), stretch.end());
+            break;
+        }
+        default: {
+            size_t length = std::min(data.size() - at, (size_t)random.Between(1, 64));
+            data.erase(data.begin() + at, data.begin() + at + length);
+            break;
+        }
+        }
+    }
+}
+
+// Decodes every page of a file up to a budget of pixels through each way a
+// decoder offers, which must all agree, and then runs the page through the
+// whole pipeline, which must agree with the reference run on the decoded
+// page. Damaged files only need to fail cleanly. A seed's first page must
+// decode in full, to what the seed says if it says.
+static void CheckDecoding(const std::string& name, const std::string& path, ThreadPool* pool,
+                          const DecoderSeed* seed)
+{
+    int pages = std::min(CountImagePages(path.c_str()), FUZZ_MAX_PAGES);
+    for (int page = 0; page < pages; ++page) {
+        char text[32];
+        sprintf(text, ", page %d", page);
+        std::string what = name + text;
+        std::string error;
+        RowSource* source = OpenImagePage(path.c_str(), page, error);
+        if (source == NULL) {
+            if (seed != NULL) Fail(what, "%s", error.c_str());
+            if (error.empty()) Fail(what, "opening failed without saying why");
+            continue;
+        }
+        ++openedPages;
+        int width = source->Width();
+        int height = source->Height();
+        if (width <= 0 || height <= 0) {
+            Fail(what, "opened as %dx%d", width, height);
+            delete source;
+            continue;
+        }
+        int rows = (int)std::min<int64_t>(height, std::max(1, FUZZ_MAX_PIXELS / width));
+        std::vector<unsigned char> gray((size_t)width * rows);
+        int decoded = 0;
+        while (decoded < rows && source->ReadGrayRow(&gray[(size_t)decoded * width])) ++decoded;
+        bool inkRows = source->HasInkRows();
+        delete source;
+
+        if (seed != NULL && page == 0) {
+            if (decoded < height) Fail(what, "only %d of %d rows decode", decoded, height);
+            else if (width != seed->width || height != seed->height)
+                Fail(what, "decodes as %dx%d instead of %dx%d", width, height, seed->width, seed->height);
+            else if (!seed->gray.empty())
+                ComparePlanes(what, "decoded", &seed->gray[0], &gray[0], width, height);
+        }
+
+        // Bilevel pages also decode straight to ink bits
+        if (inkRows && decoded > 0) {
+            source = OpenImagePage(path.c_str(), page, error);
+            std::vector<uint64_t> ink(WordsForWidth(width));
+            for (int y = 0; source != NULL && y < decoded; ++y) {
+                if (!source->ReadInkRow(&ink[0])) {
+                    Fail(what, "ink row %d fails where its luminance decodes", y);
+                    break;
+                }
+                int x = 0;
+                for (; x < width; ++x) {
+                    bool black = (ink[x / BITS_PER_WORD] >> (x % BITS_PER_WORD) & 1) != 0;
+                    if (black != (gray[(size_t)y * width + x] < 128)) break;
+                }
+                if (x < width) {
+                    Fail(what, "ink bit %d,%d differs from the luminance", x, y);
+                    break;
+                }
+            }
+            delete source;
+        }
+
+        // .bmp files also decode to BGRA, and split across threads
+        BmpReader reader;
+        if (decoded > 0 && reader.Open(path.c_str())) {
+            std::vector<unsigned char> bgra((size_t)width * 4);
+            std::vector<unsigned char> row(width);
+            for (int y = 0; y < decoded; ++y) {
+                if (!reader.ReadRow(&bgra[0])) {
+                    Fail(what, "BGRA row %d fails where its luminance decodes", y);
+                    break;
+                }
+                BgrRowToGrayScalar(&bgra[0], 4, &row[0], width);
+                if (memcmp(&row[0], &gray[(size_t)y * width], width) != 0) {
+                    ComparePlanes(what + ", BGRA row", "decoded", &row[0], &gray[(size_t)y * width], width, 1);
+                    break;
+                }
+            }
+            reader.Rewind();
+            std::vector<unsigned char> strip((size_t)width * STRIP_ROWS);
+            reader.ReserveStripScratch(pool);
+            for (int y = 0; y < decoded; y += STRIP_ROWS) {
+                int count = std::min(STRIP_ROWS, decoded - y);
+                if (!reader.ReadGrayRows(&strip[0], count, pool)) {
+                    Fail(what, "threaded decoding fails at row %d", y);
+                    break;
+                }
+                if (memcmp(&strip[0], &gray[(size_t)y * width], (size_t)width * count) != 0) {
+                    ComparePlanes(what + ", threaded strip", "decoded", &gray[(size_t)y * width], &strip[0],
+                                  width, count);
+                    break;
+                }
+            }
+        }
+
+        // The whole pipeline, only on pages that decode in full
+        if (decoded < height) continue;
+        ++decodedPages;
+        PipelineParams params;
+        for (int binarize = BINARIZE_NONE; binarize <= BINARIZE_ADAPTIVE; ++binarize) {
+            params.binarize = (BinarizeMode)binarize;
+            ReferenceResult expected;
+            if (params.binarize != BINARIZE_NONE && inkRows) {
+                std::vector<unsigned char> ink(gray.size());
+                for (size_t i = 0; i < ink.size(); ++i) ink[i] = gray[i] < 128;
+                RunReferenceInkPipeline(&ink[0], width, height, params, expected);
+            }
+            else {
+                RunReferencePipeline(&gray[0], width, height, params, expected);
+            }
+            PageResult result;
+            std::string pipelineWhat = what + ", -b " + BinarizeModeName(params.binarize);
+            if (!ProcessFile(path.c_str(), page, params, result, error, pool))
+                Fail(pipelineWhat, "%s", error.c_str());
+            else CompareColumns(pipelineWhat, expected.columns, result.columns);
+        }
+    }
+}
+
+// A request line for the server's parser, and the field it must yield, or
+// no field if the line must be refused
+struct RequestCase {
+    const char* line;
+    const char* field;
+    bool isString;
+    const char* text;
+};
+
+static const RequestCase requestCases[] = {
+    { "{\"id\":7,\"path\":\"a.tif\"}", "id", false, "7" },
+    { "{\"id\":-1.5e+3,\"path\":\"a\"}", "id", false, "-1.5e+3" },
+    { "{ \"id\" : null , \"path\":\"a\" }", "id", false, "null" },
+    { "{\"deskew\":true}", "deskew", false, "true" },
+    { "{\"path\":\"a\\u0041\\u00e9\\/\"}", "path", true, "aA\xc3\xa9/" },
+    { "{\"path\":\"\\ud83d\\ude00\"}", "path", true, "\xf0\x9f\x98\x80" },
+    { "{\"path\":\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\",\"id\":\"\\u1", NULL, false, NULL },
+    { "{\"path\":\"\\u12\"}", NULL, false, NULL },
+    { "{\"path\":\"\\ud83d\"}", NULL, false, NULL },
+    { "{\"path\":\"\\ude00\"}", NULL, false, NULL },
+    { "{\"path\":\"\\ud83d\\u0041\"}", NULL, false, NULL },
+    { "{\"id\":1\"x,\"path\":\"nofile\"}", NULL, false, NULL },
+    { "{\"id\":tru,\"path\":\"a\"}", NULL, false, NULL },
+    { "{\"id\":nullx}", NULL, false, NULL },
+    { "{\"id\":01}", NULL, false, NULL },
+    { "{\"id\":1.}", NULL, false, NULL },
+    { "{\"id\":-}", NULL, false, NULL },
+    { "{\"id\":1e}", NULL, false, NULL },
+    { "{\"id\":[1]}", NULL, false, NULL },
+};
+
+// Runs the server's request parser on lines it must read or refuse, and on
+// every cut-short copy of a request full of escapes, which must all be
+// refused without reading past their end. Returns the lines parsed.
+static int CheckRequestParser()
+{
+    int lines = 0;
+    for (int i = 0; i < COUNT_OF(requestCases); ++i) {
+        const RequestCase& test = requestCases[i];
+        Request request;
+        std::string error;
+        bool ok = ParseRequest(test.line, request, error);
+        ++lines;
+        if (test.field == NULL) {
+            if (ok) Fail("request parser", "accepted %s", test.line);
+            continue;
+        }
+        Request::const_iterator field = request.find(test.field);
+        if (!ok) Fail("request parser", "refused %s: %s", test.line, error.c_str());
+        else if (field == request.end() || field->second.isString != test.isString ||
+                 field->second.text != test.text)
+            Fail("request parser", "misread \"%s\" of %s", test.field, test.line);
+    }
+
+    std::string full = "{\"id\":\"\\ud83d\\ude00\\u00e9\\n\",\"page\":-12.5e-1,\"coarse\":false}";
+    for (size_t length = 0; length <= full.size(); ++length) {
+        Request request;
+        std::string error;
+        bool ok = ParseRequest(full.substr(0, length), request, error);
+        ++lines;
+        if (ok != (length == full.size()))
+            Fail("request parser", "%s %.*s", ok ? "accepted" : "refused", (int)length, full.c_str());
+    }
+    return lines;
+}
+
+static bool ReadFile(const char* path, std::vector<unsigned char>& data)
+{
+    MappedFile file;
+    if (!file.Open(path)) return false;
+    data.assign(file.Data(), file.Data() + file.Size());
+    return true;
+}
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "usage: colfind_verify [options] [seed files...]\n"
+        "\n"
+        "Checks every optimized path of the pipeline (vector kernels, threads, strips,\n"
+        "streaming, the fused smear, binarized pages, redoing stages) against the\n"
+        "reference pipeline on random pages, and fuzzes the image decoders with damaged\n"
+        "copies of built-in seed files and of any given ones. Exits with 1 on any\n"
+        "mismatch.\n"
+        "\n"
+        "options:\n"
+        "  -n N         random pages to check (default: %d)\n"
+        "  --fuzz N     damaged files to decode (default: %d)\n"
+        "  --seed N     random seed, the same seed checks the same pages (default: 1)\n"
+        "  -o FILE      temporary file for the decoders (default: %s)\n",
+        DEFAULT_PAGES, DEFAULT_FUZZ_RUNS, DEFAULT_TEMP_FILE);
+}
+
+static bool ParseIntArg(int argc, char** argv, int& i, int& value)
+{
+    if (i + 1 >= argc) return false;
+    char* end;
+    long parsed = strtol(argv[++i], &end, 10);
+    if (*end != '\0' || parsed < 0) return false;
+    value = (int)parsed;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int pageCount = DEFAULT_PAGES;
+    int fuzzRuns = DEFAULT_FUZZ_RUNS;
+    int seedValue = 1;
+    std::string tempFile = DEFAULT_TEMP_FILE;
+    std::vector<const char*> seedFiles;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool ok = true;
+        if (strcmp(arg, "-n") == 0) ok = ParseIntArg(argc, argv, i, pageCount);
+        else if (strcmp(arg, "--fuzz") == 0) ok = ParseIntArg(argc, argv, i, fuzzRuns);
+        else if (strcmp(arg, "--seed") == 0) ok = ParseIntArg(argc, argv, i, seedValue);
+        else if (strcmp(arg, "-o") == 0) {
+            if (i + 1 < argc) tempFile = argv[++i];
+            else ok = false;
+        }
+        else if (arg[0] == '-') ok = false;
+        else seedFiles.push_back(arg);
+
+        if (!ok) {
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    double start = GetTimeSeconds();
+    Random random((unsigned int)seedValue);
+    std::vector<ThreadPool*> pools;
+    pools.push_back(NULL);
+    for (int threads = 2; threads <= 4; ++threads) pools.push_back(new ThreadPool(threads));
+
+    std::string report;
+    if (!VerifyKernels(report)) Fail("kernels", "%s", report.c_str());
+    printf("kernels: %s\n", report.c_str());
+
+    int before = failures;
+    KernelLevel bestLevel = GetSupportedKernelLevel();
+    for (int index = 0; index < pageCount; ++index) {
+        TestPage page;
+        MakeTestPage(index, random, page);
+        CheckPage(page, pools, tempFile, random);
+        SetKernelLevel(bestLevel);
+    }
+    printf("pipeline: %d pages at %d kernel levels and %d thread counts, %d mismatches\n",
+           pageCount, (int)bestLevel + 1, (int)pools.size(), failures - before);
+
+    before = failures;
+    std::vector<DecoderSeed> seeds;
+    MakeDecoderSeeds(random, seeds);
+    for (size_t i = 0; i < seedFiles.size(); ++i) {
+        DecoderSeed seed;
+        seed.name = seedFiles[i];
+        if (!ReadFile(seedFiles[i], seed.data)) {
+            fprintf(stderr, "colfind_verify: cannot read %s\n", seedFiles[i]);
+            return 2;
+        }
+        seeds.push_back(seed);
+    }
+    for (size_t i = 0; i < seeds.size(); ++i) {
+        if (!WriteFile(tempFile, seeds[i].data)) {
+            fprintf(stderr, "colfind_verify: cannot write %s\n", tempFile.c_str());
+            return 2;
+        }
+        // Seeds of given files need only decode, their luminance is unknown
+        bool builtIn = seeds[i].width > 0;
+        CheckDecoding(seeds[i].name, tempFile, pools[2], builtIn ? &seeds[i] : NULL);
+    }
+    for (int run = 0; run < fuzzRuns && !seeds.empty(); ++run) {
+        const DecoderSeed& seed = seeds[random.Below((int)seeds.size())];
+        std::vector<unsigned char> data(seed.data);
+        Mutate(data, random);
+        if (!WriteFile(tempFile, data)) {
+            fprintf(stderr, "colfind_verify: cannot write %s\n", tempFile.c_str());
+            return 2;
+        }
+        char number[16];
+        sprintf(number, " %d", run);
+        CheckDecoding("damaged " + seed.name + number, tempFile, pools[1 + run % 3], NULL);
+    }
+    remove(tempFile.c_str());
+    printf("decoders: %d seed files and %d damaged copies, %d pages opened, %d decoded in full, "
+           "%d mismatches\n", (int)seeds.size(), fuzzRuns, openedPages, decodedPages, failures - before);
+
+    before = failures;
+    int requestLines = CheckRequestParser();
+    printf("server: %d request lines parsed, %d mismatches\n", requestLines, failures - before);
+
+    for (size_t p = 0; p < pools.size(); ++p) delete pools[p];
+    printf("%s after %.1f s\n", failures == 0 ? "all identical" : "MISMATCHES FOUND", GetTimeSeconds() - start);
+    return failures == 0 ? 0 : 1;
+}